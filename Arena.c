@@ -0,0 +1,409 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Arena.c
+
+Abstract:
+
+  Memory arena for LKL and the LK scheduler.
+
+  Page runs of PcdLKLArenaChunkSize are reserved with AllocatePages and cut
+  into slabs, each slab serving a single power of two size class through a
+  free list. Allocations larger than the biggest class get their own page
+  run. Every slab object is preceded by a small header so a free can find
+  its class without any lookup. Page runs keep their size in a hash table
+  keyed by address instead, so they stay page aligned and a run of a power
+  of two size, like a thread stack, doesn't cost an extra page. Slab objects
+  are never page aligned, which tells the two apart.
+
+  LKLArenaFreeDelayed can be used from any context, including with
+  interrupts disabled. It only pushes the buffer on a lock-free list, which
+  is drained by the next regular allocate or free, on any processor.
+
+Revision History
+
+--*/
+
+#include "LKL.h"
+
+#define LKL_ARENA_SIGNATURE     SIGNATURE_32 ('l', 'k', 'l', 'a')
+#define LKL_ARENA_SLAB_SIZE     SIZE_64KB
+
+typedef struct {
+  UINT32                  Signature;
+  UINT32                  Class;
+  UINT64                  Size;       // requested size
+} LKL_ARENA_HEADER;
+
+typedef struct _LKL_ARENA_OBJECT {
+  struct _LKL_ARENA_OBJECT  *Next;
+} LKL_ARENA_OBJECT;
+
+typedef struct {
+  VOID                    *Buffer;    // NULL if the slot is empty
+  UINT64                  Size;       // requested size
+} LKL_ARENA_RUN;
+
+STATIC EFI_LOCK           mArenaLock = EFI_INITIALIZE_LOCK_VARIABLE (TPL_NOTIFY);
+STATIC LKL_ARENA_OBJECT   *mArenaFreeList[LKL_ARENA_CLASSES];
+STATIC UINT8              *mArenaChunk;
+STATIC UINTN              mArenaChunkLeft;
+STATIC VOID               *mArenaDelayed;
+STATIC LKL_ARENA_RUN      *mArenaRuns;
+STATIC UINTN              mArenaRunCount;
+STATIC UINTN              mArenaRunSlots;   // power of two
+STATIC LKL_ARENA_STATS    mArenaStats;
+
+STATIC
+UINTN
+ArenaClassSize (
+  IN UINTN      Class
+  )
+{
+  return (UINTN)1 << (LKL_ARENA_MIN_SHIFT + Class);
+}
+
+STATIC
+UINTN
+ArenaRunSlot (
+  IN VOID       *Buffer
+  )
+{
+  return (UINTN)MultU64x32 ((UINTN)Buffer >> EFI_PAGE_SHIFT, 0x9E3779B1) & (mArenaRunSlots - 1);
+}
+
+/**
+  Find the slot of the page run at Buffer, or the empty slot it would go to.
+
+**/
+STATIC
+LKL_ARENA_RUN *
+ArenaRunFind (
+  IN VOID       *Buffer
+  )
+{
+  UINTN                   Slot;
+
+  for (Slot = ArenaRunSlot (Buffer); ; Slot = (Slot + 1) & (mArenaRunSlots - 1)) {
+    if (mArenaRuns[Slot].Buffer == Buffer || mArenaRuns[Slot].Buffer == NULL) {
+      return &mArenaRuns[Slot];
+    }
+  }
+}
+
+/**
+  Make sure the run table has room for one more entry, keeping it at most
+  half full.
+
+**/
+STATIC
+BOOLEAN
+ArenaRunReserve (
+  VOID
+  )
+{
+  LKL_ARENA_RUN           *Old;
+  UINTN                   OldSlots;
+  UINTN                   Index;
+
+  if (2 * (mArenaRunCount + 1) <= mArenaRunSlots) {
+    return TRUE;
+  }
+
+  Old = mArenaRuns;
+  OldSlots = mArenaRunSlots;
+
+  mArenaRunSlots = MAX (OldSlots * 2, 64);
+  mArenaRuns = AllocateZeroPool (mArenaRunSlots * sizeof (*mArenaRuns));
+  if (mArenaRuns == NULL) {
+    mArenaRuns = Old;
+    mArenaRunSlots = OldSlots;
+    return FALSE;
+  }
+
+  for (Index = 0; Index < OldSlots; Index++) {
+    if (Old[Index].Buffer != NULL) {
+      *ArenaRunFind (Old[Index].Buffer) = Old[Index];
+    }
+  }
+
+  if (Old != NULL) {
+    FreePool (Old);
+  }
+
+  return TRUE;
+}
+
+/**
+  Remove a page run from the table. The entries after it in the same
+  probe sequence are moved up so lookups don't stop at the hole.
+
+**/
+STATIC
+VOID
+ArenaRunRemove (
+  IN LKL_ARENA_RUN  *Run
+  )
+{
+  UINTN                   Mask;
+  UINTN                   Hole;
+  UINTN                   Slot;
+  UINTN                   Home;
+
+  Mask = mArenaRunSlots - 1;
+  Hole = Run - mArenaRuns;
+  mArenaRuns[Hole].Buffer = NULL;
+  mArenaRunCount--;
+
+  for (Slot = (Hole + 1) & Mask; mArenaRuns[Slot].Buffer != NULL; Slot = (Slot + 1) & Mask) {
+    Home = ArenaRunSlot (mArenaRuns[Slot].Buffer);
+
+    // leave it if its home lies cyclically in (Hole, Slot]
+    if (((Slot - Home) & Mask) < ((Slot - Hole) & Mask)) {
+      continue;
+    }
+
+    mArenaRuns[Hole] = mArenaRuns[Slot];
+    mArenaRuns[Slot].Buffer = NULL;
+    Hole = Slot;
+  }
+}
+
+/**
+  Cut a new slab for Class from the current chunk, reserving a new chunk
+  if needed, and put its objects on the free list.
+
+**/
+STATIC
+BOOLEAN
+ArenaGrowClass (
+  IN UINTN      Class
+  )
+{
+  UINTN                   ChunkSize;
+  UINTN                   ObjectSize;
+  UINT8                   *Slab;
+  UINTN                   Offset;
+  LKL_ARENA_OBJECT        *Object;
+
+  if (mArenaChunkLeft < LKL_ARENA_SLAB_SIZE) {
+    // the rest of the old chunk is lost, it's always less than a slab
+    ChunkSize = ALIGN_VALUE (MAX (PcdGet32 (PcdLKLArenaChunkSize), LKL_ARENA_SLAB_SIZE), LKL_ARENA_SLAB_SIZE);
+    mArenaChunk = AllocatePages (EFI_SIZE_TO_PAGES (ChunkSize));
+    if (mArenaChunk == NULL) {
+      return FALSE;
+    }
+    mArenaChunkLeft = ChunkSize;
+    mArenaStats.ReservedBytes += ChunkSize;
+  }
+
+  Slab = mArenaChunk;
+  mArenaChunk += LKL_ARENA_SLAB_SIZE;
+  mArenaChunkLeft -= LKL_ARENA_SLAB_SIZE;
+  mArenaStats.SlabBytes += LKL_ARENA_SLAB_SIZE;
+
+  ObjectSize = ArenaClassSize (Class);
+  for (Offset = LKL_ARENA_SLAB_SIZE; Offset >= ObjectSize; ) {
+    Offset -= ObjectSize;
+    Object = (LKL_ARENA_OBJECT *)(Slab + Offset);
+    Object->Next = mArenaFreeList[Class];
+    mArenaFreeList[Class] = Object;
+    mArenaStats.ClassFree[Class]++;
+  }
+
+  return TRUE;
+}
+
+/**
+  Release a buffer, with the arena lock held.
+
+**/
+STATIC
+VOID
+ArenaFreeLocked (
+  IN VOID       *Buffer
+  )
+{
+  LKL_ARENA_HEADER        *Header;
+  LKL_ARENA_OBJECT        *Object;
+  LKL_ARENA_RUN           *Run;
+  UINTN                   Pages;
+  UINT32                  Class;
+
+  mArenaStats.Frees++;
+
+  if (((UINTN)Buffer & EFI_PAGE_MASK) == 0) {
+    Run = ArenaRunFind (Buffer);
+    ASSERT (Run->Buffer == Buffer);
+    Pages = EFI_SIZE_TO_PAGES ((UINTN)Run->Size);
+
+    mArenaStats.InUseBytes -= Run->Size;
+    mArenaStats.LargeBytes -= EFI_PAGES_TO_SIZE (Pages);
+    ArenaRunRemove (Run);
+    FreePages (Buffer, Pages);
+    return;
+  }
+
+  Header = (LKL_ARENA_HEADER *)Buffer - 1;
+  ASSERT (Header->Signature == LKL_ARENA_SIGNATURE);
+  Header->Signature = 0;
+  Class = Header->Class;
+
+  mArenaStats.InUseBytes -= Header->Size;
+
+  ASSERT (Class < LKL_ARENA_CLASSES);
+  Object = (LKL_ARENA_OBJECT *)Header;
+  Object->Next = mArenaFreeList[Class];
+  mArenaFreeList[Class] = Object;
+  mArenaStats.ClassInUse[Class]--;
+  mArenaStats.ClassFree[Class]++;
+}
+
+/**
+  Free everything queued by LKLArenaFreeDelayed, with the arena lock held.
+
+**/
+STATIC
+VOID
+ArenaDrainDelayed (
+  VOID
+  )
+{
+  VOID                    *List;
+  VOID                    *Next;
+
+  if (mArenaDelayed == NULL) {
+    return;
+  }
+
+  do {
+    List = mArenaDelayed;
+  } while (InterlockedCompareExchangePointer (&mArenaDelayed, List, NULL) != List);
+
+  for (; List != NULL; List = Next) {
+    Next = *(VOID **)List;
+    ArenaFreeLocked (List);
+    mArenaStats.DelayedFrees++;
+  }
+}
+
+VOID *
+LKLArenaAllocate (
+  IN UINTN      Size
+  )
+{
+  LKL_ARENA_HEADER        *Header;
+  LKL_ARENA_RUN           *Run;
+  VOID                    *Buffer;
+  UINTN                   Total;
+  UINTN                   Class;
+
+  Total = Size + sizeof (*Header);
+  if (Total < Size) {
+    return NULL;
+  }
+
+  EfiAcquireLock (&mArenaLock);
+  ArenaDrainDelayed ();
+
+  if (Total > ArenaClassSize (LKL_ARENA_CLASSES - 1)) {
+    if (!ArenaRunReserve ()) {
+      EfiReleaseLock (&mArenaLock);
+      return NULL;
+    }
+
+    Buffer = AllocatePages (EFI_SIZE_TO_PAGES (Size));
+    if (Buffer == NULL) {
+      EfiReleaseLock (&mArenaLock);
+      return NULL;
+    }
+
+    Run = ArenaRunFind (Buffer);
+    Run->Buffer = Buffer;
+    Run->Size = Size;
+    mArenaRunCount++;
+    mArenaStats.LargeBytes += EFI_PAGES_TO_SIZE (EFI_SIZE_TO_PAGES (Size));
+  } else {
+    for (Class = 0; ArenaClassSize (Class) < Total; Class++) {
+      ;
+    }
+
+    if (mArenaFreeList[Class] == NULL && !ArenaGrowClass (Class)) {
+      EfiReleaseLock (&mArenaLock);
+      return NULL;
+    }
+
+    Header = (LKL_ARENA_HEADER *)mArenaFreeList[Class];
+    mArenaFreeList[Class] = mArenaFreeList[Class]->Next;
+    mArenaStats.ClassFree[Class]--;
+    mArenaStats.ClassInUse[Class]++;
+
+    Header->Signature = LKL_ARENA_SIGNATURE;
+    Header->Class = (UINT32)Class;
+    Header->Size = Size;
+    Buffer = Header + 1;
+  }
+
+  mArenaStats.Allocations++;
+  mArenaStats.InUseBytes += Size;
+  mArenaStats.PeakInUseBytes = MAX (mArenaStats.PeakInUseBytes, mArenaStats.InUseBytes);
+
+  EfiReleaseLock (&mArenaLock);
+
+  return Buffer;
+}
+
+VOID
+LKLArenaFree (
+  IN VOID       *Buffer
+  )
+{
+  if (Buffer == NULL) {
+    return;
+  }
+
+  EfiAcquireLock (&mArenaLock);
+  ArenaDrainDelayed ();
+  ArenaFreeLocked (Buffer);
+  EfiReleaseLock (&mArenaLock);
+}
+
+VOID
+LKLArenaFreeDelayed (
+  IN VOID       *Buffer
+  )
+{
+  VOID                    *Head;
+
+  if (Buffer == NULL) {
+    return;
+  }
+
+  // the link only overwrites the start of the object, the header or the
+  // run table entry stays valid
+  do {
+    Head = mArenaDelayed;
+    *(VOID **)Buffer = Head;
+  } while (InterlockedCompareExchangePointer (&mArenaDelayed, Head, Buffer) != Head);
+}
+
+VOID
+LKLArenaGetStats (
+  OUT LKL_ARENA_STATS *Stats
+  )
+{
+  EfiAcquireLock (&mArenaLock);
+  CopyMem (Stats, &mArenaStats, sizeof (*Stats));
+  EfiReleaseLock (&mArenaLock);
+}
@@ -0,0 +1,193 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Async.c
+
+Abstract:
+
+  Token based (EFI_FILE_PROTOCOL revision 2) file requests.
+
+  Every request is queued to the LKL worker threads, runs the regular
+  synchronous implementation there and completes by setting Token->Status
+  and signaling Token->Event. A file handle stays alive while it has
+  requests in flight, closing or deleting it is deferred to the last one.
+
+Revision History
+
+--*/
+
+#include "LKL.h"
+
+typedef struct {
+  LKL_WORK              Work;
+  LKL_ASYNC_OP          Op;
+  LKL_IFILE             *IFile;
+  EFI_FILE_IO_TOKEN     *Token;
+
+  //
+  // OpenEx only
+  //
+  EFI_FILE_PROTOCOL     **NewHandle;
+  CHAR16                *FileName;
+  UINT64                OpenMode;
+  UINT64                Attributes;
+} LKL_ASYNC_REQUEST;
+
+STATIC EFI_LOCK         mAsyncLock = EFI_INITIALIZE_LOCK_VARIABLE (TPL_NOTIFY);
+
+STATIC
+VOID
+LKLAsyncWork (
+  IN LKL_WORK           *Work
+  )
+{
+  LKL_ASYNC_REQUEST     *Request;
+  LKL_IFILE             *IFile;
+  EFI_FILE_PROTOCOL     *FHand;
+  EFI_FILE_IO_TOKEN     *Token;
+  EFI_STATUS            Status;
+  BOOLEAN               Close;
+
+  Request = BASE_CR (Work, LKL_ASYNC_REQUEST, Work);
+  IFile   = Request->IFile;
+  FHand   = &IFile->Handle;
+  Token   = Request->Token;
+
+  switch (Request->Op) {
+  case LKL_ASYNC_OPEN:
+    Status = LKLOpen (FHand, Request->NewHandle, Request->FileName, Request->OpenMode, Request->Attributes);
+    break;
+
+  case LKL_ASYNC_READ:
+    Status = LKLIFileAccess (FHand, READ_DATA, &Token->BufferSize, Token->Buffer, Token);
+    break;
+
+  case LKL_ASYNC_WRITE:
+    Status = LKLIFileAccess (FHand, WRITE_DATA, &Token->BufferSize, Token->Buffer, Token);
+    break;
+
+  case LKL_ASYNC_FLUSH:
+    Status = LKLFlush (FHand);
+    break;
+
+  default:
+    ASSERT (FALSE);
+    Status = EFI_UNSUPPORTED;
+    break;
+  }
+
+  EfiAcquireLock (&mAsyncLock);
+  IFile->AsyncPending--;
+  Close = (IFile->AsyncPending == 0 && IFile->AsyncClose);
+  EfiReleaseLock (&mAsyncLock);
+
+  if (Close) {
+    if (IFile->AsyncDelete) {
+      LKLIFileDelete (IFile);
+    } else {
+      LKLIFileClose (IFile);
+    }
+  }
+
+  if (Request->FileName != NULL) {
+    FreePool (Request->FileName);
+  }
+  FreePool (Request);
+
+  Token->Status = Status;
+  gBS->SignalEvent (Token->Event);
+}
+
+/**
+  Queue a token based request on IFile.
+
+  @retval EFI_SUCCESS           The request was queued, Token->Event is
+                                signaled once it completed.
+  @retval EFI_OUT_OF_RESOURCES  The request could not be queued.
+
+**/
+EFI_STATUS
+LKLAsyncSubmit (
+  IN  LKL_IFILE               *IFile,
+  IN  LKL_ASYNC_OP            Op,
+  IN  EFI_FILE_IO_TOKEN       *Token,
+  OUT EFI_FILE_PROTOCOL       **NewHandle OPTIONAL,
+  IN  CHAR16                  *FileName OPTIONAL,
+  IN  UINT64                  OpenMode,
+  IN  UINT64                  Attributes
+  )
+{
+  LKL_ASYNC_REQUEST     *Request;
+
+  ASSERT (Token->Event != NULL);
+
+  Request = AllocateZeroPool (sizeof (*Request));
+  if (Request == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  //
+  // The caller only has to keep the token around, not the name
+  //
+  if (FileName != NULL) {
+    Request->FileName = UnicodeStrDup (FileName);
+    if (Request->FileName == NULL) {
+      FreePool (Request);
+      return EFI_OUT_OF_RESOURCES;
+    }
+  }
+
+  Request->Work.Func  = LKLAsyncWork;
+  Request->Op         = Op;
+  Request->IFile      = IFile;
+  Request->Token      = Token;
+  Request->NewHandle  = NewHandle;
+  Request->OpenMode   = OpenMode;
+  Request->Attributes = Attributes;
+
+  EfiAcquireLock (&mAsyncLock);
+  IFile->AsyncPending++;
+  EfiReleaseLock (&mAsyncLock);
+
+  lkl_work_queue (&Request->Work);
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Check whether IFile still has requests in flight, and if so let the last
+  one of them close it, or delete the file if Delete is set.
+
+  @retval TRUE   Closing the handle was deferred.
+  @retval FALSE  No requests are in flight, the caller closes the handle.
+
+**/
+BOOLEAN
+LKLAsyncDeferClose (
+  IN LKL_IFILE                *IFile,
+  IN BOOLEAN                  Delete
+  )
+{
+  BOOLEAN               Deferred;
+
+  EfiAcquireLock (&mAsyncLock);
+  Deferred = (IFile->AsyncPending != 0);
+  if (Deferred) {
+    IFile->AsyncClose = TRUE;
+    IFile->AsyncDelete = Delete;
+  }
+  EfiReleaseLock (&mAsyncLock);
+
+  return Deferred;
+}
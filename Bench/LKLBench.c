@@ -0,0 +1,812 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  LKLBench.c
+
+Abstract:
+
+  Benchmark of the filesystems the firmware exposes, meant to be run from
+  the shell in QEMU with ext4, f2fs and NTFS images attached as disks.
+
+    LKLBench.efi [-t Tag] [-s MiB] [-n Files] [-r Ops] [-m] [Volume ...]
+    LKLBench.efi [-t Tag] -R Trace [-w] [-p] Volume ...
+
+  Every writable volume is measured unless volume indices are given. The
+  results go to the console as CSV lines
+
+    tag,volume,fstype,metric,value,unit
+
+  so redirecting the output gives one file per run. Anything else printed
+  starts with '#'. -m also disconnects and reconnects every volume and
+  measures how long it takes until it's mounted again.
+
+  -R replays a block trace saved by LKLStat -t, found in the root of the
+  volume LKLBench was loaded from, on the disks of the given volumes. The
+  requests go straight to DiskIo. Writes are only replayed with -w, they
+  write back what's on the disk already. -p keeps the recorded pace instead
+  of issuing the requests back to back.
+
+Revision History
+
+--*/
+
+#include <Uefi.h>
+
+#include <Guid/FileInfo.h>
+#include <Guid/FileSystemInfo.h>
+
+#include <Protocol/BlockIo.h>
+#include <Protocol/DiskIo.h>
+#include <Protocol/LoadedImage.h>
+#include <Protocol/SimpleFileSystem.h>
+#include <Protocol/LKLStats.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PrintLib.h>
+#include <Library/TimerLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiLib.h>
+
+#define BENCH_DIR             L"\\lklbench"
+#define BENCH_DATA_FILE       L"\\lklbench\\data"
+#define BENCH_CHUNK_SIZE      SIZE_1MB
+#define BENCH_RANDOM_SIZE     SIZE_4KB
+#define BENCH_MOUNT_TIMEOUT   30000
+#define BENCH_MAX_VOLUMES     32
+
+typedef struct {
+  CHAR16        *Tag;
+  UINTN         DataSize;
+  UINTN         Files;
+  UINTN         RandomOps;
+  BOOLEAN       Remount;
+
+  CHAR16        *Trace;
+  BOOLEAN       ReplayWrites;
+  BOOLEAN       ReplayPace;
+} BENCH_OPTIONS;
+
+STATIC UINT32   mRandomSeed = 1;
+
+STATIC
+UINT64
+BenchNow (
+  VOID
+  )
+{
+  return GetTimeInNanoSecond (GetPerformanceCounter ());
+}
+
+STATIC
+UINT32
+BenchRandom (
+  VOID
+  )
+{
+  mRandomSeed = mRandomSeed * 1103515245 + 12345;
+  return mRandomSeed >> 8;
+}
+
+/**
+  Print one result line.
+
+**/
+STATIC
+VOID
+BenchReport (
+  IN BENCH_OPTIONS    *Options,
+  IN UINTN            Index,
+  IN CONST CHAR16     *FsType,
+  IN CONST CHAR16     *Metric,
+  IN UINT64           Value,
+  IN CONST CHAR16     *Unit
+  )
+{
+  Print (L"%s,%u,%s,%s,%lu,%s\n", Options->Tag, Index, FsType, Metric, Value, Unit);
+}
+
+/**
+  Turn bytes moved in a number of nanoseconds into KiB/s.
+
+**/
+STATIC
+UINT64
+BenchRate (
+  IN UINT64           Count,
+  IN UINT64           Ns
+  )
+{
+  if (Ns == 0) {
+    Ns = 1;
+  }
+  return DivU64x64Remainder (MultU64x32 (Count, 1000000000), Ns, NULL);
+}
+
+STATIC
+EFI_STATUS
+BenchGetFsType (
+  IN  EFI_FILE_PROTOCOL   *Root,
+  OUT CHAR16              *FsType,
+  IN  UINTN               FsTypeSize,
+  OUT BOOLEAN             *ReadOnly
+  )
+{
+  EFI_STATUS            Status;
+  UINTN                 Size;
+  EFI_FILE_SYSTEM_INFO  *Info;
+
+  Size = SIZE_OF_EFI_FILE_SYSTEM_INFO + 64 * sizeof (CHAR16);
+  Info = AllocateZeroPool (Size);
+  if (Info == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = Root->GetInfo (Root, &gEfiFileSystemInfoGuid, &Size, Info);
+  if (!EFI_ERROR (Status)) {
+    StrnCpyS (FsType, FsTypeSize / sizeof (CHAR16), Info->VolumeLabel, FsTypeSize / sizeof (CHAR16) - 1);
+    *ReadOnly = Info->ReadOnly;
+  }
+
+  FreePool (Info);
+  return Status;
+}
+
+/**
+  Create Options->Files empty files, then time opening them, opening names
+  that don't exist and listing the directory.
+
+**/
+STATIC
+EFI_STATUS
+BenchFiles (
+  IN BENCH_OPTIONS      *Options,
+  IN UINTN              Index,
+  IN CONST CHAR16       *FsType,
+  IN EFI_FILE_PROTOCOL  *Root
+  )
+{
+  EFI_STATUS          Status;
+  EFI_FILE_PROTOCOL   *File;
+  EFI_FILE_PROTOCOL   *Dir;
+  CHAR16              Name[64];
+  UINT8               Buffer[SIZE_OF_EFI_FILE_INFO + 256 * sizeof (CHAR16)];
+  UINTN               Size;
+  UINTN               Entries;
+  UINTN               Round;
+  UINTN               Nr;
+  UINT64              Start;
+  UINT64              Ns;
+
+  Start = BenchNow ();
+  for (Nr = 0; Nr < Options->Files; Nr++) {
+    UnicodeSPrint (Name, sizeof (Name), BENCH_DIR L"\\f%05u", Nr);
+    Status = Root->Open (Root, &File, Name, EFI_FILE_MODE_CREATE|EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE, 0);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+    File->Close (File);
+  }
+  Ns = BenchNow () - Start;
+  BenchReport (Options, Index, FsType, L"create_latency", DivU64x64Remainder (Ns, Options->Files, NULL), L"ns");
+
+  Start = BenchNow ();
+  for (Nr = 0; Nr < Options->Files; Nr++) {
+    UnicodeSPrint (Name, sizeof (Name), BENCH_DIR L"\\f%05u", Nr);
+    Status = Root->Open (Root, &File, Name, EFI_FILE_MODE_READ, 0);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+    File->Close (File);
+  }
+  Ns = BenchNow () - Start;
+  BenchReport (Options, Index, FsType, L"open_latency", DivU64x64Remainder (Ns, Options->Files, NULL), L"ns");
+
+  Start = BenchNow ();
+  for (Nr = 0; Nr < Options->Files; Nr++) {
+    UnicodeSPrint (Name, sizeof (Name), BENCH_DIR L"\\missing\\m%05u", Nr);
+    Status = Root->Open (Root, &File, Name, EFI_FILE_MODE_READ, 0);
+    if (!EFI_ERROR (Status)) {
+      File->Close (File);
+    }
+  }
+  Ns = BenchNow () - Start;
+  BenchReport (Options, Index, FsType, L"open_missing_latency", DivU64x64Remainder (Ns, Options->Files, NULL), L"ns");
+
+  Status = Root->Open (Root, &Dir, BENCH_DIR, EFI_FILE_MODE_READ, 0);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Entries = 0;
+  Start   = BenchNow ();
+  for (Round = 0; Round < 4; Round++) {
+    Dir->SetPosition (Dir, 0);
+    for (;;) {
+      Size   = sizeof (Buffer);
+      Status = Dir->Read (Dir, &Size, Buffer);
+      if (EFI_ERROR (Status) || Size == 0) {
+        break;
+      }
+      Entries++;
+    }
+  }
+  Ns = BenchNow () - Start;
+  Dir->Close (Dir);
+  BenchReport (Options, Index, FsType, L"readdir_rate", BenchRate (Entries, Ns), L"entries/s");
+
+  return Status;
+}
+
+/**
+  Time sequential and random reads and writes of one file.
+
+**/
+STATIC
+EFI_STATUS
+BenchData (
+  IN BENCH_OPTIONS      *Options,
+  IN UINTN              Index,
+  IN CONST CHAR16       *FsType,
+  IN EFI_FILE_PROTOCOL  *Root
+  )
+{
+  EFI_STATUS          Status;
+  EFI_FILE_PROTOCOL   *File;
+  UINT8               *Buffer;
+  UINTN               Size;
+  UINTN               Done;
+  UINTN               Nr;
+  UINT64              Blocks;
+  UINT64              Start;
+  UINT64              Ns;
+
+  Buffer = AllocatePool (BENCH_CHUNK_SIZE);
+  if (Buffer == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+  for (Nr = 0; Nr < BENCH_CHUNK_SIZE; Nr++) {
+    Buffer[Nr] = (UINT8)BenchRandom ();
+  }
+
+  Status = Root->Open (Root, &File, BENCH_DATA_FILE, EFI_FILE_MODE_CREATE|EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE, 0);
+  if (EFI_ERROR (Status)) {
+    FreePool (Buffer);
+    return Status;
+  }
+
+  Start = BenchNow ();
+  for (Done = 0; Done < Options->DataSize; Done += Size) {
+    Size   = MIN (BENCH_CHUNK_SIZE, Options->DataSize - Done);
+    Status = File->Write (File, &Size, Buffer);
+    if (EFI_ERROR (Status)) {
+      goto Exit;
+    }
+  }
+  Status = File->Flush (File);
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+  Ns = BenchNow () - Start;
+  BenchReport (Options, Index, FsType, L"seq_write", BenchRate (Options->DataSize / SIZE_1KB, Ns), L"KiB/s");
+
+  File->SetPosition (File, 0);
+  Start = BenchNow ();
+  for (Done = 0; Done < Options->DataSize; Done += Size) {
+    Size   = MIN (BENCH_CHUNK_SIZE, Options->DataSize - Done);
+    Status = File->Read (File, &Size, Buffer);
+    if (EFI_ERROR (Status) || Size == 0) {
+      goto Exit;
+    }
+  }
+  Ns = BenchNow () - Start;
+  BenchReport (Options, Index, FsType, L"seq_read", BenchRate (Options->DataSize / SIZE_1KB, Ns), L"KiB/s");
+
+  Blocks = Options->DataSize / BENCH_RANDOM_SIZE;
+  Start  = BenchNow ();
+  for (Nr = 0; Nr < Options->RandomOps; Nr++) {
+    File->SetPosition (File, MultU64x32 (BenchRandom () % Blocks, BENCH_RANDOM_SIZE));
+    Size   = BENCH_RANDOM_SIZE;
+    Status = File->Read (File, &Size, Buffer);
+    if (EFI_ERROR (Status)) {
+      goto Exit;
+    }
+  }
+  Ns = BenchNow () - Start;
+  BenchReport (Options, Index, FsType, L"rand_read", BenchRate (Options->RandomOps, Ns), L"ops/s");
+
+  Start = BenchNow ();
+  for (Nr = 0; Nr < Options->RandomOps; Nr++) {
+    File->SetPosition (File, MultU64x32 (BenchRandom () % Blocks, BENCH_RANDOM_SIZE));
+    Size   = BENCH_RANDOM_SIZE;
+    Status = File->Write (File, &Size, Buffer);
+    if (EFI_ERROR (Status)) {
+      goto Exit;
+    }
+  }
+  Status = File->Flush (File);
+  Ns = BenchNow () - Start;
+  BenchReport (Options, Index, FsType, L"rand_write", BenchRate (Options->RandomOps, Ns), L"ops/s");
+
+Exit:
+  File->Delete (File);
+  FreePool (Buffer);
+  return Status;
+}
+
+/**
+  Delete what the benchmark created on a volume.
+
+**/
+STATIC
+VOID
+BenchCleanup (
+  IN BENCH_OPTIONS      *Options,
+  IN EFI_FILE_PROTOCOL  *Root
+  )
+{
+  EFI_FILE_PROTOCOL   *File;
+  CHAR16              Name[64];
+  UINTN               Nr;
+
+  for (Nr = 0; Nr < Options->Files; Nr++) {
+    UnicodeSPrint (Name, sizeof (Name), BENCH_DIR L"\\f%05u", Nr);
+    if (!EFI_ERROR (Root->Open (Root, &File, Name, EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE, 0))) {
+      File->Delete (File);
+    }
+  }
+
+  if (!EFI_ERROR (Root->Open (Root, &File, BENCH_DIR, EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE, 0))) {
+    File->Delete (File);
+  }
+}
+
+/**
+  Reconnect a volume and wait for its filesystem to show up again. With
+  background mounts that's after ConnectController returned.
+
+**/
+STATIC
+VOID
+BenchRemount (
+  IN BENCH_OPTIONS      *Options,
+  IN UINTN              Index,
+  IN CONST CHAR16       *FsType,
+  IN EFI_HANDLE         Handle
+  )
+{
+  EFI_STATUS  Status;
+  VOID        *Interface;
+  UINT64      Start;
+  UINTN       Waited;
+
+  Status = gBS->DisconnectController (Handle, NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    Print (L"# %u: can't disconnect: %r\n", Index, Status);
+    return;
+  }
+
+  Start = BenchNow ();
+  gBS->ConnectController (Handle, NULL, NULL, TRUE);
+  for (Waited = 0; Waited < BENCH_MOUNT_TIMEOUT; Waited++) {
+    Status = gBS->HandleProtocol (Handle, &gEfiSimpleFileSystemProtocolGuid, &Interface);
+    if (!EFI_ERROR (Status)) {
+      BenchReport (Options, Index, FsType, L"mount_time", DivU64x32 (BenchNow () - Start, 1000), L"us");
+      return;
+    }
+    gBS->Stall (1000);
+  }
+
+  Print (L"# %u: not mounted again\n", Index);
+}
+
+STATIC
+VOID
+BenchVolume (
+  IN BENCH_OPTIONS      *Options,
+  IN UINTN              Index,
+  IN EFI_HANDLE         Handle
+  )
+{
+  EFI_STATUS                      Status;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *Fs;
+  EFI_FILE_PROTOCOL               *Root;
+  EFI_FILE_PROTOCOL               *Dir;
+  CHAR16                          FsType[64];
+  BOOLEAN                         ReadOnly;
+
+  Status = gBS->HandleProtocol (Handle, &gEfiSimpleFileSystemProtocolGuid, (VOID **)&Fs);
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  Status = Fs->OpenVolume (Fs, &Root);
+  if (EFI_ERROR (Status)) {
+    Print (L"# %u: can't open volume: %r\n", Index, Status);
+    return;
+  }
+
+  StrCpyS (FsType, ARRAY_SIZE (FsType), L"unknown");
+  ReadOnly = FALSE;
+  BenchGetFsType (Root, FsType, sizeof (FsType), &ReadOnly);
+  if (ReadOnly) {
+    Print (L"# %u: %s is read-only, skipped\n", Index, FsType);
+    Root->Close (Root);
+    return;
+  }
+
+  Status = Root->Open (Root, &Dir, BENCH_DIR, EFI_FILE_MODE_CREATE|EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE, EFI_FILE_DIRECTORY);
+  if (EFI_ERROR (Status)) {
+    Print (L"# %u: can't create " BENCH_DIR L": %r\n", Index, Status);
+    Root->Close (Root);
+    return;
+  }
+  Dir->Close (Dir);
+
+  Status = BenchFiles (Options, Index, FsType, Root);
+  if (EFI_ERROR (Status)) {
+    Print (L"# %u: file benchmark failed: %r\n", Index, Status);
+  }
+
+  Status = BenchData (Options, Index, FsType, Root);
+  if (EFI_ERROR (Status)) {
+    Print (L"# %u: data benchmark failed: %r\n", Index, Status);
+  }
+
+  BenchCleanup (Options, Root);
+  Root->Close (Root);
+
+  if (Options->Remount) {
+    BenchRemount (Options, Index, FsType, Handle);
+  }
+}
+
+/**
+  Read a block trace from the root of the volume the image was loaded from.
+
+**/
+STATIC
+EFI_STATUS
+BenchLoadTrace (
+  IN  EFI_HANDLE        DeviceHandle,
+  IN  CONST CHAR16      *Name,
+  OUT LKL_TRACE_HEADER  **Trace
+  )
+{
+  EFI_STATUS                      Status;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *Fs;
+  EFI_FILE_PROTOCOL               *Root;
+  EFI_FILE_PROTOCOL               *File;
+  LKL_TRACE_HEADER                Header;
+  LKL_TRACE_HEADER                *Buffer;
+  UINTN                           Size;
+  CHAR16                          Path[128];
+
+  Status = gBS->HandleProtocol (DeviceHandle, &gEfiSimpleFileSystemProtocolGuid, (VOID **)&Fs);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = Fs->OpenVolume (Fs, &Root);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  UnicodeSPrint (Path, sizeof (Path), L"\\%s", Name);
+  Status = Root->Open (Root, &File, Path, EFI_FILE_MODE_READ, 0);
+  Root->Close (Root);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Size   = sizeof (Header);
+  Status = File->Read (File, &Size, &Header);
+  if (EFI_ERROR (Status) || Size != sizeof (Header) ||
+      Header.Magic != LKL_TRACE_MAGIC || Header.Version != LKL_TRACE_VERSION ||
+      Header.RecordSize != sizeof (LKL_TRACE_RECORD)) {
+    File->Close (File);
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  Buffer = AllocatePool (sizeof (Header) + Header.Count * sizeof (LKL_TRACE_RECORD));
+  if (Buffer == NULL) {
+    File->Close (File);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  CopyMem (Buffer, &Header, sizeof (Header));
+  Size   = Header.Count * sizeof (LKL_TRACE_RECORD);
+  Status = File->Read (File, &Size, Buffer + 1);
+  File->Close (File);
+  if (EFI_ERROR (Status) || Size != Header.Count * sizeof (LKL_TRACE_RECORD)) {
+    FreePool (Buffer);
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  *Trace = Buffer;
+  return EFI_SUCCESS;
+}
+
+/**
+  Issue the requests of a block trace on the disk of a volume.
+
+**/
+STATIC
+VOID
+BenchReplay (
+  IN BENCH_OPTIONS      *Options,
+  IN UINTN              Index,
+  IN EFI_HANDLE         Handle,
+  IN LKL_TRACE_HEADER   *Trace
+  )
+{
+  EFI_STATUS            Status;
+  EFI_DISK_IO_PROTOCOL  *DiskIo;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo;
+  LKL_TRACE_RECORD      *Records;
+  LKL_TRACE_RECORD      *Record;
+  UINT8                 *Buffer;
+  UINTN                 BufferSize;
+  UINT64                Bytes[LKL_TRACE_FLUSH + 1];
+  UINT64                Ns[LKL_TRACE_FLUSH + 1];
+  UINT64                Recorded;
+  UINT64                Start;
+  UINT64                Base;
+  UINT64                Begin;
+  UINT64                Now;
+  UINT32                Nr;
+
+  Status = gBS->HandleProtocol (Handle, &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo);
+  if (!EFI_ERROR (Status)) {
+    Status = gBS->HandleProtocol (Handle, &gEfiDiskIoProtocolGuid, (VOID **)&DiskIo);
+  }
+  if (EFI_ERROR (Status)) {
+    Print (L"# %u: no disk to replay on: %r\n", Index, Status);
+    return;
+  }
+
+  Records    = (LKL_TRACE_RECORD *)(Trace + 1);
+  BufferSize = 0;
+  for (Nr = 0; Nr < Trace->Count; Nr++) {
+    BufferSize = MAX (BufferSize, Records[Nr].Length);
+  }
+
+  Buffer = AllocatePool (MAX (BufferSize, 1));
+  if (Buffer == NULL) {
+    return;
+  }
+
+  ZeroMem (Bytes, sizeof (Bytes));
+  ZeroMem (Ns, sizeof (Ns));
+  Recorded = 0;
+  Start    = 0;
+
+  //
+  // The times count from when the volume was set up, pace from the first
+  // record that's left in the ring
+  //
+  Base  = Trace->Count != 0 ? Records[0].TimeNs : 0;
+  Begin = BenchNow ();
+  for (Nr = 0; Nr < Trace->Count; Nr++) {
+    Record    = &Records[Nr];
+    Recorded += Record->LatencyNs;
+
+    if (Options->ReplayPace) {
+      Now = BenchNow () - Begin;
+      if (Base + Now < Record->TimeNs) {
+        gBS->Stall ((UINTN)DivU64x32 (Record->TimeNs - Base - Now, 1000));
+      }
+    }
+
+    switch (Record->Type) {
+    case LKL_TRACE_READ:
+      Start  = BenchNow ();
+      Status = DiskIo->ReadDisk (DiskIo, BlockIo->Media->MediaId, MultU64x32 (Record->Sector, 512), Record->Length, Buffer);
+      break;
+
+    case LKL_TRACE_WRITE:
+      if (!Options->ReplayWrites) {
+        continue;
+      }
+      Status = DiskIo->ReadDisk (DiskIo, BlockIo->Media->MediaId, MultU64x32 (Record->Sector, 512), Record->Length, Buffer);
+      if (EFI_ERROR (Status)) {
+        break;
+      }
+      Start  = BenchNow ();
+      Status = DiskIo->WriteDisk (DiskIo, BlockIo->Media->MediaId, MultU64x32 (Record->Sector, 512), Record->Length, Buffer);
+      break;
+
+    case LKL_TRACE_FLUSH:
+      if (!Options->ReplayWrites) {
+        continue;
+      }
+      Start  = BenchNow ();
+      Status = BlockIo->FlushBlocks (BlockIo);
+      break;
+
+    default:
+      continue;
+    }
+
+    if (EFI_ERROR (Status)) {
+      Print (L"# %u: request %u failed: %r\n", Index, Nr, Status);
+      break;
+    }
+
+    Ns[Record->Type]    += BenchNow () - Start;
+    Bytes[Record->Type] += Record->Length;
+  }
+  Now = BenchNow () - Begin;
+
+  BenchReport (Options, Index, L"trace", L"replay_time", DivU64x32 (Now, 1000), L"us");
+  BenchReport (Options, Index, L"trace", L"recorded_device_time", DivU64x32 (Recorded, 1000), L"us");
+  BenchReport (Options, Index, L"trace", L"replay_read", BenchRate (Bytes[LKL_TRACE_READ] / SIZE_1KB, Ns[LKL_TRACE_READ]), L"KiB/s");
+  if (Options->ReplayWrites) {
+    BenchReport (Options, Index, L"trace", L"replay_write", BenchRate (Bytes[LKL_TRACE_WRITE] / SIZE_1KB, Ns[LKL_TRACE_WRITE]), L"KiB/s");
+    BenchReport (Options, Index, L"trace", L"replay_flush_time", DivU64x32 (Ns[LKL_TRACE_FLUSH], 1000), L"us");
+  }
+
+  FreePool (Buffer);
+}
+
+/**
+  Split the load options into arguments, in place.
+
+**/
+STATIC
+UINTN
+BenchSplitArgs (
+  IN  CHAR16    *Line,
+  OUT CHAR16    **Argv,
+  IN  UINTN     MaxArgs
+  )
+{
+  UINTN   Argc;
+
+  Argc = 0;
+  while (*Line != 0 && Argc < MaxArgs) {
+    while (*Line == L' ') {
+      *Line++ = 0;
+    }
+    if (*Line == 0) {
+      break;
+    }
+    Argv[Argc++] = Line;
+    while (*Line != 0 && *Line != L' ') {
+      Line++;
+    }
+  }
+
+  return Argc;
+}
+
+EFI_STATUS
+EFIAPI
+LKLBenchMain (
+  IN EFI_HANDLE         ImageHandle,
+  IN EFI_SYSTEM_TABLE   *SystemTable
+  )
+{
+  EFI_STATUS                Status;
+  EFI_LOADED_IMAGE_PROTOCOL *LoadedImage;
+  BENCH_OPTIONS             Options;
+  CHAR16                    *Line;
+  CHAR16                    *Argv[32];
+  UINTN                     Argc;
+  UINTN                     Arg;
+  UINTN                     Volumes[BENCH_MAX_VOLUMES];
+  UINTN                     VolumeCount;
+  UINTN                     Nr;
+  EFI_HANDLE                *Handles;
+  UINTN                     HandleCount;
+  UINTN                     Index;
+  LKL_TRACE_HEADER          *Trace;
+
+  Options.Tag       = L"-";
+  Options.DataSize  = 64 * SIZE_1MB;
+  Options.Files     = 256;
+  Options.RandomOps = 2048;
+  Options.Remount      = FALSE;
+  Options.Trace        = NULL;
+  Options.ReplayWrites = FALSE;
+  Options.ReplayPace   = FALSE;
+
+  Argc  = 0;
+  Line  = NULL;
+  Trace = NULL;
+  Status = gBS->HandleProtocol (ImageHandle, &gEfiLoadedImageProtocolGuid, (VOID **)&LoadedImage);
+  if (!EFI_ERROR (Status) && LoadedImage->LoadOptionsSize >= sizeof (CHAR16)) {
+    Line = AllocateZeroPool (LoadedImage->LoadOptionsSize + sizeof (CHAR16));
+    if (Line == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    CopyMem (Line, LoadedImage->LoadOptions, LoadedImage->LoadOptionsSize);
+    Argc = BenchSplitArgs (Line, Argv, ARRAY_SIZE (Argv));
+  }
+
+  //
+  // Argv[0] is the image itself
+  //
+  VolumeCount = 0;
+  for (Arg = 1; Arg < Argc; Arg++) {
+    if (StrCmp (Argv[Arg], L"-m") == 0) {
+      Options.Remount = TRUE;
+    } else if (StrCmp (Argv[Arg], L"-w") == 0) {
+      Options.ReplayWrites = TRUE;
+    } else if (StrCmp (Argv[Arg], L"-p") == 0) {
+      Options.ReplayPace = TRUE;
+    } else if (Arg + 1 < Argc && StrCmp (Argv[Arg], L"-R") == 0) {
+      Options.Trace = Argv[++Arg];
+    } else if (Arg + 1 < Argc && StrCmp (Argv[Arg], L"-t") == 0) {
+      Options.Tag = Argv[++Arg];
+    } else if (Arg + 1 < Argc && StrCmp (Argv[Arg], L"-s") == 0) {
+      Options.DataSize = MAX (StrDecimalToUintn (Argv[++Arg]), 1) * SIZE_1MB;
+    } else if (Arg + 1 < Argc && StrCmp (Argv[Arg], L"-n") == 0) {
+      Options.Files = MAX (StrDecimalToUintn (Argv[++Arg]), 1);
+    } else if (Arg + 1 < Argc && StrCmp (Argv[Arg], L"-r") == 0) {
+      Options.RandomOps = StrDecimalToUintn (Argv[++Arg]);
+    } else if (VolumeCount < BENCH_MAX_VOLUMES) {
+      Volumes[VolumeCount++] = StrDecimalToUintn (Argv[Arg]);
+    }
+  }
+
+  if (Options.Trace != NULL) {
+    if (VolumeCount == 0) {
+      Print (L"# -R needs the volumes to replay on\n");
+      Status = EFI_INVALID_PARAMETER;
+      goto Exit;
+    }
+
+    Status = BenchLoadTrace (LoadedImage->DeviceHandle, Options.Trace, &Trace);
+    if (EFI_ERROR (Status)) {
+      Print (L"# can't load trace %s: %r\n", Options.Trace, Status);
+      goto Exit;
+    }
+  }
+
+  Status = gBS->LocateHandleBuffer (ByProtocol, &gEfiSimpleFileSystemProtocolGuid, NULL, &HandleCount, &Handles);
+  if (EFI_ERROR (Status)) {
+    Print (L"# no filesystems: %r\n", Status);
+    goto Exit;
+  }
+
+  Print (L"# tag,volume,fstype,metric,value,unit\n");
+  for (Index = 0; Index < HandleCount; Index++) {
+    if (VolumeCount != 0) {
+      for (Nr = 0; Nr < VolumeCount && Volumes[Nr] != Index; Nr++) {
+      }
+      if (Nr == VolumeCount) {
+        continue;
+      }
+    }
+
+    if (Trace != NULL) {
+      BenchReplay (&Options, Index, Handles[Index], Trace);
+    } else {
+      BenchVolume (&Options, Index, Handles[Index]);
+    }
+  }
+
+  FreePool (Handles);
+
+Exit:
+  if (Trace != NULL) {
+    FreePool (Trace);
+  }
+  if (Line != NULL) {
+    FreePool (Line);
+  }
+  return Status;
+}
@@ -33,11 +33,21 @@ Revision History
 //
 EFI_LOCK LKLFsLock   = EFI_INITIALIZE_LOCK_VARIABLE (TPL_CALLBACK);
 
+//
+// gLKLVolumeList - All mounted volumes, synced and unmounted at ExitBootServices.
+//
+LIST_ENTRY gLKLVolumeList = INITIALIZE_LIST_HEAD_VARIABLE (gLKLVolumeList);
+
+//
+// gLKLPendingList - Volumes whose mount is still running in the background.
+//
+LIST_ENTRY gLKLPendingList = INITIALIZE_LIST_HEAD_VARIABLE (gLKLPendingList);
+
 //
 // Filesystem interface functions
 //
 EFI_FILE_PROTOCOL               LKLFileInterface = {
-  EFI_FILE_PROTOCOL_REVISION,
+  EFI_FILE_PROTOCOL_REVISION2,
   LKLOpen,
   LKLClose,
   LKLDelete,
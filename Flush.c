@@ -42,6 +42,9 @@ LKLFlush (
 
   RC = lkl_sys_fsync(IFile->FD);
   Status = LKLError2EfiError(RC);
+  if (!EFI_ERROR (Status)) {
+    IFile->Dirty = FALSE;
+  }
 
   return Status;
 }
@@ -53,8 +56,12 @@ LKLFlushEx (
   IN EFI_FILE_IO_TOKEN  *Token
   )
 {
-  DEBUG((EFI_D_ERROR, "%a:%u\n", __func__, __LINE__));
-  return EFI_DEVICE_ERROR;
+  if (Token->Event == NULL) {
+    Token->Status = LKLFlush (FHand);
+    return Token->Status;
+  }
+
+  return LKLAsyncSubmit (IFILE_FROM_FHAND (FHand), LKL_ASYNC_FLUSH, Token, NULL, NULL, 0, 0);
 }
 
 EFI_STATUS
@@ -70,6 +77,13 @@ LKLClose (
   Volume  = IFile->Volume;
   (VOID)(Volume);
 
+  //
+  // Token based requests still use the handle, the last one closes it
+  //
+  if (LKLAsyncDeferClose (IFile, FALSE)) {
+    return EFI_SUCCESS;
+  }
+
   //
   // Close the file instance handle
   //
@@ -83,40 +97,99 @@ EFIAPI
 LKLDelete (
   IN EFI_FILE_PROTOCOL  *FHand
   )
+{
+  LKL_IFILE  *IFile;
+
+  IFile = IFILE_FROM_FHAND (FHand);
+
+  //
+  // No point in writing back a file which is about to be deleted
+  //
+  IFile->Dirty = FALSE;
+
+  //
+  // Token based requests still use the handle, the last one deletes it
+  //
+  if (LKLAsyncDeferClose (IFile, TRUE)) {
+    return EFI_SUCCESS;
+  }
+
+  return LKLIFileDelete (IFile);
+}
+
+/**
+  Close IFile and delete the file it refers to.
+
+  The name is removed relative to the directory it was opened in, and only
+  if it still refers to the opened file, so a rename of one of the
+  directories in between can't make this delete something else.
+
+  @retval EFI_SUCCESS               The file was deleted.
+  @retval EFI_WARN_DELETE_FAILURE   The handle was closed but the file was
+                                    not deleted.
+
+**/
+EFI_STATUS
+LKLIFileDelete (
+  LKL_IFILE           *IFile
+  )
 {
   INTN       RC;
+  INTN       DirFD;
   EFI_STATUS Status;
-  LKL_IFILE  *IFile;
   LKL_VOLUME *Volume;
+  CHAR8      *DirPath;
+  UINTN      DirPathSize;
+  CONST CHAR8 *BaseName;
+  struct lkl_stat FileStat;
+  struct lkl_stat StatBuf;
 
-  IFile = IFILE_FROM_FHAND (FHand);
   Volume  = IFile->Volume;
-  (VOID)(Volume);
 
   Status = EFI_WARN_DELETE_FAILURE;
-
-  UINTN  FilePathSize = AsciiStrLen(Volume->LKLMountPoint) + 1 + AsciiStrLen(IFile->FilePath) + 1;
-  CHAR8* FilePath = AllocatePool(FilePathSize);
-  if (FilePath) {
-    AsciiSPrint(FilePath, FilePathSize, "%a/%a", Volume->LKLMountPoint, IFile->FilePath);
-  }
+  DirFD = -1;
 
   //
-  // Close the file instance handle
+  // The root directory has no name to remove
   //
-  LKLIFileClose (IFile);
+  BaseName = GetBasenamePtr (IFile->FilePath);
+  if (BaseName[0] == 0 || lkl_sys_fstat (IFile->FD, &FileStat) != 0) {
+    goto Done;
+  }
 
-  if (FilePath) {
-    //
-    // Close the file instance handle
-    //
-    RC = lkl_sys_unlink(FilePath);
-    if (RC==0) {
+  DirPathSize = AsciiStrLen (Volume->LKLMountPoint) + 1 + (BaseName - IFile->FilePath) + 1;
+  DirPath = AllocatePool (DirPathSize);
+  if (DirPath == NULL) {
+    goto Done;
+  }
+  // the buffer only fits the path up to the last slash, which cuts off the name
+  AsciiSPrint (DirPath, DirPathSize, "%a/%a", Volume->LKLMountPoint, IFile->FilePath);
+
+  DirFD = lkl_sys_open (DirPath, LKL_O_RDONLY | LKL_O_DIRECTORY, 0);
+  FreePool (DirPath);
+  if (DirFD < 0) {
+    goto Done;
+  }
+
+  RC = lkl_sys_fstatat (DirFD, BaseName, &StatBuf, LKL_AT_SYMLINK_NOFOLLOW);
+  if (RC == 0 && StatBuf.st_dev == FileStat.st_dev && StatBuf.st_ino == FileStat.st_ino) {
+    RC = lkl_sys_unlinkat (DirFD, BaseName, LKL_S_ISDIR (FileStat.st_mode) ? LKL_AT_REMOVEDIR : 0);
+    if (RC == 0) {
       Status = EFI_SUCCESS;
     }
+  }
 
-    FreePool (FilePath);
+Done:
+  if (DirFD >= 0) {
+    lkl_sys_close (DirFD);
   }
 
+  //
+  // Close the file instance handle
+  //
+  LKLIFileClose (IFile);
+
+  LKLLookupCacheFlush (&Volume->LookupCache);
+
   return Status;
 }
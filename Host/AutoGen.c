@@ -0,0 +1,91 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  AutoGen.c
+
+Abstract:
+
+  Guid definitions of the harness, see AutoGen.h. The PCDs are generated
+  from LKL.dec, see Pcd.awk.
+
+Revision History
+
+--*/
+
+#include <Uefi.h>
+
+#include <Guid/FileInfo.h>
+#include <Guid/FileSystemInfo.h>
+#include <Guid/FileSystemVolumeLabelInfo.h>
+#include <Guid/GlobalVariable.h>
+#include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
+#include <Protocol/ComponentName.h>
+#include <Protocol/ComponentName2.h>
+#include <Protocol/Cpu.h>
+#include <Protocol/DevicePath.h>
+#include <Protocol/DiskIo.h>
+#include <Protocol/DiskIo2.h>
+#include <Protocol/DriverBinding.h>
+#include <Protocol/DriverConfiguration.h>
+#include <Protocol/DriverConfiguration2.h>
+#include <Protocol/DriverDiagnostics.h>
+#include <Protocol/DriverDiagnostics2.h>
+#include <Protocol/LoadedImage.h>
+#include <Protocol/MpService.h>
+#include <Protocol/PartitionName.h>
+#include <Protocol/SimpleFileSystem.h>
+#include <Protocol/UnicodeCollation.h>
+#include <Protocol/LKLStats.h>
+
+GUID  gEfiCallerIdGuid = { 0x21db9c99, 0x120a, 0x4c7a, { 0xa0, 0xbb, 0x7e, 0xc6, 0xb5, 0xf3, 0xb4, 0x9b } };
+CHAR8 *gEfiCallerBaseName = "LKL";
+
+//
+// Guids
+//
+EFI_GUID gEfiFileInfoGuid                     = EFI_FILE_INFO_ID;
+EFI_GUID gEfiFileSystemInfoGuid               = EFI_FILE_SYSTEM_INFO_ID;
+EFI_GUID gEfiFileSystemVolumeLabelInfoIdGuid  = EFI_FILE_SYSTEM_VOLUME_LABEL_ID;
+EFI_GUID gEfiGlobalVariableGuid               = EFI_GLOBAL_VARIABLE;
+EFI_GUID gLKLTokenSpaceGuid                   = { 0x3bb46a9f, 0x8123, 0x47a4, { 0xba, 0x4a, 0xb9, 0xdf, 0x9f, 0x71, 0xe8, 0x94 } };
+EFI_GUID gLKLVariableGuid                     = { 0xc0f40575, 0x6fe2, 0x4828, { 0xa1, 0x8a, 0x9e, 0xbf, 0x5f, 0x30, 0xc0, 0x6b } };
+
+//
+// Protocols
+//
+EFI_GUID gEfiBlockIoProtocolGuid              = EFI_BLOCK_IO_PROTOCOL_GUID;
+EFI_GUID gEfiBlockIo2ProtocolGuid             = EFI_BLOCK_IO2_PROTOCOL_GUID;
+EFI_GUID gEfiComponentNameProtocolGuid        = EFI_COMPONENT_NAME_PROTOCOL_GUID;
+EFI_GUID gEfiComponentName2ProtocolGuid       = EFI_COMPONENT_NAME2_PROTOCOL_GUID;
+EFI_GUID gEfiCpuArchProtocolGuid              = EFI_CPU_ARCH_PROTOCOL_GUID;
+EFI_GUID gEfiDevicePathProtocolGuid           = EFI_DEVICE_PATH_PROTOCOL_GUID;
+EFI_GUID gEfiDiskIoProtocolGuid               = EFI_DISK_IO_PROTOCOL_GUID;
+EFI_GUID gEfiDiskIo2ProtocolGuid              = EFI_DISK_IO2_PROTOCOL_GUID;
+EFI_GUID gEfiDriverBindingProtocolGuid        = EFI_DRIVER_BINDING_PROTOCOL_GUID;
+EFI_GUID gEfiDriverConfigurationProtocolGuid  = EFI_DRIVER_CONFIGURATION_PROTOCOL_GUID;
+EFI_GUID gEfiDriverConfiguration2ProtocolGuid = EFI_DRIVER_CONFIGURATION2_PROTOCOL_GUID;
+EFI_GUID gEfiDriverDiagnosticsProtocolGuid    = EFI_DRIVER_DIAGNOSTICS_PROTOCOL_GUID;
+EFI_GUID gEfiDriverDiagnostics2ProtocolGuid   = EFI_DRIVER_DIAGNOSTICS2_PROTOCOL_GUID;
+EFI_GUID gEfiLoadedImageProtocolGuid          = EFI_LOADED_IMAGE_PROTOCOL_GUID;
+EFI_GUID gEfiMpServiceProtocolGuid            = EFI_MP_SERVICES_PROTOCOL_GUID;
+EFI_GUID gEfiSimpleFileSystemProtocolGuid     = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+EFI_GUID gEfiUnicodeCollationProtocolGuid     = EFI_UNICODE_COLLATION_PROTOCOL_GUID;
+EFI_GUID gEfiUnicodeCollation2ProtocolGuid    = EFI_UNICODE_COLLATION_PROTOCOL2_GUID;
+EFI_GUID gLKLStatsProtocolGuid                = LKL_STATS_PROTOCOL_GUID;
+
+//
+// Only has to differ from the other protocols the harness installs
+//
+EFI_GUID gEfiPartitionNameProtocolGuid        = { 0x4e1b9c0a, 0x5ad7, 0x4b3e, { 0x9d, 0x2f, 0x61, 0x0c, 0x8e, 0x37, 0xa2, 0x54 } };
@@ -0,0 +1,88 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  AutoGen.h
+
+Abstract:
+
+  Stands in for the header the EDK2 build generates for the driver and is
+  force included into every harness and driver source. The LKL PCDs are
+  variables, so the harness can set them from its command line, the ones
+  the EDK2 libraries read are fixed.
+
+Revision History
+
+--*/
+
+#ifndef _HOST_AUTOGEN_H_
+#define _HOST_AUTOGEN_H_
+
+#include <Base.h>
+#include <Uefi.h>
+#include <Library/PcdLib.h>
+
+extern GUID  gEfiCallerIdGuid;
+extern CHAR8 *gEfiCallerBaseName;
+
+//
+// Guids and protocols that only the build declares
+//
+extern EFI_GUID gLKLTokenSpaceGuid;
+extern EFI_GUID gLKLVariableGuid;
+extern EFI_GUID gLKLStatsProtocolGuid;
+
+//
+// LKL PCDs, generated from LKL.dec by Pcd.awk, see the Makefile
+//
+#define LKL_HOST_PCD_STRING_SIZE  512
+
+#include "LKLPcd.h"
+
+//
+// MdePkg PCDs
+//
+#define _PCD_VALUE_PcdMaximumUnicodeStringLength          1000000U
+#define _PCD_GET_MODE_32_PcdMaximumUnicodeStringLength    _PCD_VALUE_PcdMaximumUnicodeStringLength
+#define _PCD_VALUE_PcdMaximumAsciiStringLength            1000000U
+#define _PCD_GET_MODE_32_PcdMaximumAsciiStringLength      _PCD_VALUE_PcdMaximumAsciiStringLength
+#define _PCD_VALUE_PcdMaximumLinkedListLength             1000000U
+#define _PCD_GET_MODE_32_PcdMaximumLinkedListLength       _PCD_VALUE_PcdMaximumLinkedListLength
+#define _PCD_VALUE_PcdVerifyNodeInList                    FALSE
+#define _PCD_GET_MODE_BOOL_PcdVerifyNodeInList            _PCD_VALUE_PcdVerifyNodeInList
+#define _PCD_VALUE_PcdUefiLibMaxPrintBufferSize           320U
+#define _PCD_GET_MODE_32_PcdUefiLibMaxPrintBufferSize     _PCD_VALUE_PcdUefiLibMaxPrintBufferSize
+#define _PCD_VALUE_PcdFixedDebugPrintErrorLevel           0xFFFFFFFFU
+#define _PCD_GET_MODE_32_PcdFixedDebugPrintErrorLevel     _PCD_VALUE_PcdFixedDebugPrintErrorLevel
+#define _PCD_VALUE_PcdDebugPropertyMask                   0x0FU
+#define _PCD_GET_MODE_8_PcdDebugPropertyMask              _PCD_VALUE_PcdDebugPropertyMask
+#define _PCD_GET_MODE_BOOL_PcdComponentNameDisable        FALSE
+#define _PCD_GET_MODE_BOOL_PcdComponentName2Disable       FALSE
+#define _PCD_GET_MODE_BOOL_PcdDriverDiagnosticsDisable    FALSE
+#define _PCD_GET_MODE_BOOL_PcdDriverDiagnostics2Disable   FALSE
+#define _PCD_GET_MODE_PTR_PcdUefiVariableDefaultLang          ((VOID *)"eng")
+#define _PCD_GET_MODE_PTR_PcdUefiVariableDefaultPlatformLang  ((VOID *)"en-US")
+
+//
+// StdLib has strlcpy(), glibc only since 2.38, see Library.c
+//
+#include <stddef.h>
+
+size_t
+strlcpy (
+  char                  *Dst,
+  const char            *Src,
+  size_t                Size
+  );
+
+#endif
@@ -0,0 +1,1054 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  BootServices.c
+
+Abstract:
+
+  The system table, the TPL and event services, memory services and the
+  CPU architectural protocol of the harness.
+
+  Events follow the DXE core: notify functions are queued per TPL and run
+  by RestoreTPL(), highest TPL first. There are no interrupts, the timer
+  tick is polled instead wherever a real one could be taken: when the
+  interrupts are enabled, at the end of RestoreTPL(), in Stall(), CpuSleep()
+  and CheckEvent(). Timers and the completions of the disks only fire on
+  tick boundaries, like they do on a firmware timer interrupt.
+
+Revision History
+
+--*/
+
+#include "Host.h"
+
+#include <Protocol/Cpu.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define HOST_EVENT_SIGNATURE  SIGNATURE_32 ('h', 'e', 'v', 't')
+
+//
+// How long an idle CPU sleeps without a tick or a timer to wake it
+//
+#define HOST_IDLE_NS          1000000ULL
+
+typedef struct {
+  UINTN                 Signature;
+  UINT32                Type;
+  EFI_TPL               NotifyTpl;
+  EFI_EVENT_NOTIFY      NotifyFunction;
+  VOID                  *NotifyContext;
+  BOOLEAN               Signaled;
+  LIST_ENTRY            NotifyLink;     // in mEventQueue while queued
+  LIST_ENTRY            TimerLink;      // in mTimers while armed
+  LIST_ENTRY            GroupLink;      // in mExitBootServicesEvents
+  UINT64                TriggerTime;
+  UINT64                Period;
+} HOST_EVENT;
+
+typedef struct {
+  LIST_ENTRY            Link;
+  HOST_EVENT            *Event;
+  UINT64                Due;
+} HOST_DEFERRED_SIGNAL;
+
+EFI_HANDLE              gImageHandle;
+EFI_SYSTEM_TABLE        *gST;
+EFI_BOOT_SERVICES       *gBS;
+EFI_RUNTIME_SERVICES    *gRT;
+
+//
+// Timer tick in ns, 0 fires timers as soon as they are due
+//
+UINT64                  gHostTickNs = 1000000;
+
+STATIC EFI_TPL          mTpl = TPL_APPLICATION;
+STATIC BOOLEAN          mInterruptState = TRUE;
+STATIC UINTN            mEventPending;
+STATIC LIST_ENTRY       mEventQueue[TPL_HIGH_LEVEL + 1];
+STATIC LIST_ENTRY       mTimers = INITIALIZE_LIST_HEAD_VARIABLE (mTimers);
+STATIC LIST_ENTRY       mDeferred = INITIALIZE_LIST_HEAD_VARIABLE (mDeferred);
+STATIC LIST_ENTRY       mExitBootServicesEvents = INITIALIZE_LIST_HEAD_VARIABLE (mExitBootServicesEvents);
+STATIC UINT64           mNextDue = MAX_UINT64;
+STATIC BOOLEAN          mTimersStopped;
+STATIC UINT32           mCrcTable[256];
+
+UINT64
+HostNow (
+  VOID
+  )
+{
+  struct timespec Now;
+
+  clock_gettime (CLOCK_MONOTONIC, &Now);
+  return (UINT64)Now.tv_sec * 1000000000ULL + (UINT64)Now.tv_nsec;
+}
+
+STATIC
+VOID
+HostSleepUntil (
+  IN UINT64             Time
+  )
+{
+  struct timespec Until;
+
+  Until.tv_sec  = Time / 1000000000ULL;
+  Until.tv_nsec = Time % 1000000000ULL;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &Until, NULL) == EINTR);
+}
+
+STATIC
+HOST_EVENT *
+HostEventFromHandle (
+  IN EFI_EVENT          Event
+  )
+{
+  HOST_EVENT *HostEvent;
+
+  HostEvent = Event;
+  if (HostEvent == NULL || HostEvent->Signature != HOST_EVENT_SIGNATURE) {
+    return NULL;
+  }
+  return HostEvent;
+}
+
+/**
+  Time of the last tick at or before Now.
+
+**/
+STATIC
+UINT64
+HostTickTime (
+  IN UINT64             Now
+  )
+{
+  return gHostTickNs == 0 ? Now : Now - Now % gHostTickNs;
+}
+
+/**
+  Time the next poll has something to do, or MAX_UINT64.
+
+**/
+STATIC
+UINT64
+HostWakeTime (
+  VOID
+  )
+{
+  UINT64 Due;
+
+  Due = mNextDue;
+  if (Due != MAX_UINT64 && gHostTickNs != 0) {
+    Due = (Due + gHostTickNs - 1) / gHostTickNs * gHostTickNs;
+  }
+  return Due;
+}
+
+STATIC
+VOID
+HostUpdateNextDue (
+  VOID
+  )
+{
+  UINT64 Due;
+
+  Due = MAX_UINT64;
+  if (!mTimersStopped) {
+    if (!IsListEmpty (&mTimers)) {
+      Due = BASE_CR (GetFirstNode (&mTimers), HOST_EVENT, TimerLink)->TriggerTime;
+    }
+    if (!IsListEmpty (&mDeferred)) {
+      Due = MIN (Due, BASE_CR (GetFirstNode (&mDeferred), HOST_DEFERRED_SIGNAL, Link)->Due);
+    }
+  }
+  mNextDue = Due;
+}
+
+/**
+  Signals an event, the caller is at TPL_HIGH_LEVEL.
+
+**/
+STATIC
+VOID
+HostSignal (
+  IN HOST_EVENT         *Event
+  )
+{
+  if (Event->Signaled) {
+    return;
+  }
+
+  Event->Signaled = TRUE;
+  if ((Event->Type & EVT_NOTIFY_SIGNAL) != 0) {
+    InsertTailList (&mEventQueue[Event->NotifyTpl], &Event->NotifyLink);
+    mEventPending |= (UINTN)1 << Event->NotifyTpl;
+  }
+}
+
+STATIC
+VOID
+HostDispatchNotifies (
+  IN EFI_TPL            Priority
+  )
+{
+  HOST_EVENT *Event;
+
+  //
+  // A notify function may switch to another LK thread, which may run the
+  // queue too, so the head is read again every time
+  //
+  while (!IsListEmpty (&mEventQueue[Priority])) {
+    Event = BASE_CR (GetFirstNode (&mEventQueue[Priority]), HOST_EVENT, NotifyLink);
+    RemoveEntryList (&Event->NotifyLink);
+    Event->NotifyLink.ForwardLink = NULL;
+
+    if ((Event->Type & EVT_NOTIFY_SIGNAL) != 0) {
+      Event->Signaled = FALSE;
+    }
+
+    Event->NotifyFunction (Event, Event->NotifyContext);
+  }
+
+  mEventPending &= ~((UINTN)1 << Priority);
+}
+
+STATIC
+VOID
+HostInsertTimer (
+  IN HOST_EVENT         *Event
+  )
+{
+  LIST_ENTRY *Link;
+
+  for (Link = GetFirstNode (&mTimers); !IsNull (&mTimers, Link); Link = GetNextNode (&mTimers, Link)) {
+    if (BASE_CR (Link, HOST_EVENT, TimerLink)->TriggerTime > Event->TriggerTime) {
+      break;
+    }
+  }
+
+  //
+  // Inserts in front of Link
+  //
+  InsertTailList (Link, &Event->TimerLink);
+}
+
+/**
+  Signals the timers and deferred signals due by Now, the caller is at
+  TPL_HIGH_LEVEL.
+
+**/
+STATIC
+VOID
+HostCheckTimers (
+  IN UINT64             Now
+  )
+{
+  HOST_EVENT            *Event;
+  HOST_DEFERRED_SIGNAL  *Deferred;
+
+  while (!IsListEmpty (&mTimers)) {
+    Event = BASE_CR (GetFirstNode (&mTimers), HOST_EVENT, TimerLink);
+    if (Event->TriggerTime > Now) {
+      break;
+    }
+
+    RemoveEntryList (&Event->TimerLink);
+    Event->TimerLink.ForwardLink = NULL;
+    if (Event->Period != 0) {
+      Event->TriggerTime += Event->Period;
+      if (Event->TriggerTime <= Now) {
+        Event->TriggerTime = Now + Event->Period;
+      }
+      HostInsertTimer (Event);
+    }
+
+    HostSignal (Event);
+  }
+
+  while (!IsListEmpty (&mDeferred)) {
+    Deferred = BASE_CR (GetFirstNode (&mDeferred), HOST_DEFERRED_SIGNAL, Link);
+    if (Deferred->Due > Now) {
+      break;
+    }
+
+    RemoveEntryList (&Deferred->Link);
+    HostSignal (Deferred->Event);
+    free (Deferred);
+  }
+
+  HostUpdateNextDue ();
+}
+
+EFI_TPL
+EFIAPI
+HostRaiseTpl (
+  IN EFI_TPL            NewTpl
+  )
+{
+  EFI_TPL OldTpl;
+
+  HOST_ASSERT_BSP ();
+
+  OldTpl = mTpl;
+  if (NewTpl >= TPL_HIGH_LEVEL && OldTpl < TPL_HIGH_LEVEL) {
+    mInterruptState = FALSE;
+  }
+  mTpl = NewTpl;
+
+  return OldTpl;
+}
+
+STATIC
+VOID
+HostSetInterruptState (
+  IN BOOLEAN            Enable
+  )
+{
+  mInterruptState = Enable;
+  if (Enable) {
+    HostPollInterrupts ();
+  }
+}
+
+VOID
+EFIAPI
+HostRestoreTpl (
+  IN EFI_TPL            NewTpl
+  )
+{
+  EFI_TPL OldTpl;
+  EFI_TPL PendingTpl;
+
+  HOST_ASSERT_BSP ();
+
+  OldTpl = mTpl;
+  if (OldTpl >= TPL_HIGH_LEVEL && NewTpl < TPL_HIGH_LEVEL) {
+    mTpl = TPL_HIGH_LEVEL;
+  }
+
+  while (mEventPending != 0) {
+    PendingTpl = (EFI_TPL)HighBitSet64 (mEventPending);
+    if (PendingTpl <= NewTpl) {
+      break;
+    }
+
+    mTpl = PendingTpl;
+    if (mTpl < TPL_HIGH_LEVEL) {
+      HostSetInterruptState (TRUE);
+    }
+    HostDispatchNotifies (mTpl);
+  }
+
+  mTpl = NewTpl;
+  if (mTpl < TPL_HIGH_LEVEL) {
+    HostSetInterruptState (TRUE);
+  }
+}
+
+/**
+  Takes the timer tick if it's due and could be taken right now.
+
+**/
+VOID
+HostPollInterrupts (
+  VOID
+  )
+{
+  EFI_TPL OldTpl;
+  UINT64  Now;
+
+  if (!mInterruptState || mTpl >= TPL_HIGH_LEVEL || HostCpuNumber () != 0) {
+    return;
+  }
+
+  Now = HostTickTime (HostNow ());
+  if (Now < mNextDue) {
+    return;
+  }
+
+  OldTpl = HostRaiseTpl (TPL_HIGH_LEVEL);
+  HostCheckTimers (Now);
+  HostRestoreTpl (OldTpl);
+}
+
+/**
+  CpuSleep(): waits for the next tick, or a moment if there is none.
+
+**/
+VOID
+HostSleep (
+  VOID
+  )
+{
+  UINT64 Now;
+  UINT64 Wake;
+
+  Now = HostNow ();
+  if (HostCpuNumber () != 0 || !mInterruptState || mTpl >= TPL_HIGH_LEVEL) {
+    HostSleepUntil (Now + HOST_IDLE_NS);
+    return;
+  }
+
+  Wake = MIN (HostWakeTime (), Now + HOST_IDLE_NS);
+  if (Wake > Now) {
+    HostSleepUntil (Wake);
+  }
+  HostPollInterrupts ();
+}
+
+/**
+  Signals Event once Due has passed, the disks complete their tokens this
+  way.
+
+**/
+VOID
+HostSignalLater (
+  IN EFI_EVENT          Event,
+  IN UINT64             Due
+  )
+{
+  HOST_DEFERRED_SIGNAL  *Deferred;
+  HOST_DEFERRED_SIGNAL  *Entry;
+  LIST_ENTRY            *Link;
+  EFI_TPL               OldTpl;
+
+  Deferred = malloc (sizeof (*Deferred));
+  ASSERT (Deferred != NULL);
+  Deferred->Event = HostEventFromHandle (Event);
+  Deferred->Due   = Due;
+  ASSERT (Deferred->Event != NULL);
+
+  OldTpl = HostRaiseTpl (TPL_HIGH_LEVEL);
+  for (Link = GetFirstNode (&mDeferred); !IsNull (&mDeferred, Link); Link = GetNextNode (&mDeferred, Link)) {
+    Entry = BASE_CR (Link, HOST_DEFERRED_SIGNAL, Link);
+    if (Entry->Due > Due) {
+      break;
+    }
+  }
+  InsertTailList (Link, &Deferred->Link);
+  HostUpdateNextDue ();
+  HostRestoreTpl (OldTpl);
+}
+
+EFI_STATUS
+EFIAPI
+HostCreateEvent (
+  IN  UINT32            Type,
+  IN  EFI_TPL           NotifyTpl,
+  IN  EFI_EVENT_NOTIFY  NotifyFunction OPTIONAL,
+  IN  VOID              *NotifyContext OPTIONAL,
+  OUT EFI_EVENT         *Event
+  )
+{
+  HOST_EVENT *HostEvent;
+
+  HOST_ASSERT_BSP ();
+
+  if (Event == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if ((Type & (EVT_NOTIFY_SIGNAL | EVT_NOTIFY_WAIT)) != 0) {
+    if (NotifyFunction == NULL || NotifyTpl <= TPL_APPLICATION || NotifyTpl >= TPL_HIGH_LEVEL) {
+      return EFI_INVALID_PARAMETER;
+    }
+  }
+
+  HostEvent = AllocateZeroPool (sizeof (*HostEvent));
+  if (HostEvent == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  HostEvent->Signature      = HOST_EVENT_SIGNATURE;
+  HostEvent->Type           = Type;
+  HostEvent->NotifyTpl      = NotifyTpl;
+  HostEvent->NotifyFunction = NotifyFunction;
+  HostEvent->NotifyContext  = NotifyContext;
+
+  if (Type == EVT_SIGNAL_EXIT_BOOT_SERVICES) {
+    InsertTailList (&mExitBootServicesEvents, &HostEvent->GroupLink);
+  }
+
+  *Event = HostEvent;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostSetTimer (
+  IN EFI_EVENT          Event,
+  IN EFI_TIMER_DELAY    Type,
+  IN UINT64             TriggerTime
+  )
+{
+  HOST_EVENT *HostEvent;
+  EFI_TPL    OldTpl;
+
+  HOST_ASSERT_BSP ();
+
+  HostEvent = HostEventFromHandle (Event);
+  if (HostEvent == NULL || (HostEvent->Type & EVT_TIMER) == 0 || (UINT32)Type > TimerRelative) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  OldTpl = HostRaiseTpl (TPL_HIGH_LEVEL);
+
+  if (HostEvent->TimerLink.ForwardLink != NULL) {
+    RemoveEntryList (&HostEvent->TimerLink);
+    HostEvent->TimerLink.ForwardLink = NULL;
+  }
+
+  HostEvent->Period = 0;
+  if (Type != TimerCancel) {
+    if (Type == TimerPeriodic) {
+      HostEvent->Period = MAX (TriggerTime * 100, 1);
+    }
+    HostEvent->TriggerTime = HostNow () + TriggerTime * 100;
+    HostInsertTimer (HostEvent);
+  }
+
+  HostUpdateNextDue ();
+  HostRestoreTpl (OldTpl);
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostSignalEvent (
+  IN EFI_EVENT          Event
+  )
+{
+  HOST_EVENT *HostEvent;
+  EFI_TPL    OldTpl;
+
+  HOST_ASSERT_BSP ();
+
+  HostEvent = HostEventFromHandle (Event);
+  if (HostEvent == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  OldTpl = HostRaiseTpl (TPL_HIGH_LEVEL);
+  HostSignal (HostEvent);
+  HostRestoreTpl (OldTpl);
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostCheckEvent (
+  IN EFI_EVENT          Event
+  )
+{
+  HOST_EVENT *HostEvent;
+  EFI_STATUS Status;
+  EFI_TPL    OldTpl;
+
+  HOST_ASSERT_BSP ();
+
+  HostEvent = HostEventFromHandle (Event);
+  if (HostEvent == NULL || (HostEvent->Type & EVT_NOTIFY_SIGNAL) != 0) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  HostPollInterrupts ();
+
+  if (!HostEvent->Signaled && (HostEvent->Type & EVT_NOTIFY_WAIT) != 0) {
+    OldTpl = HostRaiseTpl (TPL_HIGH_LEVEL);
+    if (HostEvent->NotifyLink.ForwardLink == NULL) {
+      InsertTailList (&mEventQueue[HostEvent->NotifyTpl], &HostEvent->NotifyLink);
+      mEventPending |= (UINTN)1 << HostEvent->NotifyTpl;
+    }
+    HostRestoreTpl (OldTpl);
+  }
+
+  Status = EFI_NOT_READY;
+  OldTpl = HostRaiseTpl (TPL_HIGH_LEVEL);
+  if (HostEvent->Signaled) {
+    HostEvent->Signaled = FALSE;
+    Status = EFI_SUCCESS;
+  }
+  HostRestoreTpl (OldTpl);
+
+  return Status;
+}
+
+EFI_STATUS
+EFIAPI
+HostWaitForEvent (
+  IN  UINTN             NumberOfEvents,
+  IN  EFI_EVENT         *Event,
+  OUT UINTN             *Index
+  )
+{
+  EFI_STATUS Status;
+  UINTN      EventIndex;
+
+  if (NumberOfEvents == 0 || Event == NULL || Index == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (mTpl != TPL_APPLICATION) {
+    return EFI_UNSUPPORTED;
+  }
+
+  for (;;) {
+    for (EventIndex = 0; EventIndex < NumberOfEvents; EventIndex++) {
+      Status = HostCheckEvent (Event[EventIndex]);
+      if (Status != EFI_NOT_READY) {
+        *Index = EventIndex;
+        return Status;
+      }
+    }
+
+    HostSleep ();
+  }
+}
+
+EFI_STATUS
+EFIAPI
+HostCloseEvent (
+  IN EFI_EVENT          Event
+  )
+{
+  HOST_EVENT            *HostEvent;
+  HOST_DEFERRED_SIGNAL  *Deferred;
+  LIST_ENTRY            *Link;
+  EFI_TPL               OldTpl;
+
+  HOST_ASSERT_BSP ();
+
+  HostEvent = HostEventFromHandle (Event);
+  if (HostEvent == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  OldTpl = HostRaiseTpl (TPL_HIGH_LEVEL);
+
+  if (HostEvent->NotifyLink.ForwardLink != NULL) {
+    RemoveEntryList (&HostEvent->NotifyLink);
+  }
+  if (HostEvent->TimerLink.ForwardLink != NULL) {
+    RemoveEntryList (&HostEvent->TimerLink);
+  }
+  if (HostEvent->GroupLink.ForwardLink != NULL) {
+    RemoveEntryList (&HostEvent->GroupLink);
+  }
+
+  for (Link = GetFirstNode (&mDeferred); !IsNull (&mDeferred, Link);) {
+    Deferred = BASE_CR (Link, HOST_DEFERRED_SIGNAL, Link);
+    Link = GetNextNode (&mDeferred, Link);
+    if (Deferred->Event == HostEvent) {
+      RemoveEntryList (&Deferred->Link);
+      free (Deferred);
+    }
+  }
+
+  HostUpdateNextDue ();
+  HostRestoreTpl (OldTpl);
+
+  HostEvent->Signature = 0;
+  FreePool (HostEvent);
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostStall (
+  IN UINTN              Microseconds
+  )
+{
+  UINT64 Now;
+  UINT64 End;
+
+  End = HostNow () + (UINT64)Microseconds * 1000;
+  for (;;) {
+    HostPollInterrupts ();
+
+    Now = HostNow ();
+    if (Now >= End) {
+      return EFI_SUCCESS;
+    }
+
+    if (mInterruptState && mTpl < TPL_HIGH_LEVEL && HostCpuNumber () == 0) {
+      HostSleepUntil (MIN (End, MAX (HostWakeTime (), Now)));
+    } else {
+      HostSleepUntil (End);
+    }
+  }
+}
+
+/**
+  Signals the EVT_SIGNAL_EXIT_BOOT_SERVICES events. The timer is stopped
+  first, like the DXE core does.
+
+**/
+VOID
+HostExitBootServices (
+  VOID
+  )
+{
+  LIST_ENTRY *Link;
+  EFI_TPL    OldTpl;
+
+  HOST_ASSERT_BSP ();
+
+  OldTpl = HostRaiseTpl (TPL_HIGH_LEVEL);
+  mTimersStopped = TRUE;
+  HostUpdateNextDue ();
+  for (Link = GetFirstNode (&mExitBootServicesEvents); !IsNull (&mExitBootServicesEvents, Link); Link = GetNextNode (&mExitBootServicesEvents, Link)) {
+    HostSignal (BASE_CR (Link, HOST_EVENT, GroupLink));
+  }
+  HostRestoreTpl (OldTpl);
+}
+
+EFI_STATUS
+EFIAPI
+HostAllocatePool (
+  IN  EFI_MEMORY_TYPE   PoolType,
+  IN  UINTN             Size,
+  OUT VOID              **Buffer
+  )
+{
+  HOST_ASSERT_BSP ();
+
+  if (Buffer == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *Buffer = malloc (MAX (Size, 1));
+  return *Buffer != NULL ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+EFI_STATUS
+EFIAPI
+HostFreePool (
+  IN VOID               *Buffer
+  )
+{
+  HOST_ASSERT_BSP ();
+
+  if (Buffer == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  free (Buffer);
+  return EFI_SUCCESS;
+}
+
+/**
+  Pages are mapped one allocation at a time, so they can be given back in
+  parts like the firmware allows.
+
+**/
+EFI_STATUS
+EFIAPI
+HostAllocatePages (
+  IN     EFI_ALLOCATE_TYPE      Type,
+  IN     EFI_MEMORY_TYPE        MemoryType,
+  IN     UINTN                  Pages,
+  IN OUT EFI_PHYSICAL_ADDRESS   *Memory
+  )
+{
+  VOID *Buffer;
+
+  HOST_ASSERT_BSP ();
+
+  if (Memory == NULL || Pages == 0) {
+    return EFI_INVALID_PARAMETER;
+  }
+  if (Type == AllocateAddress) {
+    return EFI_NOT_FOUND;
+  }
+
+  Buffer = mmap (NULL, EFI_PAGES_TO_SIZE (Pages), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (Buffer == MAP_FAILED) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  if (Type == AllocateMaxAddress && (EFI_PHYSICAL_ADDRESS)(UINTN)Buffer + EFI_PAGES_TO_SIZE (Pages) - 1 > *Memory) {
+    munmap (Buffer, EFI_PAGES_TO_SIZE (Pages));
+    return EFI_NOT_FOUND;
+  }
+
+  *Memory = (EFI_PHYSICAL_ADDRESS)(UINTN)Buffer;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostFreePages (
+  IN EFI_PHYSICAL_ADDRESS       Memory,
+  IN UINTN                      Pages
+  )
+{
+  HOST_ASSERT_BSP ();
+
+  if ((Memory & EFI_PAGE_MASK) != 0 || Pages == 0) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  return munmap ((VOID *)(UINTN)Memory, EFI_PAGES_TO_SIZE (Pages)) == 0 ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+/**
+  The memory map is a single descriptor with the memory the host has
+  available.
+
+**/
+EFI_STATUS
+EFIAPI
+HostGetMemoryMap (
+  IN OUT UINTN                  *MemoryMapSize,
+  IN OUT EFI_MEMORY_DESCRIPTOR  *MemoryMap,
+  OUT    UINTN                  *MapKey,
+  OUT    UINTN                  *DescriptorSize,
+  OUT    UINT32                 *DescriptorVersion
+  )
+{
+  HOST_ASSERT_BSP ();
+
+  if (MemoryMapSize == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (DescriptorSize != NULL) {
+    *DescriptorSize = sizeof (EFI_MEMORY_DESCRIPTOR);
+  }
+  if (DescriptorVersion != NULL) {
+    *DescriptorVersion = EFI_MEMORY_DESCRIPTOR_VERSION;
+  }
+
+  if (*MemoryMapSize < sizeof (EFI_MEMORY_DESCRIPTOR)) {
+    *MemoryMapSize = sizeof (EFI_MEMORY_DESCRIPTOR);
+    return EFI_BUFFER_TOO_SMALL;
+  }
+  if (MemoryMap == NULL || MapKey == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  ZeroMem (MemoryMap, sizeof (*MemoryMap));
+  MemoryMap->Type          = EfiConventionalMemory;
+  MemoryMap->NumberOfPages = EFI_SIZE_TO_PAGES ((UINT64)sysconf (_SC_AVPHYS_PAGES) * (UINT64)sysconf (_SC_PAGESIZE));
+  MemoryMap->Attribute     = EFI_MEMORY_WB;
+
+  *MemoryMapSize = sizeof (EFI_MEMORY_DESCRIPTOR);
+  *MapKey        = 1;
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostCalculateCrc32 (
+  IN  VOID              *Data,
+  IN  UINTN             DataSize,
+  OUT UINT32            *CrcOut
+  )
+{
+  CONST UINT8 *Bytes;
+  UINT32      Crc;
+  UINTN       Index;
+
+  if (Data == NULL || DataSize == 0 || CrcOut == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Bytes = Data;
+  Crc   = 0xFFFFFFFF;
+  for (Index = 0; Index < DataSize; Index++) {
+    Crc = (Crc >> 8) ^ mCrcTable[(Crc ^ Bytes[Index]) & 0xFF];
+  }
+
+  *CrcOut = Crc ^ 0xFFFFFFFF;
+  return EFI_SUCCESS;
+}
+
+VOID
+EFIAPI
+HostCopyMem (
+  IN VOID               *Destination,
+  IN VOID               *Source,
+  IN UINTN              Length
+  )
+{
+  CopyMem (Destination, Source, Length);
+}
+
+VOID
+EFIAPI
+HostSetMem (
+  IN VOID               *Buffer,
+  IN UINTN              Size,
+  IN UINT8              Value
+  )
+{
+  SetMem (Buffer, Size, Value);
+}
+
+EFI_STATUS
+EFIAPI
+HostCpuFlushDataCache (
+  IN EFI_CPU_ARCH_PROTOCOL      *This,
+  IN EFI_PHYSICAL_ADDRESS       Start,
+  IN UINT64                     Length,
+  IN EFI_CPU_FLUSH_TYPE         FlushType
+  )
+{
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostCpuEnableInterrupt (
+  IN EFI_CPU_ARCH_PROTOCOL      *This
+  )
+{
+  HOST_ASSERT_BSP ();
+
+  HostSetInterruptState (TRUE);
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostCpuDisableInterrupt (
+  IN EFI_CPU_ARCH_PROTOCOL      *This
+  )
+{
+  HOST_ASSERT_BSP ();
+
+  HostSetInterruptState (FALSE);
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostCpuGetInterruptState (
+  IN  EFI_CPU_ARCH_PROTOCOL     *This,
+  OUT BOOLEAN                   *State
+  )
+{
+  if (State == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *State = mInterruptState;
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_CPU_ARCH_PROTOCOL mCpu = {
+  .FlushDataCache     = HostCpuFlushDataCache,
+  .EnableInterrupt    = HostCpuEnableInterrupt,
+  .DisableInterrupt   = HostCpuDisableInterrupt,
+  .GetInterruptState  = HostCpuGetInterruptState,
+  .NumberOfTimers     = 0,
+  .DmaBufferAlignment = 64,
+};
+
+STATIC EFI_BOOT_SERVICES mBootServices = {
+  .Hdr = {
+    .Signature  = EFI_BOOT_SERVICES_SIGNATURE,
+    .Revision   = EFI_BOOT_SERVICES_REVISION,
+    .HeaderSize = sizeof (EFI_BOOT_SERVICES),
+  },
+  .RaiseTPL                             = HostRaiseTpl,
+  .RestoreTPL                           = HostRestoreTpl,
+  .AllocatePages                        = HostAllocatePages,
+  .FreePages                            = HostFreePages,
+  .GetMemoryMap                         = HostGetMemoryMap,
+  .AllocatePool                         = HostAllocatePool,
+  .FreePool                             = HostFreePool,
+  .CreateEvent                          = HostCreateEvent,
+  .SetTimer                             = HostSetTimer,
+  .WaitForEvent                         = HostWaitForEvent,
+  .SignalEvent                          = HostSignalEvent,
+  .CloseEvent                           = HostCloseEvent,
+  .CheckEvent                           = HostCheckEvent,
+  .InstallProtocolInterface             = HostInstallProtocolInterface,
+  .UninstallProtocolInterface           = HostUninstallProtocolInterface,
+  .HandleProtocol                       = HostHandleProtocol,
+  .Stall                                = HostStall,
+  .ConnectController                    = HostConnectController,
+  .DisconnectController                 = HostDisconnectController,
+  .OpenProtocol                         = HostOpenProtocol,
+  .CloseProtocol                        = HostCloseProtocol,
+  .LocateHandleBuffer                   = HostLocateHandleBuffer,
+  .LocateProtocol                       = HostLocateProtocol,
+  .InstallMultipleProtocolInterfaces    = HostInstallMultipleProtocolInterfaces,
+  .UninstallMultipleProtocolInterfaces  = HostUninstallMultipleProtocolInterfaces,
+  .CalculateCrc32                       = HostCalculateCrc32,
+  .CopyMem                              = HostCopyMem,
+  .SetMem                               = HostSetMem,
+};
+
+STATIC EFI_RUNTIME_SERVICES mRuntimeServices = {
+  .Hdr = {
+    .Signature  = EFI_RUNTIME_SERVICES_SIGNATURE,
+    .Revision   = EFI_RUNTIME_SERVICES_REVISION,
+    .HeaderSize = sizeof (EFI_RUNTIME_SERVICES),
+  },
+  .GetVariable = HostGetVariable,
+  .SetVariable = HostSetVariable,
+};
+
+STATIC EFI_SYSTEM_TABLE mSystemTable = {
+  .Hdr = {
+    .Signature  = EFI_SYSTEM_TABLE_SIGNATURE,
+    .Revision   = EFI_SYSTEM_TABLE_REVISION,
+    .HeaderSize = sizeof (EFI_SYSTEM_TABLE),
+  },
+  .FirmwareVendor   = L"LKL host",
+  .RuntimeServices  = &mRuntimeServices,
+  .BootServices     = &mBootServices,
+};
+
+VOID
+HostInitBootServices (
+  VOID
+  )
+{
+  EFI_HANDLE  Handle;
+  EFI_STATUS  Status;
+  UINT32      Crc;
+  UINTN       Index;
+  UINTN       Bit;
+
+  for (Index = 0; Index <= TPL_HIGH_LEVEL; Index++) {
+    InitializeListHead (&mEventQueue[Index]);
+  }
+
+  for (Index = 0; Index < sizeof (mCrcTable) / sizeof (mCrcTable[0]); Index++) {
+    Crc = (UINT32)Index;
+    for (Bit = 0; Bit < 8; Bit++) {
+      Crc = (Crc & 1) != 0 ? (Crc >> 1) ^ 0xEDB88320 : Crc >> 1;
+    }
+    mCrcTable[Index] = Crc;
+  }
+
+  gST = &mSystemTable;
+  gBS = &mBootServices;
+  gRT = &mRuntimeServices;
+
+  Handle = NULL;
+  Status = HostInstallProtocolInterface (&Handle, &gEfiCpuArchProtocolGuid, EFI_NATIVE_INTERFACE, &mCpu);
+  ASSERT_EFI_ERROR (Status);
+}
@@ -0,0 +1,196 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Collation.c
+
+Abstract:
+
+  English Unicode Collation 2 protocol of the harness, case folding is
+  ASCII only.
+
+Revision History
+
+--*/
+
+#include "Host.h"
+
+#include <Protocol/UnicodeCollation.h>
+
+STATIC
+CHAR16
+HostToUpper (
+  IN CHAR16             Char
+  )
+{
+  return (Char >= L'a' && Char <= L'z') ? (CHAR16)(Char - (L'a' - L'A')) : Char;
+}
+
+STATIC
+CHAR16
+HostToLower (
+  IN CHAR16             Char
+  )
+{
+  return (Char >= L'A' && Char <= L'Z') ? (CHAR16)(Char + (L'a' - L'A')) : Char;
+}
+
+INTN
+EFIAPI
+HostStriColl (
+  IN EFI_UNICODE_COLLATION_PROTOCOL   *This,
+  IN CHAR16                           *Str1,
+  IN CHAR16                           *Str2
+  )
+{
+  while (*Str1 != 0 && HostToUpper (*Str1) == HostToUpper (*Str2)) {
+    Str1++;
+    Str2++;
+  }
+
+  return HostToUpper (*Str1) - HostToUpper (*Str2);
+}
+
+BOOLEAN
+EFIAPI
+HostMetaiMatch (
+  IN EFI_UNICODE_COLLATION_PROTOCOL   *This,
+  IN CHAR16                           *String,
+  IN CHAR16                           *Pattern
+  )
+{
+  for (;;) {
+    switch (*Pattern) {
+    case 0:
+      return *String == 0;
+
+    case L'*':
+      //
+      // Match the rest of the pattern at every position
+      //
+      Pattern++;
+      do {
+        if (HostMetaiMatch (This, String, Pattern)) {
+          return TRUE;
+        }
+      } while (*String++ != 0);
+      return FALSE;
+
+    case L'?':
+      if (*String == 0) {
+        return FALSE;
+      }
+      break;
+
+    default:
+      if (HostToUpper (*String) != HostToUpper (*Pattern)) {
+        return FALSE;
+      }
+      break;
+    }
+
+    String++;
+    Pattern++;
+  }
+}
+
+VOID
+EFIAPI
+HostStrLwr (
+  IN     EFI_UNICODE_COLLATION_PROTOCOL   *This,
+  IN OUT CHAR16                           *Str
+  )
+{
+  for (; *Str != 0; Str++) {
+    *Str = HostToLower (*Str);
+  }
+}
+
+VOID
+EFIAPI
+HostStrUpr (
+  IN     EFI_UNICODE_COLLATION_PROTOCOL   *This,
+  IN OUT CHAR16                           *Str
+  )
+{
+  for (; *Str != 0; Str++) {
+    *Str = HostToUpper (*Str);
+  }
+}
+
+VOID
+EFIAPI
+HostFatToStr (
+  IN  EFI_UNICODE_COLLATION_PROTOCOL  *This,
+  IN  UINTN                           FatSize,
+  IN  CHAR8                           *Fat,
+  OUT CHAR16                          *String
+  )
+{
+  for (; FatSize != 0 && *Fat != 0; FatSize--) {
+    *String++ = (CHAR8)*Fat++;
+  }
+  *String = 0;
+}
+
+BOOLEAN
+EFIAPI
+HostStrToFat (
+  IN  EFI_UNICODE_COLLATION_PROTOCOL  *This,
+  IN  CHAR16                          *String,
+  IN  UINTN                           FatSize,
+  OUT CHAR8                           *Fat
+  )
+{
+  BOOLEAN Lossy;
+
+  Lossy = FALSE;
+  for (; *String != 0 && FatSize != 0; String++) {
+    if (*String == L'.' || *String == L' ') {
+      continue;
+    }
+    if (*String >= 0x80) {
+      *Fat = '_';
+      Lossy = TRUE;
+    } else {
+      *Fat = (CHAR8)HostToUpper (*String);
+    }
+    Fat++;
+    FatSize--;
+  }
+
+  return Lossy;
+}
+
+STATIC EFI_UNICODE_COLLATION_PROTOCOL mUnicodeCollation2 = {
+  HostStriColl,
+  HostMetaiMatch,
+  HostStrLwr,
+  HostStrUpr,
+  HostFatToStr,
+  HostStrToFat,
+  "en"
+};
+
+VOID
+HostInstallUnicodeCollation (
+  VOID
+  )
+{
+  EFI_HANDLE Handle;
+  EFI_STATUS Status;
+
+  Handle = NULL;
+  Status = HostInstallProtocolInterface (&Handle, &gEfiUnicodeCollation2ProtocolGuid, EFI_NATIVE_INTERFACE, &mUnicodeCollation2);
+  ASSERT_EFI_ERROR (Status);
+}
@@ -0,0 +1,601 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Disk.c
+
+Abstract:
+
+  Disks backed by image files, each producing Block I/O, Disk I/O and a
+  hard drive device path like a partition does, and optionally Block I/O 2
+  and Disk I/O 2.
+
+  A disk handles one request at a time. Every request takes the configured
+  latency plus its transfer time, after the requests before it are done.
+  The data is copied right away, blocking requests then sleep until their
+  completion time, non-blocking ones get their token signaled at it.
+
+Revision History
+
+--*/
+
+#include "Host.h"
+
+#include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
+#include <Protocol/DevicePath.h>
+#include <Protocol/DiskIo.h>
+#include <Protocol/DiskIo2.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define HOST_DISK_SIGNATURE   SIGNATURE_32 ('h', 'd', 's', 'k')
+
+#pragma pack(1)
+typedef struct {
+  HARDDRIVE_DEVICE_PATH     HardDrive;
+  EFI_DEVICE_PATH_PROTOCOL  End;
+} HOST_DISK_DEVICE_PATH;
+#pragma pack()
+
+typedef struct {
+  UINTN                     Signature;
+  int                       Fd;
+  UINT64                    Size;
+  UINT64                    LatencyNs;
+  UINT64                    NsPerMiB;
+  UINT64                    BusyUntil;
+  EFI_BLOCK_IO_MEDIA        Media;
+  EFI_BLOCK_IO_PROTOCOL     BlockIo;
+  EFI_BLOCK_IO2_PROTOCOL    BlockIo2;
+  EFI_DISK_IO_PROTOCOL      DiskIo;
+  EFI_DISK_IO2_PROTOCOL     DiskIo2;
+  HOST_DISK_DEVICE_PATH     DevicePath;
+} HOST_DISK;
+
+STATIC UINT32 mDiskCount;
+
+/**
+  Books the disk for a request of Size bytes and returns the time it
+  completes at.
+
+**/
+STATIC
+UINT64
+HostDiskSchedule (
+  IN HOST_DISK          *Disk,
+  IN UINTN              Size
+  )
+{
+  UINT64 Start;
+
+  Start = MAX (HostNow (), Disk->BusyUntil);
+  Disk->BusyUntil = Start + Disk->LatencyNs + MultU64x64 (Size, Disk->NsPerMiB) / SIZE_1MB;
+  return Disk->BusyUntil;
+}
+
+STATIC
+VOID
+HostDiskWait (
+  IN UINT64             Done
+  )
+{
+  struct timespec Until;
+
+  Until.tv_sec  = Done / 1000000000ULL;
+  Until.tv_nsec = Done % 1000000000ULL;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &Until, NULL) == EINTR);
+}
+
+STATIC
+EFI_STATUS
+HostDiskTransfer (
+  IN     HOST_DISK      *Disk,
+  IN     BOOLEAN        Write,
+  IN     UINT32         MediaId,
+  IN     UINT64         Offset,
+  IN     UINTN          Size,
+  IN OUT VOID           *Buffer
+  )
+{
+  UINT8   *Bytes;
+  ssize_t Done;
+
+  HOST_ASSERT_BSP ();
+
+  if (MediaId != Disk->Media.MediaId) {
+    return EFI_MEDIA_CHANGED;
+  }
+  if (Write && Disk->Media.ReadOnly) {
+    return EFI_WRITE_PROTECTED;
+  }
+  if (Buffer == NULL && Size != 0) {
+    return EFI_INVALID_PARAMETER;
+  }
+  if (Offset > Disk->Size || Size > Disk->Size - Offset) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Bytes = Buffer;
+  while (Size != 0) {
+    Done = Write ? pwrite (Disk->Fd, Bytes, Size, Offset) : pread (Disk->Fd, Bytes, Size, Offset);
+    if (Done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (Done <= 0) {
+      return EFI_DEVICE_ERROR;
+    }
+
+    Bytes  += Done;
+    Offset += Done;
+    Size   -= Done;
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+HostDiskCheckBlocks (
+  IN HOST_DISK          *Disk,
+  IN EFI_LBA            Lba,
+  IN UINTN              BufferSize
+  )
+{
+  if (BufferSize % Disk->Media.BlockSize != 0) {
+    return EFI_BAD_BUFFER_SIZE;
+  }
+  if (Lba > Disk->Media.LastBlock || BufferSize / Disk->Media.BlockSize > Disk->Media.LastBlock - Lba + 1) {
+    return EFI_INVALID_PARAMETER;
+  }
+  return EFI_SUCCESS;
+}
+
+/**
+  Runs a request and completes it, blocking when there is no token event.
+
+**/
+STATIC
+EFI_STATUS
+HostDiskRequest (
+  IN     HOST_DISK      *Disk,
+  IN     BOOLEAN        Write,
+  IN     UINT32         MediaId,
+  IN     UINT64         Offset,
+  IN     EFI_EVENT      Event OPTIONAL,
+  OUT    EFI_STATUS     *TransactionStatus OPTIONAL,
+  IN     UINTN          Size,
+  IN OUT VOID           *Buffer
+  )
+{
+  EFI_STATUS Status;
+  UINT64     Done;
+
+  Status = HostDiskTransfer (Disk, Write, MediaId, Offset, Size, Buffer);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Done = HostDiskSchedule (Disk, Size);
+  if (Event == NULL) {
+    HostDiskWait (Done);
+    return EFI_SUCCESS;
+  }
+
+  *TransactionStatus = EFI_SUCCESS;
+  HostSignalLater (Event, Done);
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostBlockReset (
+  IN EFI_BLOCK_IO_PROTOCOL      *This,
+  IN BOOLEAN                    ExtendedVerification
+  )
+{
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostBlockRead (
+  IN  EFI_BLOCK_IO_PROTOCOL     *This,
+  IN  UINT32                    MediaId,
+  IN  EFI_LBA                   Lba,
+  IN  UINTN                     BufferSize,
+  OUT VOID                      *Buffer
+  )
+{
+  HOST_DISK  *Disk;
+  EFI_STATUS Status;
+
+  Disk = BASE_CR (This, HOST_DISK, BlockIo);
+  Status = HostDiskCheckBlocks (Disk, Lba, BufferSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return HostDiskRequest (Disk, FALSE, MediaId, MultU64x32 (Lba, Disk->Media.BlockSize), NULL, NULL, BufferSize, Buffer);
+}
+
+EFI_STATUS
+EFIAPI
+HostBlockWrite (
+  IN EFI_BLOCK_IO_PROTOCOL      *This,
+  IN UINT32                     MediaId,
+  IN EFI_LBA                    Lba,
+  IN UINTN                      BufferSize,
+  IN VOID                       *Buffer
+  )
+{
+  HOST_DISK  *Disk;
+  EFI_STATUS Status;
+
+  Disk = BASE_CR (This, HOST_DISK, BlockIo);
+  Status = HostDiskCheckBlocks (Disk, Lba, BufferSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return HostDiskRequest (Disk, TRUE, MediaId, MultU64x32 (Lba, Disk->Media.BlockSize), NULL, NULL, BufferSize, Buffer);
+}
+
+/**
+  The image is left to the host page cache, a flush only costs the
+  latency.
+
+**/
+EFI_STATUS
+EFIAPI
+HostBlockFlush (
+  IN EFI_BLOCK_IO_PROTOCOL      *This
+  )
+{
+  HOST_DISK *Disk;
+
+  Disk = BASE_CR (This, HOST_DISK, BlockIo);
+  return HostDiskRequest (Disk, FALSE, Disk->Media.MediaId, 0, NULL, NULL, 0, NULL);
+}
+
+EFI_STATUS
+EFIAPI
+HostBlockResetEx (
+  IN EFI_BLOCK_IO2_PROTOCOL     *This,
+  IN BOOLEAN                    ExtendedVerification
+  )
+{
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostBlockReadEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL *This,
+  IN     UINT32                 MediaId,
+  IN     EFI_LBA                Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN    *Token,
+  IN     UINTN                  BufferSize,
+  OUT    VOID                   *Buffer
+  )
+{
+  HOST_DISK  *Disk;
+  EFI_STATUS Status;
+
+  Disk = BASE_CR (This, HOST_DISK, BlockIo2);
+  Status = HostDiskCheckBlocks (Disk, Lba, BufferSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return HostDiskRequest (
+           Disk,
+           FALSE,
+           MediaId,
+           MultU64x32 (Lba, Disk->Media.BlockSize),
+           Token != NULL ? Token->Event : NULL,
+           Token != NULL ? &Token->TransactionStatus : NULL,
+           BufferSize,
+           Buffer
+           );
+}
+
+EFI_STATUS
+EFIAPI
+HostBlockWriteEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL *This,
+  IN     UINT32                 MediaId,
+  IN     EFI_LBA                Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN    *Token,
+  IN     UINTN                  BufferSize,
+  IN     VOID                   *Buffer
+  )
+{
+  HOST_DISK  *Disk;
+  EFI_STATUS Status;
+
+  Disk = BASE_CR (This, HOST_DISK, BlockIo2);
+  Status = HostDiskCheckBlocks (Disk, Lba, BufferSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return HostDiskRequest (
+           Disk,
+           TRUE,
+           MediaId,
+           MultU64x32 (Lba, Disk->Media.BlockSize),
+           Token != NULL ? Token->Event : NULL,
+           Token != NULL ? &Token->TransactionStatus : NULL,
+           BufferSize,
+           Buffer
+           );
+}
+
+EFI_STATUS
+EFIAPI
+HostBlockFlushEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL *This,
+  IN OUT EFI_BLOCK_IO2_TOKEN    *Token
+  )
+{
+  HOST_DISK *Disk;
+
+  Disk = BASE_CR (This, HOST_DISK, BlockIo2);
+  return HostDiskRequest (
+           Disk,
+           FALSE,
+           Disk->Media.MediaId,
+           0,
+           Token != NULL ? Token->Event : NULL,
+           Token != NULL ? &Token->TransactionStatus : NULL,
+           0,
+           NULL
+           );
+}
+
+EFI_STATUS
+EFIAPI
+HostDiskRead (
+  IN  EFI_DISK_IO_PROTOCOL      *This,
+  IN  UINT32                    MediaId,
+  IN  UINT64                    Offset,
+  IN  UINTN                     BufferSize,
+  OUT VOID                      *Buffer
+  )
+{
+  return HostDiskRequest (BASE_CR (This, HOST_DISK, DiskIo), FALSE, MediaId, Offset, NULL, NULL, BufferSize, Buffer);
+}
+
+EFI_STATUS
+EFIAPI
+HostDiskWrite (
+  IN EFI_DISK_IO_PROTOCOL       *This,
+  IN UINT32                     MediaId,
+  IN UINT64                     Offset,
+  IN UINTN                      BufferSize,
+  IN VOID                       *Buffer
+  )
+{
+  return HostDiskRequest (BASE_CR (This, HOST_DISK, DiskIo), TRUE, MediaId, Offset, NULL, NULL, BufferSize, Buffer);
+}
+
+EFI_STATUS
+EFIAPI
+HostDiskCancelEx (
+  IN EFI_DISK_IO2_PROTOCOL      *This
+  )
+{
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostDiskReadEx (
+  IN     EFI_DISK_IO2_PROTOCOL  *This,
+  IN     UINT32                 MediaId,
+  IN     UINT64                 Offset,
+  IN OUT EFI_DISK_IO2_TOKEN     *Token,
+  IN     UINTN                  BufferSize,
+  OUT    VOID                   *Buffer
+  )
+{
+  return HostDiskRequest (
+           BASE_CR (This, HOST_DISK, DiskIo2),
+           FALSE,
+           MediaId,
+           Offset,
+           Token != NULL ? Token->Event : NULL,
+           Token != NULL ? &Token->TransactionStatus : NULL,
+           BufferSize,
+           Buffer
+           );
+}
+
+EFI_STATUS
+EFIAPI
+HostDiskWriteEx (
+  IN     EFI_DISK_IO2_PROTOCOL  *This,
+  IN     UINT32                 MediaId,
+  IN     UINT64                 Offset,
+  IN OUT EFI_DISK_IO2_TOKEN     *Token,
+  IN     UINTN                  BufferSize,
+  IN     VOID                   *Buffer
+  )
+{
+  return HostDiskRequest (
+           BASE_CR (This, HOST_DISK, DiskIo2),
+           TRUE,
+           MediaId,
+           Offset,
+           Token != NULL ? Token->Event : NULL,
+           Token != NULL ? &Token->TransactionStatus : NULL,
+           BufferSize,
+           Buffer
+           );
+}
+
+EFI_STATUS
+EFIAPI
+HostDiskFlushEx (
+  IN     EFI_DISK_IO2_PROTOCOL  *This,
+  IN OUT EFI_DISK_IO2_TOKEN     *Token
+  )
+{
+  HOST_DISK *Disk;
+
+  Disk = BASE_CR (This, HOST_DISK, DiskIo2);
+  return HostDiskRequest (
+           Disk,
+           FALSE,
+           Disk->Media.MediaId,
+           0,
+           Token != NULL ? Token->Event : NULL,
+           Token != NULL ? &Token->TransactionStatus : NULL,
+           0,
+           NULL
+           );
+}
+
+/**
+  Partition GUID of an image, derived from its path so the probe cache
+  recognizes it from run to run.
+
+**/
+STATIC
+VOID
+HostDiskGuid (
+  IN  CONST CHAR8       *Path,
+  OUT UINT8             *Guid
+  )
+{
+  UINT64 Hash[2];
+  UINTN  Index;
+
+  Hash[0] = 0xcbf29ce484222325ULL;
+  Hash[1] = 0x84222325cbf29ce4ULL;
+  for (; *Path != '\0'; Path++) {
+    for (Index = 0; Index < 2; Index++) {
+      Hash[Index] = (Hash[Index] ^ (UINT8)*Path) * 0x100000001b3ULL;
+    }
+  }
+
+  CopyMem (Guid, Hash, sizeof (Hash));
+}
+
+EFI_STATUS
+HostAddDisk (
+  IN  CONST HOST_DISK_CONFIG  *Config,
+  OUT EFI_HANDLE              *Handle
+  )
+{
+  HOST_DISK     *Disk;
+  struct stat   Stat;
+  EFI_STATUS    Status;
+
+  Disk = AllocateZeroPool (sizeof (*Disk));
+  if (Disk == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Disk->Signature = HOST_DISK_SIGNATURE;
+  Disk->Fd = open (Config->Path, Config->ReadOnly ? O_RDONLY : O_RDWR);
+  if (Disk->Fd < 0 || fstat (Disk->Fd, &Stat) != 0 || Stat.st_size < Config->BlockSize) {
+    if (Disk->Fd >= 0) {
+      close (Disk->Fd);
+    }
+    FreePool (Disk);
+    return EFI_NOT_FOUND;
+  }
+
+  Disk->Size      = (UINT64)Stat.st_size / Config->BlockSize * Config->BlockSize;
+  Disk->LatencyNs = Config->LatencyNs;
+  Disk->NsPerMiB  = Config->NsPerMiB;
+
+  Disk->Media.MediaId          = 1;
+  Disk->Media.MediaPresent     = TRUE;
+  Disk->Media.LogicalPartition = TRUE;
+  Disk->Media.ReadOnly         = Config->ReadOnly;
+  Disk->Media.BlockSize        = Config->BlockSize;
+  Disk->Media.IoAlign          = 0;
+  Disk->Media.LastBlock        = Disk->Size / Config->BlockSize - 1;
+
+  Disk->BlockIo.Revision    = EFI_BLOCK_IO_PROTOCOL_REVISION;
+  Disk->BlockIo.Media       = &Disk->Media;
+  Disk->BlockIo.Reset       = HostBlockReset;
+  Disk->BlockIo.ReadBlocks  = HostBlockRead;
+  Disk->BlockIo.WriteBlocks = HostBlockWrite;
+  Disk->BlockIo.FlushBlocks = HostBlockFlush;
+
+  Disk->BlockIo2.Media         = &Disk->Media;
+  Disk->BlockIo2.Reset         = HostBlockResetEx;
+  Disk->BlockIo2.ReadBlocksEx  = HostBlockReadEx;
+  Disk->BlockIo2.WriteBlocksEx = HostBlockWriteEx;
+  Disk->BlockIo2.FlushBlocksEx = HostBlockFlushEx;
+
+  Disk->DiskIo.Revision  = EFI_DISK_IO_PROTOCOL_REVISION;
+  Disk->DiskIo.ReadDisk  = HostDiskRead;
+  Disk->DiskIo.WriteDisk = HostDiskWrite;
+
+  Disk->DiskIo2.Revision    = EFI_DISK_IO2_PROTOCOL_REVISION;
+  Disk->DiskIo2.Cancel      = HostDiskCancelEx;
+  Disk->DiskIo2.ReadDiskEx  = HostDiskReadEx;
+  Disk->DiskIo2.WriteDiskEx = HostDiskWriteEx;
+  Disk->DiskIo2.FlushDiskEx = HostDiskFlushEx;
+
+  Disk->DevicePath.HardDrive.Header.Type      = MEDIA_DEVICE_PATH;
+  Disk->DevicePath.HardDrive.Header.SubType   = MEDIA_HARDDRIVE_DP;
+  Disk->DevicePath.HardDrive.Header.Length[0] = (UINT8)sizeof (HARDDRIVE_DEVICE_PATH);
+  Disk->DevicePath.HardDrive.Header.Length[1] = (UINT8)(sizeof (HARDDRIVE_DEVICE_PATH) >> 8);
+  Disk->DevicePath.HardDrive.PartitionNumber  = ++mDiskCount;
+  Disk->DevicePath.HardDrive.PartitionStart   = 0;
+  Disk->DevicePath.HardDrive.PartitionSize    = Disk->Media.LastBlock + 1;
+  Disk->DevicePath.HardDrive.MBRType          = MBR_TYPE_EFI_PARTITION_TABLE_HEADER;
+  Disk->DevicePath.HardDrive.SignatureType    = SIGNATURE_TYPE_GUID;
+  HostDiskGuid (Config->Path, Disk->DevicePath.HardDrive.Signature);
+  Disk->DevicePath.End.Type                   = END_DEVICE_PATH_TYPE;
+  Disk->DevicePath.End.SubType                = END_ENTIRE_DEVICE_PATH_SUBTYPE;
+  Disk->DevicePath.End.Length[0]              = (UINT8)sizeof (EFI_DEVICE_PATH_PROTOCOL);
+  Disk->DevicePath.End.Length[1]              = 0;
+
+  *Handle = NULL;
+  if (Config->Async) {
+    Status = gBS->InstallMultipleProtocolInterfaces (
+                    Handle,
+                    &gEfiDevicePathProtocolGuid, &Disk->DevicePath,
+                    &gEfiBlockIoProtocolGuid, &Disk->BlockIo,
+                    &gEfiBlockIo2ProtocolGuid, &Disk->BlockIo2,
+                    &gEfiDiskIoProtocolGuid, &Disk->DiskIo,
+                    &gEfiDiskIo2ProtocolGuid, &Disk->DiskIo2,
+                    NULL
+                    );
+  } else {
+    Status = gBS->InstallMultipleProtocolInterfaces (
+                    Handle,
+                    &gEfiDevicePathProtocolGuid, &Disk->DevicePath,
+                    &gEfiBlockIoProtocolGuid, &Disk->BlockIo,
+                    &gEfiDiskIoProtocolGuid, &Disk->DiskIo,
+                    NULL
+                    );
+  }
+  if (EFI_ERROR (Status)) {
+    close (Disk->Fd);
+    FreePool (Disk);
+  }
+
+  return Status;
+}
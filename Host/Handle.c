@@ -0,0 +1,671 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Handle.c
+
+Abstract:
+
+  Handle database of the harness: protocol installation, the open protocol
+  records that the driver model depends on, and connecting controllers to
+  the installed driver bindings.
+
+Revision History
+
+--*/
+
+#include "Host.h"
+
+#include <Protocol/DriverBinding.h>
+
+#define HOST_HANDLE_SIGNATURE   SIGNATURE_32 ('h', 'h', 'n', 'd')
+
+//
+// Upper bound of the drivers managing one controller
+//
+#define HOST_MAX_AGENTS         8
+
+typedef struct {
+  UINTN                 Signature;
+  LIST_ENTRY            Link;           // in mHandles
+  LIST_ENTRY            Protocols;
+} HOST_HANDLE;
+
+typedef struct {
+  LIST_ENTRY            Link;           // in HOST_HANDLE.Protocols
+  EFI_GUID              Guid;
+  VOID                  *Interface;
+  LIST_ENTRY            Opens;
+} HOST_PROTOCOL;
+
+typedef struct {
+  LIST_ENTRY            Link;           // in HOST_PROTOCOL.Opens
+  EFI_HANDLE            AgentHandle;
+  EFI_HANDLE            ControllerHandle;
+  UINT32                Attributes;
+} HOST_OPEN;
+
+STATIC LIST_ENTRY mHandles = INITIALIZE_LIST_HEAD_VARIABLE (mHandles);
+
+STATIC
+HOST_HANDLE *
+HostFindHandle (
+  IN EFI_HANDLE         Handle
+  )
+{
+  LIST_ENTRY *Link;
+
+  for (Link = GetFirstNode (&mHandles); !IsNull (&mHandles, Link); Link = GetNextNode (&mHandles, Link)) {
+    if (BASE_CR (Link, HOST_HANDLE, Link) == Handle) {
+      return Handle;
+    }
+  }
+
+  return NULL;
+}
+
+STATIC
+HOST_PROTOCOL *
+HostFindProtocol (
+  IN HOST_HANDLE        *Handle,
+  IN EFI_GUID           *Protocol
+  )
+{
+  LIST_ENTRY    *Link;
+  HOST_PROTOCOL *Entry;
+
+  for (Link = GetFirstNode (&Handle->Protocols); !IsNull (&Handle->Protocols, Link); Link = GetNextNode (&Handle->Protocols, Link)) {
+    Entry = BASE_CR (Link, HOST_PROTOCOL, Link);
+    if (CompareGuid (&Entry->Guid, Protocol)) {
+      return Entry;
+    }
+  }
+
+  return NULL;
+}
+
+STATIC
+VOID
+HostFreeOpens (
+  IN HOST_PROTOCOL      *Protocol
+  )
+{
+  HOST_OPEN *Open;
+
+  while (!IsListEmpty (&Protocol->Opens)) {
+    Open = BASE_CR (GetFirstNode (&Protocol->Opens), HOST_OPEN, Link);
+    RemoveEntryList (&Open->Link);
+    FreePool (Open);
+  }
+}
+
+EFI_STATUS
+EFIAPI
+HostInstallProtocolInterface (
+  IN OUT EFI_HANDLE     *Handle,
+  IN     EFI_GUID       *Protocol,
+  IN     EFI_INTERFACE_TYPE InterfaceType,
+  IN     VOID           *Interface
+  )
+{
+  HOST_HANDLE   *HostHandle;
+  HOST_PROTOCOL *Entry;
+
+  HOST_ASSERT_BSP ();
+
+  if (Handle == NULL || Protocol == NULL || InterfaceType != EFI_NATIVE_INTERFACE) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (*Handle == NULL) {
+    HostHandle = AllocateZeroPool (sizeof (*HostHandle));
+    if (HostHandle == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    HostHandle->Signature = HOST_HANDLE_SIGNATURE;
+    InitializeListHead (&HostHandle->Protocols);
+    InsertTailList (&mHandles, &HostHandle->Link);
+  } else {
+    HostHandle = HostFindHandle (*Handle);
+    if (HostHandle == NULL) {
+      return EFI_INVALID_PARAMETER;
+    }
+    if (HostFindProtocol (HostHandle, Protocol) != NULL) {
+      return EFI_INVALID_PARAMETER;
+    }
+  }
+
+  Entry = AllocateZeroPool (sizeof (*Entry));
+  if (Entry == NULL) {
+    if (IsListEmpty (&HostHandle->Protocols)) {
+      RemoveEntryList (&HostHandle->Link);
+      FreePool (HostHandle);
+    }
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  CopyGuid (&Entry->Guid, Protocol);
+  Entry->Interface = Interface;
+  InitializeListHead (&Entry->Opens);
+  InsertTailList (&HostHandle->Protocols, &Entry->Link);
+
+  *Handle = HostHandle;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostUninstallProtocolInterface (
+  IN EFI_HANDLE         Handle,
+  IN EFI_GUID           *Protocol,
+  IN VOID               *Interface
+  )
+{
+  HOST_HANDLE   *HostHandle;
+  HOST_PROTOCOL *Entry;
+  HOST_OPEN     *Open;
+  LIST_ENTRY    *Link;
+
+  HOST_ASSERT_BSP ();
+
+  if (Protocol == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  HostHandle = HostFindHandle (Handle);
+  if (HostHandle == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Entry = HostFindProtocol (HostHandle, Protocol);
+  if (Entry == NULL || Entry->Interface != Interface) {
+    return EFI_NOT_FOUND;
+  }
+
+  //
+  // The DXE core would disconnect the drivers first, the harness leaves
+  // that to its callers
+  //
+  for (Link = GetFirstNode (&Entry->Opens); !IsNull (&Entry->Opens, Link); Link = GetNextNode (&Entry->Opens, Link)) {
+    Open = BASE_CR (Link, HOST_OPEN, Link);
+    if ((Open->Attributes & (EFI_OPEN_PROTOCOL_BY_DRIVER | EFI_OPEN_PROTOCOL_EXCLUSIVE)) != 0) {
+      return EFI_ACCESS_DENIED;
+    }
+  }
+
+  HostFreeOpens (Entry);
+  RemoveEntryList (&Entry->Link);
+  FreePool (Entry);
+
+  if (IsListEmpty (&HostHandle->Protocols)) {
+    RemoveEntryList (&HostHandle->Link);
+    HostHandle->Signature = 0;
+    FreePool (HostHandle);
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostInstallMultipleProtocolInterfaces (
+  IN OUT EFI_HANDLE     *Handle,
+  ...
+  )
+{
+  VA_LIST       Args;
+  EFI_STATUS    Status;
+  EFI_GUID      *Protocol;
+  VOID          *Interface;
+  EFI_HANDLE    OldHandle;
+  UINTN         Count;
+  UINTN         Index;
+
+  if (Handle == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  OldHandle = *Handle;
+  Status    = EFI_SUCCESS;
+  Count     = 0;
+
+  VA_START (Args, Handle);
+  for (;;) {
+    Protocol = VA_ARG (Args, EFI_GUID *);
+    if (Protocol == NULL) {
+      break;
+    }
+    Interface = VA_ARG (Args, VOID *);
+
+    Status = HostInstallProtocolInterface (Handle, Protocol, EFI_NATIVE_INTERFACE, Interface);
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+    Count++;
+  }
+  VA_END (Args);
+
+  if (EFI_ERROR (Status)) {
+    VA_START (Args, Handle);
+    for (Index = 0; Index < Count; Index++) {
+      Protocol  = VA_ARG (Args, EFI_GUID *);
+      Interface = VA_ARG (Args, VOID *);
+      HostUninstallProtocolInterface (*Handle, Protocol, Interface);
+    }
+    VA_END (Args);
+
+    *Handle = OldHandle;
+  }
+
+  return Status;
+}
+
+EFI_STATUS
+EFIAPI
+HostUninstallMultipleProtocolInterfaces (
+  IN EFI_HANDLE         Handle,
+  ...
+  )
+{
+  VA_LIST       Args;
+  EFI_STATUS    Status;
+  EFI_GUID      *Protocol;
+  VOID          *Interface;
+  UINTN         Count;
+  UINTN         Index;
+
+  Status = EFI_SUCCESS;
+  Count  = 0;
+
+  VA_START (Args, Handle);
+  for (;;) {
+    Protocol = VA_ARG (Args, EFI_GUID *);
+    if (Protocol == NULL) {
+      break;
+    }
+    Interface = VA_ARG (Args, VOID *);
+
+    Status = HostUninstallProtocolInterface (Handle, Protocol, Interface);
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+    Count++;
+  }
+  VA_END (Args);
+
+  if (EFI_ERROR (Status)) {
+    VA_START (Args, Handle);
+    for (Index = 0; Index < Count; Index++) {
+      Protocol  = VA_ARG (Args, EFI_GUID *);
+      Interface = VA_ARG (Args, VOID *);
+      HostInstallProtocolInterface (&Handle, Protocol, EFI_NATIVE_INTERFACE, Interface);
+    }
+    VA_END (Args);
+
+    return EFI_INVALID_PARAMETER;
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostOpenProtocol (
+  IN  EFI_HANDLE        Handle,
+  IN  EFI_GUID          *Protocol,
+  OUT VOID              **Interface OPTIONAL,
+  IN  EFI_HANDLE        AgentHandle,
+  IN  EFI_HANDLE        ControllerHandle,
+  IN  UINT32            Attributes
+  )
+{
+  HOST_HANDLE   *HostHandle;
+  HOST_PROTOCOL *Entry;
+  HOST_OPEN     *Open;
+  LIST_ENTRY    *Link;
+
+  HOST_ASSERT_BSP ();
+
+  if (Protocol == NULL || (Interface == NULL && Attributes != EFI_OPEN_PROTOCOL_TEST_PROTOCOL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  HostHandle = HostFindHandle (Handle);
+  if (HostHandle == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Entry = HostFindProtocol (HostHandle, Protocol);
+  if (Entry == NULL) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if (Attributes == EFI_OPEN_PROTOCOL_TEST_PROTOCOL) {
+    return EFI_SUCCESS;
+  }
+
+  if ((Attributes & (EFI_OPEN_PROTOCOL_BY_DRIVER | EFI_OPEN_PROTOCOL_EXCLUSIVE)) != 0) {
+    for (Link = GetFirstNode (&Entry->Opens); !IsNull (&Entry->Opens, Link); Link = GetNextNode (&Entry->Opens, Link)) {
+      Open = BASE_CR (Link, HOST_OPEN, Link);
+      if ((Open->Attributes & (EFI_OPEN_PROTOCOL_BY_DRIVER | EFI_OPEN_PROTOCOL_EXCLUSIVE)) == 0) {
+        continue;
+      }
+
+      if (Open->AgentHandle == AgentHandle) {
+        *Interface = Entry->Interface;
+        return EFI_ALREADY_STARTED;
+      }
+      return EFI_ACCESS_DENIED;
+    }
+  }
+
+  if ((Attributes & (EFI_OPEN_PROTOCOL_BY_DRIVER | EFI_OPEN_PROTOCOL_EXCLUSIVE | EFI_OPEN_PROTOCOL_BY_CHILD_CONTROLLER)) != 0) {
+    Open = AllocateZeroPool (sizeof (*Open));
+    if (Open == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    Open->AgentHandle      = AgentHandle;
+    Open->ControllerHandle = ControllerHandle;
+    Open->Attributes       = Attributes;
+    InsertTailList (&Entry->Opens, &Open->Link);
+  }
+
+  *Interface = Entry->Interface;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostCloseProtocol (
+  IN EFI_HANDLE         Handle,
+  IN EFI_GUID           *Protocol,
+  IN EFI_HANDLE         AgentHandle,
+  IN EFI_HANDLE         ControllerHandle
+  )
+{
+  HOST_HANDLE   *HostHandle;
+  HOST_PROTOCOL *Entry;
+  HOST_OPEN     *Open;
+  LIST_ENTRY    *Link;
+  EFI_STATUS    Status;
+
+  HOST_ASSERT_BSP ();
+
+  if (Protocol == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  HostHandle = HostFindHandle (Handle);
+  if (HostHandle == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Entry = HostFindProtocol (HostHandle, Protocol);
+  if (Entry == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  Status = EFI_NOT_FOUND;
+  for (Link = GetFirstNode (&Entry->Opens); !IsNull (&Entry->Opens, Link);) {
+    Open = BASE_CR (Link, HOST_OPEN, Link);
+    Link = GetNextNode (&Entry->Opens, Link);
+    if (Open->AgentHandle == AgentHandle && Open->ControllerHandle == ControllerHandle) {
+      RemoveEntryList (&Open->Link);
+      FreePool (Open);
+      Status = EFI_SUCCESS;
+    }
+  }
+
+  return Status;
+}
+
+EFI_STATUS
+EFIAPI
+HostHandleProtocol (
+  IN  EFI_HANDLE        Handle,
+  IN  EFI_GUID          *Protocol,
+  OUT VOID              **Interface
+  )
+{
+  return HostOpenProtocol (Handle, Protocol, Interface, gImageHandle, NULL, EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+}
+
+EFI_STATUS
+EFIAPI
+HostLocateHandleBuffer (
+  IN     EFI_LOCATE_SEARCH_TYPE SearchType,
+  IN     EFI_GUID       *Protocol OPTIONAL,
+  IN     VOID           *SearchKey OPTIONAL,
+  OUT    UINTN          *NoHandles,
+  OUT    EFI_HANDLE     **Buffer
+  )
+{
+  LIST_ENTRY    *Link;
+  HOST_HANDLE   *HostHandle;
+  UINTN         Count;
+
+  HOST_ASSERT_BSP ();
+
+  if (NoHandles == NULL || Buffer == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+  if (SearchType != AllHandles && (SearchType != ByProtocol || Protocol == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *NoHandles = 0;
+  *Buffer    = NULL;
+
+  Count = 0;
+  for (Link = GetFirstNode (&mHandles); !IsNull (&mHandles, Link); Link = GetNextNode (&mHandles, Link)) {
+    HostHandle = BASE_CR (Link, HOST_HANDLE, Link);
+    if (SearchType == AllHandles || HostFindProtocol (HostHandle, Protocol) != NULL) {
+      Count++;
+    }
+  }
+
+  if (Count == 0) {
+    return EFI_NOT_FOUND;
+  }
+
+  *Buffer = AllocatePool (Count * sizeof (EFI_HANDLE));
+  if (*Buffer == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  for (Link = GetFirstNode (&mHandles); !IsNull (&mHandles, Link); Link = GetNextNode (&mHandles, Link)) {
+    HostHandle = BASE_CR (Link, HOST_HANDLE, Link);
+    if (SearchType == AllHandles || HostFindProtocol (HostHandle, Protocol) != NULL) {
+      (*Buffer)[(*NoHandles)++] = HostHandle;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostLocateProtocol (
+  IN  EFI_GUID          *Protocol,
+  IN  VOID              *Registration OPTIONAL,
+  OUT VOID              **Interface
+  )
+{
+  LIST_ENTRY    *Link;
+  HOST_PROTOCOL *Entry;
+
+  HOST_ASSERT_BSP ();
+
+  if (Protocol == NULL || Interface == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  for (Link = GetFirstNode (&mHandles); !IsNull (&mHandles, Link); Link = GetNextNode (&mHandles, Link)) {
+    Entry = HostFindProtocol (BASE_CR (Link, HOST_HANDLE, Link), Protocol);
+    if (Entry != NULL) {
+      *Interface = Entry->Interface;
+      return EFI_SUCCESS;
+    }
+  }
+
+  *Interface = NULL;
+  return EFI_NOT_FOUND;
+}
+
+/**
+  Starts every driver binding that supports the controller. The harness
+  has no bus drivers, so RemainingDevicePath and Recursive don't matter.
+
+**/
+EFI_STATUS
+EFIAPI
+HostConnectController (
+  IN EFI_HANDLE                 ControllerHandle,
+  IN EFI_HANDLE                 *DriverImageHandle OPTIONAL,
+  IN EFI_DEVICE_PATH_PROTOCOL   *RemainingDevicePath OPTIONAL,
+  IN BOOLEAN                    Recursive
+  )
+{
+  EFI_STATUS                    Status;
+  EFI_DRIVER_BINDING_PROTOCOL   *DriverBinding;
+  EFI_HANDLE                    *Drivers;
+  UINTN                         DriverCount;
+  UINTN                         Index;
+  BOOLEAN                       Started;
+
+  if (HostFindHandle (ControllerHandle) == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Status = HostLocateHandleBuffer (ByProtocol, &gEfiDriverBindingProtocolGuid, NULL, &DriverCount, &Drivers);
+  if (EFI_ERROR (Status)) {
+    return EFI_NOT_FOUND;
+  }
+
+  Started = FALSE;
+  for (Index = 0; Index < DriverCount; Index++) {
+    Status = HostHandleProtocol (Drivers[Index], &gEfiDriverBindingProtocolGuid, (VOID **)&DriverBinding);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    Status = DriverBinding->Supported (DriverBinding, ControllerHandle, RemainingDevicePath);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    Status = DriverBinding->Start (DriverBinding, ControllerHandle, RemainingDevicePath);
+    if (!EFI_ERROR (Status)) {
+      Started = TRUE;
+    }
+  }
+
+  FreePool (Drivers);
+  return Started ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+/**
+  Stops the drivers that opened a protocol of the controller BY_DRIVER, or
+  just DriverImageHandle.
+
+**/
+EFI_STATUS
+EFIAPI
+HostDisconnectController (
+  IN EFI_HANDLE         ControllerHandle,
+  IN EFI_HANDLE         DriverImageHandle OPTIONAL,
+  IN EFI_HANDLE         ChildHandle OPTIONAL
+  )
+{
+  EFI_STATUS                    Status;
+  EFI_DRIVER_BINDING_PROTOCOL   *DriverBinding;
+  HOST_HANDLE                   *HostHandle;
+  HOST_PROTOCOL                 *Entry;
+  HOST_OPEN                     *Open;
+  LIST_ENTRY                    *ProtocolLink;
+  LIST_ENTRY                    *OpenLink;
+  EFI_HANDLE                    Agents[HOST_MAX_AGENTS];
+  UINTN                         AgentCount;
+  UINTN                         Index;
+
+  HostHandle = HostFindHandle (ControllerHandle);
+  if (HostHandle == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  AgentCount = 0;
+  for (ProtocolLink = GetFirstNode (&HostHandle->Protocols); !IsNull (&HostHandle->Protocols, ProtocolLink); ProtocolLink = GetNextNode (&HostHandle->Protocols, ProtocolLink)) {
+    Entry = BASE_CR (ProtocolLink, HOST_PROTOCOL, Link);
+    for (OpenLink = GetFirstNode (&Entry->Opens); !IsNull (&Entry->Opens, OpenLink); OpenLink = GetNextNode (&Entry->Opens, OpenLink)) {
+      Open = BASE_CR (OpenLink, HOST_OPEN, Link);
+      if ((Open->Attributes & EFI_OPEN_PROTOCOL_BY_DRIVER) == 0) {
+        continue;
+      }
+      if (DriverImageHandle != NULL && Open->AgentHandle != DriverImageHandle) {
+        continue;
+      }
+
+      for (Index = 0; Index < AgentCount && Agents[Index] != Open->AgentHandle; Index++);
+      if (Index == AgentCount && AgentCount < HOST_MAX_AGENTS) {
+        Agents[AgentCount++] = Open->AgentHandle;
+      }
+    }
+  }
+
+  for (Index = 0; Index < AgentCount; Index++) {
+    Status = HostHandleProtocol (Agents[Index], &gEfiDriverBindingProtocolGuid, (VOID **)&DriverBinding);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    Status = DriverBinding->Stop (DriverBinding, ControllerHandle, 0, NULL);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Tells whether a driver has the protocol of the controller open BY_DRIVER.
+
+**/
+BOOLEAN
+HostControllerManaged (
+  IN EFI_HANDLE         ControllerHandle,
+  IN EFI_GUID           *Protocol
+  )
+{
+  HOST_HANDLE   *HostHandle;
+  HOST_PROTOCOL *Entry;
+  LIST_ENTRY    *Link;
+
+  HostHandle = HostFindHandle (ControllerHandle);
+  if (HostHandle == NULL) {
+    return FALSE;
+  }
+
+  Entry = HostFindProtocol (HostHandle, Protocol);
+  if (Entry == NULL) {
+    return FALSE;
+  }
+
+  for (Link = GetFirstNode (&Entry->Opens); !IsNull (&Entry->Opens, Link); Link = GetNextNode (&Entry->Opens, Link)) {
+    if ((BASE_CR (Link, HOST_OPEN, Link)->Attributes & EFI_OPEN_PROTOCOL_BY_DRIVER) != 0) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
@@ -0,0 +1,267 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Host.h
+
+Abstract:
+
+  Interfaces between the parts of the Linux userspace harness, which runs
+  the driver against image files on a development machine. See LKLHost.c.
+
+Revision History
+
+--*/
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <Uefi.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiRuntimeServicesTableLib.h>
+
+//
+// Boot services (BootServices.c). Timers and deferred signals are only
+// seen on ticks of gHostTickNs.
+//
+extern UINT64 gHostTickNs;
+
+VOID
+HostInitBootServices (
+  VOID
+  );
+
+UINT64
+HostNow (
+  VOID
+  );
+
+VOID
+HostPollInterrupts (
+  VOID
+  );
+
+VOID
+HostSleep (
+  VOID
+  );
+
+VOID
+HostSignalLater (
+  IN EFI_EVENT          Event,
+  IN UINT64             Due
+  );
+
+VOID
+HostExitBootServices (
+  VOID
+  );
+
+//
+// Handle database (Handle.c)
+//
+EFI_STATUS
+EFIAPI
+HostInstallProtocolInterface (
+  IN OUT EFI_HANDLE     *Handle,
+  IN     EFI_GUID       *Protocol,
+  IN     EFI_INTERFACE_TYPE InterfaceType,
+  IN     VOID           *Interface
+  );
+
+EFI_STATUS
+EFIAPI
+HostUninstallProtocolInterface (
+  IN EFI_HANDLE         Handle,
+  IN EFI_GUID           *Protocol,
+  IN VOID               *Interface
+  );
+
+EFI_STATUS
+EFIAPI
+HostInstallMultipleProtocolInterfaces (
+  IN OUT EFI_HANDLE     *Handle,
+  ...
+  );
+
+EFI_STATUS
+EFIAPI
+HostUninstallMultipleProtocolInterfaces (
+  IN EFI_HANDLE         Handle,
+  ...
+  );
+
+EFI_STATUS
+EFIAPI
+HostHandleProtocol (
+  IN  EFI_HANDLE        Handle,
+  IN  EFI_GUID          *Protocol,
+  OUT VOID              **Interface
+  );
+
+EFI_STATUS
+EFIAPI
+HostOpenProtocol (
+  IN  EFI_HANDLE        Handle,
+  IN  EFI_GUID          *Protocol,
+  OUT VOID              **Interface OPTIONAL,
+  IN  EFI_HANDLE        AgentHandle,
+  IN  EFI_HANDLE        ControllerHandle,
+  IN  UINT32            Attributes
+  );
+
+EFI_STATUS
+EFIAPI
+HostCloseProtocol (
+  IN EFI_HANDLE         Handle,
+  IN EFI_GUID           *Protocol,
+  IN EFI_HANDLE         AgentHandle,
+  IN EFI_HANDLE         ControllerHandle
+  );
+
+EFI_STATUS
+EFIAPI
+HostLocateHandleBuffer (
+  IN     EFI_LOCATE_SEARCH_TYPE SearchType,
+  IN     EFI_GUID       *Protocol OPTIONAL,
+  IN     VOID           *SearchKey OPTIONAL,
+  OUT    UINTN          *NoHandles,
+  OUT    EFI_HANDLE     **Buffer
+  );
+
+EFI_STATUS
+EFIAPI
+HostLocateProtocol (
+  IN  EFI_GUID          *Protocol,
+  IN  VOID              *Registration OPTIONAL,
+  OUT VOID              **Interface
+  );
+
+EFI_STATUS
+EFIAPI
+HostConnectController (
+  IN EFI_HANDLE                 ControllerHandle,
+  IN EFI_HANDLE                 *DriverImageHandle OPTIONAL,
+  IN EFI_DEVICE_PATH_PROTOCOL   *RemainingDevicePath OPTIONAL,
+  IN BOOLEAN                    Recursive
+  );
+
+EFI_STATUS
+EFIAPI
+HostDisconnectController (
+  IN EFI_HANDLE         ControllerHandle,
+  IN EFI_HANDLE         DriverImageHandle OPTIONAL,
+  IN EFI_HANDLE         ChildHandle OPTIONAL
+  );
+
+BOOLEAN
+HostControllerManaged (
+  IN EFI_HANDLE         ControllerHandle,
+  IN EFI_GUID           *Protocol
+  );
+
+//
+// Variables (Variable.c)
+//
+EFI_STATUS
+EFIAPI
+HostGetVariable (
+  IN     CHAR16         *VariableName,
+  IN     EFI_GUID       *VendorGuid,
+  OUT    UINT32         *Attributes OPTIONAL,
+  IN OUT UINTN          *DataSize,
+  OUT    VOID           *Data OPTIONAL
+  );
+
+EFI_STATUS
+EFIAPI
+HostSetVariable (
+  IN CHAR16             *VariableName,
+  IN EFI_GUID           *VendorGuid,
+  IN UINT32             Attributes,
+  IN UINTN              DataSize,
+  IN VOID               *Data
+  );
+
+//
+// Libraries (Library.c). Every thread that stands for a processor knows
+// its number, the main thread is the boot processor. Print() writes to
+// gHostPrintFd, so the results can be kept apart from the kernel log.
+//
+extern UINTN   gHostDebugLevel;
+extern BOOLEAN gHostDebugCode;
+extern INT32   gHostPrintFd;
+
+UINTN
+HostCpuNumber (
+  VOID
+  );
+
+VOID
+HostSetCpuNumber (
+  IN UINTN              Cpu
+  );
+
+#define HOST_ASSERT_BSP()  ASSERT (HostCpuNumber () == 0)
+
+//
+// Unicode collation (Collation.c)
+//
+VOID
+HostInstallUnicodeCollation (
+  VOID
+  );
+
+//
+// Image backed disks (Disk.c)
+//
+typedef struct {
+  CONST CHAR8           *Path;
+  UINT32                BlockSize;
+  UINT64                LatencyNs;      // per request
+  UINT64                NsPerMiB;       // transfer time, 0 for none
+  BOOLEAN               Async;          // also produce BlockIo2 and DiskIo2
+  BOOLEAN               ReadOnly;
+} HOST_DISK_CONFIG;
+
+EFI_STATUS
+HostAddDisk (
+  IN  CONST HOST_DISK_CONFIG  *Config,
+  OUT EFI_HANDLE              *Handle
+  );
+
+//
+// MP services (Mp.c), the driver uses at most SMP_MAX_CPUS of LK
+//
+#define HOST_MAX_CPUS  8
+
+VOID
+HostInstallMpServices (
+  IN UINTN              CpuCount
+  );
+
+//
+// Read-only file system over a host directory (HostFs.c)
+//
+EFI_STATUS
+HostAddFileSystem (
+  IN  CONST CHAR8       *Directory,
+  OUT EFI_HANDLE        *Handle
+  );
+
+#endif
@@ -0,0 +1,439 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  HostFs.c
+
+Abstract:
+
+  Read-only Simple File System over a directory of the host. It is the
+  device LKLBench is loaded from, which is where it finds the block traces
+  it replays (-R). Only files can be read, directories can be opened but
+  not listed.
+
+Revision History
+
+--*/
+
+#include "Host.h"
+
+#include <Guid/FileInfo.h>
+#include <Guid/FileSystemInfo.h>
+#include <Protocol/SimpleFileSystem.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define HOST_FILE_SIGNATURE   SIGNATURE_32 ('h', 'f', 'i', 'l')
+
+#define HOST_FS_LABEL         L"host"
+
+typedef struct {
+  UINTN                     Signature;
+  EFI_FILE_PROTOCOL         File;
+  int                       Fd;
+  BOOLEAN                   IsDirectory;
+  CHAR8                     *Path;            // relative to the root, "" for it
+} HOST_FILE;
+
+#define HOST_FILE_FROM_THIS(a)  CR (a, HOST_FILE, File, HOST_FILE_SIGNATURE)
+
+STATIC int                              mRootFd = -1;
+STATIC EFI_SIMPLE_FILE_SYSTEM_PROTOCOL  mFileSystem;
+
+STATIC
+EFI_STATUS
+HostFsOpenPath (
+  IN  CONST CHAR8       *Path,
+  OUT EFI_FILE_PROTOCOL **File
+  );
+
+/**
+  Resolves FileName against the directory of Parent into a path relative
+  to the root. "." and ".." are resolved here, ".." never leaves the root.
+
+**/
+STATIC
+CHAR8 *
+HostFsResolve (
+  IN HOST_FILE          *Parent,
+  IN CONST CHAR16       *FileName
+  )
+{
+  CHAR8   *Path;
+  UINTN   Length;
+  UINTN   Pos;
+  UINTN   Start;
+
+  Length = AsciiStrLen (Parent->Path) + StrLen (FileName) + 2;
+  Path   = AllocateZeroPool (Length);
+  if (Path == NULL) {
+    return NULL;
+  }
+
+  Pos = 0;
+  if (*FileName != L'\\') {
+    AsciiStrCpyS (Path, Length, Parent->Path);
+    Pos = AsciiStrLen (Path);
+  }
+
+  while (*FileName != 0) {
+    while (*FileName == L'\\') {
+      FileName++;
+    }
+    if (*FileName == 0) {
+      break;
+    }
+
+    Start = Pos;
+    if (Pos != 0) {
+      Path[Pos++] = '/';
+    }
+    while (*FileName != 0 && *FileName != L'\\') {
+      if (*FileName >= 0x80 || *FileName == L'/') {
+        FreePool (Path);
+        return NULL;
+      }
+      Path[Pos++] = (CHAR8)*FileName++;
+    }
+    Path[Pos] = '\0';
+
+    if (AsciiStrCmp (Path + Start + (Start != 0), ".") == 0) {
+      Pos = Start;
+    } else if (AsciiStrCmp (Path + Start + (Start != 0), "..") == 0) {
+      Pos = Start;
+      while (Pos != 0 && Path[--Pos] != '/') {
+      }
+    }
+    Path[Pos] = '\0';
+  }
+
+  return Path;
+}
+
+EFI_STATUS
+EFIAPI
+HostFsOpen (
+  IN  EFI_FILE_PROTOCOL *This,
+  OUT EFI_FILE_PROTOCOL **NewHandle,
+  IN  CHAR16            *FileName,
+  IN  UINT64            OpenMode,
+  IN  UINT64            Attributes
+  )
+{
+  EFI_STATUS  Status;
+  CHAR8       *Path;
+
+  if (NewHandle == NULL || FileName == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+  if (OpenMode != EFI_FILE_MODE_READ) {
+    return EFI_WRITE_PROTECTED;
+  }
+
+  Path = HostFsResolve (HOST_FILE_FROM_THIS (This), FileName);
+  if (Path == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  Status = HostFsOpenPath (Path, NewHandle);
+  FreePool (Path);
+  return Status;
+}
+
+EFI_STATUS
+EFIAPI
+HostFsClose (
+  IN EFI_FILE_PROTOCOL  *This
+  )
+{
+  HOST_FILE *File;
+
+  File = HOST_FILE_FROM_THIS (This);
+  close (File->Fd);
+  FreePool (File->Path);
+  FreePool (File);
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostFsDelete (
+  IN EFI_FILE_PROTOCOL  *This
+  )
+{
+  HostFsClose (This);
+  return EFI_WARN_DELETE_FAILURE;
+}
+
+EFI_STATUS
+EFIAPI
+HostFsRead (
+  IN     EFI_FILE_PROTOCOL  *This,
+  IN OUT UINTN              *BufferSize,
+  OUT    VOID               *Buffer
+  )
+{
+  HOST_FILE *File;
+  UINT8     *Bytes;
+  UINTN     Total;
+  ssize_t   Done;
+
+  File = HOST_FILE_FROM_THIS (This);
+  if (File->IsDirectory) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Bytes = Buffer;
+  Total = 0;
+  while (Total < *BufferSize) {
+    Done = read (File->Fd, Bytes + Total, *BufferSize - Total);
+    if (Done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (Done < 0) {
+      return EFI_DEVICE_ERROR;
+    }
+    if (Done == 0) {
+      break;
+    }
+    Total += Done;
+  }
+
+  *BufferSize = Total;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostFsWrite (
+  IN     EFI_FILE_PROTOCOL  *This,
+  IN OUT UINTN              *BufferSize,
+  IN     VOID               *Buffer
+  )
+{
+  return EFI_WRITE_PROTECTED;
+}
+
+EFI_STATUS
+EFIAPI
+HostFsGetPosition (
+  IN  EFI_FILE_PROTOCOL *This,
+  OUT UINT64            *Position
+  )
+{
+  HOST_FILE *File;
+  off_t     Offset;
+
+  File = HOST_FILE_FROM_THIS (This);
+  if (File->IsDirectory) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Offset = lseek (File->Fd, 0, SEEK_CUR);
+  if (Offset < 0) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  *Position = Offset;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostFsSetPosition (
+  IN EFI_FILE_PROTOCOL  *This,
+  IN UINT64             Position
+  )
+{
+  HOST_FILE *File;
+  off_t     Offset;
+
+  File = HOST_FILE_FROM_THIS (This);
+  if (File->IsDirectory) {
+    return Position == 0 ? EFI_SUCCESS : EFI_UNSUPPORTED;
+  }
+
+  Offset = (Position == MAX_UINT64) ? lseek (File->Fd, 0, SEEK_END) : lseek (File->Fd, Position, SEEK_SET);
+  return Offset < 0 ? EFI_DEVICE_ERROR : EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostFsGetInfo (
+  IN     EFI_FILE_PROTOCOL  *This,
+  IN     EFI_GUID           *InformationType,
+  IN OUT UINTN              *BufferSize,
+  OUT    VOID               *Buffer
+  )
+{
+  HOST_FILE             *File;
+  EFI_FILE_INFO         *FileInfo;
+  EFI_FILE_SYSTEM_INFO  *FsInfo;
+  CONST CHAR8           *Name;
+  struct stat           Stat;
+  UINTN                 Size;
+  UINTN                 Index;
+
+  File = HOST_FILE_FROM_THIS (This);
+
+  if (CompareGuid (InformationType, &gEfiFileSystemInfoGuid)) {
+    Size = SIZE_OF_EFI_FILE_SYSTEM_INFO + sizeof (HOST_FS_LABEL);
+    if (*BufferSize < Size) {
+      *BufferSize = Size;
+      return EFI_BUFFER_TOO_SMALL;
+    }
+
+    FsInfo = Buffer;
+    ZeroMem (FsInfo, Size);
+    FsInfo->Size      = Size;
+    FsInfo->ReadOnly  = TRUE;
+    FsInfo->BlockSize = 512;
+    CopyMem (FsInfo->VolumeLabel, HOST_FS_LABEL, sizeof (HOST_FS_LABEL));
+    *BufferSize = Size;
+    return EFI_SUCCESS;
+  }
+
+  if (CompareGuid (InformationType, &gEfiFileInfoGuid)) {
+    if (fstat (File->Fd, &Stat) != 0) {
+      return EFI_DEVICE_ERROR;
+    }
+
+    Name = File->Path + AsciiStrLen (File->Path);
+    while (Name != File->Path && Name[-1] != '/') {
+      Name--;
+    }
+
+    Size = SIZE_OF_EFI_FILE_INFO + (AsciiStrLen (Name) + 1) * sizeof (CHAR16);
+    if (*BufferSize < Size) {
+      *BufferSize = Size;
+      return EFI_BUFFER_TOO_SMALL;
+    }
+
+    FileInfo = Buffer;
+    ZeroMem (FileInfo, Size);
+    FileInfo->Size         = Size;
+    FileInfo->FileSize     = File->IsDirectory ? 0 : Stat.st_size;
+    FileInfo->PhysicalSize = File->IsDirectory ? 0 : Stat.st_blocks * 512ULL;
+    FileInfo->Attribute    = EFI_FILE_READ_ONLY | (File->IsDirectory ? EFI_FILE_DIRECTORY : 0);
+    for (Index = 0; Name[Index] != '\0'; Index++) {
+      FileInfo->FileName[Index] = Name[Index];
+    }
+    *BufferSize = Size;
+    return EFI_SUCCESS;
+  }
+
+  return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS
+EFIAPI
+HostFsSetInfo (
+  IN EFI_FILE_PROTOCOL  *This,
+  IN EFI_GUID           *InformationType,
+  IN UINTN              BufferSize,
+  IN VOID               *Buffer
+  )
+{
+  return EFI_WRITE_PROTECTED;
+}
+
+EFI_STATUS
+EFIAPI
+HostFsFlush (
+  IN EFI_FILE_PROTOCOL  *This
+  )
+{
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+HostFsOpenPath (
+  IN  CONST CHAR8       *Path,
+  OUT EFI_FILE_PROTOCOL **NewHandle
+  )
+{
+  HOST_FILE   *File;
+  struct stat Stat;
+  int         Fd;
+
+  Fd = openat (mRootFd, Path[0] == '\0' ? "." : Path, O_RDONLY | O_CLOEXEC);
+  if (Fd < 0) {
+    return errno == ENOENT || errno == ENOTDIR ? EFI_NOT_FOUND : EFI_ACCESS_DENIED;
+  }
+  if (fstat (Fd, &Stat) != 0) {
+    close (Fd);
+    return EFI_DEVICE_ERROR;
+  }
+
+  File = AllocateZeroPool (sizeof (*File));
+  if (File != NULL) {
+    File->Path = AllocateCopyPool (AsciiStrSize (Path), Path);
+  }
+  if (File == NULL || File->Path == NULL) {
+    if (File != NULL) {
+      FreePool (File);
+    }
+    close (Fd);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  File->Signature          = HOST_FILE_SIGNATURE;
+  File->Fd                 = Fd;
+  File->IsDirectory        = S_ISDIR (Stat.st_mode);
+  File->File.Revision      = EFI_FILE_PROTOCOL_REVISION;
+  File->File.Open          = HostFsOpen;
+  File->File.Close         = HostFsClose;
+  File->File.Delete        = HostFsDelete;
+  File->File.Read          = HostFsRead;
+  File->File.Write         = HostFsWrite;
+  File->File.GetPosition   = HostFsGetPosition;
+  File->File.SetPosition   = HostFsSetPosition;
+  File->File.GetInfo       = HostFsGetInfo;
+  File->File.SetInfo       = HostFsSetInfo;
+  File->File.Flush         = HostFsFlush;
+
+  *NewHandle = &File->File;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostFsOpenVolume (
+  IN  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *This,
+  OUT EFI_FILE_PROTOCOL               **Root
+  )
+{
+  return HostFsOpenPath ("", Root);
+}
+
+EFI_STATUS
+HostAddFileSystem (
+  IN  CONST CHAR8       *Directory,
+  OUT EFI_HANDLE        *Handle
+  )
+{
+  mRootFd = open (Directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (mRootFd < 0) {
+    return EFI_NOT_FOUND;
+  }
+
+  mFileSystem.Revision   = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_REVISION;
+  mFileSystem.OpenVolume = HostFsOpenVolume;
+
+  *Handle = NULL;
+  return gBS->InstallProtocolInterface (Handle, &gEfiSimpleFileSystemProtocolGuid, EFI_NATIVE_INTERFACE, &mFileSystem);
+}
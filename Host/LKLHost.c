@@ -0,0 +1,366 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  LKLHost.c
+
+Abstract:
+
+  Linux userspace harness that runs the unmodified driver, LKL kernel and
+  all, against image files, so changes can be measured on a development
+  machine without booting firmware:
+
+    lklhost [-l LatencyUs] [-b MiBps] [-B BlockSize] [-T TickUs] [-s] [-r]
+            [-m MiB] [-k Args] [-c Cpus] [-d Dir] [-v]
+            Image ... [-- LKLBench arguments]
+    lklhost -S [options] [Image ... [-- LKLBench arguments]]
+
+  Every image becomes a disk that looks like a partition to the driver, see
+  Disk.c. -l and -b set the latency of each request and the bandwidth of
+  the disks, -B their block size. -T sets the firmware timer tick, timers
+  and disk completions are only seen on ticks. -s leaves out Block I/O 2
+  and Disk I/O 2, so the driver takes its synchronous path. -r opens the
+  images read-only. -m and -k set PcdLKLMemorySize and PcdLKLCmdline, -v
+  prints the driver's debug output and the kernel log on stderr.
+
+  -c runs the driver on that many processors, see Mp.c, and sets
+  PcdLKLSmp if there is more than one. That only has an effect if
+  lklhost was built with SMP=1, like LKL_SMP for the firmware.
+
+  Once the driver has mounted what it can, LKLBench runs with the
+  arguments after --, on the volumes in the order of the images, and
+  prints its CSV results on stdout. ExitBootServices() is signaled at the
+  end, which writes back and unmounts the volumes.
+
+  -S first runs the synchronization and context switch benchmark of the
+  driver (PcdLKLSyncBenchmark) and prints it in the same CSV format, with
+  "lk" for the filesystem type.
+
+  LKLBench is loaded from a read-only volume over the directory -d, the
+  current one by default, so "-- -R Trace Volume" replays a block trace
+  pulled off a device with LKLStat -t on the images. That volume comes
+  after the images and isn't measured, being read-only.
+
+Revision History
+
+--*/
+
+#include "Host.h"
+#include "LKL.h"
+
+#include <Library/UefiLib.h>
+
+#include <Protocol/LoadedImage.h>
+#include <Protocol/SimpleFileSystem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//
+// How long to wait for the background mounts, in ms
+//
+#define HOST_MOUNT_TIMEOUT  30000
+
+#define HOST_MAX_DISKS      16
+
+#define HOST_SYNC_ITERATIONS  100000
+
+EFI_STATUS
+EFIAPI
+LKLEntryPoint (
+  IN EFI_HANDLE         ImageHandle,
+  IN EFI_SYSTEM_TABLE   *SystemTable
+  );
+
+EFI_STATUS
+EFIAPI
+LKLBenchMain (
+  IN EFI_HANDLE         ImageHandle,
+  IN EFI_SYSTEM_TABLE   *SystemTable
+  );
+
+STATIC EFI_LOADED_IMAGE_PROTOCOL mDriverImage;
+STATIC EFI_LOADED_IMAGE_PROTOCOL mBenchImage;
+
+STATIC
+VOID
+HostUsage (
+  VOID
+  )
+{
+  fprintf (stderr,
+    "usage: lklhost [-l LatencyUs] [-b MiBps] [-B BlockSize] [-T TickUs] [-s] [-r]\n"
+    "               [-m MiB] [-k Args] [-c Cpus] [-d Dir] [-v]\n"
+    "               Image ... [-- LKLBench arguments]\n"
+    "       lklhost -S [options] [Image ... [-- LKLBench arguments]]\n");
+  exit (2);
+}
+
+/**
+  Waits until the driver is done with every disk: it either installed a
+  filesystem on it or let go of its Disk I/O.
+
+**/
+STATIC
+VOID
+HostWaitForMounts (
+  IN EFI_HANDLE         *Disks,
+  IN UINTN              DiskCount
+  )
+{
+  VOID  *Fs;
+  UINTN Index;
+  UINTN Pending;
+  UINTN Waited;
+
+  for (Waited = 0; Waited < HOST_MOUNT_TIMEOUT; Waited++) {
+    Pending = 0;
+    for (Index = 0; Index < DiskCount; Index++) {
+      if (EFI_ERROR (gBS->HandleProtocol (Disks[Index], &gEfiSimpleFileSystemProtocolGuid, &Fs)) &&
+          HostControllerManaged (Disks[Index], &gEfiDiskIoProtocolGuid)) {
+        Pending++;
+      }
+    }
+
+    if (Pending == 0) {
+      return;
+    }
+
+    gBS->Stall (1000);
+  }
+
+  fprintf (stderr, "lklhost: volumes still mounting after %u ms\n", HOST_MOUNT_TIMEOUT);
+}
+
+/**
+  Runs the driver's synchronization benchmark and prints it like LKLBench
+  does its results.
+
+**/
+STATIC
+VOID
+HostSyncBenchmark (
+  VOID
+  )
+{
+  LKL_SYNC_BENCHMARK  Result;
+
+  uefi_sync_benchmark (HOST_SYNC_ITERATIONS, &Result);
+
+  Print (L"# tag,volume,fstype,metric,value,unit\n");
+  Print (L"-,-,lk,mutex,%lu,ns\n", Result.MutexNs);
+  Print (L"-,-,lk,recursive_mutex,%lu,ns\n", Result.RecursiveMutexNs);
+  Print (L"-,-,lk,semaphore,%lu,ns\n", Result.SemNs);
+  Print (L"-,-,lk,handoff,%lu,ns\n", Result.HandoffNs);
+  Print (L"-,-,lk,switch,%lu,ns\n", Result.SwitchNs);
+  Print (L"-,-,lk,switch_rate,%lu,1/s\n", Result.SwitchesPerSec);
+}
+
+/**
+  Builds the load options of LKLBench, the image name followed by Args.
+
+**/
+STATIC
+CHAR16 *
+HostBenchOptions (
+  IN  int               Argc,
+  IN  char              **Argv,
+  OUT UINT32            *Size
+  )
+{
+  CONST CHAR8 *Name;
+  CHAR16      *Line;
+  UINTN       Length;
+  UINTN       Pos;
+  int         Arg;
+
+  Name   = "LKLBench.efi";
+  Length = AsciiStrLen (Name) + 1;
+  for (Arg = 0; Arg < Argc; Arg++) {
+    Length += AsciiStrLen (Argv[Arg]) + 1;
+  }
+
+  Line = AllocateZeroPool (Length * sizeof (CHAR16));
+  ASSERT (Line != NULL);
+
+  Pos = 0;
+  while (*Name != '\0') {
+    Line[Pos++] = *Name++;
+  }
+  for (Arg = 0; Arg < Argc; Arg++) {
+    Line[Pos++] = L' ';
+    for (Name = Argv[Arg]; *Name != '\0'; Name++) {
+      Line[Pos++] = (UINT8)*Name;
+    }
+  }
+
+  *Size = (UINT32)((Pos + 1) * sizeof (CHAR16));
+  return Line;
+}
+
+int
+main (
+  int                   argc,
+  char                  **argv
+  )
+{
+  HOST_DISK_CONFIG  Config;
+  EFI_HANDLE        Disks[HOST_MAX_DISKS];
+  EFI_HANDLE        BenchHandle;
+  CONST CHAR8       *Directory;
+  BOOLEAN           SyncBench;
+  UINTN             CpuCount;
+  UINTN             DiskCount;
+  EFI_STATUS        Status;
+  int               Option;
+  int               Arg;
+
+  Config.BlockSize = 512;
+  Config.LatencyNs = 100000;
+  Config.NsPerMiB  = 0;
+  Config.Async     = TRUE;
+  Config.ReadOnly  = FALSE;
+  Directory        = ".";
+  SyncBench        = FALSE;
+  CpuCount         = 1;
+
+  while ((Option = getopt (argc, argv, "+l:b:B:T:srm:k:c:d:Sv")) != -1) {
+    switch (Option) {
+    case 'l':
+      Config.LatencyNs = strtoull (optarg, NULL, 0) * 1000;
+      break;
+    case 'b':
+      Config.NsPerMiB = strtoull (optarg, NULL, 0);
+      Config.NsPerMiB = Config.NsPerMiB != 0 ? 1000000000ULL / Config.NsPerMiB : 0;
+      break;
+    case 'B':
+      Config.BlockSize = (UINT32)strtoul (optarg, NULL, 0);
+      if (Config.BlockSize < 512 || (Config.BlockSize & (Config.BlockSize - 1)) != 0) {
+        HostUsage ();
+      }
+      break;
+    case 'T':
+      gHostTickNs = strtoull (optarg, NULL, 0) * 1000;
+      break;
+    case 's':
+      Config.Async = FALSE;
+      break;
+    case 'r':
+      Config.ReadOnly = TRUE;
+      break;
+    case 'm':
+      _gPcd_BinaryPatch_PcdLKLMemorySize = (UINT32)strtoul (optarg, NULL, 0);
+      break;
+    case 'k':
+      AsciiStrnCpyS (_gPcd_BinaryPatch_PcdLKLCmdline, LKL_HOST_PCD_STRING_SIZE, optarg, LKL_HOST_PCD_STRING_SIZE - 1);
+      break;
+    case 'c':
+      CpuCount = strtoul (optarg, NULL, 0);
+      if (CpuCount < 1 || CpuCount > HOST_MAX_CPUS) {
+        HostUsage ();
+      }
+      _gPcd_BinaryPatch_PcdLKLSmp = CpuCount > 1;
+      break;
+    case 'd':
+      Directory = optarg;
+      break;
+    case 'S':
+      SyncBench = TRUE;
+      break;
+    case 'v':
+      gHostDebugLevel = DEBUG_ERROR | DEBUG_WARN | DEBUG_INFO;
+      gHostDebugCode  = TRUE;
+      break;
+    default:
+      HostUsage ();
+    }
+  }
+
+  if (!SyncBench && (optind >= argc || strcmp (argv[optind], "--") == 0)) {
+    HostUsage ();
+  }
+
+  //
+  // The kernel log goes to stdout, keep it apart from the results
+  //
+  if (gHostDebugCode) {
+    gHostPrintFd = dup (STDOUT_FILENO);
+    dup2 (STDERR_FILENO, STDOUT_FILENO);
+  }
+
+  HostInitBootServices ();
+  HostInstallUnicodeCollation ();
+  HostInstallMpServices (CpuCount);
+
+  Status = gBS->InstallProtocolInterface (&gImageHandle, &gEfiLoadedImageProtocolGuid, EFI_NATIVE_INTERFACE, &mDriverImage);
+  ASSERT_EFI_ERROR (Status);
+
+  Status = LKLEntryPoint (gImageHandle, gST);
+  if (EFI_ERROR (Status)) {
+    fprintf (stderr, "lklhost: driver failed to load: %#llx\n", (unsigned long long)Status);
+    return 1;
+  }
+
+  if (SyncBench) {
+    HostSyncBenchmark ();
+    if (optind >= argc) {
+      HostExitBootServices ();
+      return 0;
+    }
+  }
+
+  DiskCount = 0;
+  for (Arg = optind; Arg < argc && strcmp (argv[Arg], "--") != 0; Arg++) {
+    if (DiskCount == HOST_MAX_DISKS) {
+      HostUsage ();
+    }
+
+    Config.Path = argv[Arg];
+    Status = HostAddDisk (&Config, &Disks[DiskCount]);
+    if (EFI_ERROR (Status)) {
+      fprintf (stderr, "lklhost: can't open %s\n", argv[Arg]);
+      return 1;
+    }
+
+    gBS->ConnectController (Disks[DiskCount], NULL, NULL, TRUE);
+    DiskCount++;
+  }
+  if (Arg < argc) {
+    Arg++;
+  }
+
+  HostWaitForMounts (Disks, DiskCount);
+
+  Status = HostAddFileSystem (Directory, &mBenchImage.DeviceHandle);
+  if (EFI_ERROR (Status)) {
+    fprintf (stderr, "lklhost: can't open %s\n", Directory);
+    HostExitBootServices ();
+    return 1;
+  }
+
+  BenchHandle = NULL;
+  mBenchImage.Revision    = EFI_LOADED_IMAGE_PROTOCOL_REVISION;
+  mBenchImage.SystemTable = gST;
+  mBenchImage.LoadOptions = HostBenchOptions (argc - Arg, argv + Arg, &mBenchImage.LoadOptionsSize);
+  Status = gBS->InstallProtocolInterface (&BenchHandle, &gEfiLoadedImageProtocolGuid, EFI_NATIVE_INTERFACE, &mBenchImage);
+  ASSERT_EFI_ERROR (Status);
+
+  Status = LKLBenchMain (BenchHandle, gST);
+
+  HostExitBootServices ();
+  fflush (NULL);
+
+  return EFI_ERROR (Status) ? 1 : 0;
+}
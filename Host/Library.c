@@ -0,0 +1,644 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Library.c
+
+Abstract:
+
+  The library classes the driver links against that the harness can't take
+  from MdePkg as they are: DebugLib, MemoryAllocationLib, TimerLib, CpuLib,
+  the processor id of LocalApicLib and ArmLib, the processor specific part
+  of BaseLib, the DevicePathLib and FileHandleLib functions the driver uses
+  and Print(). UefiLib itself is built from MdePkg.
+
+Revision History
+
+--*/
+
+#include "Host.h"
+
+#include <Protocol/DevicePath.h>
+#include <Protocol/SimpleFileSystem.h>
+#include <Guid/FileInfo.h>
+
+#include <Library/CpuLib.h>
+#include <Library/DevicePathLib.h>
+#include <Library/FileHandleLib.h>
+#include <Library/PrintLib.h>
+#include <Library/TimerLib.h>
+#include <Library/UefiLib.h>
+#if defined (MDE_CPU_X64)
+#include <Library/LocalApicLib.h>
+#else
+#include <Library/ArmLib.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define HOST_PRINT_BUFFER_SIZE  1024
+
+UINTN   gHostDebugLevel = DEBUG_ERROR;
+BOOLEAN gHostDebugCode;
+INT32   gHostPrintFd = STDOUT_FILENO;
+
+STATIC __thread UINTN mHostCpu;
+
+UINTN
+HostCpuNumber (
+  VOID
+  )
+{
+  return mHostCpu;
+}
+
+VOID
+HostSetCpuNumber (
+  IN UINTN              Cpu
+  )
+{
+  mHostCpu = Cpu;
+}
+
+//
+// Processor
+//
+VOID
+EFIAPI
+CpuPause (
+  VOID
+  )
+{
+#if defined (MDE_CPU_X64)
+  __builtin_ia32_pause ();
+#else
+  __asm__ __volatile__ ("yield" ::: "memory");
+#endif
+}
+
+VOID
+EFIAPI
+MemoryFence (
+  VOID
+  )
+{
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+VOID
+EFIAPI
+CpuSleep (
+  VOID
+  )
+{
+  HostSleep ();
+}
+
+VOID
+EFIAPI
+CpuFlushTlb (
+  VOID
+  )
+{
+}
+
+#if defined (MDE_CPU_X64)
+UINT32
+EFIAPI
+GetApicId (
+  VOID
+  )
+{
+  return (UINT32)HostCpuNumber ();
+}
+#else
+UINTN
+EFIAPI
+ArmReadMpidr (
+  VOID
+  )
+{
+  return HostCpuNumber ();
+}
+#endif
+
+//
+// TimerLib, in nanoseconds
+//
+UINTN
+EFIAPI
+MicroSecondDelay (
+  IN UINTN              MicroSeconds
+  )
+{
+  UINT64 End;
+
+  End = HostNow () + (UINT64)MicroSeconds * 1000;
+  while (HostNow () < End) {
+    CpuPause ();
+  }
+  return MicroSeconds;
+}
+
+UINTN
+EFIAPI
+NanoSecondDelay (
+  IN UINTN              NanoSeconds
+  )
+{
+  UINT64 End;
+
+  End = HostNow () + NanoSeconds;
+  while (HostNow () < End) {
+    CpuPause ();
+  }
+  return NanoSeconds;
+}
+
+UINT64
+EFIAPI
+GetPerformanceCounter (
+  VOID
+  )
+{
+  return HostNow ();
+}
+
+UINT64
+EFIAPI
+GetPerformanceCounterProperties (
+  OUT UINT64            *StartValue OPTIONAL,
+  OUT UINT64            *EndValue OPTIONAL
+  )
+{
+  if (StartValue != NULL) {
+    *StartValue = 0;
+  }
+  if (EndValue != NULL) {
+    *EndValue = MAX_UINT64;
+  }
+  return 1000000000ULL;
+}
+
+UINT64
+EFIAPI
+GetTimeInNanoSecond (
+  IN UINT64             Ticks
+  )
+{
+  return Ticks;
+}
+
+//
+// DebugLib, on stderr
+//
+BOOLEAN
+EFIAPI
+DebugPrintLevelEnabled (
+  IN CONST UINTN        ErrorLevel
+  )
+{
+  return (ErrorLevel & gHostDebugLevel) != 0;
+}
+
+VOID
+EFIAPI
+DebugPrint (
+  IN UINTN              ErrorLevel,
+  IN CONST CHAR8        *Format,
+  ...
+  )
+{
+  CHAR8   Buffer[HOST_PRINT_BUFFER_SIZE];
+  VA_LIST Marker;
+
+  if (!DebugPrintLevelEnabled (ErrorLevel)) {
+    return;
+  }
+
+  VA_START (Marker, Format);
+  AsciiVSPrint (Buffer, sizeof (Buffer), Format, Marker);
+  VA_END (Marker);
+
+  fputs (Buffer, stderr);
+}
+
+VOID
+EFIAPI
+DebugAssert (
+  IN CONST CHAR8        *FileName,
+  IN UINTN              LineNumber,
+  IN CONST CHAR8        *Description
+  )
+{
+  fprintf (stderr, "ASSERT %s(%u): %s\n", FileName, (unsigned)LineNumber, Description);
+  fflush (NULL);
+  abort ();
+}
+
+VOID *
+EFIAPI
+DebugClearMemory (
+  OUT VOID              *Buffer,
+  IN UINTN              Length
+  )
+{
+  return SetMem (Buffer, Length, 0xAF);
+}
+
+BOOLEAN
+EFIAPI
+DebugAssertEnabled (
+  VOID
+  )
+{
+  return TRUE;
+}
+
+BOOLEAN
+EFIAPI
+DebugPrintEnabled (
+  VOID
+  )
+{
+  return TRUE;
+}
+
+BOOLEAN
+EFIAPI
+DebugCodeEnabled (
+  VOID
+  )
+{
+  return gHostDebugCode;
+}
+
+BOOLEAN
+EFIAPI
+DebugClearMemoryEnabled (
+  VOID
+  )
+{
+  return FALSE;
+}
+
+//
+// MemoryAllocationLib, over the boot services like the UEFI instance
+//
+VOID *
+EFIAPI
+AllocatePool (
+  IN UINTN              AllocationSize
+  )
+{
+  VOID *Buffer;
+
+  if (EFI_ERROR (gBS->AllocatePool (EfiBootServicesData, AllocationSize, &Buffer))) {
+    return NULL;
+  }
+  return Buffer;
+}
+
+VOID *
+EFIAPI
+AllocateZeroPool (
+  IN UINTN              AllocationSize
+  )
+{
+  VOID *Buffer;
+
+  Buffer = AllocatePool (AllocationSize);
+  if (Buffer != NULL) {
+    ZeroMem (Buffer, AllocationSize);
+  }
+  return Buffer;
+}
+
+VOID *
+EFIAPI
+AllocateCopyPool (
+  IN UINTN              AllocationSize,
+  IN CONST VOID         *Buffer
+  )
+{
+  VOID *Memory;
+
+  Memory = AllocatePool (AllocationSize);
+  if (Memory != NULL) {
+    CopyMem (Memory, Buffer, AllocationSize);
+  }
+  return Memory;
+}
+
+VOID *
+EFIAPI
+ReallocatePool (
+  IN UINTN              OldSize,
+  IN UINTN              NewSize,
+  IN VOID               *OldBuffer OPTIONAL
+  )
+{
+  VOID *NewBuffer;
+
+  NewBuffer = AllocateZeroPool (NewSize);
+  if (NewBuffer != NULL && OldBuffer != NULL) {
+    CopyMem (NewBuffer, OldBuffer, MIN (OldSize, NewSize));
+    FreePool (OldBuffer);
+  }
+  return NewBuffer;
+}
+
+VOID
+EFIAPI
+FreePool (
+  IN VOID               *Buffer
+  )
+{
+  EFI_STATUS Status;
+
+  Status = gBS->FreePool (Buffer);
+  ASSERT_EFI_ERROR (Status);
+}
+
+VOID *
+EFIAPI
+AllocatePages (
+  IN UINTN              Pages
+  )
+{
+  EFI_PHYSICAL_ADDRESS Memory;
+
+  if (Pages == 0 || EFI_ERROR (gBS->AllocatePages (AllocateAnyPages, EfiBootServicesData, Pages, &Memory))) {
+    return NULL;
+  }
+  return (VOID *)(UINTN)Memory;
+}
+
+VOID
+EFIAPI
+FreePages (
+  IN VOID               *Buffer,
+  IN UINTN              Pages
+  )
+{
+  EFI_STATUS Status;
+
+  Status = gBS->FreePages ((EFI_PHYSICAL_ADDRESS)(UINTN)Buffer, Pages);
+  ASSERT_EFI_ERROR (Status);
+}
+
+VOID *
+EFIAPI
+AllocateAlignedPages (
+  IN UINTN              Pages,
+  IN UINTN              Alignment
+  )
+{
+  EFI_PHYSICAL_ADDRESS  Memory;
+  UINTN                 AlignedMemory;
+  UINTN                 RealPages;
+  UINTN                 UnalignedPages;
+
+  ASSERT ((Alignment & (Alignment - 1)) == 0);
+
+  if (Pages == 0) {
+    return NULL;
+  }
+
+  if (Alignment <= EFI_PAGE_SIZE) {
+    return AllocatePages (Pages);
+  }
+
+  //
+  // Over-allocate and give back the pages on both sides of the aligned
+  // range
+  //
+  RealPages = Pages + EFI_SIZE_TO_PAGES (Alignment);
+  if (EFI_ERROR (gBS->AllocatePages (AllocateAnyPages, EfiBootServicesData, RealPages, &Memory))) {
+    return NULL;
+  }
+
+  AlignedMemory  = ((UINTN)Memory + Alignment - 1) & ~(Alignment - 1);
+  UnalignedPages = EFI_SIZE_TO_PAGES (AlignedMemory - (UINTN)Memory);
+  if (UnalignedPages > 0) {
+    gBS->FreePages (Memory, UnalignedPages);
+  }
+
+  Memory         = AlignedMemory + EFI_PAGES_TO_SIZE (Pages);
+  UnalignedPages = RealPages - Pages - UnalignedPages;
+  if (UnalignedPages > 0) {
+    gBS->FreePages (Memory, UnalignedPages);
+  }
+
+  return (VOID *)AlignedMemory;
+}
+
+VOID
+EFIAPI
+FreeAlignedPages (
+  IN VOID               *Buffer,
+  IN UINTN              Pages
+  )
+{
+  FreePages (Buffer, Pages);
+}
+
+//
+// DevicePathLib
+//
+UINT8
+EFIAPI
+DevicePathType (
+  IN CONST VOID         *Node
+  )
+{
+  return ((CONST EFI_DEVICE_PATH_PROTOCOL *)Node)->Type;
+}
+
+UINT8
+EFIAPI
+DevicePathSubType (
+  IN CONST VOID         *Node
+  )
+{
+  return ((CONST EFI_DEVICE_PATH_PROTOCOL *)Node)->SubType;
+}
+
+UINTN
+EFIAPI
+DevicePathNodeLength (
+  IN CONST VOID         *Node
+  )
+{
+  return ReadUnaligned16 ((UINT16 *)&((EFI_DEVICE_PATH_PROTOCOL *)Node)->Length[0]);
+}
+
+EFI_DEVICE_PATH_PROTOCOL *
+EFIAPI
+NextDevicePathNode (
+  IN CONST VOID         *Node
+  )
+{
+  return (EFI_DEVICE_PATH_PROTOCOL *)((UINT8 *)Node + DevicePathNodeLength (Node));
+}
+
+BOOLEAN
+EFIAPI
+IsDevicePathEndType (
+  IN CONST VOID         *Node
+  )
+{
+  return DevicePathType (Node) == END_DEVICE_PATH_TYPE;
+}
+
+BOOLEAN
+EFIAPI
+IsDevicePathEnd (
+  IN CONST VOID         *Node
+  )
+{
+  return IsDevicePathEndType (Node) && DevicePathSubType (Node) == END_ENTIRE_DEVICE_PATH_SUBTYPE;
+}
+
+EFI_DEVICE_PATH_PROTOCOL *
+EFIAPI
+DevicePathFromHandle (
+  IN EFI_HANDLE         Handle
+  )
+{
+  EFI_DEVICE_PATH_PROTOCOL *DevicePath;
+
+  if (EFI_ERROR (gBS->HandleProtocol (Handle, &gEfiDevicePathProtocolGuid, (VOID **)&DevicePath))) {
+    return NULL;
+  }
+  return DevicePath;
+}
+
+//
+// FileHandleLib
+//
+EFI_STATUS
+EFIAPI
+FileHandleClose (
+  IN EFI_FILE_HANDLE    FileHandle
+  )
+{
+  if (FileHandle == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+  return FileHandle->Close (FileHandle);
+}
+
+EFI_STATUS
+EFIAPI
+FileHandleGetSize (
+  IN  EFI_FILE_HANDLE   FileHandle,
+  OUT UINT64            *Size
+  )
+{
+  EFI_STATUS    Status;
+  EFI_FILE_INFO *FileInfo;
+  UINTN         InfoSize;
+
+  if (FileHandle == NULL || Size == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  InfoSize = 0;
+  Status = FileHandle->GetInfo (FileHandle, &gEfiFileInfoGuid, &InfoSize, NULL);
+  if (Status != EFI_BUFFER_TOO_SMALL) {
+    return EFI_ERROR (Status) ? Status : EFI_DEVICE_ERROR;
+  }
+
+  FileInfo = AllocatePool (InfoSize);
+  if (FileInfo == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = FileHandle->GetInfo (FileHandle, &gEfiFileInfoGuid, &InfoSize, FileInfo);
+  if (!EFI_ERROR (Status)) {
+    *Size = FileInfo->FileSize;
+  }
+
+  FreePool (FileInfo);
+  return Status;
+}
+
+//
+// Print() of UefiLib, UTF-8 on gHostPrintFd
+//
+UINTN
+EFIAPI
+Print (
+  IN CONST CHAR16       *Format,
+  ...
+  )
+{
+  CHAR16  Buffer[HOST_PRINT_BUFFER_SIZE];
+  UINT8   Utf8[HOST_PRINT_BUFFER_SIZE * 3];
+  VA_LIST Marker;
+  UINTN   Length;
+  UINTN   Index;
+  UINTN   Pos;
+  CHAR16  Char;
+
+  VA_START (Marker, Format);
+  Length = UnicodeVSPrint (Buffer, sizeof (Buffer), Format, Marker);
+  VA_END (Marker);
+
+  Pos = 0;
+  for (Index = 0; Index < Length; Index++) {
+    Char = Buffer[Index];
+    if (Char < 0x80) {
+      Utf8[Pos++] = (UINT8)Char;
+    } else if (Char < 0x800) {
+      Utf8[Pos++] = 0xC0 | (Char >> 6);
+      Utf8[Pos++] = 0x80 | (Char & 0x3F);
+    } else {
+      Utf8[Pos++] = 0xE0 | (Char >> 12);
+      Utf8[Pos++] = 0x80 | ((Char >> 6) & 0x3F);
+      Utf8[Pos++] = 0x80 | (Char & 0x3F);
+    }
+  }
+
+  if (write (gHostPrintFd, Utf8, Pos) < 0) {
+    return 0;
+  }
+
+  return Length;
+}
+
+/**
+  strlcpy() of StdLib, which glibc only has since 2.38.
+
+**/
+size_t
+strlcpy (
+  char                  *Dst,
+  const char            *Src,
+  size_t                Size
+  )
+{
+  size_t Length;
+
+  Length = AsciiStrLen (Src);
+  if (Size != 0) {
+    Size = Length < Size ? Length : Size - 1;
+    CopyMem (Dst, Src, Size);
+    Dst[Size] = '\0';
+  }
+
+  return Length;
+}
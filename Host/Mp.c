@@ -0,0 +1,287 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Mp.c
+
+Abstract:
+
+  MP services of the harness. Every application processor is a thread
+  that only exists while it runs a procedure, and knows its processor
+  number, see HostSetCpuNumber(). Like the MP services of DXE, a periodic
+  timer event on the boot processor notices finished procedures and
+  signals their wait events. Only StartupThisAP() is implemented, which
+  is all the driver uses.
+
+Revision History
+
+--*/
+
+#include "Host.h"
+
+#include <Protocol/MpService.h>
+
+#include <pthread.h>
+
+//
+// How often finished procedures are checked for, like AP_CHECK_INTERVAL
+// of MpInitLib
+//
+#define HOST_AP_CHECK_INTERVAL  1000000   // 100 ms in 100 ns units
+
+typedef struct {
+  pthread_t             Thread;
+  UINTN                 Number;
+  BOOLEAN               Busy;
+  volatile BOOLEAN      Done;
+  EFI_AP_PROCEDURE      Procedure;
+  VOID                  *Argument;
+  EFI_EVENT             WaitEvent;
+  BOOLEAN               *Finished;
+} HOST_AP;
+
+STATIC HOST_AP    mAps[HOST_MAX_CPUS];
+STATIC UINTN      mCpuCount = 1;
+STATIC EFI_EVENT  mCheckEvent;
+
+STATIC
+VOID *
+HostApThread (
+  IN VOID               *Context
+  )
+{
+  HOST_AP *Ap;
+
+  Ap = Context;
+  HostSetCpuNumber (Ap->Number);
+
+  Ap->Procedure (Ap->Argument);
+
+  __atomic_store_n (&Ap->Done, TRUE, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/**
+  Completes the procedures that finished, on the boot processor.
+
+**/
+STATIC
+VOID
+EFIAPI
+HostCheckAps (
+  IN EFI_EVENT          Event,
+  IN VOID               *Context
+  )
+{
+  HOST_AP *Ap;
+  UINTN   Number;
+
+  for (Number = 1; Number < mCpuCount; Number++) {
+    Ap = &mAps[Number];
+    if (!Ap->Busy || !__atomic_load_n (&Ap->Done, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+
+    pthread_join (Ap->Thread, NULL);
+    Ap->Busy = FALSE;
+    if (Ap->Finished != NULL) {
+      *Ap->Finished = TRUE;
+    }
+    gBS->SignalEvent (Ap->WaitEvent);
+  }
+}
+
+EFI_STATUS
+EFIAPI
+HostGetNumberOfProcessors (
+  IN  EFI_MP_SERVICES_PROTOCOL  *This,
+  OUT UINTN                     *NumberOfProcessors,
+  OUT UINTN                     *NumberOfEnabledProcessors
+  )
+{
+  if (NumberOfProcessors == NULL || NumberOfEnabledProcessors == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *NumberOfProcessors        = mCpuCount;
+  *NumberOfEnabledProcessors = mCpuCount;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostGetProcessorInfo (
+  IN  EFI_MP_SERVICES_PROTOCOL  *This,
+  IN  UINTN                     ProcessorNumber,
+  OUT EFI_PROCESSOR_INFORMATION *ProcessorInfoBuffer
+  )
+{
+  if (ProcessorInfoBuffer == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+  if (ProcessorNumber >= mCpuCount) {
+    return EFI_NOT_FOUND;
+  }
+
+  ZeroMem (ProcessorInfoBuffer, sizeof (*ProcessorInfoBuffer));
+  ProcessorInfoBuffer->ProcessorId = ProcessorNumber;
+  ProcessorInfoBuffer->StatusFlag  = PROCESSOR_ENABLED_BIT | PROCESSOR_HEALTH_STATUS_BIT;
+  if (ProcessorNumber == 0) {
+    ProcessorInfoBuffer->StatusFlag |= PROCESSOR_AS_BSP_BIT;
+  }
+  ProcessorInfoBuffer->Location.Core = (UINT32)ProcessorNumber;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostStartupAllAPs (
+  IN  EFI_MP_SERVICES_PROTOCOL  *This,
+  IN  EFI_AP_PROCEDURE          Procedure,
+  IN  BOOLEAN                   SingleThread,
+  IN  EFI_EVENT                 WaitEvent OPTIONAL,
+  IN  UINTN                     TimeoutInMicroSeconds,
+  IN  VOID                      *ProcedureArgument OPTIONAL,
+  OUT UINTN                     **FailedCpuList OPTIONAL
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS
+EFIAPI
+HostStartupThisAP (
+  IN  EFI_MP_SERVICES_PROTOCOL  *This,
+  IN  EFI_AP_PROCEDURE          Procedure,
+  IN  UINTN                     ProcessorNumber,
+  IN  EFI_EVENT                 WaitEvent OPTIONAL,
+  IN  UINTN                     TimeoutInMicroseconds,
+  IN  VOID                      *ProcedureArgument OPTIONAL,
+  OUT BOOLEAN                   *Finished OPTIONAL
+  )
+{
+  HOST_AP *Ap;
+
+  HOST_ASSERT_BSP ();
+
+  if (Procedure == NULL || ProcessorNumber == 0) {
+    return EFI_INVALID_PARAMETER;
+  }
+  if (ProcessorNumber >= mCpuCount) {
+    return EFI_NOT_FOUND;
+  }
+  if (TimeoutInMicroseconds != 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Ap = &mAps[ProcessorNumber];
+  if (Ap->Busy) {
+    return EFI_NOT_READY;
+  }
+
+  Ap->Number    = ProcessorNumber;
+  Ap->Done      = FALSE;
+  Ap->Procedure = Procedure;
+  Ap->Argument  = ProcedureArgument;
+  Ap->WaitEvent = WaitEvent;
+  Ap->Finished  = Finished;
+  if (Finished != NULL) {
+    *Finished = FALSE;
+  }
+
+  if (pthread_create (&Ap->Thread, NULL, HostApThread, Ap) != 0) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  if (WaitEvent == NULL) {
+    pthread_join (Ap->Thread, NULL);
+    if (Finished != NULL) {
+      *Finished = TRUE;
+    }
+    return EFI_SUCCESS;
+  }
+
+  Ap->Busy = TRUE;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostSwitchBSP (
+  IN EFI_MP_SERVICES_PROTOCOL   *This,
+  IN UINTN                      ProcessorNumber,
+  IN BOOLEAN                    EnableOldBSP
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS
+EFIAPI
+HostEnableDisableAP (
+  IN EFI_MP_SERVICES_PROTOCOL   *This,
+  IN UINTN                      ProcessorNumber,
+  IN BOOLEAN                    EnableAP,
+  IN UINT32                     *HealthFlag OPTIONAL
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS
+EFIAPI
+HostWhoAmI (
+  IN  EFI_MP_SERVICES_PROTOCOL  *This,
+  OUT UINTN                     *ProcessorNumber
+  )
+{
+  if (ProcessorNumber == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *ProcessorNumber = HostCpuNumber ();
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_MP_SERVICES_PROTOCOL mMpServices = {
+  HostGetNumberOfProcessors,
+  HostGetProcessorInfo,
+  HostStartupAllAPs,
+  HostStartupThisAP,
+  HostSwitchBSP,
+  HostEnableDisableAP,
+  HostWhoAmI
+};
+
+VOID
+HostInstallMpServices (
+  IN UINTN              CpuCount
+  )
+{
+  EFI_HANDLE Handle;
+  EFI_STATUS Status;
+
+  ASSERT (CpuCount >= 1 && CpuCount <= HOST_MAX_CPUS);
+  mCpuCount = CpuCount;
+
+  if (CpuCount > 1) {
+    Status = gBS->CreateEvent (EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_NOTIFY, HostCheckAps, NULL, &mCheckEvent);
+    ASSERT_EFI_ERROR (Status);
+    Status = gBS->SetTimer (mCheckEvent, TimerPeriodic, HOST_AP_CHECK_INTERVAL);
+    ASSERT_EFI_ERROR (Status);
+  }
+
+  Handle = NULL;
+  Status = gBS->InstallProtocolInterface (&Handle, &gEfiMpServiceProtocolGuid, EFI_NATIVE_INTERFACE, &mMpServices);
+  ASSERT_EFI_ERROR (Status);
+}
@@ -0,0 +1,84 @@
+## @file
+#  Generates the LKL PCDs of the harness from LKL.dec, so their defaults
+#  are the ones the driver is built with:
+#
+#    awk -v Out=h -f Pcd.awk LKL.dec > LKLPcd.h
+#    awk -v Out=c -f Pcd.awk LKL.dec > LKLPcd.c
+#
+#  Every PCD becomes a variable the harness can set from its command line,
+#  see AutoGen.h. VOID* PCDs are strings of LKL_HOST_PCD_STRING_SIZE bytes.
+#
+#  Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+#
+#  This program and the accompanying materials are licensed and made available
+#  under the terms and conditions of the BSD License which accompanies this
+#  distribution. The full text of the license may be found at
+#  http://opensource.org/licenses/bsd-license.php
+#
+#  THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+#
+##
+
+BEGIN {
+  if (Out != "h" && Out != "c") {
+    print "Pcd.awk: set Out to h or c" > "/dev/stderr"
+    exit 1
+  }
+
+  Mode["UINT8"]   = "8"
+  Mode["UINT16"]  = "16"
+  Mode["UINT32"]  = "32"
+  Mode["UINT64"]  = "64"
+  Mode["BOOLEAN"] = "BOOL"
+  Mode["VOID*"]   = "PTR"
+
+  print "//"
+  print "// Generated from LKL.dec by Pcd.awk, don't edit"
+  print "//"
+  if (Out == "c") {
+    print "#include \"AutoGen.h\""
+  }
+  print ""
+}
+
+{
+  sub (/\r$/, "")
+}
+
+/^\[/ {
+  Section = $0
+  next
+}
+
+Section ~ /^\[Pcds/ && $1 ~ /^gLKLTokenSpaceGuid\.Pcd/ {
+  split ($1, Field, "|")
+  Name  = substr (Field[1], length ("gLKLTokenSpaceGuid.") + 1)
+  Value = Field[2]
+  Type  = Field[3]
+
+  if (!(Type in Mode)) {
+    printf "Pcd.awk: %s has unsupported type %s\n", Name, Type > "/dev/stderr"
+    exit 1
+  }
+
+  Var = "_gPcd_BinaryPatch_" Name
+  if (Type == "VOID*") {
+    if (Value !~ /^".*"$/) {
+      printf "Pcd.awk: %s is not an ASCII string\n", Name > "/dev/stderr"
+      exit 1
+    }
+    Decl = sprintf ("CHAR8   %s[LKL_HOST_PCD_STRING_SIZE]", Var)
+    Get  = sprintf ("((VOID *)%s)", Var)
+  } else {
+    Decl = sprintf ("%-7s %s", Type, Var)
+    Get  = Var
+  }
+
+  if (Out == "h") {
+    printf "extern %s;\n", Decl
+    printf "#define _PCD_GET_MODE_%s_%s  %s\n", Mode[Type], Name, Get
+  } else {
+    printf "%s = %s;\n", Decl, Value
+  }
+}
@@ -0,0 +1,158 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Synchronization.c
+
+Abstract:
+
+  SynchronizationLib on the compiler's atomic builtins. The library header
+  isn't included on purpose: EDK2 releases differ in the volatile
+  qualifiers of these prototypes, which doesn't change how they are
+  called.
+
+Revision History
+
+--*/
+
+#include <Uefi.h>
+
+typedef volatile UINTN  SPIN_LOCK;
+
+#define SPIN_LOCK_RELEASED  ((UINTN) 1)
+#define SPIN_LOCK_ACQUIRED  ((UINTN) 2)
+
+VOID
+EFIAPI
+CpuPause (
+  VOID
+  );
+
+UINTN
+EFIAPI
+GetSpinLockProperties (
+  VOID
+  )
+{
+  return 64;
+}
+
+SPIN_LOCK *
+EFIAPI
+InitializeSpinLock (
+  OUT SPIN_LOCK         *SpinLock
+  )
+{
+  __atomic_store_n (SpinLock, SPIN_LOCK_RELEASED, __ATOMIC_RELEASE);
+  return SpinLock;
+}
+
+BOOLEAN
+EFIAPI
+AcquireSpinLockOrFail (
+  IN OUT SPIN_LOCK      *SpinLock
+  )
+{
+  UINTN Expected;
+
+  Expected = SPIN_LOCK_RELEASED;
+  return __atomic_compare_exchange_n (SpinLock, &Expected, SPIN_LOCK_ACQUIRED, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+SPIN_LOCK *
+EFIAPI
+AcquireSpinLock (
+  IN OUT SPIN_LOCK      *SpinLock
+  )
+{
+  while (!AcquireSpinLockOrFail (SpinLock)) {
+    CpuPause ();
+  }
+  return SpinLock;
+}
+
+SPIN_LOCK *
+EFIAPI
+ReleaseSpinLock (
+  IN OUT SPIN_LOCK      *SpinLock
+  )
+{
+  __atomic_store_n (SpinLock, SPIN_LOCK_RELEASED, __ATOMIC_RELEASE);
+  return SpinLock;
+}
+
+UINT32
+EFIAPI
+InterlockedIncrement (
+  IN volatile UINT32    *Value
+  )
+{
+  return __atomic_add_fetch (Value, 1, __ATOMIC_SEQ_CST);
+}
+
+UINT32
+EFIAPI
+InterlockedDecrement (
+  IN volatile UINT32    *Value
+  )
+{
+  return __atomic_sub_fetch (Value, 1, __ATOMIC_SEQ_CST);
+}
+
+UINT16
+EFIAPI
+InterlockedCompareExchange16 (
+  IN OUT volatile UINT16  *Value,
+  IN     UINT16           CompareValue,
+  IN     UINT16           ExchangeValue
+  )
+{
+  __atomic_compare_exchange_n (Value, &CompareValue, ExchangeValue, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return CompareValue;
+}
+
+UINT32
+EFIAPI
+InterlockedCompareExchange32 (
+  IN OUT volatile UINT32  *Value,
+  IN     UINT32           CompareValue,
+  IN     UINT32           ExchangeValue
+  )
+{
+  __atomic_compare_exchange_n (Value, &CompareValue, ExchangeValue, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return CompareValue;
+}
+
+UINT64
+EFIAPI
+InterlockedCompareExchange64 (
+  IN OUT volatile UINT64  *Value,
+  IN     UINT64           CompareValue,
+  IN     UINT64           ExchangeValue
+  )
+{
+  __atomic_compare_exchange_n (Value, &CompareValue, ExchangeValue, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return CompareValue;
+}
+
+VOID *
+EFIAPI
+InterlockedCompareExchangePointer (
+  IN OUT VOID * volatile  *Value,
+  IN     VOID             *CompareValue,
+  IN     VOID             *ExchangeValue
+  )
+{
+  __atomic_compare_exchange_n (Value, &CompareValue, ExchangeValue, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return CompareValue;
+}
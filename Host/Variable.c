@@ -0,0 +1,172 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Variable.c
+
+Abstract:
+
+  Variable services of the harness. Every variable is volatile, a run
+  starts without any.
+
+Revision History
+
+--*/
+
+#include "Host.h"
+
+typedef struct {
+  LIST_ENTRY            Link;
+  EFI_GUID              Guid;
+  CHAR16                *Name;
+  UINT32                Attributes;
+  UINTN                 DataSize;
+  VOID                  *Data;
+} HOST_VARIABLE;
+
+STATIC LIST_ENTRY mVariables = INITIALIZE_LIST_HEAD_VARIABLE (mVariables);
+
+STATIC
+HOST_VARIABLE *
+HostFindVariable (
+  IN CHAR16             *VariableName,
+  IN EFI_GUID           *VendorGuid
+  )
+{
+  LIST_ENTRY    *Link;
+  HOST_VARIABLE *Variable;
+
+  for (Link = GetFirstNode (&mVariables); !IsNull (&mVariables, Link); Link = GetNextNode (&mVariables, Link)) {
+    Variable = BASE_CR (Link, HOST_VARIABLE, Link);
+    if (CompareGuid (&Variable->Guid, VendorGuid) && StrCmp (Variable->Name, VariableName) == 0) {
+      return Variable;
+    }
+  }
+
+  return NULL;
+}
+
+STATIC
+VOID
+HostFreeVariable (
+  IN HOST_VARIABLE      *Variable
+  )
+{
+  RemoveEntryList (&Variable->Link);
+  FreePool (Variable->Name);
+  FreePool (Variable->Data);
+  FreePool (Variable);
+}
+
+EFI_STATUS
+EFIAPI
+HostGetVariable (
+  IN     CHAR16         *VariableName,
+  IN     EFI_GUID       *VendorGuid,
+  OUT    UINT32         *Attributes OPTIONAL,
+  IN OUT UINTN          *DataSize,
+  OUT    VOID           *Data OPTIONAL
+  )
+{
+  HOST_VARIABLE *Variable;
+
+  HOST_ASSERT_BSP ();
+
+  if (VariableName == NULL || VendorGuid == NULL || DataSize == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Variable = HostFindVariable (VariableName, VendorGuid);
+  if (Variable == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  if (*DataSize < Variable->DataSize) {
+    *DataSize = Variable->DataSize;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+  if (Data == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  CopyMem (Data, Variable->Data, Variable->DataSize);
+  *DataSize = Variable->DataSize;
+  if (Attributes != NULL) {
+    *Attributes = Variable->Attributes;
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostSetVariable (
+  IN CHAR16             *VariableName,
+  IN EFI_GUID           *VendorGuid,
+  IN UINT32             Attributes,
+  IN UINTN              DataSize,
+  IN VOID               *Data
+  )
+{
+  HOST_VARIABLE *Variable;
+
+  HOST_ASSERT_BSP ();
+
+  if (VariableName == NULL || VariableName[0] == L'\0' || VendorGuid == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+  if (DataSize != 0 && Data == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Variable = HostFindVariable (VariableName, VendorGuid);
+
+  //
+  // No data or no attributes deletes the variable
+  //
+  if (DataSize == 0 || Attributes == 0) {
+    if (Variable == NULL) {
+      return EFI_NOT_FOUND;
+    }
+    HostFreeVariable (Variable);
+    return EFI_SUCCESS;
+  }
+
+  if (Variable == NULL) {
+    Variable = AllocateZeroPool (sizeof (*Variable));
+    if (Variable == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    Variable->Name = AllocateCopyPool (StrSize (VariableName), VariableName);
+    if (Variable->Name == NULL) {
+      FreePool (Variable);
+      return EFI_OUT_OF_RESOURCES;
+    }
+    CopyGuid (&Variable->Guid, VendorGuid);
+    InsertTailList (&mVariables, &Variable->Link);
+  } else {
+    FreePool (Variable->Data);
+  }
+
+  Variable->Attributes = Attributes;
+  Variable->DataSize   = DataSize;
+  Variable->Data       = AllocateCopyPool (DataSize, Data);
+  if (Variable->Data == NULL) {
+    FreePool (Variable->Name);
+    RemoveEntryList (&Variable->Link);
+    FreePool (Variable);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  return EFI_SUCCESS;
+}
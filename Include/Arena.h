@@ -0,0 +1,45 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+//
+// Size classes of the arena slabs, from 32 bytes to 4KiB including the
+// allocation header. Anything larger gets its own page run.
+//
+#define LKL_ARENA_MIN_SHIFT     5
+#define LKL_ARENA_MAX_SHIFT     12
+#define LKL_ARENA_CLASSES       (LKL_ARENA_MAX_SHIFT - LKL_ARENA_MIN_SHIFT + 1)
+
+typedef struct {
+  UINT64        ReservedBytes;      // page runs reserved for slabs
+  UINT64        SlabBytes;          // part of the reserved runs carved into slabs
+  UINT64        LargeBytes;         // page runs of large allocations
+  UINT64        InUseBytes;         // requested bytes currently allocated
+  UINT64        PeakInUseBytes;
+  UINT64        Allocations;
+  UINT64        Frees;
+  UINT64        DelayedFrees;
+  UINT64        ClassInUse[LKL_ARENA_CLASSES];
+  UINT64        ClassFree[LKL_ARENA_CLASSES];
+} LKL_ARENA_STATS;
+
+VOID *
+LKLArenaAllocate (
+  IN UINTN      Size
+  );
+
+VOID
+LKLArenaFree (
+  IN VOID       *Buffer
+  );
+
+VOID
+LKLArenaFreeDelayed (
+  IN VOID       *Buffer
+  );
+
+VOID
+LKLArenaGetStats (
+  OUT LKL_ARENA_STATS *Stats
+  );
+
+#endif
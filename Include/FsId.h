@@ -12,6 +12,7 @@ typedef struct
 
 typedef struct {
   CONST CHAR8 *Name;
+  BOOLEAN     Foreign;  // handled by another driver, never mounted
   FS_IDMAG    Magics[];
 } FS_IDINFO;
 
@@ -19,7 +20,15 @@ EFI_STATUS
 GetFsType (
   IN  EFI_DISK_IO_PROTOCOL      *DiskIo,
   IN  UINT32                    MediaId,
-  OUT CONST CHAR8               **OutName
+  OUT CONST CHAR8               **OutName,
+  OUT UINT32                    *Fingerprint OPTIONAL
+  );
+
+EFI_STATUS
+GetFsFingerprint (
+  IN  EFI_DISK_IO_PROTOCOL      *DiskIo,
+  IN  UINT32                    MediaId,
+  OUT UINT32                    *Fingerprint
   );
 
 EFI_STATUS
@@ -31,5 +40,11 @@ GetFsTypeLKL (
 extern CONST FS_IDINFO IdInfoExt;
 extern CONST FS_IDINFO IdInfoNTFS;
 extern CONST FS_IDINFO IdInfoF2FS;
+extern CONST FS_IDINFO IdInfoEROFS;
+extern CONST FS_IDINFO IdInfoSquashFS;
+extern CONST FS_IDINFO IdInfoVFAT;
+extern CONST FS_IDINFO IdInfoExFAT;
+extern CONST FS_IDINFO IdInfoBtrfs;
+extern CONST FS_IDINFO IdInfoXFS;
 
 #endif
@@ -0,0 +1,198 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  LKLStats.h
+
+Abstract:
+
+  I/O statistics of an LKL volume. The protocol is installed on the same
+  handle as its simple filesystem protocol.
+
+  If the driver was built with a block trace ring, ReadTrace() returns the
+  latest block requests in the binary format below: an LKL_TRACE_HEADER
+  followed by Count records, oldest first. Files written by LKLStat -t
+  have the same layout and are replayed by LKLBench -R.
+
+  GetThreadProfile() isn't about the volume. It returns the driver's thread
+  profile if it was built with PcdLKLProfile, every instance the same.
+
+--*/
+
+#ifndef _LKL_STATS_H_
+#define _LKL_STATS_H_
+
+#define LKL_STATS_PROTOCOL_GUID \
+  { 0x5e1f3a47, 0x9b2c, 0x4d8e, { 0xa6, 0x13, 0x7c, 0x42, 0xe9, 0x0b, 0x58, 0xd1 } }
+
+#define LKL_STATS_PROTOCOL_REVISION  0x00010000
+
+//
+// Latency histogram buckets. Bucket 0 counts operations that took less than
+// 1024ns, bucket n the ones that took [2^(n+9), 2^(n+10)) ns, so roughly
+// 2^(n-1) microseconds and more. The last bucket takes everything above.
+//
+#define LKL_STATS_BUCKETS            32
+
+//
+// Block trace format, all fields little endian
+//
+#define LKL_TRACE_MAGIC              SIGNATURE_32 ('L', 'K', 'T', 'R')
+#define LKL_TRACE_VERSION            1
+
+#define LKL_TRACE_READ               0
+#define LKL_TRACE_WRITE              1
+#define LKL_TRACE_FLUSH              2
+
+typedef struct {
+  UINT32                Magic;
+  UINT16                Version;
+  UINT16                RecordSize;   // sizeof (LKL_TRACE_RECORD)
+  UINT32                Count;        // records following the header
+  UINT32                Reserved;
+  UINT64                Total;        // requests seen, Total - Count were dropped
+} LKL_TRACE_HEADER;
+
+typedef struct {
+  UINT64                TimeNs;       // start, relative to when the volume was set up
+  UINT64                Sector;       // 512 byte sectors
+  UINT32                Length;       // bytes
+  UINT32                LatencyNs;    // saturates at MAX_UINT32
+  UINT16                Iovecs;
+  UINT8                 Type;         // LKL_TRACE_*
+  UINT8                 Reserved[5];
+} LKL_TRACE_RECORD;
+
+//
+// Time spent in the threads of the driver, accounted by thread name
+//
+typedef struct {
+  CHAR8                 Name[32];
+  UINT64                RuntimeUs;
+  UINT64                Samples;      // scheduler ticks that found it running
+  UINT64                Switches;     // times it was switched to
+} LKL_THREAD_PROFILE;
+
+typedef struct _LKL_STATS_PROTOCOL LKL_STATS_PROTOCOL;
+
+typedef enum {
+  LklStatsBlockRead,      // read request of the LKL block device
+  LklStatsBlockWrite,     // write request of the LKL block device
+  LklStatsBlockFlush,     // FlushBlocks() on behalf of the block device
+  LklStatsOpen,           // EFI_FILE_PROTOCOL.Open()
+  LklStatsRead,           // EFI_FILE_PROTOCOL.Read() of a file
+  LklStatsReadDir,        // EFI_FILE_PROTOCOL.Read() of a directory
+  LklStatsWrite,          // EFI_FILE_PROTOCOL.Write()
+  LklStatsOpMax
+} LKL_STATS_OP;
+
+typedef struct {
+  UINT64                Count;
+  UINT64                Bytes;
+  UINT64                TotalNs;
+  UINT32                Histogram[LKL_STATS_BUCKETS];
+} LKL_STATS_COUNTERS;
+
+typedef struct {
+  LKL_STATS_COUNTERS    Ops[LklStatsOpMax];
+
+  //
+  // iovecs of block requests transferred together with the one before
+  // them, in one disk access
+  //
+  UINT64                MergedIovecs;
+} LKL_STATS;
+
+/**
+  Take a snapshot of the statistics.
+
+  @param  This                  The protocol instance.
+  @param  Stats                 Receives the statistics.
+
+  @retval EFI_SUCCESS           The statistics were copied.
+
+**/
+typedef
+EFI_STATUS
+(EFIAPI *LKL_STATS_GET)(
+  IN  LKL_STATS_PROTOCOL        *This,
+  OUT LKL_STATS                 *Stats
+  );
+
+/**
+  Set all counters back to zero.
+
+  @param  This                  The protocol instance.
+
+  @retval EFI_SUCCESS           The statistics were reset.
+
+**/
+typedef
+EFI_STATUS
+(EFIAPI *LKL_STATS_RESET)(
+  IN  LKL_STATS_PROTOCOL        *This
+  );
+
+/**
+  Copy the block trace ring.
+
+  @param  This                  The protocol instance.
+  @param  BufferSize            On input the size of Buffer, on output the
+                                size of the trace.
+  @param  Buffer                Receives an LKL_TRACE_HEADER and the records.
+
+  @retval EFI_SUCCESS           The trace was copied.
+  @retval EFI_BUFFER_TOO_SMALL  BufferSize is too small, it was updated.
+  @retval EFI_UNSUPPORTED       Block requests aren't traced.
+
+**/
+typedef
+EFI_STATUS
+(EFIAPI *LKL_STATS_READ_TRACE)(
+  IN     LKL_STATS_PROTOCOL     *This,
+  IN OUT UINTN                  *BufferSize,
+  OUT    VOID                   *Buffer
+  );
+
+/**
+  Copy the thread profile.
+
+  @param  This                  The protocol instance.
+  @param  Count                 On input the number of entries Profile has
+                                room for, on output the number of threads.
+  @param  Profile               Receives the entries.
+
+  @retval EFI_SUCCESS           The profile was copied.
+  @retval EFI_BUFFER_TOO_SMALL  Count is too small, it was updated.
+  @retval EFI_UNSUPPORTED       The driver wasn't built with the profiler.
+
+**/
+typedef
+EFI_STATUS
+(EFIAPI *LKL_STATS_GET_THREAD_PROFILE)(
+  IN     LKL_STATS_PROTOCOL     *This,
+  IN OUT UINTN                  *Count,
+  OUT    LKL_THREAD_PROFILE     *Profile
+  );
+
+struct _LKL_STATS_PROTOCOL {
+  UINT64                Revision;
+  LKL_STATS_GET         GetStats;
+  LKL_STATS_RESET       ResetStats;
+  LKL_STATS_READ_TRACE  ReadTrace;
+  LKL_STATS_GET_THREAD_PROFILE GetThreadProfile;
+};
+
+extern EFI_GUID gLKLStatsProtocolGuid;
+
+#endif
@@ -23,29 +23,68 @@
 #pragma once
 
 #include <Protocol/Cpu.h>
+#include <lk/arch/arch_thread.h>
+#include <lk/platform/timer.h>
 
 __BEGIN_CDECLS;
 
-extern int ints_enabled;
+/*
+ * The boot cpu uses the interrupt state of the CPU arch protocol. The
+ * application processors never take interrupts, their state is only kept
+ * so a saved state stays meaningful when a thread moves between cpus.
+ */
+extern int ints_enabled[SMP_MAX_CPUS];
 extern int fiqs_enabled;
 extern EFI_CPU_ARCH_PROTOCOL *gCpu;
 
+/* number of cpus running LK threads, 1 until the APs are started */
+extern volatile uint arch_cpu_count;
+uint platform_curr_cpu_num(void);
+
+static inline uint arch_curr_cpu_num(void) {
+#if WITH_SMP
+    if (arch_cpu_count > 1)
+        return platform_curr_cpu_num();
+#endif
+    return 0;
+}
+
+/*
+ * Interrupts come back on when the outermost irqsave lock is released, so
+ * this is where a timer deadline recorded under the lock is programmed.
+ */
 static inline void arch_enable_ints(void)
 {
-    //ints_enabled = 1;
-    gCpu->EnableInterrupt(gCpu);
+    uint cpu = arch_curr_cpu_num();
+
+    if (cpu) {
+        ints_enabled[cpu] = 1;
+    } else {
+        gCpu->EnableInterrupt(gCpu);
+#if PLATFORM_HAS_DYNAMIC_TIMER
+        platform_timer_flush();
+#endif
+    }
 }
 
 static inline void arch_disable_ints(void)
 {
-    //ints_enabled = 0;
-    gCpu->DisableInterrupt(gCpu);
+    uint cpu = arch_curr_cpu_num();
+
+    if (cpu)
+        ints_enabled[cpu] = 0;
+    else
+        gCpu->DisableInterrupt(gCpu);
 }
 
 static inline bool arch_ints_disabled(void)
 {
-    //return !ints_enabled;
+    uint cpu = arch_curr_cpu_num();
     BOOLEAN state = TRUE;
+
+    if (cpu)
+        return !ints_enabled[cpu];
+
     gCpu->GetInterruptState(gCpu, &state);
     return !state;
 }
@@ -65,21 +104,17 @@ static inline bool arch_fiqs_disabled(void)
     return !fiqs_enabled;
 }
 
-static inline uint arch_curr_cpu_num(void) {
-    return 0;
-}
-
-/* use a global pointer to store the current_thread */
-extern struct thread *_current_thread;
+/* the current thread of every cpu */
+extern struct thread *_current_thread[SMP_MAX_CPUS];
 
 static inline struct thread *get_current_thread(void)
 {
-    return _current_thread;
+    return _current_thread[arch_curr_cpu_num()];
 }
 
 static inline void set_current_thread(struct thread *t)
 {
-    _current_thread = t;
+    _current_thread[arch_curr_cpu_num()] = t;
 }
 
 
@@ -23,14 +23,51 @@
 #ifndef __LK_ARCH_ARCHTHREAD_H
 #define __LK_ARCH_ARCHTHREAD_H
 
-#include <ucontext.h>
+#include <lk/sys/types.h>
 
 #define ARCH_DEFAULT_STACK_SIZE 4096
-#define SMP_MAX_CPUS 1
+#define SMP_MAX_CPUS 8
+
+/*
+ * What lk_context_switch() leaves on the stack of a thread that is
+ * switched out, lowest address first. A new thread starts with one of
+ * these at the top of its stack, returning into initial_thread_func().
+ */
+#if defined(__arm__)
+struct context_switch_frame {
+    uint64_t d[8];          /* d8-d15 */
+    uint32_t r[9];          /* r4-r12 */
+    uint32_t lr;
+};
+#elif defined(__aarch64__)
+struct context_switch_frame {
+    uint64_t r[10];         /* x19-x28 */
+    uint64_t fp;
+    uint64_t lr;
+    uint64_t d[8];          /* d8-d15 */
+};
+#elif defined(__x86_64__)
+struct context_switch_frame {
+    uint32_t mxcsr;
+    uint16_t fcw;
+    uint16_t pad;
+    uint64_t r15, r14, r13, r12, rbx, rbp;
+    uint64_t rip;
+};
+#else
+#error "no context switch for this architecture"
+#endif
 
 struct arch_thread {
-    ucontext_t context;
+    addr_t sp;
 };
 
+#if defined(__x86_64__)
+/* the assembly takes its arguments in rdi and rsi whatever ABI C is built for */
+void lk_context_switch(addr_t *old_sp, addr_t new_sp) __attribute__((sysv_abi));
+#else
+void lk_context_switch(addr_t *old_sp, addr_t new_sp);
+#endif
+
 #endif
 
@@ -26,6 +26,8 @@
 #include <lk/arch/ops.h>
 #include <stdbool.h>
 
+#include <Library/BaseLib.h>
+
 __BEGIN_CDECLS;
 
 #define SPIN_LOCK_INITIAL_VALUE (0)
@@ -47,9 +49,27 @@ static inline bool arch_spin_lock_held(spin_lock_t *lock)
 
 #if WITH_SMP
 
-void arch_spin_lock(spin_lock_t *lock);
-int arch_spin_trylock(spin_lock_t *lock);
-void arch_spin_unlock(spin_lock_t *lock);
+/*
+ * Test and test-and-set: waiters spin on a plain load, so they don't keep
+ * pulling the cache line away from the owner.
+ */
+static inline void arch_spin_lock(spin_lock_t *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            CpuPause();
+    }
+}
+
+static inline int arch_spin_trylock(spin_lock_t *lock)
+{
+    return (int)__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void arch_spin_unlock(spin_lock_t *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
 
 #else
 
@@ -44,11 +44,12 @@ typedef enum {
     MP_IPI_RESCHEDULE,
 } mp_ipi_t;
 
-#ifdef WITH_SMP
+#if WITH_SMP
 void mp_init(void);
 
 void mp_reschedule(mp_cpu_mask_t target, uint flags);
 void mp_set_curr_cpu_active(bool active);
+void mp_set_cpu_active(uint cpu, bool active);
 
 /* called from arch code during reschedule irq */
 enum handler_return mp_mbx_reschedule_irq(void);
@@ -108,6 +109,7 @@ static inline mp_cpu_mask_t mp_get_realtime_mask(void)
 static inline void mp_init(void) {}
 static inline void mp_reschedule(mp_cpu_mask_t target, uint flags) {}
 static inline void mp_set_curr_cpu_active(bool active) {}
+static inline void mp_set_cpu_active(uint cpu, bool active) {}
 
 static inline enum handler_return mp_mbx_reschedule_irq(void) { return 0; }
 
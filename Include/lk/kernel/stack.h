@@ -0,0 +1,42 @@
+#pragma once
+
+#include <lk/compiler.h>
+#include <lk/sys/types.h>
+#include <stddef.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Thread stack pool
+ *
+ * Stacks are handed out in power of two size classes and are recycled
+ * through a per-class free list when their thread dies, so spawning a
+ * thread normally doesn't have to go to the heap at all.
+ */
+#define THREAD_STACK_POOL_MIN_SHIFT 14 /* 16KiB */
+#define THREAD_STACK_POOL_MAX_SHIFT 21 /* 2MiB */
+#define THREAD_STACK_POOL_CLASSES   (THREAD_STACK_POOL_MAX_SHIFT - THREAD_STACK_POOL_MIN_SHIFT + 1)
+
+struct thread_stack_class_stats {
+    size_t size;
+    uint live;      /* stacks owned by a thread */
+    uint cached;    /* stacks sitting on the free list */
+    uint allocs;    /* stacks taken from the heap */
+    uint reuses;    /* stacks taken from the free list */
+    size_t peak_used; /* highest stack usage seen, needs THREAD_STACK_HIGHWATER */
+};
+
+/* size is rounded up to the class size and updated */
+void *thread_stack_alloc(size_t *size);
+
+/* must be called with the thread lock held, the stack may still be in use
+ * by the current thread until it switches away */
+void thread_stack_free(void *stack, size_t size, size_t used);
+
+/* give all cached stacks back to the heap */
+void thread_stack_trim(void);
+
+void thread_stack_get_stats(struct thread_stack_class_stats stats[THREAD_STACK_POOL_CLASSES]);
+void thread_stack_dump(void);
+
+__END_CDECLS;
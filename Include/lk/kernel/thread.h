@@ -49,6 +49,11 @@ __BEGIN_CDECLS;
 #endif
 #endif
 
+/* per thread accounting for the host's sampling profiler */
+#ifndef THREAD_PROFILE
+#define THREAD_PROFILE 1
+#endif
+
 enum thread_state {
     THREAD_SUSPENDED = 0,
     THREAD_READY,
@@ -92,12 +97,13 @@ typedef struct thread {
     unsigned int flags;
 #if WITH_SMP
     int curr_cpu;
+    int last_cpu; /* where it ran last, preferred for its next run */
     int pinned_cpu; /* only run on pinned_cpu if >= 0 */
 #endif
 #if WITH_KERNEL_VM
     vmm_aspace_t *aspace;
 #endif
-    int errno;
+    int saved_errno; /* errno while switched out, errno may be a macro */
 
     /* if blocked, a pointer to the wait queue */
     struct wait_queue *blocking_wait_queue;
@@ -122,6 +128,11 @@ typedef struct thread {
     uintptr_t tls[MAX_TLS_ENTRY];
 
     char name[32];
+
+#if THREAD_PROFILE
+    /* owned by the platform, see platform_thread_switch() */
+    void *profile;
+#endif
 } thread_t;
 
 #if WITH_SMP
@@ -159,7 +170,9 @@ void thread_init(void);
 void thread_become_idle(void) __NO_RETURN;
 void thread_create_idle(void);
 void thread_secondary_cpu_init_early(void);
-void thread_secondary_cpu_entry(void) __NO_RETURN;
+void thread_secondary_cpu_entry(void);
+void thread_secondary_cpu_stop(uint cpu);
+bool thread_cpu_has_work(uint cpu);
 void thread_set_name(const char *name);
 void thread_set_priority(int priority);
 thread_t *thread_create(const char *name, thread_start_routine entry, void *arg, int priority, size_t stack_size);
@@ -175,6 +188,7 @@ status_t thread_set_real_time(thread_t *t);
 void dump_thread(thread_t *t);
 void arch_dump_thread(thread_t *t);
 void dump_all_threads(void);
+size_t thread_stack_used(thread_t *t);
 
 /* scheduler routines */
 void thread_yield(void); /* give up the cpu voluntarily */
@@ -223,6 +237,17 @@ static inline __ALWAYS_INLINE uintptr_t __tls_set(uint entry, uintptr_t val)
         __tls_set(e, v); \
     })
 
+#if THREAD_PROFILE
+/* called by the scheduler right before it switches threads, with the
+ * thread lock held */
+void platform_thread_switch(thread_t *oldthread, thread_t *newthread);
+#endif
+
+#if WITH_SMP
+/* called by the idle loop of the boot cpu while the other cpus are up */
+void platform_idle(void);
+#endif
+
 /* thread level statistics */
 #if THREAD_STATS
 struct thread_stats {
@@ -238,6 +263,7 @@ struct thread_stats {
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong steals; /* threads taken from another cpu's run queue */
 #endif
 };
 
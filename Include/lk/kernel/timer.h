@@ -61,7 +61,8 @@ typedef struct timer {
  * - Timer callbacks occur from interrupt context
  * - Timers may be programmed or canceled from interrupt or thread context
  * - Timers may be canceled or reprogrammed from within their callback
- * - Timers currently are dispatched from a 10ms periodic tick
+ * - Timers are dispatched from a single one-shot platform timer that is
+ *   always programmed for the earliest deadline in the queue
 */
 void timer_initialize(lk_timer_t *);
 void timer_set_oneshot(lk_timer_t *, lk_time_t delay, timer_callback, void *arg);
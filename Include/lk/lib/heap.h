@@ -37,6 +37,10 @@ void free(void *ptr);
 
 void heap_init(void);
 
+/* allocation routines backed by the host arena */
+void *heap_alloc(size_t size, unsigned int alignment) __MALLOC;
+void heap_free(void *ptr);
+
 /* critical section time delayed free */
 void heap_delayed_free(void *);
 
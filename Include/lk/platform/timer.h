@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2008 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __LK_PLATFORM_TIMER_H
+#define __LK_PLATFORM_TIMER_H
+
+#include <lk/compiler.h>
+#include <lk/sys/types.h>
+
+__BEGIN_CDECLS;
+
+/* implemented by the host (UefiHost.c) */
+lk_time_t current_time(void);
+lk_bigtime_t current_time_hires(void);
+
+typedef enum handler_return (*platform_timer_callback)(void *arg, lk_time_t now);
+
+status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg, lk_time_t interval);
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/*
+ * These two are called with the timer or thread lock held, so they only
+ * record the new deadline. platform_timer_flush() hands it to the firmware
+ * and must be called without any spinlock held.
+ */
+status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval);
+void     platform_stop_timer(void);
+void     platform_timer_flush(void);
+#endif
+
+__END_CDECLS;
+
+#endif
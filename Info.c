@@ -86,7 +86,7 @@ LKLGetFileInfo (
   if ((IFile->LinuxOpenFlags&LKL_O_RDONLY)==0)
     FileInfo->Attribute |= EFI_FILE_READ_ONLY;
 
-  if (LKL_S_ISDIR(IFile->StatBuf.st_mode))
+  if (LKL_S_ISDIR(IFile->Mode))
     FileInfo->Attribute |= EFI_FILE_DIRECTORY;
 
   return EFI_SUCCESS;
@@ -384,6 +384,8 @@ LKLSetFileInfo (
     if (RC) {
       return LKLError2EfiError(RC);
     }
+
+    IFile->Dirty = TRUE;
   }
 
   return EFI_SUCCESS;
@@ -414,6 +416,11 @@ LKLSetOrGetInfo (
       Status = Volume->ReadOnly ? EFI_WRITE_PROTECTED : LKLSetFileInfo (Volume, IFile, *BufferSize, Buffer);
     }
 
+    //
+    // Renames and attribute changes invalidate earlier lookups
+    //
+    LKLLookupCacheFlush (&Volume->LookupCache);
+
 #if 0
     if (CompareGuid (Type, &gEfiFileSystemInfoGuid)) {
       Status = Volume->ReadOnly ? EFI_WRITE_PROTECTED : LKLSetVolumeInfo (Volume, *BufferSize, Buffer);
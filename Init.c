@@ -22,6 +22,7 @@ Abstract:
 --*/
 
 #include "LKL.h"
+#include <lk/kernel/thread.h>
 #include <stdio.h>
 
 STATIC
@@ -91,101 +92,142 @@ LKLGetKeyLocation (
   return EFI_SUCCESS;
 }
 
+//
+// MountState of a volume mounted in the background
+//
+#define LKL_MOUNT_RUNNING   0
+#define LKL_MOUNT_DONE      1
+#define LKL_MOUNT_SIGNALED  2
+
+//
+// Background mounts of unencrypted volumes that aren't installed yet. The
+// key of an encrypted volume lives on one of them.
+//
+STATIC volatile UINT32  mPlainMountsPending;
+
+//
+// Set at ExitBootServices. Mounts still running then are left alone, their
+// threads never signal the mount event again.
+//
+STATIC volatile BOOLEAN mMountsAbandoned;
+
+/**
+  Undo everything LKLMountVolume did in LKL.
+
+  @param  Volume                The volume to release.
+
+**/
+STATIC
+VOID
+LKLReleaseDisk (
+  IN LKL_VOLUME *Volume
+  )
+{
+  if (Volume->LKLMountPoint[0])
+    lkl_sys_umount(Volume->LKLMountPoint, 0);
+
+  if (Volume->IsEncrypted) {
+    if (Volume->LKLCryptFSName[0])
+      cryptfs_revert_ext_volume(Volume->LKLCryptFSName);
+
+    if (Volume->LKLBlkDevice[0])
+      lkl_sys_unlink(Volume->LKLBlkDevice);
+  }
+
+  if (Volume->LKLDiskId >= 0)
+      lkl_disk_remove(Volume->LKLDisk);
+}
+
+/**
+  Probe, register and mount the disk of a volume. This is the slow part of
+  bringing up a volume and may run on a thread of its own.
+
+  @param  Volume                The volume to mount.
+
+  @retval EFI_SUCCESS           The volume is mounted at Volume->LKLMountPoint.
+  @retval EFI_NOT_READY         The key of an encrypted volume wasn't found.
+  @retval EFI_UNSUPPORTED       There's no filesystem LKL can mount.
+  @return others                Registering or mounting the disk failed.
+
+**/
+STATIC
 EFI_STATUS
-LKLAllocateVolume (
-  IN  EFI_HANDLE                Handle,
-  IN  EFI_DISK_IO_PROTOCOL      *DiskIo,
-  IN  EFI_DISK_IO2_PROTOCOL     *DiskIo2,
-  IN  EFI_BLOCK_IO_PROTOCOL     *BlockIo
+LKLMountVolume (
+  IN LKL_VOLUME *Volume
   )
 {
   EFI_STATUS  Status;
-  LKL_VOLUME  *Volume = NULL;
   INTN        Ret;
   CONST CHAR8 *FsType;
-  BOOLEAN     IsEncrypted = FALSE;
+  UINT32      Fingerprint;
   CHAR16            KeyLocation[100];
   EFI_FILE_PROTOCOL *KeyFile = NULL;
-  UINT64            KeyFileSize;
+  UINT64            KeyFileSize = 0;
   UINT8             *Key = NULL;
-  EFI_PARTITION_NAME_PROTOCOL *PartitionName;
+  UINTN             MountFlags;
 
-  PartitionName = NULL;
-  Status = gBS->HandleProtocol (
-                  Handle,
-                  &gEfiPartitionNameProtocolGuid,
-                  (VOID **)&PartitionName
-                  );
-  if (!EFI_ERROR (Status)) {
-    if (!StrCmp(PartitionName->Name, L"android_expand")) {
-      IsEncrypted = TRUE;
+  FsType     = NULL;
+  MountFlags = Volume->SyncMount ? LKL_MS_SYNCHRONOUS|LKL_MS_DIRSYNC : 0;
 
-      // build path for key file
-      Status = LKLGetKeyLocation(Handle, KeyLocation, sizeof(KeyLocation));
-      if (EFI_ERROR(Status)) {
-        return Status;
-      }
+  if (Volume->IsEncrypted) {
+    // build path for key file
+    Status = LKLGetKeyLocation(Volume->Handle, KeyLocation, sizeof(KeyLocation));
+    if (EFI_ERROR(Status)) {
+      return Status;
+    }
 
-      // search existing partitions for key file
-      Status = GetFileFromAnyPartition(KeyLocation, &KeyFile);
-      if (EFI_ERROR(Status)) {
-        return EFI_NOT_READY;
-      }
+    // let the other partitions come up first, one of them holds the key
+    while (mPlainMountsPending != 0) {
+      thread_sleep(10);
+    }
 
-      // get key file size
-      Status = FileHandleGetSize(KeyFile, &KeyFileSize);
-      if (EFI_ERROR(Status)) {
-        return Status;
-      }
+    // search existing partitions for key file
+    Status = GetFileFromAnyPartition(KeyLocation, &KeyFile);
+    if (EFI_ERROR(Status)) {
+      return EFI_NOT_READY;
+    }
 
-      // allocate data for key
-      Key = AllocatePool(KeyFileSize);
-      if (Key == NULL) {
-        return EFI_OUT_OF_RESOURCES;
-      }
+    // get key file size
+    Status = FileHandleGetSize(KeyFile, &KeyFileSize);
+    if (EFI_ERROR(Status)) {
+      goto Done;
+    }
 
-      // read key
-      UINTN BufferSize = KeyFileSize;
-      Status = KeyFile->Read(KeyFile, &BufferSize, Key);
-      if (EFI_ERROR(Status)) {
-        goto Done;
-      }
+    // allocate data for key
+    Key = AllocatePool(KeyFileSize);
+    if (Key == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      goto Done;
+    }
+
+    // read key
+    UINTN BufferSize = KeyFileSize;
+    Status = KeyFile->Read(KeyFile, &BufferSize, Key);
+    if (EFI_ERROR(Status)) {
+      goto Done;
     }
   }
 
-  if (IsEncrypted==FALSE) {
-    Status = GetFsType (DiskIo, BlockIo->Media->MediaId, &FsType);
+  else {
+    Status = GetFsType (Volume->DiskIo, Volume->MediaId, &FsType, &Fingerprint);
     if (EFI_ERROR(Status)) {
+      // raw or foreign, don't probe it again on the next connect
+      if (Status == EFI_NOT_FOUND || Status == EFI_UNSUPPORTED) {
+        Volume->Unmountable = TRUE;
+        Volume->Fingerprint = Fingerprint;
+      }
       return EFI_UNSUPPORTED;
     }
+    Volume->FsType = FsType;
   }
 
-  //
-  // Allocate a volume structure
-  //
-  Volume = AllocateZeroPool (sizeof (LKL_VOLUME));
-  if (Volume == NULL) {
-    return EFI_OUT_OF_RESOURCES;
+  // there's something to mount, the kernel is needed now
+  Status = LKLStartKernel ();
+  if (EFI_ERROR(Status)) {
+    goto Done;
   }
 
-  //
-  // Initialize the structure
-  //
-  Volume->Signature                   = LKL_VOLUME_SIGNATURE;
-  Volume->Handle                      = Handle;
-  Volume->DiskIo                      = DiskIo;
-  Volume->DiskIo2                     = DiskIo2;
-  Volume->BlockIo                     = BlockIo;
-  Volume->MediaId                     = BlockIo->Media->MediaId;
-  Volume->ReadOnly                    = BlockIo->Media->ReadOnly;
-  Volume->VolumeInterface.Revision    = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_REVISION;
-  Volume->LKLDisk.handle              = Volume;
-  Volume->VolumeInterface.OpenVolume  = LKLOpenVolume;
-  Volume->FsType                      = FsType;
-  Volume->IsEncrypted                 = IsEncrypted;
-
   // register disk
-  Volume->LKLDiskId = -1;
   Ret = lkl_disk_add(&Volume->LKLDisk);
   if (Ret < 0) {
     DEBUG((EFI_D_ERROR, "can't add disk: %a\n", lkl_strerror(Ret)));
@@ -229,6 +271,7 @@ LKLAllocateVolume (
     if (EFI_ERROR(Status)) {
       goto Done;
     }
+    Volume->FsType = FsType;
 
     // build path to mount point
     AsciiSPrint(Volume->LKLMountPoint, sizeof(Volume->LKLMountPoint), "/mnt/%08x", DevId);
@@ -240,7 +283,7 @@ LKLAllocateVolume (
     }
 
     // mount disk
-    Ret = lkl_sys_mount(Volume->LKLBlkDeviceDecrypted, Volume->LKLMountPoint, (CHAR8*)FsType, LKL_MS_SYNCHRONOUS|LKL_MS_DIRSYNC, NULL);
+    Ret = lkl_sys_mount(Volume->LKLBlkDeviceDecrypted, Volume->LKLMountPoint, (CHAR8*)FsType, MountFlags, NULL);
     if (Ret < 0) {
       DEBUG((EFI_D_ERROR, "can't mount disk: %a\n", lkl_strerror(Ret)));
       Status = LKLError2EfiError(Ret);
@@ -250,60 +293,371 @@ LKLAllocateVolume (
 
   else {
     // mount disk
-    Ret = lkl_mount_dev(Volume->LKLDiskId, 0, FsType, LKL_MS_SYNCHRONOUS|LKL_MS_DIRSYNC, NULL, Volume->LKLMountPoint, sizeof(Volume->LKLMountPoint));
+    Ret = lkl_mount_dev(Volume->LKLDiskId, 0, FsType, MountFlags, NULL, Volume->LKLMountPoint, sizeof(Volume->LKLMountPoint));
     if (Ret < 0) {
       DEBUG((EFI_D_ERROR, "can't mount disk: %a\n", lkl_strerror(Ret)));
+      Volume->LKLMountPoint[0] = 0;
       Status = LKLError2EfiError(Ret);
+
+      // the kernel isn't built with this filesystem, don't probe it again
+      if (Ret == -LKL_ENODEV) {
+        Volume->Unmountable = TRUE;
+        Volume->Fingerprint = Fingerprint;
+        Status = EFI_UNSUPPORTED;
+      }
       goto Done;
     }
   }
 
+  Status = EFI_SUCCESS;
+
+Done:
+  if (EFI_ERROR (Status)) {
+    LKLReleaseDisk (Volume);
+  }
+
+  if (Key) {
+    FreePool (Key);
+  }
+
+  if (KeyFile) {
+    FileHandleClose (KeyFile);
+  }
+
+  return Status;
+}
+
+/**
+  Install the filesystem protocol on a mounted volume, or release the volume
+  if the mount failed.
+
+  @param  Volume                The volume.
+  @param  Status                Result of LKLMountVolume.
+
+  @retval EFI_SUCCESS           The volume is installed.
+  @return others                The volume was released and freed.
+
+**/
+STATIC
+EFI_STATUS
+LKLInstallVolume (
+  IN LKL_VOLUME *Volume,
+  IN EFI_STATUS Status
+  )
+{
+  if (!EFI_ERROR (Status)) {
+    //
+    // Install our protocol interfaces on the device's handle
+    //
+    Status = gBS->InstallMultipleProtocolInterfaces (
+                    &Volume->Handle,
+                    &gEfiSimpleFileSystemProtocolGuid,
+                    &Volume->VolumeInterface,
+                    &gLKLStatsProtocolGuid,
+                    &Volume->StatsInterface,
+                    NULL
+                    );
+    if (EFI_ERROR (Status)) {
+      LKLReleaseDisk (Volume);
+    }
+  }
+
+  if (EFI_ERROR (Status)) {
+    //
+    // Recorded here rather than by the mount, as a background mount runs
+    // on its own thread
+    //
+    if (Volume->Unmountable) {
+      LKLProbeCacheAdd (Volume->Handle, Volume->MediaId, Volume->Fingerprint);
+    }
+
+    LKLFreeVolume (Volume);
+    return Status;
+  }
+
   //
-  // Install our protocol interfaces on the device's handle
+  // Volume installed
   //
-  Status = gBS->InstallMultipleProtocolInterfaces (
-                  &Volume->Handle,
-                  &gEfiSimpleFileSystemProtocolGuid,
-                  &Volume->VolumeInterface,
-                  NULL
-                  );
+  DEBUG ((EFI_D_INIT, "Installed LKL filesystem on %p (%a)\n", Volume->Handle, Volume->SyncMount ? "sync" : "writeback"));
+  Volume->Valid   = TRUE;
+  Volume->Mounted = TRUE;
+  InsertTailList (&gLKLVolumeList, &Volume->Link);
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Finish a background mount: install the volume, or give the disk back to
+  the other drivers if it couldn't be mounted. Does nothing if the mount was
+  finished already.
+
+  @param  Volume                The volume, its mount thread must be done.
+
+**/
+STATIC
+VOID
+LKLCompleteMount (
+  IN LKL_VOLUME *Volume
+  )
+{
+  EFI_STATUS  Status;
+  EFI_TPL     OldTpl;
+  EFI_HANDLE  Handle;
+  EFI_HANDLE  DriverBindingHandle;
+  BOOLEAN     IsEncrypted;
+
+  //
+  // The notify function can't run in between, so each mount completes once
+  //
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  if (Volume->MountEvent == NULL) {
+    gBS->RestoreTPL (OldTpl);
+    return;
+  }
+
+  gBS->CloseEvent (Volume->MountEvent);
+  Volume->MountEvent = NULL;
+  RemoveEntryList (&Volume->PendingLink);
+
+  Handle              = Volume->Handle;
+  DriverBindingHandle = Volume->DriverBindingHandle;
+  IsEncrypted         = Volume->IsEncrypted;
+
+  Status = LKLInstallVolume (Volume, Volume->MountStatus);
+
+  //
+  // Only now can an encrypted volume find its key on this one
+  //
+  if (!IsEncrypted) {
+    InterlockedDecrement (&mPlainMountsPending);
+  }
+
   if (EFI_ERROR (Status)) {
-    goto Done;
+    gBS->CloseProtocol (
+           Handle,
+           &gEfiDiskIo2ProtocolGuid,
+           DriverBindingHandle,
+           Handle
+           );
+    gBS->CloseProtocol (
+           Handle,
+           &gEfiDiskIoProtocolGuid,
+           DriverBindingHandle,
+           Handle
+           );
+  }
+
+  gBS->RestoreTPL (OldTpl);
+}
+
+/**
+  Signaled by the mount thread once the mount is done.
+
+  @param  Event                 The MountEvent of the volume.
+  @param  Context               The volume.
+
+**/
+STATIC
+VOID
+EFIAPI
+LKLMountNotify (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  LKLCompleteMount ((LKL_VOLUME *)Context);
+}
+
+/**
+  Mount a volume in the background.
+
+  @param  Context               The volume.
+
+  @return 0
+
+**/
+STATIC
+int
+LKLMountThread (
+  IN VOID *Context
+  )
+{
+  LKL_VOLUME *Volume = Context;
+
+  Volume->MountStatus = LKLMountVolume (Volume);
+
+  //
+  // ExitBootServices has given up on this volume and closed its event.
+  // Nothing else may touch the disk, so leave it unmounted.
+  //
+  if (mMountsAbandoned) {
+    if (!EFI_ERROR (Volume->MountStatus)) {
+      LKLReleaseDisk (Volume);
+    }
+    return 0;
   }
+
   //
-  // Volume installed
+  // Once SIGNALED the event won't be touched again, it may be closed
   //
-  DEBUG ((EFI_D_INIT, "Installed LKL filesystem on %p\n", Handle));
-  Volume->Valid = TRUE;
+  MemoryFence ();
+  Volume->MountState = LKL_MOUNT_DONE;
+  gBS->SignalEvent (Volume->MountEvent);
+  Volume->MountState = LKL_MOUNT_SIGNALED;
 
-Done:
-  if (EFI_ERROR (Status) && Volume) {
-    if (Volume->LKLMountPoint[0])
-      lkl_sys_umount(Volume->LKLMountPoint, 0);
+  return 0;
+}
+
+/**
+  Finish the background mount of a controller, if one is running.
+
+  @param  Handle                The controller handle.
+
+  @retval TRUE                  A mount was pending, it's finished now.
+  @retval FALSE                 No mount was pending.
+
+**/
+BOOLEAN
+LKLFinishPendingMount (
+  IN EFI_HANDLE                 Handle
+  )
+{
+  LIST_ENTRY  *Link;
+  LKL_VOLUME  *Volume;
+  BOOLEAN     Pending;
+
+  Pending = FALSE;
+
+  for (;;) {
+    //
+    // The list may change while we wait, look the volume up again
+    //
+    Volume = NULL;
+    for (Link = GetFirstNode (&gLKLPendingList);
+         !IsNull (&gLKLPendingList, Link);
+         Link = GetNextNode (&gLKLPendingList, Link)) {
+      if (VOLUME_FROM_PENDING_LINK (Link)->Handle == Handle) {
+        Volume = VOLUME_FROM_PENDING_LINK (Link);
+        break;
+      }
+    }
 
-    if (Volume->IsEncrypted) {
-      if (Volume->LKLCryptFSName[0])
-        cryptfs_revert_ext_volume(Volume->LKLCryptFSName);
+    if (Volume == NULL) {
+      return Pending;
+    }
 
-      if (Volume->LKLBlkDevice[0])
-        lkl_sys_unlink(Volume->LKLBlkDevice);
+    Pending = TRUE;
+    if (Volume->MountState == LKL_MOUNT_SIGNALED) {
+      LKLCompleteMount (Volume);
+    } else {
+      thread_yield();
     }
+  }
+}
 
-    if (Volume->LKLDiskId >= 0)
-        lkl_disk_remove(Volume->LKLDisk);
+/**
+  Allocate a volume for a disk and mount it. With PcdLKLBackgroundMount the
+  mount runs on a thread of its own and the filesystem protocol is installed
+  once it's done, so several disks mount at the same time and
+  DriverBindingStart returns right away.
+
+  @param  DriverBindingHandle   Handle of the driver managing the disk.
+  @param  Handle                The controller handle.
+  @param  DiskIo                The disk's DiskIo, opened BY_DRIVER.
+  @param  DiskIo2               The disk's DiskIo2, NULL if not present.
+  @param  BlockIo               The disk's BlockIo.
+  @param  BlockIo2              The disk's BlockIo2, NULL if not present.
+
+  @retval EFI_SUCCESS           The volume is mounted, or its mount has been
+                                started. A failing background mount closes
+                                DiskIo and DiskIo2 again.
+  @return others                The volume couldn't be mounted.
+
+**/
+EFI_STATUS
+LKLAllocateVolume (
+  IN  EFI_HANDLE                DriverBindingHandle,
+  IN  EFI_HANDLE                Handle,
+  IN  EFI_DISK_IO_PROTOCOL      *DiskIo,
+  IN  EFI_DISK_IO2_PROTOCOL     *DiskIo2,
+  IN  EFI_BLOCK_IO_PROTOCOL     *BlockIo,
+  IN  EFI_BLOCK_IO2_PROTOCOL    *BlockIo2
+  )
+{
+  EFI_STATUS  Status;
+  LKL_VOLUME  *Volume;
+  thread_t    *Thread;
+  EFI_PARTITION_NAME_PROTOCOL *PartitionName;
+
+  //
+  // Allocate a volume structure
+  //
+  Volume = AllocateZeroPool (sizeof (LKL_VOLUME));
+  if (Volume == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  //
+  // Initialize the structure
+  //
+  Volume->Signature                   = LKL_VOLUME_SIGNATURE;
+  Volume->Handle                      = Handle;
+  Volume->DriverBindingHandle         = DriverBindingHandle;
+  Volume->DiskIo                      = DiskIo;
+  Volume->DiskIo2                     = DiskIo2;
+  Volume->BlockIo                     = BlockIo;
+  Volume->BlockIo2                    = BlockIo2;
+  Volume->MediaId                     = BlockIo->Media->MediaId;
+  Volume->ReadOnly                    = BlockIo->Media->ReadOnly;
+  Volume->VolumeInterface.Revision    = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_REVISION;
+  Volume->LKLDisk.handle              = Volume;
+  Volume->VolumeInterface.OpenVolume  = LKLOpenVolume;
+  Volume->LKLDiskId                   = -1;
+  LKLLookupCacheInit (&Volume->LookupCache);
+  LKLStatsInit (Volume);
+  LKLTraceInit (Volume);
+
+  Status = gBS->HandleProtocol (
+                  Handle,
+                  &gEfiPartitionNameProtocolGuid,
+                  (VOID **)&PartitionName
+                  );
+  if (!EFI_ERROR (Status)) {
+    Volume->SyncMount   = LKLIsSyncMount (PartitionName->Name);
+    Volume->IsEncrypted = (BOOLEAN)(StrCmp (PartitionName->Name, L"android_expand") == 0);
+  }
+
+  if (!FeaturePcdGet (PcdLKLBackgroundMount)) {
+    return LKLInstallVolume (Volume, LKLMountVolume (Volume));
+  }
 
+  Status = gBS->CreateEvent (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  LKLMountNotify,
+                  Volume,
+                  &Volume->MountEvent
+                  );
+  if (EFI_ERROR (Status)) {
     LKLFreeVolume (Volume);
+    return Status;
   }
 
-  if (Key) {
-    FreePool (Key);
+  Thread = thread_create ("mount", LKLMountThread, Volume, DEFAULT_PRIORITY, PcdGet32 (PcdLKLThreadStackSize));
+  if (Thread == NULL) {
+    gBS->CloseEvent (Volume->MountEvent);
+    LKLFreeVolume (Volume);
+    return EFI_OUT_OF_RESOURCES;
   }
 
-  if (KeyFile) {
-    FileHandleClose (KeyFile);
+  if (!Volume->IsEncrypted) {
+    InterlockedIncrement (&mPlainMountsPending);
   }
+  Volume->MountState = LKL_MOUNT_RUNNING;
+  InsertTailList (&gLKLPendingList, &Volume->PendingLink);
+  thread_detach_and_resume (Thread);
 
-  return Status;
+  return EFI_SUCCESS;
 }
 
 EFI_STATUS
@@ -322,6 +676,8 @@ LKLAbandonVolume (
                     Volume->Handle,
                     &gEfiSimpleFileSystemProtocolGuid,
                     &Volume->VolumeInterface,
+                    &gLKLStatsProtocolGuid,
+                    &Volume->StatsInterface,
                     NULL
                     );
     if (EFI_ERROR (Status)) {
@@ -344,6 +700,11 @@ LKLAbandonVolume (
 
   Volume->Valid = FALSE;
 
+  //
+  // Nothing can be opened any more, write everything back and unmount
+  //
+  LKLUnmountVolume (Volume);
+
   //
   // Release the lock.
   // If locked by me, this means DriverBindingStop is NOT
@@ -359,3 +720,146 @@ LKLAbandonVolume (
 
   return EFI_SUCCESS;
 }
+
+/**
+  Write back all dirty data and metadata of a volume.
+
+  @param  Volume                The volume to sync.
+
+  @return Status of syncfs on the mount point.
+
+**/
+EFI_STATUS
+LKLSyncVolume (
+  IN LKL_VOLUME *Volume
+  )
+{
+  INTN        FD;
+  INTN        Ret;
+
+  if (!Volume->Mounted) {
+    return EFI_SUCCESS;
+  }
+
+  FD = lkl_sys_open(Volume->LKLMountPoint, LKL_O_RDONLY, 0);
+  if (FD < 0) {
+    return LKLError2EfiError(FD);
+  }
+
+  Ret = lkl_sys_syncfs(FD);
+  lkl_sys_close(FD);
+
+  return LKLError2EfiError(Ret);
+}
+
+/**
+  Sync a volume and unmount it. It stays allocated, but nothing on it can be
+  accessed any more.
+
+  @param  Volume                The volume to unmount.
+
+**/
+VOID
+LKLUnmountVolume (
+  IN LKL_VOLUME *Volume
+  )
+{
+  INTN        Ret;
+
+  if (!Volume->Mounted) {
+    return;
+  }
+
+  LKLSyncVolume (Volume);
+
+  //
+  // Still open handles keep the mount busy, the data is on disk anyway
+  //
+  Ret = lkl_sys_umount(Volume->LKLMountPoint, 0);
+  if (Ret < 0) {
+    DEBUG((EFI_D_ERROR, "can't unmount %a: %a\n", Volume->LKLMountPoint, lkl_strerror(Ret)));
+  }
+
+  DEBUG((EFI_D_INFO, "%a: lookup cache %lu hits, %lu misses\n", Volume->LKLMountPoint, Volume->LookupCache.Hits, Volume->LookupCache.Misses));
+
+  RemoveEntryList (&Volume->Link);
+  Volume->Mounted = FALSE;
+}
+
+/**
+  ExitBootServices notification. The OS is about to take over the disks, so
+  every volume is synced and unmounted while the firmware can still do I/O.
+
+  Mounts still running in the background are abandoned rather than waited
+  for. The timer is stopped by now, so a mount sleeping on an LK timer, like
+  an encrypted volume waiting for its key, would never wake up.
+
+  @param  Event                 The ExitBootServices event.
+  @param  Context               Unused.
+
+**/
+VOID
+EFIAPI
+LKLExitBootServices (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  LIST_ENTRY  *Link;
+  LKL_VOLUME  *Volume;
+
+  //
+  // Token events are not dispatched any more, so every volume has to use
+  // the blocking protocols from here on. That includes the ones still
+  // mounting, their threads may issue requests while the unmounts below
+  // block. This comes before the first LKL call.
+  //
+  for (Link = GetFirstNode (&gLKLPendingList);
+       !IsNull (&gLKLPendingList, Link);
+       Link = GetNextNode (&gLKLPendingList, Link)) {
+    Volume = VOLUME_FROM_PENDING_LINK (Link);
+    Volume->DiskIo2  = NULL;
+    Volume->BlockIo2 = NULL;
+  }
+  for (Link = GetFirstNode (&gLKLVolumeList);
+       !IsNull (&gLKLVolumeList, Link);
+       Link = GetNextNode (&gLKLVolumeList, Link)) {
+    Volume = VOLUME_FROM_LINK (Link);
+    Volume->DiskIo2  = NULL;
+    Volume->BlockIo2 = NULL;
+  }
+
+  //
+  // Nobody gets to use these any more, don't install them. Closing the
+  // event drops a notify that is still queued.
+  //
+  mMountsAbandoned = TRUE;
+  MemoryFence ();
+
+  while (!IsListEmpty (&gLKLPendingList)) {
+    Link   = GetFirstNode (&gLKLPendingList);
+    Volume = VOLUME_FROM_PENDING_LINK (Link);
+
+    RemoveEntryList (&Volume->PendingLink);
+    gBS->CloseEvent (Volume->MountEvent);
+    Volume->MountEvent = NULL;
+
+    if (Volume->MountState == LKL_MOUNT_SIGNALED && !EFI_ERROR (Volume->MountStatus)) {
+      Volume->Mounted = TRUE;
+      InsertTailList (&gLKLVolumeList, &Volume->Link);
+    }
+  }
+
+  while (!IsListEmpty (&gLKLVolumeList)) {
+    Link   = GetFirstNode (&gLKLVolumeList);
+    Volume = VOLUME_FROM_LINK (Link);
+
+    Volume->Valid = FALSE;
+    LKLUnmountVolume (Volume);
+  }
+
+  //
+  // The OS gets the application processors back from the firmware
+  //
+  lkl_smp_stop ();
+}
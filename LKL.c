@@ -26,6 +26,18 @@ Abstract:
 
 EFI_CPU_ARCH_PROTOCOL  *gCpu = NULL;
 EFI_RESET_SYSTEM       gUefiResetSystem;
+STATIC EFI_EVENT       mExitBootServicesEvent;
+
+//
+// LKLStartKernel() state
+//
+#define LKL_KERNEL_STOPPED   0
+#define LKL_KERNEL_STARTING  1
+#define LKL_KERNEL_RUNNING   2
+#define LKL_KERNEL_FAILED    3
+
+STATIC volatile UINT32  mKernelState = LKL_KERNEL_STOPPED;
+STATIC EFI_STATUS       mKernelStatus;
 
 EFI_STATUS
 EFIAPI
@@ -77,24 +89,37 @@ EFI_DRIVER_BINDING_PROTOCOL gLKLDriverBinding = {
   NULL
 };
 
+/**
+  Boot the Linux kernel and set up /dev.
+
+  @retval EFI_SUCCESS           The kernel is running.
+  @return others                The kernel couldn't be started.
+
+**/
+STATIC
 EFI_STATUS
-EFIAPI
-LKLEntryPoint (
-  IN EFI_HANDLE         ImageHandle,
-  IN EFI_SYSTEM_TABLE   *SystemTable
+LKLBootKernel (
+  VOID
   )
 {
-  EFI_STATUS                Status;
+  EFI_STATUS  Status;
+  CHAR8       *Cmdline;
   long ret;
 
-  // Get Cpu Arch protocol
-  Status = gBS->LocateProtocol (&gEfiCpuArchProtocolGuid, NULL, (VOID **)&gCpu);
-  ASSERT_EFI_ERROR(Status);
+  // start linux kernel
+  Cmdline = LKLGetKernelCmdline ();
+  if (Cmdline == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
 
-  lkl_thread_init();
+  // its threads may run on the application processors
+  if (FeaturePcdGet (PcdLKLSmp)) {
+    lkl_smp_start ();
+  }
+  DEBUG ((EFI_D_INFO, "LKL: starting kernel with '%a'\n", Cmdline));
 
-  // start linux kernel
-  ret = lkl_start_kernel(&lkl_host_ops, "mem=64M");
+  ret = lkl_start_kernel(&lkl_host_ops, "%s", Cmdline);
+  FreePool (Cmdline);
   if (ret) {
     DEBUG((EFI_D_ERROR, "can't start kernel: %s\n", lkl_strerror(ret)));
     return LKLError2EfiError(ret);
@@ -114,6 +139,124 @@ LKLEntryPoint (
     return LKLError2EfiError(ret);
   }
 
+  return EFI_SUCCESS;
+}
+
+/**
+  Start the Linux kernel unless it's running already. Boots that never mount
+  a volume don't pay for it. Concurrent callers wait for the first one.
+
+  @retval EFI_SUCCESS           The kernel is running.
+  @return others                The kernel couldn't be started.
+
+**/
+EFI_STATUS
+LKLStartKernel (
+  VOID
+  )
+{
+  if (InterlockedCompareExchange32 ((UINT32 *)&mKernelState, LKL_KERNEL_STOPPED, LKL_KERNEL_STARTING) == LKL_KERNEL_STOPPED) {
+    mKernelStatus = LKLBootKernel ();
+    MemoryFence ();
+    mKernelState = EFI_ERROR (mKernelStatus) ? LKL_KERNEL_FAILED : LKL_KERNEL_RUNNING;
+  }
+
+  while (mKernelState == LKL_KERNEL_STARTING) {
+    thread_yield();
+  }
+
+  return mKernelStatus;
+}
+
+/**
+  Tell whether LKLStartKernel() brought the kernel up. Waits for a start
+  that's in progress.
+
+  @retval TRUE                  The kernel is running.
+  @retval FALSE                 It never started.
+
+**/
+BOOLEAN
+LKLKernelRunning (
+  VOID
+  )
+{
+  while (mKernelState == LKL_KERNEL_STARTING) {
+    thread_yield();
+  }
+
+  return (BOOLEAN)(mKernelState == LKL_KERNEL_RUNNING);
+}
+
+/**
+  Start the kernel while the rest of the firmware initializes.
+
+  @param  Context               Unused.
+
+  @return 0
+
+**/
+STATIC
+int
+LKLKernelThread (
+  IN VOID *Context
+  )
+{
+  LKLStartKernel ();
+  return 0;
+}
+
+EFI_STATUS
+EFIAPI
+LKLEntryPoint (
+  IN EFI_HANDLE         ImageHandle,
+  IN EFI_SYSTEM_TABLE   *SystemTable
+  )
+{
+  EFI_STATUS                Status;
+  LKL_SYNC_BENCHMARK        SyncBench;
+  thread_t                  *Thread;
+
+  // Get Cpu Arch protocol
+  Status = gBS->LocateProtocol (&gEfiCpuArchProtocolGuid, NULL, (VOID **)&gCpu);
+  ASSERT_EFI_ERROR(Status);
+
+  lkl_thread_init();
+
+  LKLProbeCacheLoad ();
+
+  if (FeaturePcdGet (PcdLKLSyncBenchmark)) {
+    uefi_sync_benchmark (100000, &SyncBench);
+    DEBUG ((EFI_D_INFO, "LKL sync benchmark (%u iterations): mutex %lu ns, recursive mutex %lu ns, sem %lu ns, handoff %lu ns\n",
+      SyncBench.Iterations, SyncBench.MutexNs, SyncBench.RecursiveMutexNs, SyncBench.SemNs, SyncBench.HandoffNs));
+    DEBUG ((EFI_D_INFO, "LKL switch benchmark: %lu ns per switch, %lu switches/s\n",
+      SyncBench.SwitchNs, SyncBench.SwitchesPerSec));
+  }
+
+  //
+  // The kernel is started by the first volume that needs it, or right away
+  // in the background
+  //
+  if (FeaturePcdGet (PcdLKLEarlyKernelStart)) {
+    Thread = thread_create ("kernel", LKLKernelThread, NULL, DEFAULT_PRIORITY, PcdGet32 (PcdLKLThreadStackSize));
+    if (Thread != NULL) {
+      thread_detach_and_resume (Thread);
+    }
+  }
+
+  //
+  // Volumes are mounted in writeback mode, write them back before the OS
+  // takes over the disks
+  //
+  Status = gBS->CreateEvent (
+                  EVT_SIGNAL_EXIT_BOOT_SERVICES,
+                  TPL_CALLBACK,
+                  LKLExitBootServices,
+                  NULL,
+                  &mExitBootServicesEvent
+                  );
+  ASSERT_EFI_ERROR (Status);
+
   //
   // Initialize the EFI Driver Library
   //
@@ -168,6 +311,10 @@ LKLUnload (
     }
   }
 
+  DEBUG_CODE_BEGIN ();
+  lkl_thread_stack_report ();
+  DEBUG_CODE_END ();
+
   if (Index == DeviceHandleCount) {
     //
     // Driver is stopped successfully.
@@ -221,10 +368,20 @@ LKLUnload (
     FreePool (DeviceHandleBuffer);
   }
 
-  lkl_sys_halt();
+  if (mExitBootServicesEvent != NULL) {
+    gBS->CloseEvent (mExitBootServicesEvent);
+  }
 
-  // this kills the kernel's main thread
-  thread_yield();
+  if (LKLKernelRunning ()) {
+    // the volumes were unmounted by DriverBindingStop, catch everything else
+    lkl_sys_sync();
+    lkl_sys_halt();
+
+    // this kills the kernel's main thread
+    thread_yield();
+  }
+
+  lkl_smp_stop ();
 
   return Status;
 }
@@ -255,6 +412,14 @@ LKLDriverBindingSupported (
   if (EFI_ERROR (Status)) {
     return Status;
   }
+
+  //
+  // Partitions already found to be raw or foreign are not probed again
+  //
+  if (LKLProbeCacheCheck (ControllerHandle, DiskIo)) {
+    Status = EFI_UNSUPPORTED;
+  }
+
   //
   // Close the I/O Abstraction(s) used to perform the supported test
   //
@@ -265,6 +430,10 @@ LKLDriverBindingSupported (
          ControllerHandle
          );
 
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
   //
   // Open the IO Abstraction(s) needed to perform the supported test
   //
@@ -290,6 +459,7 @@ LKLDriverBindingStart (
 {
   EFI_STATUS            Status;
   EFI_BLOCK_IO_PROTOCOL *BlockIo;
+  EFI_BLOCK_IO2_PROTOCOL *BlockIo2;
   EFI_DISK_IO_PROTOCOL  *DiskIo;
   EFI_DISK_IO2_PROTOCOL *DiskIo2;
   BOOLEAN               LockedByMe;
@@ -323,6 +493,21 @@ LKLDriverBindingStart (
     goto Exit;
   }
 
+  //
+  // BlockIo2 is optional, it's used for aligned requests if present
+  //
+  Status = gBS->OpenProtocol (
+                  ControllerHandle,
+                  &gEfiBlockIo2ProtocolGuid,
+                  (VOID **) &BlockIo2,
+                  This->DriverBindingHandle,
+                  ControllerHandle,
+                  EFI_OPEN_PROTOCOL_GET_PROTOCOL
+                  );
+  if (EFI_ERROR (Status)) {
+    BlockIo2 = NULL;
+  }
+
   Status = gBS->OpenProtocol (
                   ControllerHandle,
                   &gEfiDiskIoProtocolGuid,
@@ -349,9 +534,10 @@ LKLDriverBindingStart (
 
   //
   // Allocate Volume structure. In LKLAllocateVolume(), Resources
-  // are allocated with protocol installed and cached initialized
+  // are allocated and the mount is started, the protocol is installed
+  // once it's done
   //
-  Status = LKLAllocateVolume (ControllerHandle, DiskIo, DiskIo2, BlockIo);
+  Status = LKLAllocateVolume (This->DriverBindingHandle, ControllerHandle, DiskIo, DiskIo2, BlockIo, BlockIo2);
 
   //
   // When the media changes on a device it will Reinstall the BlockIo interaface.
@@ -406,8 +592,16 @@ LKLDriverBindingStop (
   EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *FileSystem;
   LKL_VOLUME                      *Volume;
   EFI_DISK_IO2_PROTOCOL           *DiskIo2;
+  BOOLEAN                         Pending;
 
   DiskIo2 = NULL;
+
+  //
+  // Let a mount still running in the background finish first. If it
+  // failed, the disk has been released already.
+  //
+  Pending = LKLFinishPendingMount (ControllerHandle);
+
   //
   // Get our context back
   //
@@ -424,6 +618,8 @@ LKLDriverBindingStop (
     Volume  = VOLUME_FROM_VOL_INTERFACE (FileSystem);
     DiskIo2 = Volume->DiskIo2;
     Status  = LKLAbandonVolume (Volume);
+  } else if (Pending) {
+    return EFI_SUCCESS;
   }
 
   if (!EFI_ERROR (Status)) {
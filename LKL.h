@@ -32,11 +32,13 @@ Revision History
 #include <Guid/FileSystemInfo.h>
 #include <Guid/FileSystemVolumeLabelInfo.h>
 #include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
 #include <Protocol/DiskIo.h>
 #include <Protocol/DiskIo2.h>
 #include <Protocol/SimpleFileSystem.h>
 #include <Protocol/UnicodeCollation.h>
 #include <Protocol/PartitionName.h>
+#include <Protocol/LKLStats.h>
 
 #include <Library/PcdLib.h>
 #include <Library/DebugLib.h>
@@ -47,6 +49,8 @@ Revision History
 #include <Library/BaseMemoryLib.h>
 #include <Library/FileHandleLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/SynchronizationLib.h>
+#include <Library/TimerLib.h>
 #include <Library/UefiDriverEntryPoint.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiRuntimeServicesTableLib.h>
@@ -56,6 +60,7 @@ Revision History
 #include <sys/param.h>
 
 #include <FsId.h>
+#include <Arena.h>
 
 //
 // The LKL signature
@@ -67,8 +72,61 @@ Revision History
 
 #define IFILE_FROM_FHAND(a)          CR (a, LKL_IFILE, Handle, LKL_IFILE_SIGNATURE)
 
+#define VOLUME_FROM_LINK(a)          CR (a, LKL_VOLUME, Link, LKL_VOLUME_SIGNATURE)
+
+#define VOLUME_FROM_PENDING_LINK(a)  CR (a, LKL_VOLUME, PendingLink, LKL_VOLUME_SIGNATURE)
+
+#define VOLUME_FROM_STATS_INTERFACE(a) CR (a, LKL_VOLUME, StatsInterface, LKL_VOLUME_SIGNATURE)
+
 #define ASSERT_VOLUME_LOCKED(a)      ASSERT_LOCKED (&LKLFsLock)
 
+//
+// Longest path below a volume root, including the terminator
+//
+#define LKL_PATH_MAX                 4096
+
+//
+// Space a directory entry takes in LKL_IFILE.DirBuffer
+//
+#define LKL_DIR_RECORD_SIZE(NameLen) ALIGN_VALUE (SIZE_OF_EFI_FILE_INFO + ((NameLen) + 1) * sizeof (CHAR16), 8)
+
+//
+// Hash buckets of the per-volume lookup cache
+//
+#define LKL_LOOKUP_BUCKETS           64
+
+//
+// Number of partitions the probe cache remembers
+//
+#define LKL_PROBE_CACHE_SIZE         128
+
+//
+// Kernel command line limits, the memory size is in MiB
+//
+#define LKL_CMDLINE_MAX              512
+#define LKL_MEMORY_MIN               16
+
+//
+// Remembered result of looking up a path on a volume (Lookup.c)
+//
+typedef struct {
+  LIST_ENTRY          Link;
+  LIST_ENTRY          LruLink;
+  UINT32              Hash;
+  UINTN               Len;
+  EFI_STATUS          Status;
+  CHAR8               Path[1];
+} LKL_LOOKUP_ENTRY;
+
+typedef struct {
+  EFI_LOCK            Lock;
+  LIST_ENTRY          Buckets[LKL_LOOKUP_BUCKETS];
+  LIST_ENTRY          Lru;
+  UINTN               Count;
+  UINT64              Hits;
+  UINT64              Misses;
+} LKL_LOOKUP_CACHE;
+
 typedef struct _LKL_VOLUME {
   UINTN                           Signature;
 
@@ -76,17 +134,72 @@ typedef struct _LKL_VOLUME {
   BOOLEAN                         Valid;
   BOOLEAN                         DiskError;
 
+  //
+  // Link in gLKLVolumeList while mounted
+  //
+  LIST_ENTRY                      Link;
+  BOOLEAN                         Mounted;
+
+  //
+  // Background mount (Init.c). The mount runs on its own thread and
+  // MountEvent installs the filesystem protocol once it's done. Linked in
+  // gLKLPendingList until then.
+  //
+  LIST_ENTRY                      PendingLink;
+  EFI_EVENT                       MountEvent;
+  EFI_HANDLE                      DriverBindingHandle;
+  volatile UINT32                 MountState;
+  EFI_STATUS                      MountStatus;
+
+  //
+  // Set by the mount if there's nothing to mount on the partition, which
+  // then goes to the probe cache with this fingerprint (ProbeCache.c)
+  //
+  BOOLEAN                         Unmountable;
+  UINT32                          Fingerprint;
+
+  //
+  // Mounted with MS_SYNCHRONOUS|MS_DIRSYNC instead of writeback
+  //
+  BOOLEAN                         SyncMount;
+
+  //
+  // Results of earlier opens, dropped whenever this driver changes the
+  // filesystem
+  //
+  LKL_LOOKUP_CACHE                LookupCache;
+
   EFI_SIMPLE_FILE_SYSTEM_PROTOCOL VolumeInterface;
 
+  //
+  // I/O statistics (Stats.c), installed next to VolumeInterface
+  //
+  LKL_STATS                       Stats;
+  LKL_STATS_PROTOCOL              StatsInterface;
+
+  //
+  // Ring of the latest block requests (Trace.c), NULL if not tracing
+  //
+  LKL_TRACE_RECORD                *Trace;
+  UINT32                          TraceEntries;
+  volatile UINT32                 TraceNext;
+  UINT64                          TraceStart;
+
   //
   // If opened, the parent handle and BlockIo interface
   //
   EFI_BLOCK_IO_PROTOCOL           *BlockIo;
+  EFI_BLOCK_IO2_PROTOCOL          *BlockIo2;
   EFI_DISK_IO_PROTOCOL            *DiskIo;
   EFI_DISK_IO2_PROTOCOL           *DiskIo2;
   UINT32                          MediaId;
   BOOLEAN                         ReadOnly;
 
+  //
+  // Private state of the LKL block device backend (UefiHost.c)
+  //
+  VOID                            *BlkContext;
+
   struct lkl_disk                 LKLDisk;
   INTN                            LKLDiskId;
   CHAR8                           LKLMountPoint[32];
@@ -106,13 +219,50 @@ typedef struct {
 
   INTN                FD;
   INTN                LinuxOpenFlags;
-  struct lkl_stat     StatBuf;
-  CHAR8               FilePath[4096];
+  BOOLEAN             Dirty;
+  UINT32              Mode;
+  UINT64              Dev;
 
-  struct lkl_dir      *Dir;
-  struct lkl_linux_dirent64 *DirEnt;
+  //
+  // Directory entries read in getdents64 batches and already converted to
+  // EFI_FILE_INFO records, Read() copies them out one at a time (ReadWrite.c)
+  //
+  UINT8               *DirBuffer;
+  UINTN               DirBufferSize;
+  UINTN               DirUsed;
+  UINTN               DirOffset;
+  BOOLEAN             DirEof;
+
+  //
+  // Token based requests in flight, the handle is closed, or deleted, by
+  // the last one if the caller closed or deleted it in the meantime (Async.c)
+  //
+  UINTN               AsyncPending;
+  BOOLEAN             AsyncClose;
+  BOOLEAN             AsyncDelete;
+
+  //
+  // Path relative to the volume root, the handle is allocated to fit it
+  //
+  CHAR8               FilePath[1];
 } LKL_IFILE;
 
+//
+// Work item run by the LKL worker threads (UefiHost.c)
+//
+typedef struct _LKL_WORK LKL_WORK;
+
+typedef
+VOID
+(*LKL_WORK_FUNC) (
+  IN LKL_WORK   *Work
+  );
+
+struct _LKL_WORK {
+  LIST_ENTRY          Link;
+  LKL_WORK_FUNC       Func;
+};
+
 typedef enum {
   READ_DATA     = 0,
   WRITE_DATA    = 1
@@ -126,12 +276,31 @@ extern EFI_COMPONENT_NAME_PROTOCOL     gLKLComponentName;
 extern EFI_COMPONENT_NAME2_PROTOCOL    gLKLComponentName2;
 extern EFI_LOCK                        LKLFsLock;
 extern EFI_FILE_PROTOCOL               LKLFileInterface;
+extern LIST_ENTRY                      gLKLVolumeList;
+extern LIST_ENTRY                      gLKLPendingList;
 
 //
 // Function Prototypes
 //
 
+typedef struct {
+  UINT32                Iterations;
+  UINT64                MutexNs;
+  UINT64                RecursiveMutexNs;
+  UINT64                SemNs;
+  UINT64                HandoffNs;
+  UINT64                SwitchNs;
+  UINT64                SwitchesPerSec;
+} LKL_SYNC_BENCHMARK;
+
 void lkl_thread_init(void);
+void lkl_smp_start(void);
+void lkl_smp_stop(void);
+void lkl_thread_stack_report(void);
+void uefi_sync_benchmark(UINT32 iterations, LKL_SYNC_BENCHMARK *res);
+void uefi_blk_cleanup(LKL_VOLUME *Volume);
+UINTN uefi_profile_read(LKL_THREAD_PROFILE *Profile, UINTN Count);
+void lkl_work_queue(LKL_WORK *Work);
 int cryptfs_setup_ext_volume(const char *label, const char *real_blkdev,
                              const unsigned char *key, int keysize, char *out_crypto_blkdev);
 int cryptfs_revert_ext_volume(const char *label);
@@ -158,10 +327,13 @@ LKLMakeDir (
  CONST CHAR8 *Path
 );
 
-CHAR8 *
-RealPath (
-  CONST CHAR8 *name,
-  CHAR8 *resolved
+EFI_STATUS
+LKLJoinPath (
+  IN  CONST CHAR8 *Root OPTIONAL,
+  IN  CONST CHAR8 *Base,
+  IN  CONST CHAR8 *Name,
+  OUT CHAR8       *Result,
+  IN  UINTN       ResultSize
   );
 
 BOOLEAN
@@ -253,6 +425,12 @@ LKLFillFileInfo (
   OUT EFI_FILE_INFO   *FileInfo
   );
 
+VOID
+LKLStatToFileInfo (
+  IN  struct lkl_stat *StatBuf,
+  OUT EFI_FILE_INFO   *FileInfo
+  );
+
 VOID
 RemoveTrailingSlashes (
   CHAR8 *s
@@ -268,6 +446,29 @@ LKLFreeVolume (
   IN LKL_VOLUME       *Volume
   );
 
+CHAR8*
+LKLGetKernelCmdline (
+  VOID
+  );
+
+BOOLEAN
+LKLIsSyncMount (
+  IN CONST CHAR16     *PartitionName
+  );
+
+//
+// LKL.c
+//
+EFI_STATUS
+LKLStartKernel (
+  VOID
+  );
+
+BOOLEAN
+LKLKernelRunning (
+  VOID
+  );
+
 //
 // OpenVolume.c
 //
@@ -280,10 +481,17 @@ LKLOpenVolume (
 
 EFI_STATUS
 LKLAllocateVolume (
+  IN  EFI_HANDLE                DriverBindingHandle,
   IN  EFI_HANDLE                Handle,
   IN  EFI_DISK_IO_PROTOCOL      *DiskIo,
   IN  EFI_DISK_IO2_PROTOCOL     *DiskIo2,
-  IN  EFI_BLOCK_IO_PROTOCOL     *BlockIo
+  IN  EFI_BLOCK_IO_PROTOCOL     *BlockIo,
+  IN  EFI_BLOCK_IO2_PROTOCOL    *BlockIo2
+  );
+
+BOOLEAN
+LKLFinishPendingMount (
+  IN EFI_HANDLE                 Handle
   );
 
 EFI_STATUS
@@ -291,10 +499,28 @@ LKLAbandonVolume (
   IN LKL_VOLUME *Volume
   );
 
+EFI_STATUS
+LKLSyncVolume (
+  IN LKL_VOLUME *Volume
+  );
+
+VOID
+LKLUnmountVolume (
+  IN LKL_VOLUME *Volume
+  );
+
+VOID
+EFIAPI
+LKLExitBootServices (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  );
+
 EFI_STATUS
 LKLAllocateIFile (
   IN LKL_VOLUME   *Volume,
   IN INTN         FD,
+  IN CONST CHAR8  *FilePath,
   OUT LKL_IFILE   **PtrIFile
   );
 
@@ -303,6 +529,145 @@ LKLIFileClose (
   LKL_IFILE           *IFile
   );
 
+EFI_STATUS
+LKLIFileDelete (
+  LKL_IFILE           *IFile
+  );
+
+//
+// Lookup.c
+//
+VOID
+LKLLookupCacheInit (
+  OUT LKL_LOOKUP_CACHE  *Cache
+  );
+
+BOOLEAN
+LKLLookupCacheGet (
+  IN  LKL_LOOKUP_CACHE  *Cache,
+  IN  CONST CHAR8       *Path,
+  OUT EFI_STATUS        *Status
+  );
+
+VOID
+LKLLookupCachePut (
+  IN LKL_LOOKUP_CACHE   *Cache,
+  IN CONST CHAR8        *Path,
+  IN EFI_STATUS         Status
+  );
+
+VOID
+LKLLookupCacheFlush (
+  IN LKL_LOOKUP_CACHE   *Cache
+  );
+
+//
+// ProbeCache.c
+//
+VOID
+LKLProbeCacheLoad (
+  VOID
+  );
+
+VOID
+LKLProbeCacheAdd (
+  IN EFI_HANDLE             Handle,
+  IN UINT32                 MediaId,
+  IN UINT32                 Fingerprint
+  );
+
+BOOLEAN
+LKLProbeCacheCheck (
+  IN EFI_HANDLE             Handle,
+  IN EFI_DISK_IO_PROTOCOL   *DiskIo
+  );
+
+//
+// Stats.c
+//
+VOID
+LKLStatsInit (
+  IN LKL_VOLUME             *Volume
+  );
+
+VOID
+LKLStatsRecord (
+  IN LKL_VOLUME             *Volume,
+  IN LKL_STATS_OP           Op,
+  IN UINT64                 Bytes,
+  IN UINT64                 Start
+  );
+
+VOID
+LKLStatsMerged (
+  IN LKL_VOLUME             *Volume,
+  IN UINTN                  Count
+  );
+
+UINT64
+LKLStatsNs (
+  IN UINT64                 From,
+  IN UINT64                 To
+  );
+
+//
+// Trace.c
+//
+VOID
+LKLTraceInit (
+  IN LKL_VOLUME             *Volume
+  );
+
+VOID
+LKLTraceFree (
+  IN LKL_VOLUME             *Volume
+  );
+
+VOID
+LKLTraceRecord (
+  IN LKL_VOLUME             *Volume,
+  IN UINT8                  Type,
+  IN UINT64                 Sector,
+  IN UINT64                 Length,
+  IN UINTN                  Iovecs,
+  IN UINT64                 Start
+  );
+
+EFI_STATUS
+EFIAPI
+LKLTraceRead (
+  IN     LKL_STATS_PROTOCOL *This,
+  IN OUT UINTN              *BufferSize,
+  OUT    VOID               *Buffer
+  );
+
+//
+// Async.c
+//
+typedef enum {
+  LKL_ASYNC_OPEN,
+  LKL_ASYNC_READ,
+  LKL_ASYNC_WRITE,
+  LKL_ASYNC_FLUSH
+} LKL_ASYNC_OP;
+
+EFI_STATUS
+LKLAsyncSubmit (
+  IN  LKL_IFILE               *IFile,
+  IN  LKL_ASYNC_OP            Op,
+  IN  EFI_FILE_IO_TOKEN       *Token,
+  OUT EFI_FILE_PROTOCOL       **NewHandle OPTIONAL,
+  IN  CHAR16                  *FileName OPTIONAL,
+  IN  UINT64                  OpenMode,
+  IN  UINT64                  Attributes
+  );
+
+BOOLEAN
+LKLAsyncDeferClose (
+  IN LKL_IFILE                *IFile,
+  IN BOOLEAN                  Delete
+  );
+
 
 //
 // Function Prototypes
@@ -415,4 +780,13 @@ LKLWriteEx (
   IN OUT EFI_FILE_IO_TOKEN  *Token
   );
 
+EFI_STATUS
+LKLIFileAccess (
+  IN     EFI_FILE_PROTOCOL     *FHand,
+  IN     IO_MODE               IoMode,
+  IN OUT UINTN                 *BufferSize,
+  IN OUT VOID                  *Buffer,
+  IN     EFI_FILE_IO_TOKEN     *Token
+  );
+
 #endif
@@ -0,0 +1,252 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Lookup.c
+
+Abstract:
+
+  Per-volume cache of open lookups.
+
+  An entry is keyed by the path relative to the volume root, which is the
+  parent handle's path joined with the name passed to Open. It remembers
+  whether the path exists. Paths that were found missing, or that are below
+  a missing directory, fail without calling into LKL. Known present paths
+  end the search for a missing parent early. Opens of names with a ".."
+  component bypass the cache, the joined path isn't necessarily what the
+  kernel resolved for them.
+
+  Nothing else changes the mounted filesystems while the firmware runs, so
+  the cache only has to be dropped when this driver creates, deletes,
+  renames or changes a file.
+
+Revision History
+
+--*/
+
+#include "LKL.h"
+
+STATIC
+UINT32
+LKLLookupHash (
+  IN CONST CHAR8        *Path,
+  IN UINTN              Len
+  )
+{
+  UINT32                Hash;
+  UINTN                 Index;
+
+  // FNV-1a
+  Hash = 2166136261U;
+  for (Index = 0; Index < Len; Index++) {
+    Hash = (Hash ^ (UINT8)Path[Index]) * 16777619U;
+  }
+
+  return Hash;
+}
+
+STATIC
+LKL_LOOKUP_ENTRY *
+LKLLookupFind (
+  IN LKL_LOOKUP_CACHE   *Cache,
+  IN CONST CHAR8        *Path,
+  IN UINTN              Len
+  )
+{
+  LIST_ENTRY            *Bucket;
+  LIST_ENTRY            *Link;
+  LKL_LOOKUP_ENTRY      *Entry;
+  UINT32                Hash;
+
+  Hash   = LKLLookupHash (Path, Len);
+  Bucket = &Cache->Buckets[Hash % LKL_LOOKUP_BUCKETS];
+
+  for (Link = GetFirstNode (Bucket); !IsNull (Bucket, Link); Link = GetNextNode (Bucket, Link)) {
+    Entry = BASE_CR (Link, LKL_LOOKUP_ENTRY, Link);
+    if (Entry->Hash == Hash && Entry->Len == Len && CompareMem (Entry->Path, Path, Len) == 0) {
+      return Entry;
+    }
+  }
+
+  return NULL;
+}
+
+STATIC
+VOID
+LKLLookupRemove (
+  IN LKL_LOOKUP_CACHE   *Cache,
+  IN LKL_LOOKUP_ENTRY   *Entry
+  )
+{
+  RemoveEntryList (&Entry->Link);
+  RemoveEntryList (&Entry->LruLink);
+  Cache->Count--;
+  FreePool (Entry);
+}
+
+VOID
+LKLLookupCacheInit (
+  OUT LKL_LOOKUP_CACHE  *Cache
+  )
+{
+  UINTN                 Index;
+
+  ZeroMem (Cache, sizeof (*Cache));
+  EfiInitializeLock (&Cache->Lock, TPL_NOTIFY);
+  InitializeListHead (&Cache->Lru);
+  for (Index = 0; Index < LKL_LOOKUP_BUCKETS; Index++) {
+    InitializeListHead (&Cache->Buckets[Index]);
+  }
+}
+
+/**
+  Look up the remembered result for a path.
+
+  If the path itself isn't cached its parents are checked, closest first,
+  up to the first one that is. A missing parent makes the path missing too.
+
+  @param  Cache                 The cache of the volume.
+  @param  Path                  Path relative to the volume root.
+  @param  Status                Receives EFI_SUCCESS if the path exists, or
+                                the error opening it failed with.
+
+  @retval TRUE                  The result is known.
+  @retval FALSE                 The path has to be looked up.
+
+**/
+BOOLEAN
+LKLLookupCacheGet (
+  IN  LKL_LOOKUP_CACHE  *Cache,
+  IN  CONST CHAR8       *Path,
+  OUT EFI_STATUS        *Status
+  )
+{
+  LKL_LOOKUP_ENTRY      *Entry;
+  UINTN                 PathLen;
+  UINTN                 Len;
+  BOOLEAN               Found;
+
+  Found   = FALSE;
+  PathLen = AsciiStrLen (Path);
+
+  EfiAcquireLock (&Cache->Lock);
+
+  for (Len = PathLen; Len > 0; ) {
+    Entry = LKLLookupFind (Cache, Path, Len);
+    if (Entry != NULL) {
+      //
+      // A present parent says nothing about the path itself
+      //
+      if (Len == PathLen || EFI_ERROR (Entry->Status)) {
+        RemoveEntryList (&Entry->LruLink);
+        InsertHeadList (&Cache->Lru, &Entry->LruLink);
+        *Status = Entry->Status;
+        Found = TRUE;
+      }
+      break;
+    }
+
+    // strip the last component
+    while (Len > 0 && Path[Len - 1] != '/')
+      Len--;
+    if (Len > 0)
+      Len--;
+  }
+
+  if (Found) {
+    Cache->Hits++;
+  } else {
+    Cache->Misses++;
+  }
+
+  EfiReleaseLock (&Cache->Lock);
+  return Found;
+}
+
+/**
+  Remember the result of looking up a path. The least recently used entry
+  is dropped once PcdLKLLookupCacheSize entries are cached.
+
+  @param  Cache                 The cache of the volume.
+  @param  Path                  Path relative to the volume root.
+  @param  Status                EFI_SUCCESS if the path exists, or the error
+                                opening it failed with.
+
+**/
+VOID
+LKLLookupCachePut (
+  IN LKL_LOOKUP_CACHE   *Cache,
+  IN CONST CHAR8        *Path,
+  IN EFI_STATUS         Status
+  )
+{
+  LKL_LOOKUP_ENTRY      *Entry;
+  UINTN                 Len;
+  UINT32                MaxEntries;
+
+  MaxEntries = PcdGet32 (PcdLKLLookupCacheSize);
+  if (MaxEntries == 0) {
+    return;
+  }
+
+  Len = AsciiStrLen (Path);
+
+  EfiAcquireLock (&Cache->Lock);
+
+  Entry = LKLLookupFind (Cache, Path, Len);
+  if (Entry != NULL) {
+    Entry->Status = Status;
+    RemoveEntryList (&Entry->LruLink);
+    InsertHeadList (&Cache->Lru, &Entry->LruLink);
+    EfiReleaseLock (&Cache->Lock);
+    return;
+  }
+
+  while (Cache->Count >= MaxEntries) {
+    LKLLookupRemove (Cache, BASE_CR (GetPreviousNode (&Cache->Lru, &Cache->Lru), LKL_LOOKUP_ENTRY, LruLink));
+  }
+
+  Entry = AllocatePool (OFFSET_OF (LKL_LOOKUP_ENTRY, Path) + Len + 1);
+  if (Entry != NULL) {
+    Entry->Hash   = LKLLookupHash (Path, Len);
+    Entry->Len    = Len;
+    Entry->Status = Status;
+    CopyMem (Entry->Path, Path, Len + 1);
+
+    InsertHeadList (&Cache->Buckets[Entry->Hash % LKL_LOOKUP_BUCKETS], &Entry->Link);
+    InsertHeadList (&Cache->Lru, &Entry->LruLink);
+    Cache->Count++;
+  }
+
+  EfiReleaseLock (&Cache->Lock);
+}
+
+/**
+  Forget all remembered lookups, the counters are kept.
+
+  @param  Cache                 The cache of the volume.
+
+**/
+VOID
+LKLLookupCacheFlush (
+  IN LKL_LOOKUP_CACHE   *Cache
+  )
+{
+  EfiAcquireLock (&Cache->Lock);
+
+  while (!IsListEmpty (&Cache->Lru)) {
+    LKLLookupRemove (Cache, BASE_CR (GetFirstNode (&Cache->Lru), LKL_LOOKUP_ENTRY, LruLink));
+  }
+
+  EfiReleaseLock (&Cache->Lock);
+}
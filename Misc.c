@@ -25,8 +25,6 @@ Revision History
 
 #include "LKL.h"
 
-#define __alloca(size) __builtin_alloca (size)
-
 VOID
 LKLAcquireLock (
   VOID
@@ -56,7 +54,9 @@ LKLFreeVolume (
   IN LKL_VOLUME       *Volume
   )
 {
-  
+  uefi_blk_cleanup (Volume);
+  LKLLookupCacheFlush (&Volume->LookupCache);
+  LKLTraceFree (Volume);
   FreePool (Volume);
 }
 
@@ -154,163 +154,107 @@ PathToUefiAscii(
   }
 }
 
-STATIC VOID*
-mempcpy (
-  VOID *dest,
-  CONST VOID *src,
-  UINTN n
-  )
-{
-  return (CHAR8 *)CopyMem(dest, src, n) + n;
-}
+/**
+  Append a unix style name to a path relative to the volume root.
 
-CHAR8 *
-RealPath (
-  CONST CHAR8 *name,
-  CHAR8 *resolved
-  )
-{
-  CHAR8 *rpath, *dest, *extra_buf = NULL;
-  CONST CHAR8 *start, *end, *rpath_limit;
-  INTN path_max;
-  INTN num_links = 0;
-  UINTN AllocSize;
-
-  if (name == NULL) {
-    /* As per Single Unix Specification V2 we must return an error if
-    either parameter is a null pointer.  We extend this to allow
-     the RESOLVED parameter to be NULL in case the we are expected to
-     allocate the room for the return value.  */
-    return NULL;
-  }
+  The result is normalized without looking at the filesystem: empty and "."
+  components are dropped and ".." removes the previous component. It has
+  no leading or trailing slash, the root directory is "".
 
-  if (name[0] == '\0') {
-    /* As per Single Unix Specification V2 we must return an error if
-    the name argument points to an empty string.  */
-    return NULL;
-  }
+  The kernel resolves ".." after a symlink relative to the link's target,
+  so the lexical result would name a different file. If Root is given, the
+  component a ".." removes is checked with an lstat below Root and such
+  names are rejected. Names without ".." never touch the filesystem.
 
-  path_max = 4096;
+  @param  Root                  Mountpoint of the volume, or NULL.
+  @param  Base                  Path of the directory Name is relative to.
+  @param  Name                  The name, absolute ones start at the root.
+  @param  Result                Receives the path.
+  @param  ResultSize            Size of Result in bytes.
 
-  if (resolved == NULL) {
-    AllocSize = path_max;
-    rpath = AllocatePool (path_max);
-    if (rpath == NULL)
-      return NULL;
-  } else
-    rpath = resolved;
-  rpath_limit = rpath + path_max;
+  @retval EFI_SUCCESS           Result holds the path.
+  @retval EFI_NOT_FOUND         The name goes above the root directory.
+  @retval EFI_UNSUPPORTED       A ".." follows a symlink.
+  @retval EFI_INVALID_PARAMETER The path is too long.
 
-  if (name[0] != '/') {
-    goto error;
-  } else {
-    rpath[0] = '/';
-    dest = rpath + 1;
+**/
+EFI_STATUS
+LKLJoinPath (
+  IN  CONST CHAR8 *Root OPTIONAL,
+  IN  CONST CHAR8 *Base,
+  IN  CONST CHAR8 *Name,
+  OUT CHAR8       *Result,
+  IN  UINTN       ResultSize
+  )
+{
+  CONST CHAR8 *Start;
+  CONST CHAR8 *End;
+  UINTN       Len;
+  CHAR8       *Path;
+  UINTN       PathSize;
+  INTN        RC;
+  struct lkl_stat StatBuf;
+
+  Len = 0;
+  if (Name[0] != '/') {
+    Len = AsciiStrLen (Base);
+    if (Len >= ResultSize) {
+      return EFI_INVALID_PARAMETER;
+    }
+    CopyMem (Result, Base, Len);
   }
 
-  for (start = end = name; *start; start = end) {
-    struct lkl_stat st;
-    INTN n;
+  for (Start = Name; *Start; Start = End) {
+    // skip sequence of multiple path-separators
+    while (*Start == '/')
+      Start++;
 
-    /* Skip sequence of multiple path-separators.  */
-    while (*start == '/')
-      ++start;
+    // find end of path component
+    for (End = Start; *End && *End != '/'; End++);
 
-    /* Find end of path component.  */
-    for (end = start; *end && *end != '/'; ++end)
-      /* Nothing.  */;
+    if (End - Start == 0 || (End - Start == 1 && Start[0] == '.'))
+      continue;
 
-    if (end - start == 0)
-      break;
-    else if (end - start == 1 && start[0] == '.')
-      /* nothing */;
-    else if (end - start == 2 && start[0] == '.' && start[1] == '.') {
-      /* Back up to previous component, ignore if at root already.  */
-      if (dest > rpath + 1)
-        while ((--dest)[-1] != '/');
-    } else {
-      UINTN new_size;
-
-      if (dest[-1] != '/')
-        *dest++ = '/';
-
-      if (dest + (end - start) >= rpath_limit) {
-        INTN dest_offset = dest - rpath;
-        CHAR8 *new_rpath;
-
-        if (resolved) {
-          if (dest > rpath + 1)
-            dest--;
-          *dest = '\0';
-          goto error;
-        }
-        new_size = rpath_limit - rpath;
-        if (end - start + 1 > path_max)
-          new_size += end - start + 1;
-        else
-          new_size += path_max;
-        new_rpath = (CHAR8 *) ReallocatePool (AllocSize, new_size, rpath);
-        AllocSize = new_size;
-        if (new_rpath == NULL)
-          goto error;
-        rpath = new_rpath;
-        rpath_limit = rpath + new_size;
-
-        dest = rpath + dest_offset;
+    if (End - Start == 2 && Start[0] == '.' && Start[1] == '.') {
+      // back up to previous component
+      if (Len == 0)
+        return EFI_NOT_FOUND;
+
+      if (Root != NULL) {
+        Result[Len] = 0;
+        PathSize = AsciiStrLen (Root) + 1 + Len + 1;
+        Path = AllocatePool (PathSize);
+        if (Path == NULL)
+          return EFI_OUT_OF_RESOURCES;
+        AsciiSPrint (Path, PathSize, "%a/%a", Root, Result);
+
+        RC = lkl_sys_fstatat (LKL_AT_FDCWD, Path, &StatBuf, LKL_AT_SYMLINK_NOFOLLOW);
+        FreePool (Path);
+
+        if (RC)
+          return LKLError2EfiError (RC);
+        if (LKL_S_ISLNK (StatBuf.st_mode))
+          return EFI_UNSUPPORTED;
       }
 
-      dest = mempcpy (dest, start, end - start);
-      *dest = '\0';
-
-      if (lkl_sys_lstat (rpath, &st) < 0)
-        goto error;
-
-      if (LKL_S_ISLNK (st.st_mode)) {
-        CHAR8 *buf = __alloca (path_max);
-        UINTN len;
-
-        if (++num_links > 40) {
-          goto error;
-        }
-
-        n = lkl_sys_readlink (rpath, buf, path_max - 1);
-        if (n < 0)
-          goto error;
-        buf[n] = '\0';
-
-        if (!extra_buf)
-          extra_buf = __alloca (path_max);
-
-        len = AsciiStrLen (end);
-        if ((INTN) (n + len) >= path_max) {
-          goto error;
-        }
+      while (Len && Result[Len - 1] != '/')
+        Len--;
+      if (Len)
+        Len--;
+      continue;
+    }
 
-        /* Careful here, end may be a pointer into extra_buf... */
-        CopyMem (&extra_buf[n], end, len + 1);
-        name = end = CopyMem (extra_buf, buf, n);
+    if (Len + 1 + (End - Start) >= ResultSize)
+      return EFI_INVALID_PARAMETER;
 
-        if (buf[0] == '/')
-          dest = rpath + 1;   /* It's an absolute symlink */
-        else
-          /* Back up to previous component, ignore if at root already: */
-          if (dest > rpath + 1)
-            while ((--dest)[-1] != '/');
-      }
-    }
+    if (Len)
+      Result[Len++] = '/';
+    CopyMem (Result + Len, Start, End - Start);
+    Len += End - Start;
   }
-  if (dest > rpath + 1 && dest[-1] == '/')
-    --dest;
-  *dest = '\0';
-
-  ASSERT (resolved == NULL || resolved == rpath);
-  return rpath;
-
-error:
-  ASSERT (resolved == NULL || resolved == rpath);
-  if (resolved == NULL)
-    FreePool (rpath);
-  return NULL;
+
+  Result[Len] = 0;
+  return EFI_SUCCESS;
 }
 
 CONST
@@ -489,6 +433,28 @@ EfiTimeIsValid (
   return TRUE;
 }
 
+VOID
+LKLStatToFileInfo (
+  IN  struct lkl_stat *StatBuf,
+  OUT EFI_FILE_INFO   *FileInfo
+  )
+{
+  FileInfo->FileSize = StatBuf->st_size;
+  FileInfo->PhysicalSize = StatBuf->st_blocks*512;
+  EpochToEfiTime(StatBuf->lkl_st_atime, &FileInfo->LastAccessTime);
+  EpochToEfiTime(StatBuf->lkl_st_mtime, &FileInfo->ModificationTime);
+
+  // since there's no creation-time, use the modificationtime
+  EpochToEfiTime(StatBuf->lkl_st_mtime, &FileInfo->CreateTime);
+  FileInfo->Attribute = 0;
+
+  if ((StatBuf->st_mode&LKL_S_IWUSR)==0)
+    FileInfo->Attribute |= EFI_FILE_READ_ONLY;
+
+  if (LKL_S_ISDIR(StatBuf->st_mode))
+    FileInfo->Attribute |= EFI_FILE_DIRECTORY;
+}
+
 EFI_STATUS
 LKLFillFileInfo (
   IN INTN             FD,
@@ -503,20 +469,7 @@ LKLFillFileInfo (
     return  EFI_DEVICE_ERROR;
   }
 
-  FileInfo->FileSize = StatBuf.st_size;
-  FileInfo->PhysicalSize = StatBuf.st_blocks*512;
-  EpochToEfiTime(StatBuf.lkl_st_atime, &FileInfo->LastAccessTime);
-  EpochToEfiTime(StatBuf.lkl_st_mtime, &FileInfo->ModificationTime);
-
-  // since there's no creation-time, use the modificationtime
-  EpochToEfiTime(StatBuf.lkl_st_mtime, &FileInfo->CreateTime);
-  FileInfo->Attribute = 0;
-
-  if ((StatBuf.st_mode&LKL_S_IWUSR)==0)
-    FileInfo->Attribute |= EFI_FILE_READ_ONLY;
-
-  if (LKL_S_ISDIR(StatBuf.st_mode))
-    FileInfo->Attribute |= EFI_FILE_DIRECTORY;
+  LKLStatToFileInfo(&StatBuf, FileInfo);
 
   return EFI_SUCCESS;
 }
@@ -821,3 +774,186 @@ GetFileFromAnyPartition (
   else
     return EFI_NOT_FOUND;
 }
+
+STATIC
+UINT64
+LKLGetFreeMemory (
+  VOID
+  )
+{
+  EFI_STATUS                Status;
+  EFI_MEMORY_DESCRIPTOR     *MemoryMap;
+  EFI_MEMORY_DESCRIPTOR     *Desc;
+  UINTN                     MapSize;
+  UINTN                     MapKey;
+  UINTN                     DescriptorSize;
+  UINT32                    DescriptorVersion;
+  UINT64                    FreePages;
+
+  MapSize = 0;
+  MemoryMap = NULL;
+  Status = gBS->GetMemoryMap (&MapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion);
+  while (Status == EFI_BUFFER_TOO_SMALL) {
+    // allocating the buffer may split a descriptor, leave some room
+    MapSize += 4 * DescriptorSize;
+    MemoryMap = AllocatePool (MapSize);
+    if (MemoryMap == NULL) {
+      return 0;
+    }
+
+    Status = gBS->GetMemoryMap (&MapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion);
+    if (EFI_ERROR (Status)) {
+      FreePool (MemoryMap);
+      MemoryMap = NULL;
+    }
+  }
+  if (MemoryMap == NULL) {
+    return 0;
+  }
+
+  FreePages = 0;
+  for (Desc = MemoryMap;
+       (UINT8 *)Desc < (UINT8 *)MemoryMap + MapSize;
+       Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize)) {
+    if (Desc->Type == EfiConventionalMemory) {
+      FreePages += Desc->NumberOfPages;
+    }
+  }
+
+  FreePool (MemoryMap);
+  return LShiftU64 (FreePages, EFI_PAGE_SHIFT);
+}
+
+/**
+  Build the command line the LKL kernel is started with.
+
+  The arguments come from the LKLCmdline variable, or PcdLKLCmdline if it
+  isn't set. Unless they already contain a mem= argument one is prepended,
+  sized by the LKLMemSize variable or PcdLKLMemorySize (in MiB). If that is
+  0 the size is PcdLKLMemoryAutoPercent of the free memory in the memory
+  map, capped at PcdLKLMemoryAutoMax MiB.
+
+  @return  The command line, to be freed with FreePool, or NULL.
+
+**/
+CHAR8*
+LKLGetKernelCmdline (
+  VOID
+  )
+{
+  EFI_STATUS                Status;
+  CHAR8                     VarCmdline[LKL_CMDLINE_MAX];
+  CONST CHAR8               *Args;
+  CHAR8                     *Cmdline;
+  UINTN                     CmdlineSize;
+  UINTN                     Size;
+  UINT32                    MemSize;
+  UINT32                    Value;
+
+  Args = PcdGetPtr (PcdLKLCmdline);
+  Size = sizeof (VarCmdline) - 1;
+  Status = gRT->GetVariable (L"LKLCmdline", &gLKLVariableGuid, NULL, &Size, VarCmdline);
+  if (!EFI_ERROR (Status)) {
+    VarCmdline[Size] = '\0';
+    Args = VarCmdline;
+  }
+
+  CmdlineSize = AsciiStrSize (Args) + 16;
+  Cmdline = AllocatePool (CmdlineSize);
+  if (Cmdline == NULL) {
+    return NULL;
+  }
+
+  if (AsciiStrnCmp (Args, "mem=", 4) == 0 || AsciiStrStr (Args, " mem=") != NULL) {
+    AsciiSPrint (Cmdline, CmdlineSize, "%a", Args);
+    return Cmdline;
+  }
+
+  //
+  // A variable of another size than a UINT32 is ignored
+  //
+  MemSize = PcdGet32 (PcdLKLMemorySize);
+  Value = 0;
+  Size = sizeof (Value);
+  Status = gRT->GetVariable (L"LKLMemSize", &gLKLVariableGuid, NULL, &Size, &Value);
+  if (!EFI_ERROR (Status) && Size == sizeof (Value)) {
+    MemSize = Value;
+  }
+
+  if (MemSize == 0) {
+    MemSize = (UINT32)DivU64x32 (
+                        MultU64x32 (RShiftU64 (LKLGetFreeMemory (), 20), PcdGet8 (PcdLKLMemoryAutoPercent)),
+                        100
+                        );
+    MemSize = MIN (MemSize, PcdGet32 (PcdLKLMemoryAutoMax));
+    MemSize = MAX (MemSize, LKL_MEMORY_MIN);
+  }
+
+  if (*Args == '\0') {
+    AsciiSPrint (Cmdline, CmdlineSize, "mem=%uM", MemSize);
+  } else {
+    AsciiSPrint (Cmdline, CmdlineSize, "mem=%uM %a", MemSize, Args);
+  }
+
+  return Cmdline;
+}
+
+/**
+  Check whether a partition has to be mounted synchronously.
+
+  The LKLSyncMounts variable, or PcdLKLSyncMounts if it is not set, holds a
+  space separated list of partition names, "*" matches every partition.
+  All other partitions are mounted in writeback mode.
+
+  @param  PartitionName         The name of the partition.
+
+  @retval TRUE                  Mount with MS_SYNCHRONOUS|MS_DIRSYNC.
+  @retval FALSE                 Mount in writeback mode.
+
+**/
+BOOLEAN
+LKLIsSyncMount (
+  IN CONST CHAR16           *PartitionName
+  )
+{
+  EFI_STATUS                Status;
+  CHAR8                     VarList[LKL_CMDLINE_MAX];
+  CONST CHAR8               *List;
+  CHAR8                     *Name;
+  UINTN                     NameLen;
+  UINTN                     Size;
+  BOOLEAN                   Found;
+
+  List = PcdGetPtr (PcdLKLSyncMounts);
+  Size = sizeof (VarList) - 1;
+  Status = gRT->GetVariable (L"LKLSyncMounts", &gLKLVariableGuid, NULL, &Size, VarList);
+  if (!EFI_ERROR (Status)) {
+    VarList[Size] = '\0';
+    List = VarList;
+  }
+
+  Name = Unicode2Ascii (PartitionName);
+  if (Name == NULL) {
+    return FALSE;
+  }
+  NameLen = AsciiStrLen (Name);
+
+  Found = FALSE;
+  while (*List != '\0' && !Found) {
+    while (*List == ' ') {
+      List++;
+    }
+
+    for (Size = 0; List[Size] != '\0' && List[Size] != ' '; Size++);
+
+    if ((Size == 1 && *List == '*') ||
+        (Size == NameLen && Size != 0 && AsciiStrnCmp (List, Name, Size) == 0)) {
+      Found = TRUE;
+    }
+
+    List += Size;
+  }
+
+  FreePool (Name);
+  return Found;
+}
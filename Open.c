@@ -29,52 +29,80 @@ EFI_STATUS
 LKLAllocateIFile (
   IN LKL_VOLUME   *Volume,
   IN INTN         FD,
+  IN CONST CHAR8  *FilePath,
   OUT LKL_IFILE   **PtrIFile
   )
 {
   LKL_IFILE         *IFile;
-  EFI_STATUS        Status;
+  UINTN             FilePathSize;
   INTN              RC;
+  struct lkl_stat   StatBuf;
+
+  RC = lkl_sys_fstat(FD, &StatBuf);
+  if (RC) {
+    return LKLError2EfiError(RC);
+  }
 
   //
-  // Allocate a new open instance
+  // Allocate a new open instance. It comes from the arena's size classes,
+  // only as large as the path needs.
   //
-  IFile = AllocateZeroPool (sizeof (LKL_IFILE));
+  FilePathSize = AsciiStrSize (FilePath);
+  IFile = LKLArenaAllocate (OFFSET_OF (LKL_IFILE, FilePath) + FilePathSize);
   if (IFile == NULL) {
     return EFI_OUT_OF_RESOURCES;
   }
 
-  RC = lkl_sys_fstat(FD, &IFile->StatBuf);
-  if (RC) {
-    Status = LKLError2EfiError(RC);
-    goto Done;
-  }
+  ZeroMem (IFile, OFFSET_OF (LKL_IFILE, FilePath));
+  CopyMem (IFile->FilePath, FilePath, FilePathSize);
 
   IFile->Signature = LKL_IFILE_SIGNATURE;
   IFile->FD        = FD;
   IFile->Volume    = Volume;
+  IFile->Mode      = StatBuf.st_mode;
+  IFile->Dev       = StatBuf.st_dev;
 
   CopyMem (&(IFile->Handle), &LKLFileInterface, sizeof (EFI_FILE_PROTOCOL));
 
   //
-  // Report the correct revision number based on the DiskIo2 availability
+  // The Ex functions are always available, they run on the LKL worker threads
   //
-  IFile->Handle.Revision = EFI_FILE_PROTOCOL_REVISION;
+  IFile->Handle.Revision = EFI_FILE_PROTOCOL_REVISION2;
 
   *PtrIFile = IFile;
-  Status = EFI_SUCCESS;
+  return EFI_SUCCESS;
+}
 
-Done:
-  if (EFI_ERROR(Status)) {
-    if (IFile)
-      FreePool (IFile);
+/**
+  Check whether a unix style name has a ".." component.
+
+**/
+STATIC
+BOOLEAN
+LKLNameHasDotDot (
+  IN CONST CHAR8  *Name
+  )
+{
+  CONST CHAR8 *Start;
+
+  for (Start = Name; *Start; ) {
+    if (Start[0] == '.' && Start[1] == '.' && (Start[2] == '/' || Start[2] == 0)) {
+      return TRUE;
+    }
+
+    // next component
+    while (*Start && *Start != '/')
+      Start++;
+    while (*Start == '/')
+      Start++;
   }
-  return Status;
+
+  return FALSE;
 }
 
+STATIC
 EFI_STATUS
-EFIAPI
-LKLOpen (
+LKLIFileOpen (
   IN  EFI_FILE_PROTOCOL *FHand,
   OUT EFI_FILE_PROTOCOL **NewHandle,
   IN  CHAR16            *FileName,
@@ -88,22 +116,23 @@ LKLOpen (
   LKL_IFILE   *ParentIFile;
   LKL_IFILE   *IFile;
   INTN        FD;
-  CHAR8       *FileNameAscii;
-  CHAR8       *NewFileName;
-  CHAR8       *AbsFilePath;
-  CONST CHAR8 *BaseName;
+  INTN        DirFD;
+  INTN        CreateDirFD;
+  CHAR8       NameBuffer[sizeof (Volume->LKLMountPoint) + LKL_PATH_MAX];
+  CHAR8       *Name;
+  CHAR8       FilePath[LKL_PATH_MAX];
+  CHAR8       *BaseName;
+  UINTN       MountPointLen;
   BOOLEAN     ReadMode;
   BOOLEAN     WriteMode;
   BOOLEAN     CreateMode;
+  BOOLEAN     Cacheable;
   INTN        LinuxFlags;
   lkl_umode_t LinuxMode;
+  struct lkl_stat StatBuf;
 
   ParentIFile = IFILE_FROM_FHAND (FHand);
   Volume  = ParentIFile->Volume;
-  FileNameAscii = NULL;
-  NewFileName = NULL;
-  AbsFilePath = NULL;
-  BaseName = NULL;
   ReadMode =   ((OpenMode & EFI_FILE_MODE_READ)   !=0);
   WriteMode =  ((OpenMode & EFI_FILE_MODE_WRITE)  !=0);
   CreateMode = ((OpenMode & EFI_FILE_MODE_CREATE) !=0);
@@ -158,77 +187,96 @@ LKLOpen (
   }
 
   FD = -1;
+  CreateDirFD = -1;
 
   if (Volume->ReadOnly && WriteMode) {
     return EFI_WRITE_PROTECTED;
   }
 
-  // convert to char8 unix path
-  FileNameAscii = Unicode2Ascii (FileName);
-  if (FileNameAscii == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Done;
+  //
+  // Convert to a char8 unix path. Room for the mountpoint is left in front
+  // of it, absolute names are resolved from there.
+  //
+  if (StrLen (FileName) >= LKL_PATH_MAX) {
+    return EFI_INVALID_PARAMETER;
   }
-  PathToUnixAscii(FileNameAscii);
-
-  // build absolute path(including the linux mountpoint)
-  if (FileNameAscii[0]=='/') {
-    UINTN  NewFileNameSize = AsciiStrLen(Volume->LKLMountPoint) + AsciiStrLen(FileNameAscii) + 1;
-    NewFileName = AllocatePool(NewFileNameSize);
-    if (!NewFileName) {
-      Status = EFI_OUT_OF_RESOURCES;
-      goto Done;
-    }
+  Name = NameBuffer + sizeof (Volume->LKLMountPoint);
+  UnicodeStrToAsciiStr (FileName, Name);
+  PathToUnixAscii (Name);
 
-    AsciiSPrint(NewFileName, NewFileNameSize, "%a%a", Volume->LKLMountPoint, FileNameAscii);
+  //
+  // The path relative to the volume root is only bookkeeping for GetInfo,
+  // SetInfo and Delete. It's built lexically, only a ".." is checked
+  // against the filesystem, so the path names the file the kernel opens.
+  //
+  Status = LKLJoinPath (Volume->LKLMountPoint, ParentIFile->FilePath, Name, FilePath, sizeof (FilePath));
+  if (EFI_ERROR (Status)) {
+    return Status;
   }
-  else {
-    UINTN  NewFileNameSize = AsciiStrLen(Volume->LKLMountPoint) + 1 + AsciiStrLen(ParentIFile->FilePath) + 1 + AsciiStrLen(FileNameAscii) + 1;
-    NewFileName = AllocatePool(NewFileNameSize);
-    if (!NewFileName) {
-      Status = EFI_OUT_OF_RESOURCES;
-      goto Done;
-    }
 
-    AsciiSPrint(NewFileName, NewFileNameSize, "%a/%a/%a", Volume->LKLMountPoint, ParentIFile->FilePath, FileNameAscii);
+  //
+  // The cache is keyed by the joined path. A ".." in the name isn't
+  // resolved the way the kernel does it, so such names are never cached.
+  //
+  Cacheable = !LKLNameHasDotDot (Name);
+
+  //
+  // Probes of paths that are known to be missing end here
+  //
+  if (!CreateMode && Cacheable &&
+      LKLLookupCacheGet (&Volume->LookupCache, FilePath, &Status) &&
+      EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // Relative names are looked up from the parent directory, the kernel
+  // resolves all components with one openat
+  //
+  if (Name[0]=='/') {
+    MountPointLen = AsciiStrLen (Volume->LKLMountPoint);
+    Name -= MountPointLen;
+    CopyMem (Name, Volume->LKLMountPoint, MountPointLen);
+    DirFD = LKL_AT_FDCWD;
+  }
+  else {
+    DirFD = ParentIFile->FD;
   }
 
   if (CreateMode) {
-    RemoveTrailingSlashes(NewFileName);
-    BaseName = GetBasenamePtr(NewFileName);
+    RemoveTrailingSlashes(Name);
+    BaseName = (CHAR8*)GetBasenamePtr(Name);
     if (BaseName[0]==0) {
       Status = EFI_NOT_FOUND;
       goto Done;
     }
 
-    // remove basename from 'NewFileName'
-    ((CHAR8*)BaseName)[-1] = 0;
-  }
+    //
+    // The file is created in the directory the name points to, that one has
+    // to be on this volume as well
+    //
+    if (BaseName != Name) {
+      BaseName[-1] = 0;
 
-  // resolve realpath
-  AbsFilePath = RealPath(NewFileName, NULL);
-  if (AbsFilePath==NULL) {
-    Status = EFI_NOT_FOUND;
-    goto Done;
-  }
-
-  if (CreateMode) {
-    UINTN  CreateNameSize = AsciiStrLen(AbsFilePath) + 1 + AsciiStrLen(BaseName) + 1;
-    CHAR8 *CreateName = AllocatePool(CreateNameSize);
-    if (CreateName == NULL) {
-      Status = EFI_OUT_OF_RESOURCES;
-      goto Done;
-    }
+      CreateDirFD = lkl_sys_openat(DirFD, Name, LKL_O_RDONLY|LKL_O_DIRECTORY, 0);
+      if (CreateDirFD<0) {
+        Status = LKLError2EfiError(CreateDirFD);
+        goto Done;
+      }
 
-    AsciiSPrint(CreateName, CreateNameSize, "%a/%a", AbsFilePath, BaseName);
+      RC = lkl_sys_fstat(CreateDirFD, &StatBuf);
+      if (RC || StatBuf.st_dev != ParentIFile->Dev) {
+        Status = EFI_NOT_FOUND;
+        goto Done;
+      }
 
-    FreePool(AbsFilePath);
-    BaseName = NULL;
-    AbsFilePath = CreateName;
+      DirFD = CreateDirFD;
+      Name = BaseName;
+    }
 
     // use mkdir if we want to create a directory
     if (Attributes & EFI_FILE_DIRECTORY) {
-      RC = lkl_sys_mkdir(AbsFilePath, LinuxMode);
+      RC = lkl_sys_mkdirat(DirFD, Name, LinuxMode);
       if (RC) {
         Status = LKLError2EfiError(RC);
         goto Done;
@@ -240,44 +288,84 @@ LKLOpen (
     }
   }
 
-  // return error if we're outside the mountpoint's root directory
-  if (!StartsWith(AbsFilePath, Volume->LKLMountPoint)) {
-    Status = EFI_NOT_FOUND;
-    goto Done;
+  //
+  // open the file. A create doesn't follow a symlink in the last component,
+  // it could point off the volume and the file would be created there
+  // before the device check below. A symlink only opens what it points to
+  // if that exists, which leaves that check to reject it.
+  //
+  if (LinuxFlags & LKL_O_CREAT) {
+    FD = lkl_sys_openat(DirFD, Name, LinuxFlags | LKL_O_NOFOLLOW, LinuxMode);
+    if (FD == -LKL_ELOOP) {
+      FD = lkl_sys_openat(DirFD, Name, LinuxFlags & ~LKL_O_CREAT, 0);
+    }
+  }
+  else {
+    FD = lkl_sys_openat(DirFD, Name, LinuxFlags, LinuxMode);
   }
-
-  // open the file
-  FD = lkl_sys_open(AbsFilePath, LinuxFlags, LinuxMode);
   if(FD<0) {
     Status = LKLError2EfiError(FD);
     goto Done;
   }
 
   // allocate internal file structure
-  Status = LKLAllocateIFile (Volume, FD, &IFile);
-  if (!EFI_ERROR (Status)) {
-
-    CONST CHAR8* CopySrc = AbsFilePath + AsciiStrLen(Volume->LKLMountPoint);
-    if (CopySrc[0]=='/')
-      CopySrc++;
+  Status = LKLAllocateIFile (Volume, FD, FilePath, &IFile);
+  if (EFI_ERROR (Status)) {
+    goto Done;
+  }
 
-    AsciiStrnCpyS(IFile->FilePath, sizeof(IFile->FilePath), CopySrc, sizeof(IFile->FilePath));
-    IFile->LinuxOpenFlags = LinuxFlags;
-    *NewHandle = &IFile->Handle;
+  //
+  // Return an error if ".." or a symlink left the volume. Every volume is
+  // its own mount, so that's the case if the device differs.
+  //
+  if (IFile->Dev != ParentIFile->Dev) {
+    LKLArenaFree (IFile);
+    Status = EFI_NOT_FOUND;
+    goto Done;
   }
 
+  IFile->LinuxOpenFlags = LinuxFlags;
+  *NewHandle = &IFile->Handle;
+
 Done:
   if (EFI_ERROR(Status)) {
     if (FD>=0)
       lkl_sys_close (FD);
   }
 
-  if (FileNameAscii!=NULL)
-    FreePool (FileNameAscii);
-  if (NewFileName!=NULL)
-    FreePool (NewFileName);
-  if (AbsFilePath!=NULL)
-    FreePool (AbsFilePath);
+  //
+  // A create may have added entries even if it failed in the end
+  //
+  if (CreateMode) {
+    LKLLookupCacheFlush (&Volume->LookupCache);
+  }
+
+  if (Cacheable && (!EFI_ERROR (Status) || Status == EFI_NOT_FOUND)) {
+    LKLLookupCachePut (&Volume->LookupCache, FilePath, Status);
+  }
+
+  if (CreateDirFD>=0)
+    lkl_sys_close (CreateDirFD);
+
+  return Status;
+}
+
+EFI_STATUS
+EFIAPI
+LKLOpen (
+  IN  EFI_FILE_PROTOCOL *FHand,
+  OUT EFI_FILE_PROTOCOL **NewHandle,
+  IN  CHAR16            *FileName,
+  IN  UINT64            OpenMode,
+  IN  UINT64            Attributes
+  )
+{
+  EFI_STATUS  Status;
+  UINT64      Start;
+
+  Start  = GetPerformanceCounter ();
+  Status = LKLIFileOpen (FHand, NewHandle, FileName, OpenMode, Attributes);
+  LKLStatsRecord (IFILE_FROM_FHAND (FHand)->Volume, LklStatsOpen, 0, Start);
 
   return Status;
 }
@@ -293,8 +381,12 @@ LKLOpenEx (
   IN OUT EFI_FILE_IO_TOKEN    *Token
   )
 {
-  DEBUG((EFI_D_ERROR, "%a:%u\n", __func__, __LINE__));
-  return EFI_DEVICE_ERROR;
+  if (Token->Event == NULL) {
+    Token->Status = LKLOpen (FHand, NewHandle, FileName, OpenMode, Attributes);
+    return Token->Status;
+  }
+
+  return LKLAsyncSubmit (IFILE_FROM_FHAND (FHand), LKL_ASYNC_OPEN, Token, NewHandle, FileName, OpenMode, Attributes);
 }
 
 EFI_STATUS
@@ -302,11 +394,23 @@ LKLIFileClose (
   LKL_IFILE           *IFile
   )
 {
+  //
+  // Writeback mounts only hit the disk at the flush points, closing a
+  // written handle is one of them
+  //
+  if (IFile->Dirty && !IFile->Volume->SyncMount) {
+    lkl_sys_fsync(IFile->FD);
+  }
+
   lkl_sys_close(IFile->FD);
-  
+
+  if (IFile->DirBuffer != NULL) {
+    FreePool (IFile->DirBuffer);
+  }
+
   //
   // Done. Free the open instance structure
   //
-  FreePool (IFile);
+  LKLArenaFree (IFile);
   return EFI_SUCCESS;
 }
@@ -49,11 +49,11 @@ LKLOpenVolume (
   //
   // Open a new instance to the root
   //
-  Status = LKLAllocateIFile (Volume, FD, &IFile);
+  Status = LKLAllocateIFile (Volume, FD, "", &IFile);
   if (!EFI_ERROR (Status)) {
+    IFile->LinuxOpenFlags = LKL_O_RDONLY;
     *File = &IFile->Handle;
   }
-  IFile->LinuxOpenFlags = LKL_O_RDONLY;
 
 Done:
   if (EFI_ERROR(Status)) {
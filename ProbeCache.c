@@ -0,0 +1,275 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  ProbeCache.c
+
+Abstract:
+
+  Cache of partitions that hold no filesystem this driver mounts.
+
+  Entries are keyed by the partition GUID (or MBR signature and partition
+  number) and the MediaId, and carry the fingerprint of the superblock area
+  GetFsType read. DriverBindingSupported rejects a cached partition after a
+  single read that confirms the fingerprint, instead of letting every
+  ConnectController pass probe it again.
+
+  If PcdLKLProbeCachePersist is set the cache is also kept in the volatile
+  LKLProbeCache variable, so a reloaded driver starts with it.
+
+  Entries are added when a mount completes, which may be a notify function
+  interrupting DriverBindingSupported, so the cache is only accessed with
+  mProbeCacheLock held. The disk isn't read with the lock held.
+
+Revision History
+
+--*/
+
+#include "LKL.h"
+
+typedef struct {
+  EFI_GUID              Partition;
+  UINT32                MediaId;
+  UINT32                Fingerprint;
+} LKL_PROBE_ENTRY;
+
+STATIC LKL_PROBE_ENTRY  mProbeCache[LKL_PROBE_CACHE_SIZE];
+STATIC UINTN            mProbeCacheCount;
+STATIC UINTN            mProbeCacheNext;
+STATIC EFI_LOCK         mProbeCacheLock = EFI_INITIALIZE_LOCK_VARIABLE (TPL_CALLBACK);
+
+/**
+  Build the cache key of a partition from its hard drive device path node.
+
+  @retval TRUE                  Key holds the key.
+  @retval FALSE                 The handle isn't a partition.
+
+**/
+STATIC
+BOOLEAN
+LKLProbeCacheKey (
+  IN  EFI_HANDLE        Handle,
+  OUT EFI_GUID          *Key
+  )
+{
+  EFI_DEVICE_PATH_PROTOCOL  *Node;
+  HARDDRIVE_DEVICE_PATH     *Hd;
+
+  Node = DevicePathFromHandle (Handle);
+  if (Node == NULL) {
+    return FALSE;
+  }
+
+  for (; !IsDevicePathEnd (Node); Node = NextDevicePathNode (Node)) {
+    if (DevicePathType (Node) != MEDIA_DEVICE_PATH ||
+        DevicePathSubType (Node) != MEDIA_HARDDRIVE_DP) {
+      continue;
+    }
+
+    Hd = (HARDDRIVE_DEVICE_PATH *)Node;
+    ZeroMem (Key, sizeof (*Key));
+
+    switch (Hd->SignatureType) {
+    case SIGNATURE_TYPE_GUID:
+      CopyMem (Key, Hd->Signature, sizeof (*Key));
+      return TRUE;
+
+    case SIGNATURE_TYPE_MBR:
+      Key->Data1 = ReadUnaligned32 ((UINT32 *)Hd->Signature);
+      Key->Data2 = (UINT16)Hd->PartitionNumber;
+      return TRUE;
+
+    default:
+      return FALSE;
+    }
+  }
+
+  return FALSE;
+}
+
+STATIC
+LKL_PROBE_ENTRY *
+LKLProbeCacheFind (
+  IN EFI_GUID           *Key,
+  IN UINT32             MediaId
+  )
+{
+  UINTN                 Index;
+
+  for (Index = 0; Index < mProbeCacheCount; Index++) {
+    if (mProbeCache[Index].MediaId == MediaId && CompareGuid (&mProbeCache[Index].Partition, Key)) {
+      return &mProbeCache[Index];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Store the cache in the LKLProbeCache variable, with the lock held.
+
+**/
+STATIC
+VOID
+LKLProbeCacheSave (
+  VOID
+  )
+{
+  if (!FeaturePcdGet (PcdLKLProbeCachePersist)) {
+    return;
+  }
+
+  gRT->SetVariable (
+         L"LKLProbeCache",
+         &gLKLVariableGuid,
+         EFI_VARIABLE_BOOTSERVICE_ACCESS,
+         mProbeCacheCount * sizeof (LKL_PROBE_ENTRY),
+         mProbeCache
+         );
+}
+
+/**
+  Load the entries a previous instance of the driver left behind.
+
+**/
+VOID
+LKLProbeCacheLoad (
+  VOID
+  )
+{
+  EFI_STATUS            Status;
+  UINTN                 Size;
+
+  if (!FeaturePcdGet (PcdLKLProbeCachePersist)) {
+    return;
+  }
+
+  Size = sizeof (mProbeCache);
+  Status = gRT->GetVariable (L"LKLProbeCache", &gLKLVariableGuid, NULL, &Size, mProbeCache);
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  mProbeCacheCount = Size / sizeof (LKL_PROBE_ENTRY);
+}
+
+/**
+  Remember that a partition holds nothing this driver mounts.
+
+  @param  Handle                The partition.
+  @param  MediaId               Its current MediaId.
+  @param  Fingerprint           The fingerprint GetFsType returned.
+
+**/
+VOID
+LKLProbeCacheAdd (
+  IN EFI_HANDLE         Handle,
+  IN UINT32             MediaId,
+  IN UINT32             Fingerprint
+  )
+{
+  EFI_GUID              Key;
+  LKL_PROBE_ENTRY       *Entry;
+
+  if (!LKLProbeCacheKey (Handle, &Key)) {
+    return;
+  }
+
+  EfiAcquireLock (&mProbeCacheLock);
+
+  Entry = LKLProbeCacheFind (&Key, MediaId);
+  if (Entry == NULL) {
+    if (mProbeCacheCount < LKL_PROBE_CACHE_SIZE) {
+      Entry = &mProbeCache[mProbeCacheCount++];
+    } else {
+      // replace the entries round robin once the cache is full
+      Entry = &mProbeCache[mProbeCacheNext];
+      mProbeCacheNext = (mProbeCacheNext + 1) % LKL_PROBE_CACHE_SIZE;
+    }
+  }
+
+  CopyGuid (&Entry->Partition, &Key);
+  Entry->MediaId     = MediaId;
+  Entry->Fingerprint = Fingerprint;
+
+  LKLProbeCacheSave ();
+
+  EfiReleaseLock (&mProbeCacheLock);
+}
+
+/**
+  Check whether a partition is known to hold nothing this driver mounts.
+
+  Nothing is read unless the partition is cached. If it is, the fingerprint
+  is read again, and the entry dropped if it changed.
+
+  @param  Handle                The partition.
+  @param  DiskIo                Its DiskIo protocol.
+
+  @retval TRUE                  Don't try to mount the partition.
+  @retval FALSE                 The partition has to be probed.
+
+**/
+BOOLEAN
+LKLProbeCacheCheck (
+  IN EFI_HANDLE             Handle,
+  IN EFI_DISK_IO_PROTOCOL   *DiskIo
+  )
+{
+  EFI_STATUS            Status;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo;
+  EFI_GUID              Key;
+  LKL_PROBE_ENTRY       *Entry;
+  UINT32                MediaId;
+  UINT32                Cached;
+  UINT32                Fingerprint;
+
+  if (mProbeCacheCount == 0 || !LKLProbeCacheKey (Handle, &Key)) {
+    return FALSE;
+  }
+
+  Status = gBS->HandleProtocol (Handle, &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo);
+  if (EFI_ERROR (Status)) {
+    return FALSE;
+  }
+  MediaId = BlockIo->Media->MediaId;
+  Cached  = 0;
+
+  EfiAcquireLock (&mProbeCacheLock);
+  Entry = LKLProbeCacheFind (&Key, MediaId);
+  if (Entry != NULL) {
+    Cached = Entry->Fingerprint;
+  }
+  EfiReleaseLock (&mProbeCacheLock);
+
+  if (Entry == NULL) {
+    return FALSE;
+  }
+
+  Status = GetFsFingerprint (DiskIo, MediaId, &Fingerprint);
+  if (!EFI_ERROR (Status) && Fingerprint == Cached) {
+    return TRUE;
+  }
+
+  // reformatted, probe it again. The entry may have moved in the meantime.
+  EfiAcquireLock (&mProbeCacheLock);
+  Entry = LKLProbeCacheFind (&Key, MediaId);
+  if (Entry != NULL) {
+    *Entry = mProbeCache[--mProbeCacheCount];
+    mProbeCacheNext = 0;
+    LKLProbeCacheSave ();
+  }
+  EfiReleaseLock (&mProbeCacheLock);
+
+  return FALSE;
+}
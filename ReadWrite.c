@@ -70,13 +70,18 @@ LKLSetPosition (
   Volume  = IFile->Volume;
   (VOID)(Volume);
 
-  if (LKL_S_ISDIR(IFile->StatBuf.st_mode)) {
+  if (LKL_S_ISDIR(IFile->Mode)) {
     if (Position==0) {
-      if (IFile->Dir) {
-        lkl_rewinddir(IFile->Dir);
+      NewPosition = lkl_sys_lseek(IFile->FD, 0, LKL_SEEK_SET);
+      if (NewPosition<0) {
+        Status = LKLError2EfiError((INTN)NewPosition);
+      }
+      else {
+        IFile->DirUsed = 0;
+        IFile->DirOffset = 0;
+        IFile->DirEof = FALSE;
+        Status = EFI_SUCCESS;
       }
-      IFile->DirEnt = NULL;
-      Status = EFI_SUCCESS;
     }
     else {
       Status = EFI_UNSUPPORTED;
@@ -102,78 +107,143 @@ Done:
   return Status;
 }
 
+/**
+  Read the next batch of directory entries into IFile->DirBuffer.
+
+  One getdents64 call fetches up to PcdLKLDirBatchSize bytes of entries.
+  Every entry is stat'ed relative to the directory FD, without opening it,
+  and stored as a ready EFI_FILE_INFO record.
+
+  @param  IFile                 The directory.
+
+  @retval EFI_SUCCESS           The buffer holds the next entries, or
+                                IFile->DirEof is set.
+  @return                       The error getdents64 failed with.
+
+**/
+STATIC
 EFI_STATUS
-LKLIFileReadDir (
-  IN     LKL_IFILE              *IFile,
-  IN OUT UINTN                  *BufferSize,
-     OUT VOID                   *Buffer
+LKLIFileFillDir (
+  IN LKL_IFILE              *IFile
   )
 {
-  int         RC;
+  UINT8                     *DentBuffer;
+  UINT32                    DentBufferSize;
   struct lkl_linux_dirent64 *DirEnt;
-  UINTN       Size;
-  UINTN       NameSize;
-  UINTN       ResultSize;
-  EFI_FILE_INFO *FileInfo;
+  struct lkl_stat           StatBuf;
+  EFI_FILE_INFO             *FileInfo;
+  INTN                      RC;
+  INTN                      Pos;
+  UINTN                     Needed;
+
+  IFile->DirUsed = 0;
+  IFile->DirOffset = 0;
+
+  DentBufferSize = PcdGet32 (PcdLKLDirBatchSize);
+  DentBuffer = AllocatePool (DentBufferSize);
+  if (DentBuffer == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
 
-  FileInfo = Buffer;
+  RC = lkl_sys_getdents64 (IFile->FD, (struct lkl_linux_dirent64 *)DentBuffer, DentBufferSize);
+  if (RC < 0) {
+    FreePool (DentBuffer);
+    return LKLError2EfiError (RC);
+  }
 
-  // open dir
-  if (IFile->Dir == NULL) {
-    IFile->Dir = lkl_fdopendir(IFile->FD, &RC);
-    if (IFile->Dir == NULL)
-      return LKLError2EfiError(RC);
+  if (RC == 0) {
+    IFile->DirEof = TRUE;
+    FreePool (DentBuffer);
+    return EFI_SUCCESS;
   }
 
-  if (IFile->DirEnt == NULL) {
-    // read new entry
-    DirEnt = lkl_readdir(IFile->Dir);
+  //
+  // Size the records first, the buffer is kept for the next batch
+  //
+  Needed = 0;
+  for (Pos = 0; Pos < RC; Pos += DirEnt->d_reclen) {
+    DirEnt = (struct lkl_linux_dirent64 *)(DentBuffer + Pos);
+    Needed += LKL_DIR_RECORD_SIZE (AsciiStrLen (DirEnt->d_name));
   }
-  else {
-    // use previously read entry
-    DirEnt = IFile->DirEnt;
+
+  if (Needed > IFile->DirBufferSize) {
+    if (IFile->DirBuffer != NULL) {
+      FreePool (IFile->DirBuffer);
+    }
+
+    IFile->DirBuffer = AllocatePool (Needed);
+    if (IFile->DirBuffer == NULL) {
+      IFile->DirBufferSize = 0;
+      FreePool (DentBuffer);
+      return EFI_OUT_OF_RESOURCES;
+    }
+    IFile->DirBufferSize = Needed;
   }
 
-  if (DirEnt == NULL) {
-    // error
-    if(lkl_errdir(IFile->Dir)) {
-      *BufferSize = 0;
-      return EFI_DEVICE_ERROR;
+  for (Pos = 0; Pos < RC; Pos += DirEnt->d_reclen) {
+    DirEnt = (struct lkl_linux_dirent64 *)(DentBuffer + Pos);
+    FileInfo = (EFI_FILE_INFO *)(IFile->DirBuffer + IFile->DirUsed);
+
+    ZeroMem (FileInfo, SIZE_OF_EFI_FILE_INFO);
+    FileInfo->Size = SIZE_OF_EFI_FILE_INFO + AsciiStrSize (DirEnt->d_name) * sizeof (CHAR16);
+    AsciiStrToUnicodeStr (DirEnt->d_name, FileInfo->FileName);
+
+    //
+    // Symlinks are followed like an open would, dangling ones are
+    // reported as the link itself
+    //
+    if (lkl_sys_fstatat (IFile->FD, DirEnt->d_name, &StatBuf, 0) == 0 ||
+        lkl_sys_fstatat (IFile->FD, DirEnt->d_name, &StatBuf, LKL_AT_SYMLINK_NOFOLLOW) == 0) {
+      LKLStatToFileInfo (&StatBuf, FileInfo);
     }
 
+    IFile->DirUsed += LKL_DIR_RECORD_SIZE (AsciiStrLen (DirEnt->d_name));
+  }
+
+  FreePool (DentBuffer);
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+LKLIFileReadDir (
+  IN     LKL_IFILE              *IFile,
+  IN OUT UINTN                  *BufferSize,
+     OUT VOID                   *Buffer
+  )
+{
+  EFI_STATUS    Status;
+  EFI_FILE_INFO *FileInfo;
+
+  if (IFile->DirOffset >= IFile->DirUsed) {
     // EOF
-    else {
+    if (IFile->DirEof) {
+      *BufferSize = 0;
+      return EFI_SUCCESS;
+    }
+
+    // read the next batch
+    Status = LKLIFileFillDir (IFile);
+    if (EFI_ERROR (Status)) {
+      *BufferSize = 0;
+      return Status;
+    }
+
+    if (IFile->DirEof) {
       *BufferSize = 0;
-      IFile->DirEnt = NULL;
       return EFI_SUCCESS;
     }
   }
 
-  // calculate size
-  Size = SIZE_OF_EFI_FILE_INFO;
-  NameSize = AsciiStrSize(DirEnt->d_name) * sizeof(CHAR16);
-  ResultSize = Size + NameSize;
-  if (ResultSize > *BufferSize) {
-    *BufferSize = ResultSize;
-    IFile->DirEnt = DirEnt;
+  FileInfo = (EFI_FILE_INFO *)(IFile->DirBuffer + IFile->DirOffset);
+  if (FileInfo->Size > *BufferSize) {
+    *BufferSize = (UINTN)FileInfo->Size;
     return EFI_BUFFER_TOO_SMALL;
   }
 
-  // initialize file info
-  ZeroMem (FileInfo, SIZE_OF_EFI_FILE_INFO);
-  FileInfo->Size = ResultSize;
-
-  // write name
-  AsciiStrToUnicodeStr(DirEnt->d_name, FileInfo->FileName);
-
-  // add additional info
-  INTN FD = lkl_sys_openat(IFile->FD, DirEnt->d_name, LKL_O_RDONLY, 0644);
-  if (FD>=0) {
-    LKLFillFileInfo(FD, FileInfo);
-    lkl_sys_close(FD);
-  }
+  CopyMem (Buffer, FileInfo, (UINTN)FileInfo->Size);
+  *BufferSize = (UINTN)FileInfo->Size;
+  IFile->DirOffset += ALIGN_VALUE ((UINTN)FileInfo->Size, 8);
 
-  IFile->DirEnt = NULL;
   return EFI_SUCCESS;
 }
 
@@ -190,14 +260,16 @@ LKLIFileAccess (
   LKL_IFILE   *IFile;
   LKL_VOLUME  *Volume;
   INTN        RC;
+  UINT64      Start;
 
   IFile  = IFILE_FROM_FHAND (FHand);
   Volume = IFile->Volume;
+  Start  = GetPerformanceCounter ();
 
   //
   // Write to a directory is unsupported
   //
-  if (LKL_S_ISDIR(IFile->StatBuf.st_mode) && (IoMode == WRITE_DATA)) {
+  if (LKL_S_ISDIR(IFile->Mode) && (IoMode == WRITE_DATA)) {
     return EFI_UNSUPPORTED;
   }
 
@@ -210,12 +282,13 @@ LKLIFileAccess (
     }
   }
 
-  if (LKL_S_ISDIR(IFile->StatBuf.st_mode)) {
+  if (LKL_S_ISDIR(IFile->Mode)) {
     //
     // Read a directory is supported
     //
     ASSERT (IoMode == READ_DATA);
     Status = LKLIFileReadDir (IFile, BufferSize, Buffer);
+    LKLStatsRecord (Volume, LklStatsReadDir, 0, Start);
   } else {
     //
     // Access a file
@@ -234,7 +307,13 @@ LKLIFileAccess (
     else {
       *BufferSize = RC;
       Status = EFI_SUCCESS;
+
+      if (IoMode == WRITE_DATA) {
+        IFile->Dirty = TRUE;
+      }
     }
+
+    LKLStatsRecord (Volume, IoMode == WRITE_DATA ? LklStatsWrite : LklStatsRead, RC > 0 ? RC : 0, Start);
   }
 
   return Status;
@@ -258,8 +337,12 @@ LKLReadEx (
   IN OUT EFI_FILE_IO_TOKEN  *Token
   )
 {
-  DEBUG((EFI_D_ERROR, "%a:%u\n", __func__, __LINE__));
-  return EFI_UNSUPPORTED;
+  if (Token->Event == NULL) {
+    Token->Status = LKLIFileAccess (FHand, READ_DATA, &Token->BufferSize, Token->Buffer, Token);
+    return Token->Status;
+  }
+
+  return LKLAsyncSubmit (IFILE_FROM_FHAND (FHand), LKL_ASYNC_READ, Token, NULL, NULL, 0, 0);
 }
 
 EFI_STATUS
@@ -280,6 +363,10 @@ LKLWriteEx (
   IN OUT EFI_FILE_IO_TOKEN  *Token
   )
 {
-  DEBUG((EFI_D_ERROR, "%a:%u\n", __func__, __LINE__));
-  return EFI_UNSUPPORTED;
+  if (Token->Event == NULL) {
+    Token->Status = LKLIFileAccess (FHand, WRITE_DATA, &Token->BufferSize, Token->Buffer, Token);
+    return Token->Status;
+  }
+
+  return LKLAsyncSubmit (IFILE_FROM_FHAND (FHand), LKL_ASYNC_WRITE, Token, NULL, NULL, 0, 0);
 }
@@ -0,0 +1,331 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  LKLStat.c
+
+Abstract:
+
+  Shell application printing the I/O statistics of every LKL volume.
+
+    LKLStat.efi [-r] [-t Name]
+
+  The thread profile of the driver is printed first, if it has one. -r
+  resets the counters after printing them. -t also saves the block trace
+  of volume n as \Name<n>.bin on the volume LKLStat was loaded from, for
+  LKLBench -R.
+
+Revision History
+
+--*/
+
+#include <Uefi.h>
+
+#include <Protocol/DevicePath.h>
+#include <Protocol/LoadedImage.h>
+#include <Protocol/SimpleFileSystem.h>
+#include <Protocol/LKLStats.h>
+
+#include <Library/BaseLib.h>
+#include <Library/DevicePathLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PrintLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiLib.h>
+
+STATIC CONST CHAR16 *mOpNames[LklStatsOpMax] = {
+  L"blk-read",
+  L"blk-write",
+  L"blk-flush",
+  L"open",
+  L"read",
+  L"readdir",
+  L"write"
+};
+
+STATIC
+VOID
+StatPrintHistogram (
+  IN LKL_STATS_COUNTERS   *Counters
+  )
+{
+  UINTN   Bucket;
+
+  for (Bucket = 0; Bucket < LKL_STATS_BUCKETS; Bucket++) {
+    if (Counters->Histogram[Bucket] == 0) {
+      continue;
+    }
+
+    if (Bucket == 0) {
+      Print (L"      <1us %10u\n", Counters->Histogram[Bucket]);
+    } else {
+      Print (L"  >=%8luus %10u\n", LShiftU64 (1, Bucket - 1), Counters->Histogram[Bucket]);
+    }
+  }
+}
+
+STATIC
+VOID
+StatPrint (
+  IN EFI_HANDLE   Handle,
+  IN LKL_STATS    *Stats
+  )
+{
+  EFI_DEVICE_PATH_PROTOCOL  *DevicePath;
+  CHAR16                    *Text;
+  LKL_STATS_COUNTERS        *Counters;
+  UINTN                     Op;
+
+  Text = NULL;
+  DevicePath = DevicePathFromHandle (Handle);
+  if (DevicePath != NULL) {
+    Text = ConvertDevicePathToText (DevicePath, TRUE, TRUE);
+  }
+  Print (L"%s\n", Text != NULL ? Text : L"(no device path)");
+  if (Text != NULL) {
+    FreePool (Text);
+  }
+
+  Print (L"  %-10s %10s %14s %12s\n", L"op", L"count", L"bytes", L"avg us");
+  for (Op = 0; Op < LklStatsOpMax; Op++) {
+    Counters = &Stats->Ops[Op];
+    if (Counters->Count == 0) {
+      continue;
+    }
+
+    Print (L"  %-10s %10lu %14lu %12lu\n",
+      mOpNames[Op],
+      Counters->Count,
+      Counters->Bytes,
+      DivU64x64Remainder (Counters->TotalNs, MultU64x32 (Counters->Count, 1000), NULL));
+    StatPrintHistogram (Counters);
+  }
+
+  Print (L"  merged iovecs %lu\n\n", Stats->MergedIovecs);
+}
+
+STATIC
+VOID
+StatPrintProfile (
+  IN LKL_STATS_PROTOCOL   *StatsProtocol
+  )
+{
+  EFI_STATUS          Status;
+  LKL_THREAD_PROFILE  *Profile;
+  UINT64              Total;
+  UINTN               Count;
+  UINTN               Index;
+
+  Count  = 0;
+  Status = StatsProtocol->GetThreadProfile (StatsProtocol, &Count, NULL);
+  if (Status != EFI_BUFFER_TOO_SMALL) {
+    return;
+  }
+
+  Profile = AllocatePool (Count * sizeof (*Profile));
+  if (Profile == NULL) {
+    return;
+  }
+
+  Status = StatsProtocol->GetThreadProfile (StatsProtocol, &Count, Profile);
+  if (!EFI_ERROR (Status)) {
+    Total = 0;
+    for (Index = 0; Index < Count; Index++) {
+      Total += Profile[Index].Samples;
+    }
+
+    Print (L"Threads\n");
+    Print (L"  %-31s %12s %10s %8s %10s\n", L"name", L"runtime us", L"samples", L"%", L"switches");
+    for (Index = 0; Index < Count; Index++) {
+      Print (L"  %-31a %12lu %10lu %8lu %10lu\n",
+        Profile[Index].Name,
+        Profile[Index].RuntimeUs,
+        Profile[Index].Samples,
+        Total != 0 ? DivU64x64Remainder (MultU64x32 (Profile[Index].Samples, 100), Total, NULL) : 0,
+        Profile[Index].Switches);
+    }
+    Print (L"\n");
+  }
+
+  FreePool (Profile);
+}
+
+/**
+  Write the block trace of a volume to a file in the root of Root.
+
+**/
+STATIC
+EFI_STATUS
+StatSaveTrace (
+  IN LKL_STATS_PROTOCOL   *StatsProtocol,
+  IN EFI_FILE_PROTOCOL    *Root,
+  IN CONST CHAR16         *Name,
+  IN UINTN                Index
+  )
+{
+  EFI_STATUS          Status;
+  EFI_FILE_PROTOCOL   *File;
+  CHAR16              Path[128];
+  VOID                *Buffer;
+  UINTN               Size;
+
+  Size   = 0;
+  Status = StatsProtocol->ReadTrace (StatsProtocol, &Size, NULL);
+  if (Status != EFI_BUFFER_TOO_SMALL) {
+    return Status;
+  }
+
+  //
+  // Leave room for requests coming in meanwhile
+  //
+  Size  += 64 * sizeof (LKL_TRACE_RECORD);
+  Buffer = AllocatePool (Size);
+  if (Buffer == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = StatsProtocol->ReadTrace (StatsProtocol, &Size, Buffer);
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  UnicodeSPrint (Path, sizeof (Path), L"\\%s%u.bin", Name, Index);
+
+  //
+  // Replace an older trace
+  //
+  if (!EFI_ERROR (Root->Open (Root, &File, Path, EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE, 0))) {
+    File->Delete (File);
+  }
+
+  Status = Root->Open (Root, &File, Path, EFI_FILE_MODE_CREATE|EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE, 0);
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  Status = File->Write (File, &Size, Buffer);
+  File->Close (File);
+
+  if (!EFI_ERROR (Status)) {
+    Print (L"  trace saved as %s, %u requests\n\n", Path, ((LKL_TRACE_HEADER *)Buffer)->Count);
+  }
+
+Exit:
+  FreePool (Buffer);
+  return Status;
+}
+
+EFI_STATUS
+EFIAPI
+LKLStatMain (
+  IN EFI_HANDLE         ImageHandle,
+  IN EFI_SYSTEM_TABLE   *SystemTable
+  )
+{
+  EFI_STATUS                Status;
+  EFI_LOADED_IMAGE_PROTOCOL *LoadedImage;
+  LKL_STATS_PROTOCOL        *StatsProtocol;
+  LKL_STATS                 *Stats;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *Fs;
+  EFI_FILE_PROTOCOL         *Root;
+  EFI_HANDLE                *Handles;
+  UINTN                     HandleCount;
+  UINTN                     Index;
+  BOOLEAN                   Reset;
+  BOOLEAN                   ProfilePrinted;
+  CHAR16                    *Options;
+  CHAR16                    TraceName[64];
+  UINTN                     Length;
+
+  Reset          = FALSE;
+  ProfilePrinted = FALSE;
+  Root           = NULL;
+  TraceName[0] = 0;
+  Status = gBS->HandleProtocol (ImageHandle, &gEfiLoadedImageProtocolGuid, (VOID **)&LoadedImage);
+  if (!EFI_ERROR (Status) && LoadedImage->LoadOptions != NULL) {
+    Reset = (BOOLEAN)(StrStr (LoadedImage->LoadOptions, L" -r") != NULL);
+
+    Options = StrStr (LoadedImage->LoadOptions, L" -t ");
+    if (Options != NULL) {
+      Options += 4;
+      for (Length = 0; Options[Length] != 0 && Options[Length] != L' ' && Length < ARRAY_SIZE (TraceName) - 1; Length++) {
+        TraceName[Length] = Options[Length];
+      }
+      TraceName[Length] = 0;
+    }
+  }
+
+  if (TraceName[0] != 0) {
+    Status = gBS->HandleProtocol (LoadedImage->DeviceHandle, &gEfiSimpleFileSystemProtocolGuid, (VOID **)&Fs);
+    if (!EFI_ERROR (Status)) {
+      Status = Fs->OpenVolume (Fs, &Root);
+    }
+    if (EFI_ERROR (Status)) {
+      Print (L"Can't open the volume to save traces on: %r\n", Status);
+      Root = NULL;
+    }
+  }
+
+  Status = gBS->LocateHandleBuffer (ByProtocol, &gLKLStatsProtocolGuid, NULL, &HandleCount, &Handles);
+  if (EFI_ERROR (Status)) {
+    Print (L"No LKL volumes\n");
+    return Status;
+  }
+
+  Stats = AllocatePool (sizeof (*Stats));
+  if (Stats == NULL) {
+    FreePool (Handles);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  for (Index = 0; Index < HandleCount; Index++) {
+    Status = gBS->HandleProtocol (Handles[Index], &gLKLStatsProtocolGuid, (VOID **)&StatsProtocol);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    Status = StatsProtocol->GetStats (StatsProtocol, Stats);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    //
+    // Every instance returns the same profile
+    //
+    if (!ProfilePrinted) {
+      StatPrintProfile (StatsProtocol);
+      ProfilePrinted = TRUE;
+    }
+
+    StatPrint (Handles[Index], Stats);
+
+    if (Root != NULL) {
+      Status = StatSaveTrace (StatsProtocol, Root, TraceName, Index);
+      if (EFI_ERROR (Status)) {
+        Print (L"  no trace saved: %r\n\n", Status);
+      }
+    }
+
+    if (Reset) {
+      StatsProtocol->ResetStats (StatsProtocol);
+    }
+  }
+
+  if (Root != NULL) {
+    Root->Close (Root);
+  }
+
+  FreePool (Stats);
+  FreePool (Handles);
+  return EFI_SUCCESS;
+}
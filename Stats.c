@@ -0,0 +1,214 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Stats.c
+
+Abstract:
+
+  Per-volume I/O statistics, published through LKL_STATS_PROTOCOL.
+
+  Recording an operation reads the performance counter once more and does a
+  few interlocked adds, so it stays enabled in release builds. Counters are
+  updated independently of each other, a snapshot taken while I/O is
+  running may be off by the operations in flight.
+
+Revision History
+
+--*/
+
+#include "LKL.h"
+
+//
+// 1 if the performance counter counts up, -1 if it counts down, 0 if not
+// known yet
+//
+STATIC INTN mCounterDirection;
+
+STATIC
+VOID
+LKLStatsAdd64 (
+  IN OUT volatile UINT64  *Value,
+  IN     UINT64           Add
+  )
+{
+  UINT64  Old;
+
+  do {
+    Old = *Value;
+  } while (InterlockedCompareExchange64 ((UINT64 *)Value, Old, Old + Add) != Old);
+}
+
+/**
+  Nanoseconds between two GetPerformanceCounter() values.
+
+  @param  From                  The earlier value.
+  @param  To                    The later value.
+
+  @return The time between them.
+
+**/
+UINT64
+LKLStatsNs (
+  IN UINT64           From,
+  IN UINT64           To
+  )
+{
+  UINT64              StartValue;
+  UINT64              EndValue;
+
+  if (mCounterDirection == 0) {
+    GetPerformanceCounterProperties (&StartValue, &EndValue);
+    mCounterDirection = (EndValue >= StartValue) ? 1 : -1;
+  }
+
+  return GetTimeInNanoSecond (mCounterDirection > 0 ? To - From : From - To);
+}
+
+/**
+  Record one operation.
+
+  @param  Volume                The volume the operation was on.
+  @param  Op                    The type of operation.
+  @param  Bytes                 Bytes transferred.
+  @param  Start                 GetPerformanceCounter() when it started.
+
+**/
+VOID
+LKLStatsRecord (
+  IN LKL_VOLUME       *Volume,
+  IN LKL_STATS_OP     Op,
+  IN UINT64           Bytes,
+  IN UINT64           Start
+  )
+{
+  LKL_STATS_COUNTERS  *Counters;
+  UINT64              Ns;
+  UINTN               Bucket;
+
+  Ns = LKLStatsNs (Start, GetPerformanceCounter ());
+
+  Bucket = 0;
+  if ((Ns >> 10) != 0) {
+    Bucket = MIN ((UINTN)HighBitSet64 (Ns >> 10) + 1, LKL_STATS_BUCKETS - 1);
+  }
+
+  Counters = &Volume->Stats.Ops[Op];
+  LKLStatsAdd64 (&Counters->Count, 1);
+  if (Bytes != 0) {
+    LKLStatsAdd64 (&Counters->Bytes, Bytes);
+  }
+  LKLStatsAdd64 (&Counters->TotalNs, Ns);
+  InterlockedIncrement (&Counters->Histogram[Bucket]);
+}
+
+/**
+  Count iovecs merged into the transfer of the one before them.
+
+  @param  Volume                The volume.
+  @param  Count                 Number of merged iovecs.
+
+**/
+VOID
+LKLStatsMerged (
+  IN LKL_VOLUME       *Volume,
+  IN UINTN            Count
+  )
+{
+  if (Count != 0) {
+    LKLStatsAdd64 (&Volume->Stats.MergedIovecs, Count);
+  }
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+LKLStatsGet (
+  IN  LKL_STATS_PROTOCOL        *This,
+  OUT LKL_STATS                 *Stats
+  )
+{
+  LKL_VOLUME  *Volume;
+
+  if (Stats == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Volume = VOLUME_FROM_STATS_INTERFACE (This);
+  CopyMem (Stats, (VOID *)&Volume->Stats, sizeof (*Stats));
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+LKLStatsReset (
+  IN  LKL_STATS_PROTOCOL        *This
+  )
+{
+  LKL_VOLUME  *Volume;
+
+  Volume = VOLUME_FROM_STATS_INTERFACE (This);
+  ZeroMem ((VOID *)&Volume->Stats, sizeof (Volume->Stats));
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+LKLStatsGetThreadProfile (
+  IN     LKL_STATS_PROTOCOL     *This,
+  IN OUT UINTN                  *Count,
+  OUT    LKL_THREAD_PROFILE     *Profile
+  )
+{
+  UINTN       Used;
+
+  if (!FeaturePcdGet (PcdLKLProfile)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if (Count == NULL || (*Count != 0 && Profile == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Used = uefi_profile_read (Profile, *Count);
+  if (Used > *Count) {
+    *Count = Used;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  *Count = Used;
+  return EFI_SUCCESS;
+}
+
+/**
+  Initialize the statistics and the protocol instance of a volume.
+
+  @param  Volume                The volume.
+
+**/
+VOID
+LKLStatsInit (
+  IN LKL_VOLUME       *Volume
+  )
+{
+  ZeroMem ((VOID *)&Volume->Stats, sizeof (Volume->Stats));
+  Volume->StatsInterface.Revision   = LKL_STATS_PROTOCOL_REVISION;
+  Volume->StatsInterface.GetStats   = LKLStatsGet;
+  Volume->StatsInterface.ResetStats = LKLStatsReset;
+  Volume->StatsInterface.ReadTrace  = LKLTraceRead;
+  Volume->StatsInterface.GetThreadProfile = LKLStatsGetThreadProfile;
+}
@@ -0,0 +1,176 @@
+/*++
+
+Copyright (c) 2016, The EFIDroid Project. All rights reserved.<BR>
+This program and the accompanying materials are licensed and made available
+under the terms and conditions of the BSD License which accompanies this
+distribution. The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+Module Name:
+
+  Trace.c
+
+Abstract:
+
+  Ring of the latest block requests of a volume, for replaying a device's
+  access pattern elsewhere. PcdLKLBlockTraceEntries sets the size of the
+  ring, 0 disables tracing. It's rounded up to a power of two, so the
+  slot counter can wrap without the ring position jumping.
+
+  A request takes its slot with one interlocked increment. The ring is
+  read while requests keep coming in, so the oldest records of a copy may
+  already be overwritten by newer ones.
+
+Revision History
+
+--*/
+
+#include "LKL.h"
+
+/**
+  Allocate the trace ring of a volume, if tracing is enabled.
+
+  @param  Volume                The volume.
+
+**/
+VOID
+LKLTraceInit (
+  IN LKL_VOLUME       *Volume
+  )
+{
+  Volume->TraceEntries = PcdGet32 (PcdLKLBlockTraceEntries);
+  if (Volume->TraceEntries == 0) {
+    return;
+  }
+
+  Volume->TraceEntries = MIN (Volume->TraceEntries, BIT31);
+  if ((Volume->TraceEntries & (Volume->TraceEntries - 1)) != 0) {
+    Volume->TraceEntries = GetPowerOfTwo32 (Volume->TraceEntries) << 1;
+  }
+
+  //
+  // Before the volume's first request, so no record starts earlier
+  //
+  Volume->TraceStart = GetPerformanceCounter ();
+
+  Volume->Trace = AllocateZeroPool (Volume->TraceEntries * sizeof (LKL_TRACE_RECORD));
+  if (Volume->Trace == NULL) {
+    DEBUG ((EFI_D_WARN, "can't allocate block trace ring\n"));
+    Volume->TraceEntries = 0;
+  }
+}
+
+/**
+  Free the trace ring of a volume.
+
+  @param  Volume                The volume.
+
+**/
+VOID
+LKLTraceFree (
+  IN LKL_VOLUME       *Volume
+  )
+{
+  if (Volume->Trace != NULL) {
+    FreePool (Volume->Trace);
+    Volume->Trace = NULL;
+  }
+}
+
+/**
+  Log a finished block request.
+
+  @param  Volume                The volume.
+  @param  Type                  LKL_TRACE_READ, LKL_TRACE_WRITE or LKL_TRACE_FLUSH.
+  @param  Sector                First sector.
+  @param  Length                Bytes transferred.
+  @param  Iovecs                Number of iovecs of the request.
+  @param  Start                 GetPerformanceCounter() when it started.
+
+**/
+VOID
+LKLTraceRecord (
+  IN LKL_VOLUME       *Volume,
+  IN UINT8            Type,
+  IN UINT64           Sector,
+  IN UINT64           Length,
+  IN UINTN            Iovecs,
+  IN UINT64           Start
+  )
+{
+  LKL_TRACE_RECORD    *Record;
+  UINT32              Slot;
+  UINT64              Latency;
+
+  Slot    = InterlockedIncrement (&Volume->TraceNext) - 1;
+  Latency = LKLStatsNs (Start, GetPerformanceCounter ());
+
+  Record = &Volume->Trace[Slot & (Volume->TraceEntries - 1)];
+  Record->TimeNs    = LKLStatsNs (Volume->TraceStart, Start);
+  Record->Sector    = Sector;
+  Record->Length    = (UINT32)MIN (Length, MAX_UINT32);
+  Record->LatencyNs = (UINT32)MIN (Latency, MAX_UINT32);
+  Record->Iovecs    = (UINT16)MIN (Iovecs, MAX_UINT16);
+  Record->Type      = Type;
+}
+
+/**
+  LKL_STATS_PROTOCOL.ReadTrace()
+
+**/
+EFI_STATUS
+EFIAPI
+LKLTraceRead (
+  IN     LKL_STATS_PROTOCOL     *This,
+  IN OUT UINTN                  *BufferSize,
+  OUT    VOID                   *Buffer
+  )
+{
+  LKL_VOLUME        *Volume;
+  LKL_TRACE_HEADER  *Header;
+  LKL_TRACE_RECORD  *Records;
+  UINT32            Total;
+  UINT32            Count;
+  UINT32            First;
+  UINT32            Index;
+  UINTN             Size;
+
+  if (BufferSize == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Volume = VOLUME_FROM_STATS_INTERFACE (This);
+  if (Volume->Trace == NULL) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Total = Volume->TraceNext;
+  Count = MIN (Total, Volume->TraceEntries);
+  Size  = sizeof (LKL_TRACE_HEADER) + Count * sizeof (LKL_TRACE_RECORD);
+
+  if (*BufferSize < Size || Buffer == NULL) {
+    *BufferSize = Size;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  Header = Buffer;
+  ZeroMem (Header, sizeof (*Header));
+  Header->Magic      = LKL_TRACE_MAGIC;
+  Header->Version    = LKL_TRACE_VERSION;
+  Header->RecordSize = sizeof (LKL_TRACE_RECORD);
+  Header->Count      = Count;
+  Header->Total      = Total;
+
+  Records = (LKL_TRACE_RECORD *)(Header + 1);
+  First   = Total - Count;
+  for (Index = 0; Index < Count; Index++) {
+    CopyMem (&Records[Index], &Volume->Trace[(First + Index) & (Volume->TraceEntries - 1)], sizeof (LKL_TRACE_RECORD));
+  }
+
+  *BufferSize = Size;
+  return EFI_SUCCESS;
+}
@@ -3,116 +3,614 @@
 #include <jmp_buf.h>
 #include <unistd.h>
 
+#include <lk/err.h>
 #include <lk/kernel/semaphore.h>
 #include <lk/kernel/mutex.h>
 #include <lk/kernel/thread.h>
 #include <lk/kernel/event.h>
+#include <lk/kernel/stack.h>
+#include <lk/kernel/timer.h>
+#include <lk/kernel/mp.h>
+#include <lk/platform/timer.h>
 
 #include "LKL.h"
 
+#include <Protocol/MpService.h>
+#if defined (MDE_CPU_X64)
+#include <Library/LocalApicLib.h>
+#else
+#include <Library/ArmLib.h>
+#endif
+
+/*
+ * SMP
+ *
+ * With PcdLKLSmp the application processors run LK threads too, once the
+ * kernel is started. Only the boot processor may call into the firmware,
+ * so LK threads are pinned to it unless they unpin themselves. The LKL
+ * threads do, and go back to the boot processor with uefi_bsp_enter()
+ * for everything that reaches the firmware: block requests, memory
+ * allocation, timer events and console output.
+ *
+ * The APs take no interrupts. Each one runs an LK idle thread on the stack
+ * the MP services gave it, polls the run queues for work and runs threads
+ * until they block or yield, without preemption.
+ *
+ * All of this needs LK built with WITH_SMP, see LKL_SMP in LKL.dsc.inc.
+ */
+#if WITH_SMP
+STATIC EFI_MP_SERVICES_PROTOCOL *mMpServices;
+STATIC UINT64 mCpuIds[SMP_MAX_CPUS];
+STATIC EFI_EVENT mApEvents[SMP_MAX_CPUS];
+STATIC volatile BOOLEAN mApDone[SMP_MAX_CPUS];
+
+STATIC UINT64 platform_cpu_id(void)
+{
+#if defined (MDE_CPU_X64)
+	return GetApicId();
+#else
+	return ArmReadMpidr();
+#endif
+}
+
+uint platform_curr_cpu_num(void)
+{
+	UINT64 id = platform_cpu_id();
+	uint cpu;
+
+	for (cpu = 0; cpu < arch_cpu_count; cpu++) {
+		if (mCpuIds[cpu] == id)
+			return cpu;
+	}
+
+	ASSERT(FALSE);
+	return 0;
+}
+#endif
+
+/*
+ * Keep the current thread on the boot processor until uefi_bsp_leave().
+ * Returns the pinning to restore.
+ */
+static int uefi_bsp_enter(void)
+{
+	thread_t *self = get_current_thread();
+	int pinned = thread_pinned_cpu(self);
+
+	if (pinned != 0) {
+		thread_set_pinned_cpu(self, 0);
+		if (arch_curr_cpu_num() != 0)
+			thread_yield();
+	}
+
+	return pinned;
+}
+
+static void uefi_bsp_leave(int pinned)
+{
+	thread_set_pinned_cpu(get_current_thread(), pinned);
+}
+
+#if WITH_SMP
+STATIC VOID EFIAPI ap_entry(IN OUT VOID *arg)
+{
+	uint cpu = (uint)(UINTN)arg;
+
+	mCpuIds[cpu] = platform_cpu_id();
+
+	thread_secondary_cpu_init_early();
+	thread_secondary_cpu_entry();
+
+	MemoryFence();
+	mApDone[cpu] = TRUE;
+}
+
+void lkl_smp_start(void)
+{
+	EFI_PROCESSOR_INFORMATION info;
+	UINTN numbers[SMP_MAX_CPUS];
+	UINTN count, enabled, i;
+	EFI_STATUS Status;
+	uint cpu, cpus;
+
+	if (mMpServices)
+		return;
+
+	Status = gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL, (VOID **)&mMpServices);
+	if (EFI_ERROR(Status)) {
+		mMpServices = NULL;
+		return;
+	}
+
+	Status = mMpServices->GetNumberOfProcessors(mMpServices, &count, &enabled);
+	if (EFI_ERROR(Status))
+		return;
+
+	cpus = 1;
+	for (i = 0; i < count && cpus < SMP_MAX_CPUS; i++) {
+		Status = mMpServices->GetProcessorInfo(mMpServices, i, &info);
+		if (EFI_ERROR(Status) || (info.StatusFlag & PROCESSOR_AS_BSP_BIT))
+			continue;
+		if (!(info.StatusFlag & PROCESSOR_ENABLED_BIT) || !(info.StatusFlag & PROCESSOR_HEALTH_STATUS_BIT))
+			continue;
+
+		/* the MP services want an event to start an AP without blocking */
+		Status = gBS->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &mApEvents[cpus]);
+		if (EFI_ERROR(Status))
+			break;
+
+		numbers[cpus++] = i;
+	}
+
+	if (cpus == 1)
+		return;
+
+	for (cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+		mCpuIds[cpu] = MAX_UINT64;
+	mCpuIds[0] = platform_cpu_id();
+	MemoryFence();
+	arch_cpu_count = cpus;
+
+	for (cpu = 1; cpu < cpus; cpu++) {
+		mp_set_cpu_active(cpu, true);
+
+		Status = mMpServices->StartupThisAP(mMpServices, ap_entry, numbers[cpu], mApEvents[cpu], 0, (VOID *)(UINTN)cpu, NULL);
+		if (EFI_ERROR(Status)) {
+			DEBUG((EFI_D_WARN, "LKL: can't start processor %lu: %r\n", (UINT64)numbers[cpu], Status));
+			mp_set_cpu_active(cpu, false);
+			mApDone[cpu] = TRUE;
+		}
+	}
+
+	DEBUG((EFI_D_INFO, "LKL: running threads on %u cpus\n", cpus));
+}
+
+/*
+ * Hand the APs back to the firmware. The threads queued on them move to
+ * the boot processor, a thread running on one finishes there once it
+ * blocks or yields, and may need the boot processor for that.
+ *
+ * The wait events are left alone, the MP services signal them once they
+ * notice that the APs are done.
+ */
+void lkl_smp_stop(void)
+{
+	uint cpus = arch_cpu_count;
+	uint cpu;
+
+	if (cpus == 1)
+		return;
+
+	for (cpu = 1; cpu < cpus; cpu++)
+		thread_secondary_cpu_stop(cpu);
+
+	for (cpu = 1; cpu < cpus; cpu++) {
+		while (!mApDone[cpu]) {
+			platform_timer_flush();
+			thread_yield();
+		}
+	}
+
+	arch_cpu_count = 1;
+}
+#else
+void lkl_smp_start(void)
+{
+	DEBUG((EFI_D_WARN, "LKL: built without LKL_SMP, PcdLKLSmp has no effect\n"));
+}
+
+void lkl_smp_stop(void)
+{
+}
+#endif
+
 static void print(const char *str, int len)
 {
 	int ret __attribute__((unused));
+	int pinned;
 
 	DEBUG_CODE_BEGIN();
+	pinned = uefi_bsp_enter();
 	ret = write(STDOUT_FILENO, str, len);
+	uefi_bsp_leave(pinned);
 	DEBUG_CODE_END();
 }
 
+/*
+ * Synchronization
+ *
+ * LKL takes its semaphores and mutexes at a very high rate, and most of
+ * those operations are uncontended. Every LK primitive operation raises
+ * the thread lock, which costs several calls into the CPU arch protocol.
+ * So each LKL semaphore is a counter that is updated with interlocked
+ * operations, and the LK semaphore is only used to block and wake the
+ * threads that actually have to wait:
+ *
+ *   count > 0   resources available
+ *   count <= 0  -count threads are blocked (or about to block) on wait
+ *
+ * A thread that finds the semaphore empty can optionally yield a few times
+ * (PcdLKLSyncSpinCount) before it blocks. Spinning without yielding is
+ * pointless here, because the owner can only run once we yield.
+ */
+struct lkl_sem {
+	UINT32 count;
+	semaphore_t wait;
+};
+
 struct lkl_mutex {
 	int recursive;
-	mutex_t mutex;
-	semaphore_t sem;
+	thread_t *owner;
+	UINT32 depth;
+	struct lkl_sem sem;
 };
 
-struct lkl_sem {
-	semaphore_t sem;
-};
+static void fast_sem_init(struct lkl_sem *sem, int count)
+{
+	sem->count = (UINT32)count;
+	sem_init(&sem->wait, 0);
+}
+
+static void fast_sem_up(struct lkl_sem *sem)
+{
+	if ((INT32)InterlockedIncrement(&sem->count) <= 0)
+		sem_post(&sem->wait, 1);
+}
+
+static void fast_sem_down(struct lkl_sem *sem)
+{
+	UINT32 spin;
+	int err;
+
+	for (spin = PcdGet32(PcdLKLSyncSpinCount); spin && (INT32)sem->count <= 0; spin--)
+		thread_yield();
+
+	if ((INT32)InterlockedDecrement(&sem->count) >= 0)
+		return;
+
+	do {
+		err = sem_wait(&sem->wait);
+	} while (err < 0);
+}
 
 static struct lkl_sem *sem_alloc(int count)
 {
 	struct lkl_sem *sem;
+	int pinned;
 
-	sem = AllocatePool(sizeof(*sem));
+	pinned = uefi_bsp_enter();
+	sem = LKLArenaAllocate(sizeof(*sem));
+	uefi_bsp_leave(pinned);
 	if (!sem)
 		return NULL;
 
-	sem_init(&sem->sem, count);
+	fast_sem_init(sem, count);
 
 	return sem;
 }
 
 static void sem_free(struct lkl_sem *sem)
 {
-	sem_destroy(&sem->sem);
-	FreePool(sem);
+	int pinned;
+
+	sem_destroy(&sem->wait);
+
+	pinned = uefi_bsp_enter();
+	LKLArenaFree(sem);
+	uefi_bsp_leave(pinned);
 }
 
 static void sem_up(struct lkl_sem *sem)
 {
-	sem_post(&sem->sem, 1);
+	fast_sem_up(sem);
 }
 
 static void sem_down(struct lkl_sem *sem)
 {
-	int err;
-	do {
-		thread_yield();
-		err = sem_wait(&sem->sem);
-	} while (err < 0);
+	fast_sem_down(sem);
 }
 
 static struct lkl_mutex *mutex_alloc(int recursive)
 {
-	struct lkl_mutex *mutex = AllocatePool(sizeof(struct lkl_mutex));
+	struct lkl_mutex *mutex;
+	int pinned;
+
+	pinned = uefi_bsp_enter();
+	mutex = LKLArenaAllocate(sizeof(struct lkl_mutex));
+	uefi_bsp_leave(pinned);
 
 	if (!mutex)
 		return NULL;
 
-	if (recursive)
-		mutex_init(&mutex->mutex);
-	else
-		sem_init(&mutex->sem, 1);
+	fast_sem_init(&mutex->sem, 1);
 	mutex->recursive = recursive;
+	mutex->owner = NULL;
+	mutex->depth = 0;
 
 	return mutex;
 }
 
 static void mutex_lock(struct lkl_mutex *mutex)
 {
-	int err;
+	thread_t *self;
 
-	if (mutex->recursive)
-		mutex_acquire(&mutex->mutex);
-	else {
-		do {
-			thread_yield();
-			err = sem_wait(&mutex->sem);
-		} while (err < 0);
+	if (!mutex->recursive) {
+		fast_sem_down(&mutex->sem);
+		return;
+	}
+
+	/* only the owner itself can observe owner == self */
+	self = get_current_thread();
+	if (mutex->owner == self) {
+		mutex->depth++;
+		return;
 	}
+
+	fast_sem_down(&mutex->sem);
+	mutex->owner = self;
+	mutex->depth = 1;
 }
 
 static void mutex_unlock(struct lkl_mutex *mutex)
 {
-	if (mutex->recursive)
-		mutex_release(&mutex->mutex);
-	else {
-		sem_post(&mutex->sem, 1);
+	if (mutex->recursive) {
+		ASSERT(mutex->owner == get_current_thread());
+
+		if (--mutex->depth)
+			return;
+
+		mutex->owner = NULL;
 	}
+
+	fast_sem_up(&mutex->sem);
 }
 
 static void mutex_free(struct lkl_mutex *mutex)
 {
-	if (mutex->recursive)
-		mutex_destroy(&mutex->mutex);
-	else
-		sem_destroy(&mutex->sem);
-	FreePool(mutex);
+	int pinned;
+
+	sem_destroy(&mutex->sem.wait);
+
+	pinned = uefi_bsp_enter();
+	LKLArenaFree(mutex);
+	uefi_bsp_leave(pinned);
 }
 
+/*
+ * Scheduler clock
+ *
+ * Time is taken from the platform performance counter, which is far finer
+ * than the firmware timer tick. The counter may wrap and may count down, so
+ * the elapsed ticks are accumulated into a 64 bit value on every read.
+ *
+ * LK is built with PLATFORM_HAS_DYNAMIC_TIMER: there is no periodic tick,
+ * the timer queue programs a single one-shot UEFI timer event for its
+ * earliest deadline and the preemption tick only runs while a regular
+ * thread is runnable. An idle system takes no scheduler wakeups at all.
+ */
 #define MS2100N(x) ((x)*(1000000/100))
 STATIC EFI_EVENT mTimerEvent;
-STATIC volatile lk_time_t ticks = 0;
+STATIC platform_timer_callback mTimerCallback;
+STATIC void *mTimerArg;
+
+STATIC UINT64 mCounterFreq;
+STATIC UINT64 mCounterStart;
+STATIC UINT64 mCounterEnd;
+STATIC UINT64 mCounterLast;
+STATIC UINT64 mCounterElapsed;
+
+/*
+ * Only the boot cpu reads the performance counter, the counters of the
+ * other cpus needn't agree with it. They return the elapsed time the boot
+ * cpu published last, which it refreshes on every timer event and in its
+ * idle loop. On the boot cpu the timer event calls in here too, so the
+ * update runs with interrupts off.
+ */
+STATIC UINT64 counter_elapsed(void)
+{
+	spin_lock_saved_state_t state;
+	UINT64 now, delta;
+
+	if (arch_curr_cpu_num() != 0)
+		return __atomic_load_n(&mCounterElapsed, __ATOMIC_RELAXED);
+
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	now = GetPerformanceCounter();
+	if (mCounterEnd > mCounterStart) {
+		if (now >= mCounterLast)
+			delta = now - mCounterLast;
+		else
+			delta = (mCounterEnd - mCounterLast) + (now - mCounterStart) + 1;
+	} else {
+		if (now <= mCounterLast)
+			delta = mCounterLast - now;
+		else
+			delta = (mCounterLast - mCounterEnd) + (mCounterStart - now) + 1;
+	}
+
+	mCounterLast = now;
+
+	delta += mCounterElapsed;
+	__atomic_store_n(&mCounterElapsed, delta, __ATOMIC_RELAXED);
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	return delta;
+}
+
+/* convert counter ticks to a time unit without overflowing the multiply */
+STATIC UINT64 counter_to_units(UINT64 ticks, UINT32 units_per_sec)
+{
+	UINT64 rem;
+	UINT64 secs = DivU64x64Remainder(ticks, mCounterFreq, &rem);
+
+	return MultU64x32(secs, units_per_sec) + DivU64x64Remainder(MultU64x32(rem, units_per_sec), mCounterFreq, NULL);
+}
+
+/*
+ * Sampling profiler
+ *
+ * Every scheduler tick counts a sample for the thread it interrupted, and
+ * every context switch charges the time since the previous one to the
+ * thread that ran. Threads are accounted by name, so a thread that exits
+ * keeps its numbers and threads running the same code add up. LKL threads
+ * are named after their entry point for that.
+ *
+ * The timer arch driver doesn't pass the interrupted context on to timer
+ * events, so there's no program counter to sample, only the thread.
+ */
+#define PROFILE_SLOTS 64
+
+struct profile_slot {
+	char name[32];
+	UINT64 runtime;		/* counter ticks */
+	UINT64 samples;
+	UINT64 switches;
+};
+
+STATIC struct profile_slot mProfile[PROFILE_SLOTS];
+STATIC UINT32 mProfileUsed;
+STATIC UINT64 mProfileLast[SMP_MAX_CPUS];
+
+/* the caller holds the thread lock */
+STATIC struct profile_slot *profile_slot(thread_t *t)
+{
+	struct profile_slot *slot = t->profile;
+	UINT32 i;
+
+	if (slot)
+		return slot;
+
+	for (i = 0; i < mProfileUsed; i++) {
+		if (!AsciiStrnCmp(mProfile[i].name, t->name, sizeof(mProfile[i].name))) {
+			slot = &mProfile[i];
+			break;
+		}
+	}
+
+	if (!slot) {
+		if (mProfileUsed < PROFILE_SLOTS - 1) {
+			slot = &mProfile[mProfileUsed++];
+			AsciiStrnCpyS(slot->name, sizeof(slot->name), t->name, sizeof(slot->name) - 1);
+		} else {
+			/* everything that didn't fit */
+			slot = &mProfile[PROFILE_SLOTS - 1];
+			AsciiStrCpyS(slot->name, sizeof(slot->name), "(other)");
+			mProfileUsed = PROFILE_SLOTS;
+		}
+	}
+
+	t->profile = slot;
+	return slot;
+}
+
+void platform_thread_switch(thread_t *oldthread, thread_t *newthread)
+{
+	UINT64 now;
+	uint cpu;
+
+	if (!FeaturePcdGet(PcdLKLProfile))
+		return;
+
+	cpu = arch_curr_cpu_num();
+	now = counter_elapsed();
+	profile_slot(oldthread)->runtime += now - mProfileLast[cpu];
+	profile_slot(newthread)->switches++;
+	mProfileLast[cpu] = now;
+}
+
+/* only the boot cpu takes timer interrupts, so only its threads are sampled */
+STATIC void profile_sample(void)
+{
+	THREAD_LOCK(state);
+	profile_slot(get_current_thread())->samples++;
+	THREAD_UNLOCK(state);
+}
+
+UINTN uefi_profile_read(LKL_THREAD_PROFILE *profile, UINTN count)
+{
+	UINT64 now;
+	UINTN used;
+	UINTN i;
+	uint cpu;
+
+	if (!FeaturePcdGet(PcdLKLProfile))
+		return 0;
+
+	THREAD_LOCK(state);
+
+	/* charge the running thread up to now, the other cpus catch up on their next switch */
+	cpu = arch_curr_cpu_num();
+	now = counter_elapsed();
+	profile_slot(get_current_thread())->runtime += now - mProfileLast[cpu];
+	mProfileLast[cpu] = now;
+
+	used = mProfileUsed;
+	for (i = 0; i < MIN(used, count); i++) {
+		CopyMem(profile[i].Name, mProfile[i].name, sizeof(profile[i].Name));
+		profile[i].RuntimeUs = counter_to_units(mProfile[i].runtime, 1000000);
+		profile[i].Samples = mProfile[i].samples;
+		profile[i].Switches = mProfile[i].switches;
+	}
+
+	THREAD_UNLOCK(state);
+
+	return used;
+}
+
+/*
+ * The timer queue and the scheduler change the deadline with their
+ * spinlock held and interrupts off. SetTimer would restore the TPL and
+ * dispatch TimerCallback right there, which takes the same locks again, so
+ * the new deadline is only recorded here. platform_timer_flush() programs
+ * it once the lock is dropped, and only on the boot cpu, as that's the
+ * only one allowed to call into the firmware. The other cpus leave it to
+ * the idle loop or the next tick of the boot cpu.
+ */
+#define TIMER_DEFER_NONE 0
+#define TIMER_DEFER_SET  1
+#define TIMER_DEFER_STOP 2
+
+STATIC volatile UINT32 mTimerDeferred;
+STATIC volatile lk_time_t mTimerDeferredAt;
+
+void platform_timer_flush(void)
+{
+	UINT32 op = mTimerDeferred;
+	lk_time_t now, at;
+	EFI_TPL OldTpl;
+
+	if (op == TIMER_DEFER_NONE || arch_curr_cpu_num() != 0)
+		return;
+
+	/* keep TimerCallback from recording and flushing a newer deadline in between */
+	OldTpl = gBS->RaiseTPL (TPL_HIGH_LEVEL);
+
+	do {
+		op = mTimerDeferred;
+	} while (InterlockedCompareExchange32(&mTimerDeferred, op, TIMER_DEFER_NONE) != op);
+
+	if (op == TIMER_DEFER_STOP) {
+		gBS->SetTimer (mTimerEvent, TimerCancel, 0);
+	} else if (op == TIMER_DEFER_SET) {
+		/* a zero relative timeout would fire on the next firmware tick anyway */
+		at = mTimerDeferredAt;
+		now = current_time();
+		gBS->SetTimer (mTimerEvent, TimerRelative, MS2100N((UINT64)(TIME_GT(at, now) ? at - now : 1)));
+	}
+
+	gBS->RestoreTPL (OldTpl);
+}
+
+#if WITH_SMP
+void platform_idle(void)
+{
+	/* keeps the clock of the other cpus going */
+	counter_elapsed();
+	platform_timer_flush();
+}
+#endif
 
 VOID
 EFIAPI
@@ -121,46 +619,155 @@ TimerCallback (
     IN  VOID        *Context
 )
 {
-	ticks += 10;
-	if (thread_timer_tick()==INT_RESCHEDULE) {
-		thread_preempt();
+	platform_timer_callback callback = mTimerCallback;
+	enum handler_return ret;
+
+	if (callback) {
+		if (FeaturePcdGet(PcdLKLProfile))
+			profile_sample();
+
+		ret = callback(mTimerArg, current_time());
+	} else {
+		ret = INT_NO_RESCHEDULE;
 	}
+
+	/* the timer queue rearmed itself with its lock held */
+	platform_timer_flush();
+
+	if (ret == INT_RESCHEDULE)
+		thread_preempt();
 }
+
+status_t platform_set_oneshot_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
+{
+	mTimerCallback = callback;
+	mTimerArg = arg;
+
+	/* the caller holds the timer lock, this supersedes anything recorded before */
+	mTimerDeferredAt = current_time() + MAX(interval, 1);
+	MemoryFence();
+	mTimerDeferred = TIMER_DEFER_SET;
+
+	return NO_ERROR;
+}
+
+void platform_stop_timer(void)
+{
+	mTimerDeferred = TIMER_DEFER_STOP;
+}
+
 lk_time_t current_time(void)
 {
-	return ticks;
+	return (lk_time_t)counter_to_units(counter_elapsed(), 1000);
 }
 
 lk_bigtime_t current_time_hires(void)
 {
-	lk_bigtime_t time;
+	return counter_to_units(counter_elapsed(), 1000000);
+}
+
+/*
+ * Work queue
+ *
+ * A small pool of LK threads runs LKL_WORK items, which may block in LKL
+ * system calls. Used for the token based file protocol requests (Async.c).
+ */
+STATIC LIST_ENTRY mWorkQueue = INITIALIZE_LIST_HEAD_VARIABLE (mWorkQueue);
+STATIC EFI_LOCK mWorkLock = EFI_INITIALIZE_LOCK_VARIABLE (TPL_NOTIFY);
+STATIC struct lkl_sem mWorkSem;
+
+static int work_thread(void *arg)
+{
+	LKL_WORK *work;
+
+	for (;;) {
+		fast_sem_down(&mWorkSem);
+
+		EfiAcquireLock(&mWorkLock);
+		ASSERT(!IsListEmpty(&mWorkQueue));
+		work = BASE_CR(GetFirstNode(&mWorkQueue), LKL_WORK, Link);
+		RemoveEntryList(&work->Link);
+		EfiReleaseLock(&mWorkLock);
+
+		work->Func(work);
+	}
+
+	return 0;
+}
+
+void lkl_work_queue(LKL_WORK *work)
+{
+	EfiAcquireLock(&mWorkLock);
+	InsertTailList(&mWorkQueue, &work->Link);
+	EfiReleaseLock(&mWorkLock);
 
-	time = (lk_bigtime_t)ticks * 1000;
-	return time;
+	fast_sem_up(&mWorkSem);
 }
 
+static void work_init(void)
+{
+	thread_t *thread;
+	UINT32 i;
+
+	fast_sem_init(&mWorkSem, 0);
+
+	for (i = 0; i < MAX(PcdGet32(PcdLKLWorkerThreads), 1); i++) {
+		thread = thread_create("worker", work_thread, NULL, DEFAULT_PRIORITY, PcdGet32(PcdLKLThreadStackSize));
+		ASSERT(thread);
+		thread_detach_and_resume(thread);
+	}
+}
+
+static void ltimer_init(void);
+
 void lkl_thread_init(void)
 {
 	EFI_STATUS Status;
 
+	mCounterFreq = GetPerformanceCounterProperties(&mCounterStart, &mCounterEnd);
+	mCounterLast = GetPerformanceCounter();
+	mCounterElapsed = 0;
+
+	Status = gBS->CreateEvent (EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK, TimerCallback, NULL, &mTimerEvent);
+	ASSERT_EFI_ERROR (Status);
+
+	timer_init();
 	thread_init_early();
 	thread_init();
 	thread_create_idle();
 	thread_set_priority(DEFAULT_PRIORITY);
 
-	Status = gBS->CreateEvent (EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK, TimerCallback, NULL, &mTimerEvent);
-	ASSERT_EFI_ERROR (Status);
+	ltimer_init();
+	work_init();
+}
 
-	Status = gBS->SetTimer (mTimerEvent, TimerPeriodic, MS2100N(10));
-	ASSERT_EFI_ERROR (Status);
+/*
+ * Print the stack pool usage, including the peak stack usage of every
+ * thread when LK is built with THREAD_STACK_HIGHWATER. Use this to tune
+ * PcdLKLThreadStackSize and PcdLKLTimerStackSize.
+ */
+void lkl_thread_stack_report(void)
+{
+	thread_stack_dump();
 }
 
 static lkl_thread_t lkl_thread_create(void (*fn)(void *), void *arg)
 {
-	thread_t *thread = thread_create("lkl", (int (*)(void *))fn, arg, DEFAULT_PRIORITY, 2*1024*1024);
+	char name[32];
+	thread_t *thread;
+	int pinned;
+
+	/* look the entry point up in the kernel's System.map */
+	AsciiSPrint(name, sizeof(name), "lkl %p", fn);
+
+	pinned = uefi_bsp_enter();
+	thread = thread_create(name, (int (*)(void *))fn, arg, DEFAULT_PRIORITY, PcdGet32(PcdLKLThreadStackSize));
+	uefi_bsp_leave(pinned);
 	if (!thread)
 		return 0;
 	else {
+		/* kernel threads may run on any cpu */
+		thread_set_pinned_cpu(thread, -1);
 		thread_resume(thread);
 		return (lkl_thread_t) thread;
 	}
@@ -178,10 +785,15 @@ static void lkl_thread_exit(void)
 
 static int lkl_thread_join(lkl_thread_t tid)
 {
-	if (thread_join((thread_t *)tid, NULL, INFINITE_TIME))
-		return -1;
-	else
-		return 0;
+	status_t err;
+	int pinned;
+
+	/* frees the thread */
+	pinned = uefi_bsp_enter();
+	err = thread_join((thread_t *)tid, NULL, INFINITE_TIME);
+	uefi_bsp_leave(pinned);
+
+	return err ? -1 : 0;
 }
 
 static lkl_thread_t thread_self(void)
@@ -196,19 +808,123 @@ static int thread_equal(lkl_thread_t a, lkl_thread_t b)
 
 static unsigned long long time_ns(void)
 {
-	return current_time()*1000000ULL;
+	return counter_to_units(counter_elapsed(), 1000000000);
 }
 
+/*
+ * LKL timers
+ *
+ * All LKL timers live in a single binary min-heap ordered by their
+ * deadline in ns. One UEFI one-shot timer event is always armed for the
+ * earliest deadline and wakes one dispatcher thread, which runs the
+ * callbacks of all expired timers. Allocating a timer is O(1) and arming
+ * or freeing one is O(log n), none of them create threads or events.
+ */
+#define LTIMER_IDLE ((UINTN)-1)
+
 typedef struct {
-	EFI_EVENT event;
+	unsigned long long deadline;
+	UINTN index;		/* position in the heap, LTIMER_IDLE if not armed */
 	void (*fn)(void *);
 	void *arg;
-	event_t cond;
-	thread_t *thread;
-
-	int request_stop;
 } ltimer_t;
 
+STATIC EFI_EVENT mLTimerEvent;
+STATIC event_t mLTimerWake;
+STATIC struct lkl_sem mLTimerLock;
+STATIC ltimer_t **mLTimerHeap;
+STATIC UINTN mLTimerCount;	/* armed timers */
+STATIC UINTN mLTimerSize;	/* heap capacity */
+STATIC UINTN mLTimerNum;	/* allocated timers */
+
+static void ltimer_swap(UINTN a, UINTN b)
+{
+	ltimer_t *tmp = mLTimerHeap[a];
+
+	mLTimerHeap[a] = mLTimerHeap[b];
+	mLTimerHeap[b] = tmp;
+	mLTimerHeap[a]->index = a;
+	mLTimerHeap[b]->index = b;
+}
+
+static void ltimer_sift_up(UINTN i)
+{
+	while (i) {
+		UINTN parent = (i - 1) / 2;
+
+		if (mLTimerHeap[parent]->deadline <= mLTimerHeap[i]->deadline)
+			break;
+
+		ltimer_swap(i, parent);
+		i = parent;
+	}
+}
+
+static void ltimer_sift_down(UINTN i)
+{
+	for (;;) {
+		UINTN left = 2 * i + 1;
+		UINTN right = left + 1;
+		UINTN min = i;
+
+		if (left < mLTimerCount && mLTimerHeap[left]->deadline < mLTimerHeap[min]->deadline)
+			min = left;
+		if (right < mLTimerCount && mLTimerHeap[right]->deadline < mLTimerHeap[min]->deadline)
+			min = right;
+		if (min == i)
+			break;
+
+		ltimer_swap(i, min);
+		i = min;
+	}
+}
+
+static void ltimer_insert(ltimer_t *timer)
+{
+	ASSERT(mLTimerCount < mLTimerSize);
+
+	timer->index = mLTimerCount;
+	mLTimerHeap[mLTimerCount++] = timer;
+	ltimer_sift_up(timer->index);
+}
+
+static void ltimer_remove(ltimer_t *timer)
+{
+	UINTN i = timer->index;
+
+	mLTimerCount--;
+	if (i != mLTimerCount) {
+		mLTimerHeap[i] = mLTimerHeap[mLTimerCount];
+		mLTimerHeap[i]->index = i;
+		ltimer_sift_down(i);
+		ltimer_sift_up(i);
+	}
+	timer->index = LTIMER_IDLE;
+}
+
+/* program the UEFI event for the earliest deadline, lock held */
+static void ltimer_program(unsigned long long now)
+{
+	unsigned long long deadline;
+	UINT64 delay = 1;
+	int pinned;
+
+	pinned = uefi_bsp_enter();
+
+	if (!mLTimerCount) {
+		gBS->SetTimer (mLTimerEvent, TimerCancel, 0);
+	} else {
+		/* SetTimer takes 100ns units, and 0 would mean the next tick anyway */
+		deadline = mLTimerHeap[0]->deadline;
+		if (deadline > now)
+			delay = MAX(DivU64x32(deadline - now + 99, 100), 1);
+
+		gBS->SetTimer (mLTimerEvent, TimerRelative, delay);
+	}
+
+	uefi_bsp_leave(pinned);
+}
+
 VOID
 EFIAPI
 LTimerCallback (
@@ -216,68 +932,142 @@ LTimerCallback (
     IN  VOID        *Context
 )
 {
-	ltimer_t *timer = Context;
-	event_signal(&timer->cond, 1);
+	event_signal(&mLTimerWake, 1);
 }
 
-static int timer_thread(void *pdata)
+static int ltimer_thread(void *pdata)
 {
-	ltimer_t *timer = pdata;
+	unsigned long long now;
+	void (*fn)(void *);
+	void *arg;
 
-	while (!timer->request_stop) {
-		event_wait(&timer->cond);
-		if (timer->request_stop)
-			break;
+	for (;;) {
+		event_wait(&mLTimerWake);
 
-		timer->fn(timer->arg);
-	}
+		fast_sem_down(&mLTimerLock);
+		now = time_ns();
+		while (mLTimerCount && mLTimerHeap[0]->deadline <= now) {
+			ltimer_t *timer = mLTimerHeap[0];
 
-	event_destroy(&timer->cond);
-	FreePool(timer);
+			/* the timer may be freed as soon as we drop the lock */
+			fn = timer->fn;
+			arg = timer->arg;
+			ltimer_remove(timer);
+
+			fast_sem_up(&mLTimerLock);
+			fn(arg);
+			fast_sem_down(&mLTimerLock);
+
+			now = time_ns();
+		}
+		ltimer_program(now);
+		fast_sem_up(&mLTimerLock);
+	}
 
 	return 0;
 }
 
-static void *timer_alloc(void (*fn)(void *), void *arg)
+static void ltimer_init(void)
 {
 	EFI_STATUS Status;
+	thread_t *thread;
+
+	fast_sem_init(&mLTimerLock, 1);
+	event_init(&mLTimerWake, 0, EVENT_FLAG_AUTOUNSIGNAL);
+
+	Status = gBS->CreateEvent (EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK, LTimerCallback, NULL, &mLTimerEvent);
+	ASSERT_EFI_ERROR (Status);
+
+	thread = thread_create("timer", ltimer_thread, NULL, DEFAULT_PRIORITY, PcdGet32(PcdLKLTimerStackSize));
+	ASSERT(thread);
+	thread_detach_and_resume(thread);
+}
+
+static void *ltimer_alloc(void (*fn)(void *), void *arg)
+{
+	ltimer_t **heap;
+	UINTN size;
+
+	ltimer_t *timer = LKLArenaAllocate(sizeof(ltimer_t));
+	if (!timer)
+		return NULL;
 
-	ltimer_t *timer = AllocatePool(sizeof(ltimer_t));
-	ASSERT(timer);
 	timer->fn = fn;
 	timer->arg = arg;
-	timer->request_stop = 0;
-	event_init(&timer->cond, 0, EVENT_FLAG_AUTOUNSIGNAL);
+	timer->deadline = 0;
+	timer->index = LTIMER_IDLE;
+
+	/* make sure arming can never fail because the heap is full */
+	fast_sem_down(&mLTimerLock);
+	if (mLTimerNum == mLTimerSize) {
+		size = MAX(mLTimerSize * 2, 16);
+		heap = ReallocatePool(mLTimerSize * sizeof(*heap), size * sizeof(*heap), mLTimerHeap);
+		if (!heap) {
+			fast_sem_up(&mLTimerLock);
+			LKLArenaFree(timer);
+			return NULL;
+		}
+		mLTimerHeap = heap;
+		mLTimerSize = size;
+	}
+	mLTimerNum++;
+	fast_sem_up(&mLTimerLock);
 
-	Status = gBS->CreateEvent (EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK, LTimerCallback, timer, &timer->event);
-	ASSERT_EFI_ERROR (Status);
+	return timer;
+}
 
-	timer->thread = thread_create("timer", timer_thread, timer, DEFAULT_PRIORITY, 1*1024*1024);
-	thread_detach_and_resume(timer->thread);
+static void *lkl_timer_alloc(void (*fn)(void *), void *arg)
+{
+	void *timer;
+	int pinned;
+
+	pinned = uefi_bsp_enter();
+	timer = ltimer_alloc(fn, arg);
+	uefi_bsp_leave(pinned);
 
 	return timer;
 }
 
-static int timer_set_oneshot(void *_timer, unsigned long ns)
+static int lkl_timer_set_oneshot(void *_timer, unsigned long ns)
 {
-	EFI_STATUS Status;
 	ltimer_t *timer = _timer;
+	ltimer_t *root;
+	unsigned long long now = time_ns();
+
+	fast_sem_down(&mLTimerLock);
+	root = mLTimerCount ? mLTimerHeap[0] : NULL;
+
+	if (timer->index != LTIMER_IDLE)
+		ltimer_remove(timer);
+	timer->deadline = now + ns;
+	ltimer_insert(timer);
+
+	if (mLTimerHeap[0] != root || root == timer)
+		ltimer_program(now);
+	fast_sem_up(&mLTimerLock);
 
-	Status = gBS->SetTimer (timer->event, TimerRelative, ns/100);
-	ASSERT_EFI_ERROR (Status);
 	return 0;
 }
 
-static void timer_free(void *_timer)
+static void lkl_timer_free(void *_timer)
 {
-	EFI_STATUS Status;
 	ltimer_t *timer = _timer;
+	ltimer_t *root;
+	int pinned;
+
+	fast_sem_down(&mLTimerLock);
+	if (timer->index != LTIMER_IDLE) {
+		root = mLTimerHeap[0];
+		ltimer_remove(timer);
+		if (root == timer)
+			ltimer_program(time_ns());
+	}
+	mLTimerNum--;
+	fast_sem_up(&mLTimerLock);
 
-	Status = gBS->CloseEvent (timer->event);
-	ASSERT_EFI_ERROR (Status);
-
-	timer->request_stop = 1;
-	event_signal(&timer->cond, 1);
+	pinned = uefi_bsp_enter();
+	LKLArenaFree(timer);
+	uefi_bsp_leave(pinned);
 }
 
 static void lkl_panic(void)
@@ -292,12 +1082,139 @@ static long _gettid(void)
 
 static void *lkl_mem_alloc(unsigned long size)
 {
-	return AllocatePool(size);
+	void *ptr;
+	int pinned;
+
+	pinned = uefi_bsp_enter();
+	ptr = LKLArenaAllocate(size);
+	uefi_bsp_leave(pinned);
+
+	return ptr;
 }
 
 static void lkl_mem_free(void *ptr)
 {
-    if (ptr) FreePool(ptr);
+	int pinned;
+
+	pinned = uefi_bsp_enter();
+	LKLArenaFree(ptr);
+	uefi_bsp_leave(pinned);
+}
+
+/*
+ * Micro-benchmark of the synchronization layer. Reports the cost of one
+ * uncontended lock/unlock or up/down pair, and of a semaphore handoff
+ * round trip between two threads, which includes two context switches.
+ */
+struct sync_bench_ctx {
+	struct lkl_sem ping;
+	struct lkl_sem pong;
+	UINT32 iterations;
+};
+
+static int sync_bench_thread(void *arg)
+{
+	struct sync_bench_ctx *ctx = arg;
+	UINT32 i;
+
+	for (i = 0; i < ctx->iterations; i++) {
+		fast_sem_down(&ctx->ping);
+		fast_sem_up(&ctx->pong);
+	}
+
+	return 0;
+}
+
+/*
+ * Yields back and forth with the benchmark caller, so every iteration
+ * is two bare reschedules and context switches without any wait queue.
+ */
+static int switch_bench_thread(void *arg)
+{
+	UINT32 *iterations = arg;
+	UINT32 i;
+
+	for (i = 0; i < *iterations; i++)
+		thread_yield();
+
+	return 0;
+}
+
+static UINT64 sync_bench_mutex(int recursive, UINT32 iterations)
+{
+	struct lkl_mutex *mutex = mutex_alloc(recursive);
+	unsigned long long start;
+	UINT32 i;
+
+	ASSERT(mutex);
+
+	start = time_ns();
+	for (i = 0; i < iterations; i++) {
+		mutex_lock(mutex);
+		mutex_unlock(mutex);
+	}
+	start = time_ns() - start;
+
+	mutex_free(mutex);
+	return DivU64x32(start, iterations);
+}
+
+void uefi_sync_benchmark(UINT32 iterations, LKL_SYNC_BENCHMARK *res)
+{
+	struct sync_bench_ctx ctx;
+	struct lkl_sem *sem;
+	thread_t *thread;
+	unsigned long long start;
+	UINT32 i;
+
+	ASSERT(iterations);
+
+	res->Iterations = iterations;
+	res->MutexNs = sync_bench_mutex(0, iterations);
+	res->RecursiveMutexNs = sync_bench_mutex(1, iterations);
+
+	sem = sem_alloc(0);
+	ASSERT(sem);
+	start = time_ns();
+	for (i = 0; i < iterations; i++) {
+		sem_up(sem);
+		sem_down(sem);
+	}
+	res->SemNs = DivU64x32(time_ns() - start, iterations);
+	sem_free(sem);
+
+	fast_sem_init(&ctx.ping, 0);
+	fast_sem_init(&ctx.pong, 0);
+	ctx.iterations = iterations;
+
+	thread = thread_create("syncbench", sync_bench_thread, &ctx, DEFAULT_PRIORITY, 64*1024);
+	ASSERT(thread);
+	thread_resume(thread);
+
+	start = time_ns();
+	for (i = 0; i < iterations; i++) {
+		fast_sem_up(&ctx.ping);
+		fast_sem_down(&ctx.pong);
+	}
+	res->HandoffNs = DivU64x32(time_ns() - start, iterations);
+
+	thread_join(thread, NULL, INFINITE_TIME);
+	sem_destroy(&ctx.ping.wait);
+	sem_destroy(&ctx.pong.wait);
+
+	thread = thread_create("switchbench", switch_bench_thread, &iterations, DEFAULT_PRIORITY, 64*1024);
+	ASSERT(thread);
+	thread_resume(thread);
+
+	start = time_ns();
+	for (i = 0; i < iterations; i++)
+		thread_yield();
+	start = time_ns() - start;
+
+	res->SwitchNs = DivU64x32(start, 2 * iterations);
+	res->SwitchesPerSec = start ? DivU64x64Remainder(MultU64x32(1000000000ULL, 2 * iterations), start, NULL) : 0;
+
+	thread_join(thread, NULL, INFINITE_TIME);
 }
 
 struct lkl_host_operations lkl_host_ops = {
@@ -317,9 +1234,9 @@ struct lkl_host_operations lkl_host_ops = {
 	.mutex_lock = mutex_lock,
 	.mutex_unlock = mutex_unlock,
 	.time = time_ns,
-	.timer_alloc = timer_alloc,
-	.timer_set_oneshot = timer_set_oneshot,
-	.timer_free = timer_free,
+	.timer_alloc = lkl_timer_alloc,
+	.timer_set_oneshot = lkl_timer_set_oneshot,
+	.timer_free = lkl_timer_free,
 	.print = print,
 	.mem_alloc = lkl_mem_alloc,
 	.mem_free = lkl_mem_free,
@@ -339,49 +1256,491 @@ static int uefi_blk_get_capacity(struct lkl_disk disk, unsigned long long *res)
 	return 0;
 }
 
-static int do_rw(LKL_VOLUME *Volume, EFI_DISK_READ fn, struct lkl_disk disk, struct lkl_blk_req *req)
+/*
+ * Block request path
+ *
+ * The iovecs of a request are coalesced into segments before they are
+ * handed to the firmware. Iovecs which are adjacent in memory are merged
+ * in place, everything else is gathered into a per-volume bounce buffer.
+ * A segment never grows beyond PcdLKLMaxTransferSize.
+ *
+ * Block aligned parts of a segment are issued to BlockIo (BlockIo2) directly,
+ * only the unaligned remainder goes through DiskIo (DiskIo2). When a disk has
+ * DiskIo2 but no BlockIo2, the aligned parts still use the synchronous BlockIo.
+ *
+ * With DiskIo2 every segment is submitted as its own token so the firmware
+ * can keep all of them in flight at once. The token events complete into
+ * an LK event, so the submitting thread blocks instead of spinning and the
+ * scheduler is free to run other threads meanwhile.
+ *
+ * Requests of one disk are serialized by its virtio queue, so the private
+ * per-volume state doesn't need any locking.
+ */
+struct uefi_blk_async {
+	event_t done;
+	UINT32 pending;
+	EFI_STATUS status;
+};
+
+struct uefi_blk_token {
+	EFI_DISK_IO2_TOKEN token;
+	EFI_BLOCK_IO2_TOKEN block_token;
+	BOOLEAN block;
+	struct uefi_blk_async *async;
+};
+
+struct uefi_blk_seg {
+	UINT64 off;
+	void *buf;
+	UINTN len;
+	int iov;
+	int num_iov;
+	BOOLEAN bounce;
+};
+
+struct uefi_blk_priv {
+	UINTN num_tokens;
+	struct uefi_blk_token **tokens;
+
+	UINTN num_segs;
+	struct uefi_blk_seg *segs;
+
+	UINT8 *bounce;
+	UINTN bounce_size;
+	UINTN bounce_align;
+};
+
+STATIC
+VOID
+EFIAPI
+BlkTokenCallback (
+    IN  EFI_EVENT   Event,
+    IN  VOID        *Context
+)
 {
-	INT64 off = req->sector * 512;
-	void *addr;
-	int len;
-	int i;
-	int ret = 0;
+	struct uefi_blk_token *tok = Context;
+	struct uefi_blk_async *async = tok->async;
 	EFI_STATUS Status;
 
-	for (i = 0; i < req->count; i++) {
+	Status = tok->block ? tok->block_token.TransactionStatus : tok->token.TransactionStatus;
+	if (EFI_ERROR(Status))
+		async->status = Status;
+
+	if (InterlockedDecrement(&async->pending) == 0)
+		event_signal(&async->done, false);
+}
+
+static struct uefi_blk_priv *blk_priv_get(LKL_VOLUME *Volume)
+{
+	struct uefi_blk_priv *priv = Volume->BlkContext;
+
+	if (priv)
+		return priv;
+
+	priv = AllocateZeroPool(sizeof(*priv));
+	if (!priv)
+		return NULL;
 
-		addr = req->buf[i].iov_base;
-		len = req->buf[i].iov_len;
+	// without a bounce buffer we still merge iovecs which are adjacent in memory.
+	// keep it aligned for BlockIo so bounced segments can take the fast path.
+	priv->bounce_size = PcdGet32(PcdLKLMaxTransferSize);
+	priv->bounce_align = MAX(Volume->BlockIo->Media->IoAlign, 1);
+	priv->bounce = AllocateAlignedPages(EFI_SIZE_TO_PAGES(priv->bounce_size), MAX(priv->bounce_align, EFI_PAGE_SIZE));
+	if (!priv->bounce)
+		priv->bounce_size = 0;
+
+	Volume->BlkContext = priv;
+	return priv;
+}
+
+static int blk_tokens_reserve(struct uefi_blk_priv *priv, UINTN count)
+{
+	EFI_STATUS Status;
+	struct uefi_blk_token **tokens;
+	struct uefi_blk_token *tok;
+
+	if (count <= priv->num_tokens)
+		return 0;
 
-		Status = fn(Volume->DiskIo, Volume->MediaId, off, len, addr);
+	tokens = ReallocatePool(priv->num_tokens * sizeof(*tokens), count * sizeof(*tokens), priv->tokens);
+	if (!tokens)
+		return -1;
+	priv->tokens = tokens;
+
+	while (priv->num_tokens < count) {
+		tok = AllocateZeroPool(sizeof(*tok));
+		if (!tok)
+			return -1;
+
+		// the submitting thread may be running at TPL_CALLBACK, so the
+		// completion has to be dispatched above that
+		Status = gBS->CreateEvent (EVT_NOTIFY_SIGNAL, TPL_NOTIFY, BlkTokenCallback, tok, &tok->token.Event);
 		if (EFI_ERROR(Status)) {
-			ret = -1;
-			goto out;
+			FreePool(tok);
+			return -1;
 		}
+		tok->block_token.Event = tok->token.Event;
 
-		addr += len;
-		off += len;
+		priv->tokens[priv->num_tokens++] = tok;
+	}
+
+	return 0;
+}
+
+static int blk_segs_reserve(struct uefi_blk_priv *priv, UINTN count)
+{
+	struct uefi_blk_seg *segs;
+
+	if (count <= priv->num_segs)
+		return 0;
+
+	segs = ReallocatePool(priv->num_segs * sizeof(*segs), count * sizeof(*segs), priv->segs);
+	if (!segs)
+		return -1;
+
+	priv->segs = segs;
+	priv->num_segs = count;
+	return 0;
+}
+
+static int blk_build_segs(struct uefi_blk_priv *priv, struct lkl_blk_req *req)
+{
+	UINT64 off = req->sector * 512;
+	UINTN max_len = PcdGet32(PcdLKLMaxTransferSize);
+	UINTN bounce_used = 0;
+	struct uefi_blk_seg *seg;
+	int nsegs = 0;
+	int i = 0;
+
+	if (blk_segs_reserve(priv, req->count))
+		return -1;
+
+	while (i < req->count) {
+		seg = &priv->segs[nsegs++];
+		seg->off = off;
+		seg->buf = req->buf[i].iov_base;
+		seg->len = req->buf[i].iov_len;
+		seg->iov = i;
+		seg->num_iov = 1;
+		seg->bounce = FALSE;
+
+		for (i++; i < req->count; i++) {
+			UINTN len = req->buf[i].iov_len;
+
+			if (seg->len + len > max_len)
+				break;
+
+			if (!seg->bounce && (UINT8 *)seg->buf + seg->len == req->buf[i].iov_base) {
+				// adjacent in memory, transfer directly
+			} else if (bounce_used + seg->len + len <= priv->bounce_size) {
+				seg->bounce = TRUE;
+			} else {
+				break;
+			}
+
+			seg->len += len;
+			seg->num_iov++;
+		}
+
+		if (seg->bounce) {
+			seg->buf = priv->bounce + bounce_used;
+			bounce_used = ALIGN_VALUE(bounce_used + seg->len, priv->bounce_align);
+		}
+
+		off += seg->len;
+	}
+
+	return nsegs;
+}
+
+static void blk_seg_copy(struct uefi_blk_seg *seg, struct lkl_blk_req *req, BOOLEAN to_bounce)
+{
+	UINT8 *p = seg->buf;
+	int i;
+
+	for (i = seg->iov; i < seg->iov + seg->num_iov; i++) {
+		if (to_bounce)
+			CopyMem(p, req->buf[i].iov_base, req->buf[i].iov_len);
+		else
+			CopyMem(req->buf[i].iov_base, p, req->buf[i].iov_len);
+		p += req->buf[i].iov_len;
+	}
+}
+
+/*
+ * Returns how many bytes at 'off' can go straight to BlockIo. That requires
+ * the offset to be block aligned and the buffer to satisfy IoAlign. Whatever
+ * isn't covered is left to DiskIo.
+ */
+static UINTN blk_aligned_len(LKL_VOLUME *Volume, UINT64 off, void *buf, UINTN len)
+{
+	EFI_BLOCK_IO_MEDIA *Media = Volume->BlockIo->Media;
+	UINTN align = Media->IoAlign > 1 ? Media->IoAlign : 1;
+
+	if (ModU64x32(off, Media->BlockSize) || ((UINTN)buf & (align - 1)))
+		return 0;
+
+	return len - (len % Media->BlockSize);
+}
+
+/* length of the unaligned chunk DiskIo has to handle before BlockIo can take over */
+static UINTN blk_unaligned_len(LKL_VOLUME *Volume, UINT64 off, UINTN len)
+{
+	UINT32 BlockSize = Volume->BlockIo->Media->BlockSize;
+	UINT32 rem = ModU64x32(off, BlockSize);
+	UINTN chunk;
+
+	// the buffer is misaligned, DiskIo has to do all of it
+	if (rem == 0)
+		return len;
+
+	chunk = BlockSize - rem;
+	return chunk < len ? chunk : len;
+}
+
+static int blk_submit_sync(LKL_VOLUME *Volume, BOOLEAN write, struct uefi_blk_seg *segs, int nsegs)
+{
+	EFI_BLOCK_IO_PROTOCOL *BlockIo = Volume->BlockIo;
+	EFI_DISK_IO_PROTOCOL *DiskIo = Volume->DiskIo;
+	EFI_STATUS Status;
+	UINT64 off;
+	UINT8 *buf;
+	UINTN len;
+	UINTN chunk;
+	int i;
+
+	for (i = 0; i < nsegs; i++) {
+		off = segs[i].off;
+		buf = segs[i].buf;
+		len = segs[i].len;
+
+		while (len) {
+			chunk = blk_aligned_len(Volume, off, buf, len);
+			if (chunk) {
+				EFI_LBA Lba = DivU64x32(off, BlockIo->Media->BlockSize);
+
+				if (write)
+					Status = BlockIo->WriteBlocks(BlockIo, Volume->MediaId, Lba, chunk, buf);
+				else
+					Status = BlockIo->ReadBlocks(BlockIo, Volume->MediaId, Lba, chunk, buf);
+			} else {
+				chunk = blk_unaligned_len(Volume, off, len);
+
+				if (write)
+					Status = DiskIo->WriteDisk(DiskIo, Volume->MediaId, off, chunk, buf);
+				else
+					Status = DiskIo->ReadDisk(DiskIo, Volume->MediaId, off, chunk, buf);
+			}
+
+			if (EFI_ERROR(Status))
+				return -1;
+
+			off += chunk;
+			buf += chunk;
+			len -= chunk;
+		}
+	}
+
+	return 0;
+}
+
+static int blk_submit_async(LKL_VOLUME *Volume, BOOLEAN write, struct uefi_blk_priv *priv, int nsegs)
+{
+	EFI_BLOCK_IO_PROTOCOL *BlockIo = Volume->BlockIo;
+	EFI_BLOCK_IO2_PROTOCOL *BlockIo2 = Volume->BlockIo2;
+	EFI_DISK_IO2_PROTOCOL *DiskIo2 = Volume->DiskIo2;
+	struct uefi_blk_async async;
+	struct uefi_blk_token *tok;
+	EFI_STATUS Status;
+	UINTN ntoks = 0;
+	UINT64 off;
+	UINT8 *buf;
+	UINTN len;
+	UINTN chunk;
+	int i;
+
+	// most segments need exactly one token
+	if (blk_tokens_reserve(priv, nsegs))
+		return blk_submit_sync(Volume, write, priv->segs, nsegs);
+
+	event_init(&async.done, false, EVENT_FLAG_AUTOUNSIGNAL);
+	async.status = EFI_SUCCESS;
+
+	// hold one reference for ourselves until everything is submitted
+	async.pending = 1;
+
+	for (i = 0; i < nsegs && !EFI_ERROR(async.status); i++) {
+		off = priv->segs[i].off;
+		buf = priv->segs[i].buf;
+		len = priv->segs[i].len;
+
+		while (len) {
+			chunk = blk_aligned_len(Volume, off, buf, len);
+
+			if (chunk && !BlockIo2) {
+				EFI_LBA Lba = DivU64x32(off, BlockIo->Media->BlockSize);
+
+				if (write)
+					Status = BlockIo->WriteBlocks(BlockIo, Volume->MediaId, Lba, chunk, buf);
+				else
+					Status = BlockIo->ReadBlocks(BlockIo, Volume->MediaId, Lba, chunk, buf);
+
+				if (EFI_ERROR(Status)) {
+					async.status = Status;
+					break;
+				}
+
+				off += chunk;
+				buf += chunk;
+				len -= chunk;
+				continue;
+			}
+
+			if (blk_tokens_reserve(priv, ntoks + 1)) {
+				async.status = EFI_OUT_OF_RESOURCES;
+				break;
+			}
+
+			tok = priv->tokens[ntoks++];
+			tok->async = &async;
+			InterlockedIncrement(&async.pending);
+
+			if (chunk) {
+				EFI_LBA Lba = DivU64x32(off, BlockIo2->Media->BlockSize);
+
+				tok->block = TRUE;
+				tok->block_token.TransactionStatus = EFI_SUCCESS;
+				if (write)
+					Status = BlockIo2->WriteBlocksEx(BlockIo2, Volume->MediaId, Lba, &tok->block_token, chunk, buf);
+				else
+					Status = BlockIo2->ReadBlocksEx(BlockIo2, Volume->MediaId, Lba, &tok->block_token, chunk, buf);
+			} else {
+				chunk = blk_unaligned_len(Volume, off, len);
+
+				tok->block = FALSE;
+				tok->token.TransactionStatus = EFI_SUCCESS;
+				if (write)
+					Status = DiskIo2->WriteDiskEx(DiskIo2, Volume->MediaId, off, &tok->token, chunk, buf);
+				else
+					Status = DiskIo2->ReadDiskEx(DiskIo2, Volume->MediaId, off, &tok->token, chunk, buf);
+			}
+
+			if (EFI_ERROR(Status)) {
+				// the token won't be signaled, so drop its reference here
+				InterlockedDecrement(&async.pending);
+				async.status = Status;
+				break;
+			}
+
+			off += chunk;
+			buf += chunk;
+			len -= chunk;
+		}
+	}
+
+	if (InterlockedDecrement(&async.pending) != 0)
+		event_wait(&async.done);
+
+	event_destroy(&async.done);
+
+	return EFI_ERROR(async.status) ? -1 : 0;
+}
+
+static int do_rw(LKL_VOLUME *Volume, BOOLEAN write, struct lkl_blk_req *req)
+{
+	struct uefi_blk_priv *priv;
+	int nsegs;
+	int ret;
+	int i;
+
+	priv = blk_priv_get(Volume);
+	if (!priv)
+		return -1;
+
+	nsegs = blk_build_segs(priv, req);
+	if (nsegs < 0)
+		return -1;
+
+	LKLStatsMerged(Volume, req->count - nsegs);
+
+	if (write) {
+		for (i = 0; i < nsegs; i++) {
+			if (priv->segs[i].bounce)
+				blk_seg_copy(&priv->segs[i], req, TRUE);
+		}
+	}
+
+	if (Volume->DiskIo2)
+		ret = blk_submit_async(Volume, write, priv, nsegs);
+	else
+		ret = blk_submit_sync(Volume, write, priv->segs, nsegs);
+
+	if (!write && ret == 0) {
+		for (i = 0; i < nsegs; i++) {
+			if (priv->segs[i].bounce)
+				blk_seg_copy(&priv->segs[i], req, FALSE);
+		}
 	}
 
-out:
 	return ret;
 }
 
-static int uefi_blk_request(struct lkl_disk disk, struct lkl_blk_req *req)
+void uefi_blk_cleanup(LKL_VOLUME *Volume)
+{
+	struct uefi_blk_priv *priv = Volume->BlkContext;
+	UINTN i;
+
+	if (!priv)
+		return;
+
+	for (i = 0; i < priv->num_tokens; i++) {
+		gBS->CloseEvent(priv->tokens[i]->token.Event);
+		FreePool(priv->tokens[i]);
+	}
+
+	if (priv->tokens)
+		FreePool(priv->tokens);
+	if (priv->segs)
+		FreePool(priv->segs);
+	if (priv->bounce)
+		FreeAlignedPages(priv->bounce, EFI_SIZE_TO_PAGES(priv->bounce_size));
+	FreePool(priv);
+	Volume->BlkContext = NULL;
+}
+
+static int uefi_blk_do_request(struct lkl_disk disk, struct lkl_blk_req *req)
 {
 	LKL_VOLUME *Volume = disk.handle;
+	UINT64 start = GetPerformanceCounter();
+	UINT64 bytes = 0;
 	int err = 0;
+	int i;
 
 	switch (req->type) {
 		case LKL_DEV_BLK_TYPE_READ:
-			err = do_rw(Volume, Volume->DiskIo->ReadDisk, disk, req);
-			break;
 		case LKL_DEV_BLK_TYPE_WRITE:
-			err = do_rw(Volume, Volume->DiskIo->WriteDisk, disk, req);
+			for (i = 0; i < req->count; i++)
+				bytes += req->buf[i].iov_len;
+
+			if (req->type == LKL_DEV_BLK_TYPE_READ) {
+				err = do_rw(Volume, FALSE, req);
+				LKLStatsRecord(Volume, LklStatsBlockRead, bytes, start);
+			} else {
+				err = do_rw(Volume, TRUE, req);
+				LKLStatsRecord(Volume, LklStatsBlockWrite, bytes, start);
+			}
+
+			if (Volume->Trace)
+				LKLTraceRecord(Volume, req->type == LKL_DEV_BLK_TYPE_READ ? LKL_TRACE_READ : LKL_TRACE_WRITE,
+					       req->sector, bytes, req->count, start);
 			break;
 		case LKL_DEV_BLK_TYPE_FLUSH:
 		case LKL_DEV_BLK_TYPE_FLUSH_OUT:
 			Volume->BlockIo->FlushBlocks(Volume->BlockIo);
+			LKLStatsRecord(Volume, LklStatsBlockFlush, 0, start);
+
+			if (Volume->Trace)
+				LKLTraceRecord(Volume, LKL_TRACE_FLUSH, 0, 0, 0, start);
 			break;
 		default:
 			return LKL_DEV_BLK_STATUS_UNSUP;
@@ -393,6 +1752,18 @@ static int uefi_blk_request(struct lkl_disk disk, struct lkl_blk_req *req)
 	return LKL_DEV_BLK_STATUS_OK;
 }
 
+static int uefi_blk_request(struct lkl_disk disk, struct lkl_blk_req *req)
+{
+	int pinned;
+	int ret;
+
+	pinned = uefi_bsp_enter();
+	ret = uefi_blk_do_request(disk, req);
+	uefi_bsp_leave(pinned);
+
+	return ret;
+}
+
 struct lkl_dev_blk_ops lkl_dev_blk_ops = {
 	.get_capacity = uefi_blk_get_capacity,
 	.request = uefi_blk_request,
@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2009 Karel Zak <kzak@redhat.com>
+ *
+ * This file may be redistributed under the terms of the
+ * GNU Lesser General Public License.
+ */
+
+#include "LKL.h"
+
+CONST FS_IDINFO IdInfoBtrfs =
+{
+	.Name		= "btrfs",
+	.Magics		=
+	{
+		{ .magic = "_BHRfS_M", .len = 8, .kboff = 64, .sboff = 0x40 },
+		{ NULL }
+	}
+};
@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ *
+ * This file may be redistributed under the terms of the
+ * GNU Lesser General Public License
+ */
+
+#include "LKL.h"
+
+#define EROFS_SUPER_OFFSET	1024
+#define EROFS_SUPER_MAGIC_V1	"\xE2\xE1\xF5\xE0"
+
+CONST FS_IDINFO IdInfoEROFS =
+{
+	.Name		= "erofs",
+	.Magics		=
+	{
+		{
+			.magic = EROFS_SUPER_MAGIC_V1,
+			.len = 4,
+			.kboff = EROFS_SUPER_OFFSET >> 10,
+			.sboff = 0
+		},
+		{ NULL }
+	}
+};
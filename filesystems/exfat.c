@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2010 Andrew Nayenko <resver@gmail.com>
+ *
+ * This file may be redistributed under the terms of the
+ * GNU Lesser General Public License.
+ */
+
+#include "LKL.h"
+
+CONST FS_IDINFO IdInfoExFAT =
+{
+	.Name		= "exfat",
+	.Magics		=
+	{
+		{ .magic = "EXFAT   ", .len = 8, .sboff = 3 },
+		{ NULL }
+	}
+};
@@ -1,101 +1,312 @@
 #include "LKL.h"
 
+//
+// Checked in this order, the first match wins. The linked kernel may lack
+// some of them, mounting those fails with ENODEV and the partition goes
+// to the probe cache like one without a filesystem (Init.c).
+//
 CONST FS_IDINFO* FsIdInfos[] = {
   &IdInfoExt,
   &IdInfoNTFS,
   &IdInfoF2FS,
+  &IdInfoEROFS,
+  &IdInfoSquashFS,
+  &IdInfoBtrfs,
+  &IdInfoXFS,
+  &IdInfoExFAT,
+  &IdInfoVFAT,
 };
 
+//
+// Magic windows closer than this are read with one transfer
+//
+#define FS_PROBE_MERGE_GAP      SIZE_4KB
+#define FS_PROBE_MAX_RANGES     32
+
+typedef struct {
+  UINT64                   Start;
+  UINT64                   End;
+  UINT8                    *Buffer;
+  BOOLEAN                  Valid;
+} FS_PROBE_RANGE;
+
+typedef
 EFI_STATUS
-GetFsType (
-  IN  EFI_DISK_IO_PROTOCOL      *DiskIo,
-  IN  UINT32                    MediaId,
-  OUT CONST CHAR8               **OutName
+(*FS_PROBE_READ) (
+  IN  VOID                 *Context,
+  IN  UINT64               Offset,
+  IN  UINTN                Size,
+  OUT VOID                 *Buffer
+  );
+
+STATIC
+UINT64
+MagicOffset (
+  IN  CONST FS_IDMAG       *Magic
+  )
+{
+  return ((UINT64)Magic->kboff << 10) + Magic->sboff;
+}
+
+/**
+  Merge the magic windows of all FsIdInfos into as few disk ranges as
+  possible. Windows less than FS_PROBE_MERGE_GAP apart share a range.
+
+  @return The number of ranges, sorted by offset.
+
+**/
+STATIC
+UINTN
+FsProbeRanges (
+  OUT FS_PROBE_RANGE       *Ranges
   )
 {
-  EFI_STATUS               Status;
-  CONST FS_IDINFO          *IdInfo;
   CONST FS_IDMAG           *Magic;
-  UINT64                   Offset;
-  UINT8                    Buffer[1024];
+  FS_PROBE_RANGE           Range;
+  UINTN                    Count;
   UINTN                    Index;
+  UINTN                    Pos;
 
+  Count = 0;
   for (Index=0; Index<ARRAY_SIZE(FsIdInfos); Index++) {
-    IdInfo = FsIdInfos[Index];
-
-    for(Magic=IdInfo->Magics; Magic->magic; Magic++) {
-      // calculate offset
-      Offset = (Magic->kboff + (Magic->sboff >> 10)) << 10;
-
-      // read magic
-      Status = DiskIo->ReadDisk(DiskIo, MediaId, Offset, sizeof(Buffer), Buffer);
-      if(EFI_ERROR(Status)) {
-        continue;
+    for(Magic=FsIdInfos[Index]->Magics; Magic->magic; Magic++) {
+      ASSERT (Count < FS_PROBE_MAX_RANGES);
+      if (Count == FS_PROBE_MAX_RANGES) {
+        break;
       }
 
-      // compare magic
-      if (!CompareMem(Magic->magic, Buffer + (Magic->sboff & 0x3ff), Magic->len)) {
-        *OutName = IdInfo->Name;
-        return EFI_SUCCESS;
+      // insertion sort by start offset
+      Range.Start = MagicOffset(Magic);
+      Range.End   = Range.Start + Magic->len;
+      for (Pos = Count; Pos > 0 && Ranges[Pos - 1].Start > Range.Start; Pos--) {
+        Ranges[Pos] = Ranges[Pos - 1];
       }
+      Ranges[Pos] = Range;
+      Count++;
     }
   }
 
-  return EFI_NOT_FOUND;
+  if (Count == 0) {
+    return 0;
+  }
+
+  // merge neighbours
+  Pos = 0;
+  for (Index = 1; Index < Count; Index++) {
+    if (Ranges[Index].Start <= Ranges[Pos].End + FS_PROBE_MERGE_GAP) {
+      Ranges[Pos].End = MAX (Ranges[Pos].End, Ranges[Index].End);
+    } else {
+      Ranges[++Pos] = Ranges[Index];
+    }
+  }
+
+  return Pos + 1;
 }
 
+/**
+  Read every superblock window once and match all FsIdInfos against them.
+
+  @param  Read                  Reads from the device.
+  @param  Context               Passed to Read.
+  @param  OutName               Receives the filesystem name.
+  @param  Fingerprint           Receives the CRC32 of the first range, which
+                                holds the boot sector and most superblocks,
+                                or 0 if it couldn't be read.
+
+  @retval EFI_SUCCESS           A filesystem to mount was found.
+  @retval EFI_UNSUPPORTED       The filesystem is handled by another driver.
+  @retval EFI_NOT_FOUND         No known filesystem was found.
+
+**/
+STATIC
 EFI_STATUS
-GetFsTypeLKL (
-  IN  CONST CHAR8               *Path,
-  OUT CONST CHAR8               **OutName
+FsProbe (
+  IN  FS_PROBE_READ        Read,
+  IN  VOID                 *Context,
+  OUT CONST CHAR8          **OutName,
+  OUT UINT32               *Fingerprint OPTIONAL
   )
 {
   EFI_STATUS               Status;
+  FS_PROBE_RANGE           Ranges[FS_PROBE_MAX_RANGES];
   CONST FS_IDINFO          *IdInfo;
   CONST FS_IDMAG           *Magic;
-  UINT64                   Offset;
-  UINT8                    Buffer[1024];
+  UINT8                    *Buffer;
+  UINTN                    BufferSize;
+  UINTN                    Count;
   UINTN                    Index;
-  INTN                     FD;
-  INTN                     Ret;
+  UINTN                    RangeIndex;
+  UINT64                   Offset;
 
-  // open file
-  FD = lkl_sys_open(Path, LKL_O_RDONLY, 0);
-  if (FD<0) {
-    return LKLError2EfiError(FD);
+  Count = FsProbeRanges(Ranges);
+
+  BufferSize = 0;
+  for (RangeIndex = 0; RangeIndex < Count; RangeIndex++) {
+    BufferSize += (UINTN)(Ranges[RangeIndex].End - Ranges[RangeIndex].Start);
+  }
+
+  Buffer = AllocatePool(BufferSize);
+  if (Buffer == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  // a range that can't be read, e.g. past the end of a small partition, never matches
+  BufferSize = 0;
+  for (RangeIndex = 0; RangeIndex < Count; RangeIndex++) {
+    Ranges[RangeIndex].Buffer = Buffer + BufferSize;
+    BufferSize += (UINTN)(Ranges[RangeIndex].End - Ranges[RangeIndex].Start);
+
+    Status = Read(Context, Ranges[RangeIndex].Start, (UINTN)(Ranges[RangeIndex].End - Ranges[RangeIndex].Start), Ranges[RangeIndex].Buffer);
+    Ranges[RangeIndex].Valid = !EFI_ERROR(Status);
+  }
+
+  if (Fingerprint != NULL) {
+    *Fingerprint = 0;
+    if (Count > 0 && Ranges[0].Valid) {
+      gBS->CalculateCrc32(Ranges[0].Buffer, (UINTN)(Ranges[0].End - Ranges[0].Start), Fingerprint);
+    }
   }
 
   Status = EFI_NOT_FOUND;
 
-  for (Index=0; Index<ARRAY_SIZE(FsIdInfos); Index++) {
+  for (Index=0; Index<ARRAY_SIZE(FsIdInfos) && Status == EFI_NOT_FOUND; Index++) {
     IdInfo = FsIdInfos[Index];
 
     for(Magic=IdInfo->Magics; Magic->magic; Magic++) {
-      // calculate offset
-      Offset = (Magic->kboff + (Magic->sboff >> 10)) << 10;
+      Offset = MagicOffset(Magic);
 
-      // seek to offset
-      Ret = lkl_sys_lseek(FD, Offset, LKL_SEEK_SET);
-      if (Ret < 0) {
-        continue;
+      for (RangeIndex = 0; RangeIndex < Count; RangeIndex++) {
+        if (Offset >= Ranges[RangeIndex].Start && Offset + Magic->len <= Ranges[RangeIndex].End) {
+          break;
+        }
       }
-
-      // read magic
-      Ret = lkl_sys_read(FD, (VOID*)Buffer, sizeof(Buffer));
-      if(Ret<0) {
+      if (RangeIndex == Count || !Ranges[RangeIndex].Valid) {
         continue;
       }
 
       // compare magic
-      if (!CompareMem(Magic->magic, Buffer + (Magic->sboff & 0x3ff), Magic->len)) {
+      if (!CompareMem(Magic->magic, Ranges[RangeIndex].Buffer + (Offset - Ranges[RangeIndex].Start), Magic->len)) {
         *OutName = IdInfo->Name;
-        Status = EFI_SUCCESS;
-        goto Done;
+        Status = IdInfo->Foreign ? EFI_UNSUPPORTED : EFI_SUCCESS;
+        break;
       }
     }
   }
 
-Done:
+  FreePool(Buffer);
+  return Status;
+}
+
+typedef struct {
+  EFI_DISK_IO_PROTOCOL     *DiskIo;
+  UINT32                   MediaId;
+} FS_PROBE_DISKIO;
+
+STATIC
+EFI_STATUS
+FsProbeReadDiskIo (
+  IN  VOID                 *Context,
+  IN  UINT64               Offset,
+  IN  UINTN                Size,
+  OUT VOID                 *Buffer
+  )
+{
+  FS_PROBE_DISKIO          *Disk;
+
+  Disk = Context;
+  return Disk->DiskIo->ReadDisk(Disk->DiskIo, Disk->MediaId, Offset, Size, Buffer);
+}
+
+STATIC
+EFI_STATUS
+FsProbeReadLKL (
+  IN  VOID                 *Context,
+  IN  UINT64               Offset,
+  IN  UINTN                Size,
+  OUT VOID                 *Buffer
+  )
+{
+  INTN                     Ret;
+
+  Ret = lkl_sys_pread64(*(INTN*)Context, Buffer, Size, Offset);
+  if (Ret < 0) {
+    return LKLError2EfiError(Ret);
+  }
+  if ((UINTN)Ret != Size) {
+    return EFI_END_OF_FILE;
+  }
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+GetFsType (
+  IN  EFI_DISK_IO_PROTOCOL      *DiskIo,
+  IN  UINT32                    MediaId,
+  OUT CONST CHAR8               **OutName,
+  OUT UINT32                    *Fingerprint OPTIONAL
+  )
+{
+  FS_PROBE_DISKIO          Disk;
+
+  Disk.DiskIo  = DiskIo;
+  Disk.MediaId = MediaId;
+
+  return FsProbe(FsProbeReadDiskIo, &Disk, OutName, Fingerprint);
+}
+
+/**
+  Compute the fingerprint GetFsType would return, with a single read.
+
+**/
+EFI_STATUS
+GetFsFingerprint (
+  IN  EFI_DISK_IO_PROTOCOL      *DiskIo,
+  IN  UINT32                    MediaId,
+  OUT UINT32                    *Fingerprint
+  )
+{
+  EFI_STATUS               Status;
+  FS_PROBE_RANGE           Ranges[FS_PROBE_MAX_RANGES];
+  UINT8                    *Buffer;
+  UINTN                    Size;
+
+  if (FsProbeRanges(Ranges) == 0) {
+    return EFI_NOT_FOUND;
+  }
+
+  Size = (UINTN)(Ranges[0].End - Ranges[0].Start);
+  Buffer = AllocatePool(Size);
+  if (Buffer == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = DiskIo->ReadDisk(DiskIo, MediaId, Ranges[0].Start, Size, Buffer);
+  if (!EFI_ERROR(Status)) {
+    Status = gBS->CalculateCrc32(Buffer, Size, Fingerprint);
+  }
+
+  FreePool(Buffer);
+  return Status;
+}
+
+EFI_STATUS
+GetFsTypeLKL (
+  IN  CONST CHAR8               *Path,
+  OUT CONST CHAR8               **OutName
+  )
+{
+  EFI_STATUS               Status;
+  INTN                     FD;
+
+  // open file
+  FD = lkl_sys_open(Path, LKL_O_RDONLY, 0);
+  if (FD<0) {
+    return LKLError2EfiError(FD);
+  }
+
+  Status = FsProbe(FsProbeReadLKL, &FD, OutName, NULL);
+
   // close file
   lkl_sys_close(FD);
 
@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2008 Karel Zak <kzak@redhat.com>
+ *
+ * This file may be redistributed under the terms of the
+ * GNU Lesser General Public License.
+ */
+
+#include "LKL.h"
+
+CONST FS_IDINFO IdInfoSquashFS =
+{
+	.Name		= "squashfs",
+	.Magics		=
+	{
+		{ .magic = "hsqs", .len = 4 },
+		{ NULL }
+	}
+};
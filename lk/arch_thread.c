@@ -1,12 +1,16 @@
 #include <lk/kernel/thread.h>
 #include <lk/kernel/timer.h>
+#include <lk/kernel/mp.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 
-struct thread *_current_thread = NULL;
-int ints_enabled = 0;
+#include <Library/CpuLib.h>
+
+struct thread *_current_thread[SMP_MAX_CPUS];
+int ints_enabled[SMP_MAX_CPUS];
 int fiqs_enabled = 0;
+volatile uint arch_cpu_count = 1;
 
 static void initial_thread_func(void)
 {
@@ -14,6 +18,9 @@ static void initial_thread_func(void)
 
     /* release the thread lock that was implicitly held across the reschedule */
     spin_unlock(&thread_lock);
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    platform_timer_flush();
+#endif
 
     thread_t *ct = get_current_thread();
     ret = ct->entry(ct->arg);
@@ -22,42 +29,55 @@ static void initial_thread_func(void)
 }
 
 void arch_thread_initialize(struct thread* t) {
-    // init context
-    getcontext(&t->arch.context);
+    struct context_switch_frame *frame;
+    addr_t stack_top;
+
+    // the ABIs want 16 byte alignment at a call boundary
+    stack_top = ((addr_t)t->stack + t->stack_size) & ~(addr_t)15;
+
+#if defined(__x86_64__)
+    // entering through ret must look like a call, i.e. leave the
+    // return address slot below the aligned stack top
+    stack_top -= sizeof(uint64_t);
+#endif
 
-    // set stack
-    t->arch.context.uc_stack.ss_sp = t->stack;
-    t->arch.context.uc_stack.ss_size = t->stack_size;
-    t->arch.context.uc_stack.ss_flags = 0;
+    frame = (struct context_switch_frame *)(stack_top - sizeof(*frame));
+    memset(frame, 0, sizeof(*frame));
 
-    // disable return
-    t->arch.context.uc_link = NULL;
+#if defined(__x86_64__)
+    frame->rip = (addr_t)initial_thread_func;
+    frame->mxcsr = 0x1f80;
+    frame->fcw = 0x037f;
+#else
+    frame->lr = (addr_t)initial_thread_func;
+#endif
 
-    // set entrypoint
-    makecontext(&t->arch.context, initial_thread_func, 0);
+    t->arch.sp = (addr_t)frame;
 }
 
 void arch_context_switch(struct thread *oldthread, struct thread *newthread) {
-    swapcontext(&oldthread->arch.context, &newthread->arch.context);
+    lk_context_switch(&oldthread->arch.sp, newthread->arch.sp);
 }
 
 void arch_idle(void) {
+    uint cpu = arch_curr_cpu_num();
+
+    if (arch_cpu_count == 1) {
+        /* nothing can become runnable before the next interrupt */
+        CpuSleep();
+        thread_preempt();
+        return;
+    }
+
+    /* the other cpus make threads runnable without interrupting us */
+    while (mp_is_cpu_active(cpu) && !thread_cpu_has_work(cpu)) {
+        if (cpu == 0)
+            platform_idle();
+        CpuPause();
+    }
     thread_preempt();
 }
 
 void arch_dump_thread(thread_t *t) {
 
 }
-
-void timer_initialize(lk_timer_t *timer) {
-    assert(0);
-}
-void timer_set_oneshot(lk_timer_t *timer, lk_time_t delay, timer_callback callback, void *arg) {
-    assert(0);
-}
-void timer_cancel(lk_timer_t *timer) {
-    assert(0);
-}
-void timer_set_periodic(lk_timer_t *timer, lk_time_t period, timer_callback callback, void *arg) {
-    assert(0);
-}
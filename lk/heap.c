@@ -1,5 +1,27 @@
 #include <lk/lib/heap.h>
+#include <lk/debug.h>
+#include <lk/assert.h>
 
+#include <Uefi.h>
+#include <Library/DebugLib.h>
+#include <Arena.h>
+
+/* the LK heap is a thin wrapper around the LKL arena (Arena.c) */
+
+void *heap_alloc(size_t size, unsigned int alignment) {
+    /* arena allocations are always 16 byte aligned */
+    DEBUG_ASSERT(alignment <= 16);
+
+    return LKLArenaAllocate(size);
+}
+
+void heap_free(void *ptr) {
+    LKLArenaFree(ptr);
+}
+
+/* safe with interrupts disabled and the thread lock held, where heap_free()
+ * can't be used. The memory may be handed out again by the next allocation
+ * on any cpu, so it must no longer be in use. */
 void heap_delayed_free(void *ptr) {
-    // TODO
+    LKLArenaFreeDelayed(ptr);
 }
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2008-2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lk/kernel/mp.h>
+#include <lk/kernel/thread.h>
+
+#if WITH_SMP
+
+/* the boot cpu is always active */
+struct mp_state mp = {
+    .active_cpus = 1,
+};
+
+void mp_init(void)
+{
+}
+
+/*
+ * There are no IPIs between the cpus of the firmware. An idle cpu polls
+ * the run queues instead, see arch_idle(), and a busy one looks at them
+ * the next time it reschedules.
+ */
+void mp_reschedule(mp_cpu_mask_t target, uint flags)
+{
+}
+
+void mp_set_cpu_active(uint cpu, bool active)
+{
+    if (active)
+        __atomic_or_fetch(&mp.active_cpus, 1U << cpu, __ATOMIC_SEQ_CST);
+    else
+        __atomic_and_fetch(&mp.active_cpus, ~(1U << cpu), __ATOMIC_SEQ_CST);
+}
+
+void mp_set_curr_cpu_active(bool active)
+{
+    mp_set_cpu_active(arch_curr_cpu_num(), active);
+}
+
+enum handler_return mp_mbx_reschedule_irq(void)
+{
+    THREAD_STATS_INC(reschedule_ipis);
+
+    return INT_RESCHEDULE;
+}
+
+#endif
@@ -0,0 +1,146 @@
+#include <lk/debug.h>
+#include <lk/assert.h>
+#include <lk/list.h>
+#include <lk/kernel/thread.h>
+#include <lk/kernel/stack.h>
+#include <lk/lib/heap.h>
+#include <string.h>
+
+struct stack_class {
+    struct list_node free_list;
+    struct thread_stack_class_stats stats;
+};
+
+static struct stack_class stack_classes[THREAD_STACK_POOL_CLASSES] = {
+#define STACK_CLASS(n) [n] = { \
+        .free_list = LIST_INITIAL_VALUE(stack_classes[n].free_list), \
+        .stats = { .size = 1UL << (THREAD_STACK_POOL_MIN_SHIFT + (n)) }, \
+    }
+    STACK_CLASS(0), STACK_CLASS(1), STACK_CLASS(2), STACK_CLASS(3),
+    STACK_CLASS(4), STACK_CLASS(5), STACK_CLASS(6), STACK_CLASS(7),
+#undef STACK_CLASS
+};
+STATIC_ASSERT(THREAD_STACK_POOL_CLASSES == 8);
+
+/* returns the class for size, or NULL if it's too large to be pooled */
+static struct stack_class *stack_class_for_size(size_t size)
+{
+    for (uint i = 0; i < THREAD_STACK_POOL_CLASSES; i++) {
+        if (size <= stack_classes[i].stats.size)
+            return &stack_classes[i];
+    }
+
+    return NULL;
+}
+
+void *thread_stack_alloc(size_t *size)
+{
+    struct stack_class *class = stack_class_for_size(*size);
+    struct list_node *node = NULL;
+    void *stack;
+
+    if (!class)
+        return heap_alloc(*size, 0);
+
+    *size = class->stats.size;
+
+    THREAD_LOCK(state);
+    node = list_remove_head(&class->free_list);
+    if (node) {
+        class->stats.cached--;
+        class->stats.reuses++;
+        class->stats.live++;
+    }
+    THREAD_UNLOCK(state);
+
+    if (node)
+        return node;
+
+    /* the heap can't be entered with the thread lock held */
+    stack = heap_alloc(*size, 0);
+    if (!stack)
+        return NULL;
+
+    THREAD_LOCK(state2);
+    class->stats.allocs++;
+    class->stats.live++;
+    THREAD_UNLOCK(state2);
+
+    return stack;
+}
+
+void thread_stack_free(void *stack, size_t size, size_t used)
+{
+    struct stack_class *class = stack_class_for_size(size);
+    struct list_node *node = stack;
+
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    if (!class) {
+        heap_delayed_free(stack);
+        return;
+    }
+
+    DEBUG_ASSERT(size == class->stats.size);
+
+    if (used > class->stats.peak_used)
+        class->stats.peak_used = used;
+
+    /* its thread has switched away for good, see thread_reap(), so the
+     * stack can be handed out again as soon as the thread lock is dropped */
+    list_clear_node(node);
+    list_add_head(&class->free_list, node);
+    class->stats.live--;
+    class->stats.cached++;
+}
+
+void thread_stack_trim(void)
+{
+    for (uint i = 0; i < THREAD_STACK_POOL_CLASSES; i++) {
+        struct stack_class *class = &stack_classes[i];
+        struct list_node *node;
+
+        for (;;) {
+            THREAD_LOCK(state);
+            node = list_remove_head(&class->free_list);
+            if (node)
+                class->stats.cached--;
+            THREAD_UNLOCK(state);
+
+            if (!node)
+                break;
+
+            heap_free(node);
+        }
+    }
+}
+
+void thread_stack_get_stats(struct thread_stack_class_stats stats[THREAD_STACK_POOL_CLASSES])
+{
+    THREAD_LOCK(state);
+    for (uint i = 0; i < THREAD_STACK_POOL_CLASSES; i++)
+        stats[i] = stack_classes[i].stats;
+    THREAD_UNLOCK(state);
+}
+
+void thread_stack_dump(void)
+{
+    struct thread_stack_class_stats stats[THREAD_STACK_POOL_CLASSES];
+
+    thread_stack_get_stats(stats);
+
+    dprintf(ALWAYS, "thread stack pool:\n");
+    for (uint i = 0; i < THREAD_STACK_POOL_CLASSES; i++) {
+        if (!stats[i].allocs)
+            continue;
+
+        dprintf(ALWAYS, "\t%7zu bytes: live %u, cached %u, allocs %u, reuses %u, peak used %zu\n",
+                stats[i].size, stats[i].live, stats[i].cached,
+                stats[i].allocs, stats[i].reuses, stats[i].peak_used);
+    }
+
+#if THREAD_STACK_HIGHWATER
+    /* the peaks above only cover threads that have died, add the live ones */
+    dump_all_threads();
+#endif
+}
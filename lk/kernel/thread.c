@@ -43,6 +43,7 @@
 #include <lk/kernel/debug.h>
 #include <lk/kernel/mp.h>
 #include <lk/lib/heap.h>
+#include <lk/kernel/stack.h>
 #if WITH_KERNEL_VM
 #include <lk/kernel/vm.h>
 #endif
@@ -62,12 +63,21 @@ static struct list_node thread_list;
 /* master thread spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/*
+ * The run queues, one per cpu. A thread goes on the queue of the cpu it
+ * is pinned to, or else of the one it ran on last. A cpu that has nothing
+ * better to run steals unpinned threads from the others.
+ */
+struct run_queue {
+    struct list_node queue[NUM_PRIORITIES];
+    uint32_t bitmap;
+    uint stealable; /* unpinned threads on the queue */
+};
+
+static struct run_queue run_queue[SMP_MAX_CPUS];
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue[0].bitmap) * 8);
 
 /* the idle thread(s) (statically allocated) */
 #if WITH_SMP
@@ -86,9 +96,93 @@ lk_bigtime_t current_time_hires(void);
 #if PLATFORM_HAS_DYNAMIC_TIMER
 /* preemption timer */
 static lk_timer_t preempt_timer[SMP_MAX_CPUS];
+
+/* whether the boot cpu runs a regular thread, and whether its tick is armed */
+static bool preempt_regular;
+static bool preempt_armed;
+#endif
+
+/* the detached thread that exited last on each cpu, freed once the cpu has
+ * switched away from its stack */
+static thread_t *dead_thread[SMP_MAX_CPUS];
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/*
+ * Only the boot cpu takes timer interrupts, and its preemption tick is
+ * only needed while it runs a regular thread and another one is waiting
+ * on its run queue. Otherwise, in particular while the bootstrap thread
+ * runs the firmware on its own, the timer stays off. Called with the
+ * thread lock held whenever either of the two may have changed.
+ */
+static void thread_update_preempt(void)
+{
+    bool need = preempt_regular && run_queue[0].bitmap != 0;
+
+    if (need == preempt_armed)
+        return;
+
+    preempt_armed = need;
+    if (need)
+        timer_set_periodic(&preempt_timer[0], 10, (timer_callback)thread_timer_tick, NULL);
+    else
+        timer_cancel(&preempt_timer[0]);
+}
+#else
+static inline void thread_update_preempt(void) {}
 #endif
 
 /* run queue manipulation */
+static inline uint run_queue_top(uint32_t bitmap)
+{
+    return HIGHEST_PRIORITY - __builtin_clz(bitmap)
+           - (sizeof(bitmap) * 8 - NUM_PRIORITIES);
+}
+
+/* the cpu whose run queue t goes on */
+static uint run_queue_cpu(thread_t *t)
+{
+#if WITH_SMP
+    int cpu = t->pinned_cpu >= 0 ? t->pinned_cpu : t->last_cpu;
+
+    if (cpu >= 0 && mp_is_cpu_active(cpu))
+        return cpu;
+
+    cpu = arch_curr_cpu_num();
+    if (mp_is_cpu_active(cpu))
+        return cpu;
+#endif
+    return 0;
+}
+
+static struct run_queue *run_queue_for(thread_t *t)
+{
+    struct run_queue *rq = &run_queue[run_queue_cpu(t)];
+
+    rq->bitmap |= (1<<t->priority);
+    if (thread_pinned_cpu(t) < 0)
+        rq->stealable++;
+
+    /* the boot cpu's own thread is only queued right before a resched,
+     * which updates the tick itself */
+    if (rq == &run_queue[0] && t != get_current_thread())
+        thread_update_preempt();
+
+    return rq;
+}
+
+static void remove_from_run_queue(struct run_queue *rq, thread_t *t)
+{
+    list_delete(&t->queue_node);
+
+    if (list_is_empty(&rq->queue[t->priority]))
+        rq->bitmap &= ~(1<<t->priority);
+    if (thread_pinned_cpu(t) < 0)
+        rq->stealable--;
+
+    if (rq == &run_queue[0])
+        thread_update_preempt();
+}
+
 static void insert_in_run_queue_head(thread_t *t)
 {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
@@ -97,8 +191,7 @@ static void insert_in_run_queue_head(thread_t *t)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    list_add_head(&run_queue_for(t)->queue[t->priority], &t->queue_node);
 }
 
 static void insert_in_run_queue_tail(thread_t *t)
@@ -109,15 +202,19 @@ static void insert_in_run_queue_tail(thread_t *t)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    list_add_tail(&run_queue_for(t)->queue[t->priority], &t->queue_node);
 }
 
 static void init_thread_struct(thread_t *t, const char *name)
 {
     memset(t, 0, sizeof(thread_t));
     t->magic = THREAD_MAGIC;
-    thread_set_pinned_cpu(t, -1);
+#if WITH_SMP
+    t->last_cpu = -1;
+#endif
+    /* only the boot cpu may call into the firmware, so a thread has to
+     * unpin itself explicitly to run anywhere else */
+    thread_set_pinned_cpu(t, 0);
     strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -153,7 +250,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     unsigned int flags = 0;
 
     if (!t) {
-        t = malloc(sizeof(thread_t));
+        t = heap_alloc(sizeof(thread_t), 0);
         if (!t)
             return NULL;
         flags |= THREAD_FLAG_FREE_STRUCT;
@@ -176,7 +273,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     t->aspace = NULL;
 #endif
 
-    t->errno = 0;
+    t->saved_errno = 0;
 
     /* create the stack */
     if (!stack) {
@@ -184,10 +281,10 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
         stack_size += THREAD_STACK_PADDING_SIZE;
         flags |= THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
 #endif
-        t->stack = malloc(stack_size);
+        t->stack = thread_stack_alloc(&stack_size);
         if (!t->stack) {
             if (flags & THREAD_FLAG_FREE_STRUCT)
-                free(t);
+                heap_free(t);
             return NULL;
         }
         flags |= THREAD_FLAG_FREE_STACK;
@@ -249,9 +346,10 @@ status_t thread_set_real_time(thread_t *t)
 
     THREAD_LOCK(state);
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (t == get_current_thread()) {
+    if (t == get_current_thread() && arch_curr_cpu_num() == 0) {
         /* if we're currently running, cancel the preemption timer. */
-        timer_cancel(&preempt_timer[arch_curr_cpu_num()]);
+        preempt_regular = false;
+        thread_update_preempt();
     }
 #endif
     t->flags |= THREAD_FLAG_REAL_TIME;
@@ -355,14 +453,15 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout)
     /* clear the structure's magic */
     t->magic = 0;
 
-    THREAD_UNLOCK(state);
-
-    /* free its stack and the thread structure itself */
+    /* give its stack back to the pool */
     if (t->flags & THREAD_FLAG_FREE_STACK && t->stack)
-        free(t->stack);
+        thread_stack_free(t->stack, t->stack_size, thread_stack_used(t));
+
+    THREAD_UNLOCK(state);
 
+    /* free the thread structure itself */
     if (t->flags & THREAD_FLAG_FREE_STRUCT)
-        free(t);
+        heap_free(t);
 
     return NO_ERROR;
 }
@@ -389,6 +488,26 @@ status_t thread_detach(thread_t *t)
     }
 }
 
+/* must be called with the thread lock held, by a thread other than
+ * dead_thread[cpu] */
+static void thread_reap(uint cpu)
+{
+    thread_t *t = dead_thread[cpu];
+
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    if (!t)
+        return;
+    dead_thread[cpu] = NULL;
+
+    if (t->flags & THREAD_FLAG_FREE_STACK && t->stack)
+        thread_stack_free(t->stack, t->stack_size, thread_stack_used(t));
+
+    /* the heap can't be entered with the thread lock held */
+    if (t->flags & THREAD_FLAG_FREE_STRUCT)
+        heap_delayed_free(t);
+}
+
 /**
  * @brief  Terminate the current thread
  *
@@ -399,6 +518,7 @@ status_t thread_detach(thread_t *t)
 void thread_exit(int retcode)
 {
     thread_t *current_thread = get_current_thread();
+    uint cpu;
 
     DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
     DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
@@ -420,16 +540,14 @@ void thread_exit(int retcode)
         /* clear the structure's magic */
         current_thread->magic = 0;
 
-        /* free its stack and the thread structure itself */
-        if (current_thread->flags & THREAD_FLAG_FREE_STACK && current_thread->stack) {
-            heap_delayed_free(current_thread->stack);
-
-            /* make sure its not going to get a bounds check performed on the half-freed stack */
-            current_thread->flags &= ~THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
-        }
-
-        if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
-            heap_delayed_free(current_thread);
+        /*
+         * Its stack and structure are in use until the switch away from
+         * it. Once freed, another cpu may hand them out again right away,
+         * so they are freed by the next reschedule on this cpu.
+         */
+        cpu = arch_curr_cpu_num();
+        thread_reap(cpu);
+        dead_thread[cpu] = current_thread;
     } else {
         /* signal if anyone is waiting */
         wait_queue_wake_all(&current_thread->retcode_wait_queue, false, 0);
@@ -447,37 +565,101 @@ static void idle_thread_routine(void)
         arch_idle();
 }
 
-static thread_t *get_top_thread(int cpu)
+#if WITH_SMP
+/* take the highest priority unpinned thread above min_priority from the
+ * other cpus, the thread that waited longest among equals */
+static thread_t *steal_thread(uint cpu, int min_priority)
 {
-    thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
+    struct run_queue *victim_rq = NULL;
+    thread_t *victim = NULL;
+    thread_t *t;
 
-    while (local_run_queue_bitmap) {
-        /* find the first (remaining) queue with a thread in it */
-        uint next_queue = HIGHEST_PRIORITY - __builtin_clz(local_run_queue_bitmap)
-                          - (sizeof(run_queue_bitmap) * 8 - NUM_PRIORITIES);
+    for (uint i = 0; i < arch_cpu_count; i++) {
+        struct run_queue *rq = &run_queue[i];
+        uint32_t bitmap = rq->bitmap;
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
-#if WITH_SMP
-            if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
-#endif
-            {
-                list_delete(&newthread->queue_node);
+        if (i == cpu || !rq->stealable)
+            continue;
+
+        while (bitmap) {
+            uint priority = run_queue_top(bitmap);
 
-                if (list_is_empty(&run_queue[next_queue]))
-                    run_queue_bitmap &= ~(1<<next_queue);
+            if ((int)priority <= min_priority)
+                break;
 
-                return newthread;
+            list_for_every_entry(&rq->queue[priority], t, thread_t, queue_node) {
+                if (t->pinned_cpu < 0) {
+                    victim = t;
+                    victim_rq = rq;
+                    min_priority = priority;
+                    break;
+                }
             }
+            if (victim_rq == rq)
+                break;
+
+            bitmap &= ~(1<<priority);
         }
+    }
+
+    if (victim) {
+        remove_from_run_queue(victim_rq, victim);
+        THREAD_STATS_INC(steals);
+    }
+
+    return victim;
+}
+#endif
+
+static thread_t *get_top_thread(int cpu)
+{
+    struct run_queue *rq = &run_queue[cpu];
+    thread_t *newthread;
+    int priority = -1;
 
-        local_run_queue_bitmap &= ~(1<<next_queue);
+    if (!mp_is_cpu_active(cpu)) {
+        /* a cpu that is being stopped only goes back to its idle thread */
+        return idle_thread(cpu);
     }
-    dprintf(CRITICAL, "IDLE THREAD!!!!!!!!!!\n");
+
+    if (rq->bitmap)
+        priority = run_queue_top(rq->bitmap);
+
+#if WITH_SMP
+    newthread = steal_thread(cpu, priority);
+    if (newthread)
+        return newthread;
+#endif
+
+    if (priority >= 0) {
+        newthread = list_peek_head_type(&rq->queue[priority], thread_t, queue_node);
+        remove_from_run_queue(rq, newthread);
+        return newthread;
+    }
+
     /* no threads to run, select the idle thread for this cpu */
     return idle_thread(cpu);
 }
 
+/*
+ * Whether cpu would find something else than its idle thread to run. Read
+ * without the thread lock, so this is only a hint for the idle loop.
+ */
+bool thread_cpu_has_work(uint cpu)
+{
+    if (__atomic_load_n(&run_queue[cpu].bitmap, __ATOMIC_RELAXED))
+        return true;
+
+#if WITH_SMP
+    for (uint i = 0; i < arch_cpu_count; i++) {
+        if (i != cpu && __atomic_load_n(&run_queue[i].stealable, __ATOMIC_RELAXED))
+            return true;
+    }
+#endif
+
+    return false;
+}
+
 /**
  * @brief  Cause another thread to be executed.
  *
@@ -502,10 +684,21 @@ void thread_resched(void)
 
     THREAD_STATS_INC(reschedules);
 
+    if (dead_thread[cpu] != current_thread)
+        thread_reap(cpu);
+
     newthread = get_top_thread(cpu);
 
     DEBUG_ASSERT(newthread);
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the old thread is back on the queue or blocked, the new one is off it */
+    if (cpu == 0) {
+        preempt_regular = !thread_is_real_time_or_idle(newthread);
+        thread_update_preempt();
+    }
+#endif
+
     newthread->state = THREAD_RUNNING;
 
     oldthread = current_thread;
@@ -521,6 +714,9 @@ void thread_resched(void)
     /* mark the cpu ownership of the threads */
     thread_set_curr_cpu(oldthread, -1);
     thread_set_curr_cpu(newthread, cpu);
+#if WITH_SMP
+    newthread->last_cpu = cpu;
+#endif
 
 #if WITH_SMP
     if (thread_is_idle(newthread)) {
@@ -550,26 +746,8 @@ void thread_resched(void)
 
     KEVLOG_THREAD_SWITCH(oldthread, newthread);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    if (thread_is_real_time_or_idle(newthread)) {
-        if (!thread_is_real_time_or_idle(oldthread)) {
-            /* if we're switching from a non real time to a real time, cancel
-             * the preemption timer. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-            dprintf(ALWAYS, "arch_context_switch: stop preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                    cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-            timer_cancel(&preempt_timer[cpu]);
-        }
-    } else if (thread_is_real_time_or_idle(oldthread)) {
-        /* if we're switching from a real time (or idle thread) to a regular one,
-         * set up a periodic timer to run our preemption tick. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-        dprintf(ALWAYS, "arch_context_switch: start preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-        timer_set_periodic(&preempt_timer[cpu], 10, (timer_callback)thread_timer_tick, NULL);
-    }
+#if THREAD_PROFILE
+    platform_thread_switch(oldthread, newthread);
 #endif
 
     /* set some optional target debug leds */
@@ -614,8 +792,8 @@ void thread_resched(void)
 #endif
 
     /* swap errno value */
-    oldthread->errno = errno;
-    errno = newthread->errno;
+    oldthread->saved_errno = errno;
+    errno = newthread->saved_errno;
 
     /* do the low level context switch */
     arch_context_switch(oldthread, newthread);
@@ -807,14 +985,16 @@ void thread_init_early(void)
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
     /* initialize the run queues */
-    for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (i=0; i < NUM_PRIORITIES; i++)
+            list_initialize(&run_queue[cpu].queue[i]);
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
 
     /* create a thread to cover the current running state */
-    thread_t *t = malloc(sizeof(thread_t));
+    thread_t *t = heap_alloc(sizeof(thread_t), 0);
     init_thread_struct(t, "bootstrap");
 
     /* half construct this thread, since we're already running */
@@ -839,6 +1019,10 @@ void thread_init(void)
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
         timer_initialize(&preempt_timer[i]);
     }
+
+    /* the bootstrap thread is a regular thread, its tick is armed once
+     * another thread becomes ready */
+    preempt_regular = true;
 #endif
 }
 
@@ -927,9 +1111,8 @@ void thread_create_idle(void) {
     thread_detach(t);
 }
 
+#if WITH_SMP
 /* create an idle thread for the cpu we're on, and start scheduling */
-
-#if 0
 void thread_secondary_cpu_init_early(void)
 {
     DEBUG_ASSERT(arch_ints_disabled());
@@ -959,20 +1142,53 @@ void thread_secondary_cpu_init_early(void)
     THREAD_UNLOCK(state);
 }
 
+/*
+ * Run threads on this cpu until thread_secondary_cpu_stop() is called for
+ * it, then return to the caller, which gives the cpu back to the firmware.
+ */
 void thread_secondary_cpu_entry(void)
 {
     uint cpu = arch_curr_cpu_num();
     thread_t *t = get_current_thread();
     t->priority = IDLE_PRIORITY;
 
-    mp_set_curr_cpu_active(true);
     mp_set_cpu_idle(cpu);
 
     /* enable interrupts and start the scheduler on this cpu */
     arch_enable_ints();
     thread_yield();
 
-    idle_thread_routine();
+    while (mp_is_cpu_active(cpu))
+        arch_idle();
+
+    THREAD_LOCK(state);
+    list_delete(&t->thread_list_node);
+    mp_set_cpu_busy(cpu);
+    THREAD_UNLOCK(state);
+}
+
+/*
+ * Stop scheduling on cpu. Its queued threads move to the boot cpu, the
+ * thread it is running right now finishes there once it blocks or yields.
+ */
+void thread_secondary_cpu_stop(uint cpu)
+{
+    struct run_queue *rq = &run_queue[cpu];
+    thread_t *t;
+
+    DEBUG_ASSERT(cpu != 0);
+
+    THREAD_LOCK(state);
+
+    mp_set_cpu_active(cpu, false);
+
+    while (rq->bitmap) {
+        t = list_peek_head_type(&rq->queue[run_queue_top(rq->bitmap)], thread_t, queue_node);
+        remove_from_run_queue(rq, t);
+        insert_in_run_queue_tail(t);
+    }
+
+    THREAD_UNLOCK(state);
 }
 #endif
 